@@ -0,0 +1,15 @@
+#ifndef ESP_H264_ENC_SINGLE_HW_H
+#define ESP_H264_ENC_SINGLE_HW_H
+
+#include <stdint.h>
+
+// Types only; a test that drives the encoder helpers defines the calls
+typedef int esp_h264_err_t;
+#define ESP_H264_ERR_OK 0
+
+typedef void *esp_h264_enc_handle_t;
+
+esp_h264_err_t esp_h264_enc_open(esp_h264_enc_handle_t enc);
+esp_h264_err_t esp_h264_enc_close(esp_h264_enc_handle_t enc);
+
+#endif // ESP_H264_ENC_SINGLE_HW_H
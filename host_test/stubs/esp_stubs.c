@@ -0,0 +1,419 @@
+// ESP-IDF and FreeRTOS services used by main/, on POSIX threads and clocks
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_random.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+const char *esp_err_to_name(esp_err_t code)
+{
+	switch (code)
+	{
+	case ESP_OK:
+		return "ESP_OK";
+	case ESP_FAIL:
+		return "ESP_FAIL";
+	case ESP_ERR_NO_MEM:
+		return "ESP_ERR_NO_MEM";
+	case ESP_ERR_INVALID_ARG:
+		return "ESP_ERR_INVALID_ARG";
+	case ESP_ERR_INVALID_STATE:
+		return "ESP_ERR_INVALID_STATE";
+	case ESP_ERR_INVALID_SIZE:
+		return "ESP_ERR_INVALID_SIZE";
+	case ESP_ERR_NOT_FOUND:
+		return "ESP_ERR_NOT_FOUND";
+	case ESP_ERR_NOT_SUPPORTED:
+		return "ESP_ERR_NOT_SUPPORTED";
+	case ESP_ERR_TIMEOUT:
+		return "ESP_ERR_TIMEOUT";
+	case ESP_ERR_NOT_FINISHED:
+		return "ESP_ERR_NOT_FINISHED";
+	default:
+		return "UNKNOWN ERROR";
+	}
+}
+
+// Heap
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+	return malloc(size);
+}
+
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps)
+{
+	return calloc(n, size);
+}
+
+void *heap_caps_aligned_alloc(size_t alignment, size_t size, uint32_t caps)
+{
+	void *p = NULL;
+	if (alignment < sizeof(void *))
+		alignment = sizeof(void *);
+	return posix_memalign(&p, alignment, size) == 0 ? p : NULL;
+}
+
+void heap_caps_free(void *ptr)
+{
+	free(ptr);
+}
+
+uint32_t esp_random(void)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	static uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+	// xorshift64*; sessions only need distinct values
+	pthread_mutex_lock(&lock);
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	uint32_t r = (state * 0x2545F4914F6CDD1DULL) >> 32;
+	pthread_mutex_unlock(&lock);
+	return r;
+}
+
+// Time
+
+int64_t esp_timer_get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct timespec deadline_after_us(int64_t us)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	int64_t ns = ts.tv_nsec + (us % 1000000) * 1000;
+	ts.tv_sec += us / 1000000 + ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	return ts;
+}
+
+static void cond_init_monotonic(pthread_cond_t *cond)
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+// Timers: one thread each, callbacks run on it as on the esp_timer task
+
+struct esp_timer
+{
+	esp_timer_cb_t cb;
+	void *arg;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int64_t due_us;
+	uint64_t period_us;
+	bool armed;
+	bool quit;
+};
+
+static void *timer_thread(void *arg)
+{
+	struct esp_timer *t = arg;
+
+	pthread_mutex_lock(&t->lock);
+	while (!t->quit)
+	{
+		if (!t->armed)
+		{
+			pthread_cond_wait(&t->cond, &t->lock);
+			continue;
+		}
+		int64_t left = t->due_us - esp_timer_get_time();
+		if (left > 0)
+		{
+			struct timespec ts = deadline_after_us(left);
+			pthread_cond_timedwait(&t->cond, &t->lock, &ts);
+			continue;
+		}
+		if (t->period_us)
+			t->due_us += t->period_us;
+		else
+			t->armed = false;
+		pthread_mutex_unlock(&t->lock);
+		t->cb(t->arg);
+		pthread_mutex_lock(&t->lock);
+	}
+	pthread_mutex_unlock(&t->lock);
+	return NULL;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out)
+{
+	struct esp_timer *t = calloc(1, sizeof(*t));
+	if (!t)
+		return ESP_ERR_NO_MEM;
+	t->cb = args->callback;
+	t->arg = args->arg;
+	pthread_mutex_init(&t->lock, NULL);
+	cond_init_monotonic(&t->cond);
+	if (pthread_create(&t->thread, NULL, timer_thread, t) != 0)
+	{
+		free(t);
+		return ESP_ERR_NO_MEM;
+	}
+	*out = t;
+	return ESP_OK;
+}
+
+static esp_err_t timer_arm(esp_timer_handle_t t, uint64_t us, uint64_t period_us)
+{
+	pthread_mutex_lock(&t->lock);
+	if (t->armed)
+	{
+		pthread_mutex_unlock(&t->lock);
+		return ESP_ERR_INVALID_STATE;
+	}
+	t->due_us = esp_timer_get_time() + us;
+	t->period_us = period_us;
+	t->armed = true;
+	pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+	return timer_arm(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+	return timer_arm(timer, period_us, period_us);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+	pthread_mutex_lock(&timer->lock);
+	bool was = timer->armed;
+	timer->armed = false;
+	pthread_cond_signal(&timer->cond);
+	pthread_mutex_unlock(&timer->lock);
+	return was ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+	pthread_mutex_lock(&timer->lock);
+	timer->quit = true;
+	pthread_cond_signal(&timer->cond);
+	pthread_mutex_unlock(&timer->lock);
+	pthread_join(timer->thread, NULL);
+	pthread_mutex_destroy(&timer->lock);
+	pthread_cond_destroy(&timer->cond);
+	free(timer);
+	return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer)
+{
+	pthread_mutex_lock(&timer->lock);
+	bool armed = timer->armed;
+	pthread_mutex_unlock(&timer->lock);
+	return armed;
+}
+
+// Semaphores: a count with a ceiling covers mutexes and binary semaphores
+
+struct host_sem
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned count;
+};
+
+static SemaphoreHandle_t sem_create(unsigned count)
+{
+	SemaphoreHandle_t s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	pthread_mutex_init(&s->lock, NULL);
+	cond_init_monotonic(&s->cond);
+	s->count = count;
+	return s;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+	return sem_create(1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+	return sem_create(0);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait)
+{
+	struct timespec ts = deadline_after_us((int64_t)wait * 1000000 / CONFIG_FREERTOS_HZ);
+
+	pthread_mutex_lock(&sem->lock);
+	while (sem->count == 0)
+	{
+		if (wait == portMAX_DELAY)
+			pthread_cond_wait(&sem->cond, &sem->lock);
+		else if (pthread_cond_timedwait(&sem->cond, &sem->lock, &ts) != 0)
+			break;
+	}
+	bool taken = sem->count > 0;
+	if (taken)
+		sem->count--;
+	pthread_mutex_unlock(&sem->lock);
+	return taken ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+	pthread_mutex_lock(&sem->lock);
+	bool given = sem->count == 0;
+	sem->count = 1;
+	pthread_cond_signal(&sem->cond);
+	pthread_mutex_unlock(&sem->lock);
+	return given ? pdTRUE : pdFALSE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+	pthread_mutex_destroy(&sem->lock);
+	pthread_cond_destroy(&sem->cond);
+	free(sem);
+}
+
+// Tasks
+
+struct host_task
+{
+	TaskFunction_t fn;
+	void *arg;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t notify;
+};
+
+static __thread struct host_task *s_current;
+
+static struct host_task *task_new(void)
+{
+	struct host_task *t = calloc(1, sizeof(*t));
+	if (!t)
+		abort();
+	pthread_mutex_init(&t->lock, NULL);
+	cond_init_monotonic(&t->cond);
+	return t;
+}
+
+static void *task_thread(void *arg)
+{
+	s_current = arg;
+	s_current->fn(s_current->arg);
+	return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+								   UBaseType_t prio, TaskHandle_t *out, BaseType_t core)
+{
+	struct host_task *t = task_new();
+	t->fn = fn;
+	t->arg = arg;
+	if (out)
+		*out = t;
+	if (pthread_create(&t->thread, NULL, task_thread, t) != 0)
+		return pdFAIL;
+	pthread_detach(t->thread);
+	return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio,
+					   TaskHandle_t *out)
+{
+	return xTaskCreatePinnedToCore(fn, name, stack, arg, prio, out, -1);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+	// Only a task ending itself is supported; its handle goes with it, as
+	// FreeRTOS frees the TCB
+	if (!task || task == s_current)
+	{
+		struct host_task *t = s_current;
+		s_current = NULL;
+		if (t)
+		{
+			pthread_mutex_destroy(&t->lock);
+			pthread_cond_destroy(&t->cond);
+			free(t);
+		}
+		pthread_exit(NULL);
+	}
+	fprintf(stderr, "vTaskDelete() of another task is not supported on the host\n");
+	abort();
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+	usleep((useconds_t)((uint64_t)ticks * 1000000 / CONFIG_FREERTOS_HZ));
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+	return (TickType_t)(esp_timer_get_time() * CONFIG_FREERTOS_HZ / 1000000);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+	// Threads not created as tasks get a handle on first use
+	if (!s_current)
+	{
+		s_current = task_new();
+		s_current->thread = pthread_self();
+	}
+	return s_current;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait)
+{
+	struct host_task *t = xTaskGetCurrentTaskHandle();
+	struct timespec ts = deadline_after_us((int64_t)wait * 1000000 / CONFIG_FREERTOS_HZ);
+
+	pthread_mutex_lock(&t->lock);
+	while (t->notify == 0)
+	{
+		if (wait == portMAX_DELAY)
+			pthread_cond_wait(&t->cond, &t->lock);
+		else if (pthread_cond_timedwait(&t->cond, &t->lock, &ts) != 0)
+			break;
+	}
+	uint32_t value = t->notify;
+	if (value > 0)
+		t->notify = clear ? 0 : value - 1;
+	pthread_mutex_unlock(&t->lock);
+	return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+	pthread_mutex_lock(&task->lock);
+	task->notify++;
+	pthread_cond_signal(&task->cond);
+	pthread_mutex_unlock(&task->lock);
+	return pdPASS;
+}
@@ -0,0 +1,6 @@
+#ifndef ESP_SYSTEM_H
+#define ESP_SYSTEM_H
+
+#include "esp_random.h"
+
+#endif // ESP_SYSTEM_H
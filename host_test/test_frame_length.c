@@ -0,0 +1,170 @@
+// Encoded frame length: agreement with find_h264_data_end(), and cost per frame
+#include "test_util.h"
+#include "h264_nal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Encoder output buffer of the camera tasks
+#define ENC_BUF_SIZE (3072 * 1024)
+
+static size_t s_scanned; // Positions examined by the legacy scan
+
+// find_h264_data_end() as it was, counting positions
+static size_t legacy_data_end(const uint8_t *data, size_t max_len)
+{
+	for (size_t i = max_len - 10; i > 0; i--)
+	{
+		s_scanned++;
+		if (i < max_len - 3 && data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+		{
+			for (size_t j = i + 3; j < max_len; j++)
+			{
+				s_scanned++;
+				if (data[j] != 0)
+				{
+					for (size_t k = j; k < max_len; k++)
+					{
+						s_scanned++;
+						if (data[k] == 0)
+						{
+							size_t zero_count = 0;
+							for (size_t z = k; z < max_len && data[z] == 0; z++)
+							{
+								s_scanned++;
+								zero_count++;
+							}
+							if (zero_count >= 8)
+								return k;
+							k += zero_count - 1;
+						}
+					}
+					return max_len;
+				}
+			}
+		}
+	}
+
+	for (size_t i = max_len - 1; i > 0; i--)
+	{
+		s_scanned++;
+		if (data[i] != 0)
+			return ((i + 4) & ~3);
+	}
+	return max_len;
+}
+
+// Encoder output: the access unit, then zeros to the end of the buffer
+static void place(uint8_t *buf, size_t size, const uint8_t *au, size_t len)
+{
+	memcpy(buf, au, len);
+	memset(buf + len, 0, size - len);
+}
+
+static void check_frame(uint8_t *buf, size_t size, const uint8_t *au, size_t len)
+{
+	place(buf, size, au, len);
+	size_t want = legacy_data_end(buf, size);
+	CHECK(want == len);
+
+	// Trusted length, then every reason to distrust it
+	CHECK(h264_frame_length(buf, len, size) == len);
+	CHECK(h264_frame_length(buf, 0, size) == want);
+	CHECK(h264_frame_length(buf, size, size) == want);
+	CHECK(h264_frame_length(buf + 1, len - 1, size - 1) == want - 1); // No start code at the front
+}
+
+static void check_corpus(uint8_t *buf)
+{
+	static const uint32_t zero_permille[] = {4, 100, 500};
+	test_rng_t rng;
+	test_rng_seed(&rng, 5);
+	uint8_t *au = malloc(64 * 1024);
+
+	// Small frames of every shape, short trailing zeros merged into the padding
+	for (int round = 0; round < 300; round++)
+	{
+		size_t len = 0, nals = 1 + test_rng_below(&rng, 4);
+		for (size_t n = 0; n < nals; n++)
+		{
+			uint8_t type = (n == nals - 1) ? 0x41 : 0x06;
+			len += test_make_nal(au + len, 32 * 1024, type, 1 + test_rng_below(&rng, 8000),
+								 zero_permille[round % 3], &rng);
+		}
+		size_t size = len + 16 + test_rng_below(&rng, 64 * 1024 - len - 16);
+		check_frame(buf, size, au, len);
+
+		size_t trailing = test_rng_below(&rng, 8);
+		memset(au + len, 0, trailing);
+		place(buf, size, au, len + trailing);
+		CHECK(h264_frame_length(buf, 0, size) == legacy_data_end(buf, size));
+	}
+
+	// A frame filling the whole buffer has no padding to find
+	size_t len = test_make_nal(au, 4096, 0x41, 4000, 4, &rng);
+	CHECK(h264_frame_length(au, len, len) == len);
+	CHECK(h264_frame_length(au, 0, len) == len);
+	free(au);
+}
+
+static void bench(uint8_t *buf, const test_stream_t *s, const char *name)
+{
+	uint64_t legacy_bytes = 0;
+	int64_t legacy_ns = 0, scan_ns = 0, trusted_ns = 0;
+	volatile size_t sink = 0;
+
+	for (size_t f = 0; f < s->count; f++)
+	{
+		size_t len = s->offset[f + 1] - s->offset[f];
+		if (len + 8 > ENC_BUF_SIZE)
+			continue;
+		place(buf, ENC_BUF_SIZE, s->data + s->offset[f], len);
+
+		s_scanned = 0;
+		int64_t t0 = test_now_ns();
+		size_t want = legacy_data_end(buf, ENC_BUF_SIZE);
+		int64_t t1 = test_now_ns();
+		size_t got = h264_frame_length(buf, 0, ENC_BUF_SIZE);
+		int64_t t2 = test_now_ns();
+		sink += h264_frame_length(buf, len, ENC_BUF_SIZE);
+		int64_t t3 = test_now_ns();
+
+		CHECK(got == want);
+		legacy_bytes += s_scanned;
+		legacy_ns += t1 - t0;
+		scan_ns += t2 - t1;
+		trusted_ns += t3 - t2;
+	}
+	(void)sink;
+
+	printf("\n%s: %zu frames, %.1f KB/frame, %u KB buffer\n", name, s->count, s->len / 1024.0 / s->count,
+		   ENC_BUF_SIZE / 1024);
+	printf("find_h264_data_end()       %9.0f B examined  %9.0f ns/frame\n", (double)legacy_bytes / s->count,
+		   (double)legacy_ns / s->count);
+	printf("h264_frame_length() scan   %9.0f B examined  %9.0f ns/frame\n", (double)s->len / s->count,
+		   (double)scan_ns / s->count);
+	printf("h264_frame_length() length %9d B examined  %9.0f ns/frame\n", 4, (double)trusted_ns / s->count);
+	CHECK(scan_ns < legacy_ns);
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t *buf = malloc(ENC_BUF_SIZE);
+	test_stream_t s;
+
+	check_corpus(buf);
+
+	test_stream_synthetic(&s, 60, 30, 6);
+	bench(buf, &s, "synthetic 1080p, 4 Mbit/s");
+	test_stream_free(&s);
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!CHECK(test_stream_load(&s, argv[i])))
+			continue;
+		bench(buf, &s, argv[i]);
+		test_stream_free(&s);
+	}
+	free(buf);
+	return TEST_RESULT();
+}
@@ -0,0 +1,312 @@
+// Time to first frame over loopback: a synthetic 30 fps camera feeds the
+// RTSP server while RTSP clients join at random points of the GOP, from the
+// GOP cache or, built with CONFIG_RTSP_GOP_CACHE=0, from a forced IDR.
+// Every client must see SPS, PPS and an IDR first, then the stream in order.
+#include "test_rtsp.h"
+#include "h264_nal.h"
+#include "rtsp_server.h"
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define FPS 30
+#define GOP 30
+#define TIMED_JOINS 8		  // One client at a time, for the time to first frame
+#define WATCH_FRAMES 45		  // Access units a client takes before it leaves
+#define CHURN_MS 4000		  // Clients joining and leaving around two watchers
+#define FIRST_FRAME_WAIT_MS 3000
+
+static test_stream_t s_stream;
+static uint32_t s_hash[GOP * 3]; // Of each access unit's slice
+static volatile bool s_churning;
+
+typedef struct
+{
+	bool ok;			 // Got a first frame and left cleanly
+	double ttff_ms;		 // PLAY sent to the first whole access unit received
+	uint32_t server_us;	 // first_frame_us the server reported for the session
+	uint32_t frames;
+	uint32_t cached;	 // Frames sent from the GOP cache, one tick apart
+} join_t;
+
+static uint32_t fnv1a(const uint8_t *data, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ data[i]) * 16777619u;
+	return h;
+}
+
+/**
+ * @brief OPTIONS, DESCRIBE and SETUP for RTP over UDP to rtp_port
+ *
+ * @return Session, 0 on failure
+ */
+static uint32_t rtsp_setup(int sock, uint16_t rtp_port, uint16_t rtcp_port, int *cseq, bool describe)
+{
+	char rsp[4096], transport[64];
+	if (describe)
+	{
+		if (!CHECK(test_rtsp_request(sock, "OPTIONS", ++*cseq, "", rsp, sizeof(rsp)) == 200) ||
+			!CHECK(test_rtsp_request(sock, "DESCRIBE", ++*cseq, "Accept: application/sdp\r\n", rsp, sizeof(rsp)) == 200))
+			return 0;
+		CHECK(strstr(rsp, "m=video") && strstr(rsp, "sprop-parameter-sets="));
+	}
+
+	snprintf(transport, sizeof(transport), "RTP/AVP;unicast;client_port=%u-%u", rtp_port, rtcp_port);
+	return test_rtsp_setup(sock, transport, cseq, rsp, sizeof(rsp));
+}
+
+// Stream position of a received access unit, -1 if it matches none
+static int find_au(const test_depack_t *d)
+{
+	if (d->count == 0)
+		return -1;
+	size_t last = d->count - 1;
+	uint32_t h = fnv1a(d->data + d->offset[last], d->nal_len[last]);
+	for (size_t i = 0; i < s_stream.count; i++)
+	{
+		if (s_hash[i] != h)
+			continue;
+
+		// SPS may be rewritten on the way; the rest arrives as encoded
+		h264_nal_index_t idx;
+		const uint8_t *au = s_stream.data + s_stream.offset[i];
+		h264_nal_index_build(au, s_stream.offset[i + 1] - s_stream.offset[i], &idx);
+		if (idx.count != d->count)
+			return -1;
+		for (size_t n = 0; n < idx.count; n++)
+		{
+			if (idx.nals[n].type == H264_NAL_SPS)
+				continue;
+			if (d->nal_len[n] != idx.nals[n].len ||
+				memcmp(d->data + d->offset[n], au + idx.nals[n].offset, idx.nals[n].len) != 0)
+				return -1;
+		}
+		return (int)i;
+	}
+	return -1;
+}
+
+// The server counts the frame once its last packet left, which may be just
+// after the client has it
+static uint32_t server_first_frame_us(uint32_t session)
+{
+	rtsp_session_stats_t stats[RTSP_SERVER_MAX_CLIENTS];
+	for (int tries = 0; tries < 100; tries++)
+	{
+		int n = rtsp_server_get_session_stats(stats, RTSP_SERVER_MAX_CLIENTS);
+		for (int i = 0; i < n; i++)
+		{
+			if (stats[i].session == session && stats[i].first_frame_us > 0)
+				return stats[i].first_frame_us;
+		}
+		test_sleep_ms(1);
+	}
+	return 0;
+}
+
+/**
+ * @brief Join, take WATCH_FRAMES access units and leave
+ *
+ * The first access unit must be an IDR with SPS and PPS in front; each
+ * after it continues the stream where the one before left off, unless it is
+ * an IDR, which the encoder may have been asked for. Sequence numbers run
+ * without a gap and timestamps only go up.
+ */
+static void watch(join_t *j)
+{
+	static const size_t cap = 512 * 1024;
+	uint16_t rtp_port, rtcp_port;
+	int rtp = test_udp_open(&rtp_port);
+	int rtcp = test_udp_open(&rtcp_port);
+	int sock = test_rtsp_connect(0);
+	int cseq = 0;
+	memset(j, 0, sizeof(*j));
+	if (!CHECK(rtp >= 0 && rtcp >= 0 && sock >= 0))
+		goto out;
+
+	uint32_t session = rtsp_setup(sock, rtp_port, rtcp_port, &cseq, true);
+	if (!CHECK(session != 0))
+		goto out;
+	int64_t play_ns = test_now_ns();
+	if (!CHECK(test_rtsp_play(sock, session, &cseq) == 200))
+		goto out;
+
+	test_depack_t d;
+	test_depack_init(&d, cap);
+	uint8_t pkt[2048];
+	int prev = -1;
+	uint32_t prev_ts = 0;
+	int64_t deadline = play_ns + FIRST_FRAME_WAIT_MS * 1000000LL;
+	while (j->frames < WATCH_FRAMES)
+	{
+		struct pollfd pfd = {.fd = rtp, .events = POLLIN};
+		int64_t left_ms = (deadline - test_now_ns()) / 1000000;
+		if (left_ms <= 0 || poll(&pfd, 1, (int)left_ms) <= 0)
+			break;
+		ssize_t n = recv(rtp, pkt, sizeof(pkt), 0);
+		if (n <= 0 || !test_depack_rtp(&d, pkt, n) || !d.marker)
+			continue;
+
+		int k = find_au(&d);
+		CHECK(k >= 0);
+		if (j->frames == 0)
+		{
+			j->ttff_ms = (test_now_ns() - play_ns) / 1e6;
+			j->server_us = server_first_frame_us(session);
+			CHECK(d.count == 3 && k % GOP == 0);
+			CHECK(d.count > 0 && (d.data[d.offset[0]] & 0x1F) == H264_NAL_SPS);
+			CHECK(d.count > 1 && (d.data[d.offset[1]] & 0x1F) == H264_NAL_PPS);
+			CHECK(j->server_us > 0);
+			deadline = test_now_ns() + (int64_t)WATCH_FRAMES * 2 * 1000000000LL / FPS;
+		}
+		else
+		{
+			CHECK(k == (prev + 1) % (int)s_stream.count || (k >= 0 && k % GOP == 0));
+			CHECK((int32_t)(d.ts - prev_ts) > 0);
+			j->cached += d.ts - prev_ts == 1;
+		}
+		prev = k;
+		prev_ts = d.ts;
+		j->frames++;
+		test_depack_reset(&d);
+	}
+	CHECK(j->frames == WATCH_FRAMES);
+	CHECK(d.errors == 0 && d.seq_gaps == 0);
+	j->ok = j->frames == WATCH_FRAMES && d.errors == 0 && d.seq_gaps == 0;
+	test_depack_free(&d);
+	test_rtsp_teardown(sock, session, &cseq);
+
+out:
+	if (sock >= 0)
+		close(sock);
+	if (rtp >= 0)
+		close(rtp);
+	if (rtcp >= 0)
+		close(rtcp);
+}
+
+// Clients that come and go: some leave with TEARDOWN, some drop the
+// connection while frames are on their way, some never start playing
+static void *churn(void *arg)
+{
+	uint32_t *cycles = arg;
+	test_rng_t rng;
+	test_rng_seed(&rng, 25);
+
+	while (s_churning)
+	{
+		uint16_t rtp_port, rtcp_port;
+		int rtp = test_udp_open(&rtp_port);
+		int rtcp = test_udp_open(&rtcp_port);
+		int sock = test_rtsp_connect(0);
+		int cseq = 0;
+		uint32_t how = test_rng_below(&rng, 3);
+		uint32_t session = sock >= 0 ? rtsp_setup(sock, rtp_port, rtcp_port, &cseq, false) : 0;
+		CHECK(session != 0);
+		if (session && how != 2)
+			CHECK(test_rtsp_play(sock, session, &cseq) == 200);
+		test_sleep_ms(test_rng_below(&rng, 150));
+		if (session && how == 0)
+			test_rtsp_teardown(sock, session, &cseq);
+		if (sock >= 0)
+			close(sock);
+		close(rtp);
+		close(rtcp);
+		(*cycles)++;
+	}
+	return NULL;
+}
+
+static void *watcher(void *arg)
+{
+	uint32_t *joins = arg;
+	while (s_churning)
+	{
+		join_t j;
+		watch(&j);
+		(*joins)++;
+	}
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+int main(void)
+{
+	test_stream_synthetic(&s_stream, GOP * 3, GOP, 25);
+	for (size_t i = 0; i < s_stream.count; i++)
+	{
+		h264_nal_index_t idx;
+		const uint8_t *au = s_stream.data + s_stream.offset[i];
+		h264_nal_index_build(au, s_stream.offset[i + 1] - s_stream.offset[i], &idx);
+		const h264_nal_t *last = &idx.nals[idx.count - 1];
+		s_hash[i] = fnv1a(au + last->offset, last->len);
+	}
+
+	if (!CHECK(rtsp_server_init() == ESP_OK) || !CHECK(rtsp_server_start() == ESP_OK))
+		return TEST_RESULT();
+	test_camera_start(&s_stream, FPS, GOP);
+	test_sleep_ms(1000);
+
+	// Joins spread over the GOP, one at a time
+	test_rng_t rng;
+	test_rng_seed(&rng, 7);
+	join_t joins[TIMED_JOINS];
+	double ttff[TIMED_JOINS], server_ms[TIMED_JOINS];
+	uint32_t cached = 0;
+	for (int i = 0; i < TIMED_JOINS; i++)
+	{
+		test_sleep_ms(test_rng_below(&rng, 1000 / FPS * GOP));
+		watch(&joins[i]);
+		ttff[i] = joins[i].ttff_ms;
+		server_ms[i] = joins[i].server_us / 1000.0;
+		cached += joins[i].cached;
+		CHECK(joins[i].ok);
+#if CONFIG_RTSP_GOP_CACHE
+		// The IDR is at hand: it leaves at once, without asking the encoder
+		CHECK(joins[i].ttff_ms < 200);
+#endif
+	}
+	qsort(ttff, TIMED_JOINS, sizeof(double), cmp_double);
+	qsort(server_ms, TIMED_JOINS, sizeof(double), cmp_double);
+	printf("\nGOP cache %s: %d joins, 1080p %d fps, IDR every %d frames\n", CONFIG_RTSP_GOP_CACHE ? "on" : "off",
+		   TIMED_JOINS, FPS, GOP);
+	printf("time to first frame ms  min %.1f  median %.1f  max %.1f (server: median %.1f, max %.1f)\n", ttff[0],
+		   ttff[TIMED_JOINS / 2], ttff[TIMED_JOINS - 1], server_ms[TIMED_JOINS / 2], server_ms[TIMED_JOINS - 1]);
+	printf("frames caught up from the cache per join %.1f\n", (double)cached / TIMED_JOINS);
+#if !CONFIG_RTSP_GOP_CACHE
+	CHECK(cached == 0);
+#endif
+
+	// Two watchers keep checking the stream while other clients come and go
+	pthread_t churner, watchers[2];
+	uint32_t cycles = 0, watched[2] = {0};
+	s_churning = true;
+	pthread_create(&churner, NULL, churn, &cycles);
+	for (int i = 0; i < 2; i++)
+		pthread_create(&watchers[i], NULL, watcher, &watched[i]);
+	test_sleep_ms(CHURN_MS);
+	s_churning = false;
+	pthread_join(churner, NULL);
+	for (int i = 0; i < 2; i++)
+		pthread_join(watchers[i], NULL);
+	printf("churn: %u clients came and went, %u joins watched\n", cycles, watched[0] + watched[1]);
+	CHECK(cycles > 10 && watched[0] + watched[1] >= 2);
+
+	test_camera_stop();
+	rtsp_server_stop();
+	test_sleep_ms(700);
+	test_stream_free(&s_stream);
+	return TEST_RESULT();
+}
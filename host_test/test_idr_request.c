@@ -0,0 +1,115 @@
+// IDR requests: spacing, and an encoder that fails to reopen for one
+#include "test_util.h"
+#include "camera_encoder.h"
+#include "camera_encoder_common.h"
+#include <stdio.h>
+
+#define FRAME_US 33333
+
+static int s_opens;
+static int s_open_failures; // Opens still to fail
+static bool s_open;
+
+// Services of the firmware the encoder helpers link against
+esp_h264_err_t esp_h264_enc_open(esp_h264_enc_handle_t enc)
+{
+	s_opens++;
+	if (s_open_failures > 0)
+	{
+		s_open_failures--;
+		return -1;
+	}
+	s_open = true;
+	return ESP_H264_ERR_OK;
+}
+
+esp_h264_err_t esp_h264_enc_close(esp_h264_enc_handle_t enc)
+{
+	s_open = false;
+	return ESP_H264_ERR_OK;
+}
+
+esp_err_t rtsp_set_sps_pps(const uint8_t *sps, size_t sps_len, const uint8_t *pps, size_t pps_len)
+{
+	return ESP_OK;
+}
+
+/**
+ * @brief One frame of the encoder loop; a reopened encoder encodes an IDR
+ *
+ * @return true if the frame was encoded
+ */
+static bool frame(int64_t *now_us, bool gop_idr)
+{
+	int opens = s_opens;
+	bool encoded = idr_request_apply(NULL, *now_us) == ESP_OK;
+	CHECK(encoded == s_open);
+	if (encoded)
+		idr_request_done(gop_idr || s_opens != opens, *now_us);
+	*now_us += FRAME_US;
+	return encoded;
+}
+
+int main(void)
+{
+	int64_t now = 1000000;
+	s_open = true;
+
+	// Before any IDR a request is answered by the next frame, with a reopen
+	frame(&now, false);
+	camera_encoder_request_idr();
+	frame(&now, false);
+	CHECK(s_opens == 1);
+
+	// A burst within the minimum interval costs one IDR, once it is due
+	for (int i = 0; i < 5; i++)
+		camera_encoder_request_idr();
+	int frames = 0;
+	while (s_opens == 1 && frames < 100)
+	{
+		frame(&now, false);
+		frames++;
+	}
+	CHECK(s_opens == 2);
+	CHECK(frames >= CAMERA_IDR_MIN_INTERVAL_MS * 1000 / FRAME_US);
+	for (int i = 0; i < 30; i++)
+		frame(&now, false);
+	CHECK(s_opens == 2);
+
+	// A failed reopen skips frames, keeps the request and retries every
+	// frame; the stream resumes with an IDR
+	now += CAMERA_IDR_MIN_INTERVAL_MS * 1000LL;
+	camera_encoder_request_idr();
+	s_open_failures = 3;
+	int opens = s_opens;
+	for (int i = 0; i < 3; i++)
+		CHECK(!frame(&now, false));
+	CHECK(s_opens == opens + 3);
+	CHECK(camera_encoder_get_status() == ESP_OK);
+	CHECK(frame(&now, false));
+	CHECK(s_opens == opens + 4);
+	frame(&now, false);
+	CHECK(s_opens == opens + 4);
+
+	// Long enough and the failure is reported, until the encoder opens
+	now += CAMERA_IDR_MIN_INTERVAL_MS * 1000LL;
+	camera_encoder_request_idr();
+	s_open_failures = CAMERA_ENCODER_REOPEN_FAIL_FRAMES + 10;
+	for (int i = 0; i < CAMERA_ENCODER_REOPEN_FAIL_FRAMES - 1; i++)
+		CHECK(!frame(&now, false));
+	CHECK(camera_encoder_get_status() == ESP_OK);
+	CHECK(!frame(&now, false));
+	CHECK(camera_encoder_get_status() == ESP_ERR_INVALID_STATE);
+	camera_encoder_request_idr();
+	while (s_open_failures > 0)
+		CHECK(!frame(&now, false));
+	CHECK(frame(&now, false));
+	CHECK(camera_encoder_get_status() == ESP_OK);
+
+	// That IDR answered the request made while the encoder was closed
+	opens = s_opens;
+	for (int i = 0; i < 60; i++)
+		frame(&now, false);
+	CHECK(s_opens == opens);
+	return TEST_RESULT();
+}
@@ -0,0 +1,203 @@
+// Multicast delivery over loopback: two sessions SETUP with RTP/AVP;multicast
+// and PLAY; a receiver that joined the advertised group on lo must see one
+// stream, each packet once, until the last session leaves.
+#include "test_rtsp.h"
+#include "h264_nal.h"
+#include "rtsp_server.h"
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define FPS 30
+#define GOP 30
+#define WATCH_MS 1500 // Each phase: one session playing, two, one again
+#define QUIET_MS 500  // Nothing may reach the group this long after the last TEARDOWN
+
+typedef struct
+{
+	int rtp;
+	int rtcp;
+	test_depack_t d;
+	uint8_t seen[65536]; // Times each sequence number arrived
+	uint32_t packets;
+	uint32_t duplicates;
+	uint32_t frames;
+	uint32_t ssrcs;		 // Distinct SSRCs seen
+	uint32_t ssrc;
+	uint32_t byes;
+} group_t;
+
+static test_stream_t s_stream;
+
+/**
+ * @brief Join group:port on lo
+ *
+ * @return Socket, -1 on failure
+ */
+static int group_open(const char *group, uint16_t port)
+{
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = inet_addr(group), .sin_port = htons(port)};
+	struct ip_mreq mreq = {.imr_multiaddr.s_addr = inet_addr(group), .imr_interface.s_addr = htonl(INADDR_LOOPBACK)};
+	int rcvbuf = 4 << 20, reuse = 1;
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+		setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0)
+	{
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+// Take what reaches the group within ms; returns the RTP packets taken
+static uint32_t receive(group_t *g, uint32_t ms)
+{
+	uint32_t packets = 0;
+	uint8_t pkt[2048];
+	int64_t deadline = test_now_ns() + ms * 1000000LL;
+	for (int64_t left_ms = ms; left_ms > 0; left_ms = (deadline - test_now_ns()) / 1000000)
+	{
+		struct pollfd pfd[2] = {{.fd = g->rtp, .events = POLLIN}, {.fd = g->rtcp, .events = POLLIN}};
+		if (poll(pfd, 2, (int)left_ms) <= 0)
+			continue;
+		if (pfd[1].revents & POLLIN)
+		{
+			ssize_t n = recv(g->rtcp, pkt, sizeof(pkt), 0);
+			for (ssize_t pos = 0; pos + 4 <= n; pos += 4 + 4 * (pkt[pos + 2] << 8 | pkt[pos + 3]))
+				g->byes += pkt[pos + 1] == 203;
+		}
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+		ssize_t n = recv(g->rtp, pkt, sizeof(pkt), 0);
+		if (n < 12)
+			continue;
+		packets++;
+		g->packets++;
+		uint16_t seq = pkt[2] << 8 | pkt[3];
+		uint32_t ssrc = (uint32_t)pkt[8] << 24 | pkt[9] << 16 | pkt[10] << 8 | pkt[11];
+		g->duplicates += g->seen[seq]++ > 0;
+		if (g->ssrcs == 0 || ssrc != g->ssrc)
+		{
+			g->ssrcs++;
+			g->ssrc = ssrc;
+		}
+		if (!test_depack_rtp(&g->d, pkt, n) || !g->d.marker)
+			continue;
+		if (g->frames == 0)
+		{
+			// The group starts at an IDR, parameter sets ahead
+			CHECK(g->d.count == 3);
+			CHECK(g->d.count > 0 && (g->d.data[g->d.offset[0]] & 0x1F) == H264_NAL_SPS);
+			CHECK(g->d.count > 2 && (g->d.data[g->d.offset[2]] & 0x1F) == H264_NAL_IDR);
+		}
+		g->frames++;
+		test_depack_reset(&g->d);
+	}
+	return packets;
+}
+
+/**
+ * @brief Open a session with a multicast transport
+ *
+ * @param group Output, the advertised destination
+ * @param port Output, the advertised RTP port
+ * @return Session, 0 on failure
+ */
+static uint32_t session_open(int sock, int *cseq, char *group, uint16_t *port)
+{
+	char rsp[4096];
+	if (!CHECK(test_rtsp_request(sock, "OPTIONS", ++*cseq, "", rsp, sizeof(rsp)) == 200) ||
+		!CHECK(test_rtsp_request(sock, "DESCRIBE", ++*cseq, "Accept: application/sdp\r\n", rsp, sizeof(rsp)) == 200))
+		return 0;
+	uint32_t session = test_rtsp_setup(sock, "RTP/AVP;multicast", cseq, rsp, sizeof(rsp));
+	const char *t = strstr(rsp, "Transport: RTP/AVP;multicast;destination=");
+	unsigned rtp_port = 0, rtcp_port = 0, ttl = 0;
+	if (!CHECK(session != 0 && t) ||
+		!CHECK(sscanf(t, "Transport: RTP/AVP;multicast;destination=%15[0-9.];port=%u-%u;ttl=%u", group, &rtp_port,
+					  &rtcp_port, &ttl) == 4))
+		return 0;
+	CHECK(rtcp_port == rtp_port + 1 && ttl == CONFIG_RTSP_MULTICAST_TTL);
+	*port = rtp_port;
+	return session;
+}
+
+int main(void)
+{
+	static group_t g;
+	char group[16] = "", group_b[16] = "";
+	uint16_t port = 0, port_b = 0;
+	int cseq_a = 0, cseq_b = 0;
+	g.rtp = g.rtcp = -1;
+
+	test_stream_synthetic(&s_stream, GOP * 3, GOP, 15);
+	if (!CHECK(rtsp_server_init() == ESP_OK) || !CHECK(rtsp_server_start() == ESP_OK))
+		return TEST_RESULT();
+	test_camera_start(&s_stream, FPS, GOP);
+	test_sleep_ms(500);
+
+	int a = test_rtsp_connect(0);
+	int b = test_rtsp_connect(0);
+	if (!CHECK(a >= 0 && b >= 0))
+		goto out;
+	uint32_t session_a = session_open(a, &cseq_a, group, &port);
+	uint32_t session_b = session_open(b, &cseq_b, group_b, &port_b);
+	if (!CHECK(session_a != 0 && session_b != 0))
+		goto out;
+	CHECK(strcmp(group, CONFIG_RTSP_MULTICAST_ADDR) == 0 && port == CONFIG_RTSP_MULTICAST_PORT);
+	CHECK(strcmp(group, group_b) == 0 && port == port_b);
+
+	g.rtp = group_open(group, port);
+	g.rtcp = group_open(group, port + 1);
+	if (!CHECK(g.rtp >= 0 && g.rtcp >= 0))
+		goto out;
+	test_depack_init(&g.d, 512 * 1024);
+
+	// Set up but not playing: the group is silent
+	CHECK(receive(&g, 300) == 0);
+
+	// One session, then both: one stream either way
+	CHECK(test_rtsp_play(a, session_a, &cseq_a) == 200);
+	uint32_t one = receive(&g, WATCH_MS);
+	CHECK(test_rtsp_play(b, session_b, &cseq_b) == 200);
+	uint32_t two = receive(&g, WATCH_MS);
+
+	// The first to leave does not stop the group
+	CHECK(test_rtsp_teardown(a, session_a, &cseq_a) == 200);
+	uint32_t last = receive(&g, WATCH_MS);
+	printf("multicast group %s:%u, packets per %d ms: one session %u, two %u, one left %u\n", group, port,
+		   WATCH_MS, one, two, last);
+	CHECK(one > 0 && last > 0);
+	CHECK(two < one * 3 / 2 && two > one / 2);
+	CHECK(g.ssrcs == 1);
+	CHECK(g.duplicates == 0);
+	CHECK(g.d.errors == 0 && g.d.seq_gaps == 0);
+	CHECK(g.frames >= 3 * WATCH_MS * FPS / 1000 * 8 / 10);
+
+	// The last TEARDOWN ends the group with a BYE; then it is silent
+	CHECK(g.byes == 0);
+	CHECK(test_rtsp_teardown(b, session_b, &cseq_b) == 200);
+	receive(&g, 100);
+	CHECK(g.byes == 1);
+	CHECK(receive(&g, QUIET_MS) == 0);
+	test_depack_free(&g.d);
+
+out:
+	if (a >= 0)
+		close(a);
+	if (b >= 0)
+		close(b);
+	if (g.rtp >= 0)
+		close(g.rtp);
+	if (g.rtcp >= 0)
+		close(g.rtcp);
+	test_camera_stop();
+	rtsp_server_stop();
+	test_sleep_ms(700);
+	test_stream_free(&s_stream);
+	return TEST_RESULT();
+}
@@ -0,0 +1,169 @@
+// NAL index: agreement with a byte-loop walk, and the bytes walked per frame
+// by the per-client scans it replaced against its single pass
+#include "test_util.h"
+#include "h264_nal.h"
+#include <stdio.h>
+#include <string.h>
+
+static size_t s_scanned; // Positions examined by the legacy scanners
+
+// find_nal() of the former rtsp_send_h264_frame(), counting positions
+static const uint8_t *legacy_find_nal(const uint8_t *data, size_t len)
+{
+	for (size_t i = 0; len > 3 && i < len - 3; i++)
+	{
+		s_scanned++;
+		if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+			return &data[i];
+		if (i < len - 4 && data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 0 && data[i + 3] == 1)
+			return &data[i];
+	}
+	return NULL;
+}
+
+// IDR detection loop of the former frame_callback()
+static bool legacy_is_idr(const uint8_t *data, size_t len)
+{
+	for (size_t i = 0; i < len - 4; i++)
+	{
+		s_scanned++;
+		size_t skip = 0;
+		if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 0 && data[i + 3] == 1)
+			skip = 4;
+		else if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+			skip = 3;
+		else
+			continue;
+		if ((data[i + skip] & 0x1F) == H264_NAL_IDR)
+			return true;
+	}
+	return false;
+}
+
+// One client's pass of the former rtsp_send_h264_frame(); fills what it finds
+static size_t legacy_walk(const uint8_t *data, size_t len, h264_nal_t *nals, size_t max)
+{
+	size_t n = 0;
+	const uint8_t *nal = legacy_find_nal(data, len);
+	while (nal)
+	{
+		const uint8_t *next = legacy_find_nal(nal + 3, len - (nal - data) - 3);
+		size_t nal_len = next ? (size_t)(next - nal) : len - (nal - data);
+		size_t skip = (nal[2] == 1) ? 3 : 4;
+		if (n < max)
+		{
+			nals[n].offset = nal + skip - data;
+			nals[n].len = nal_len - skip;
+			nals[n].type = nal[skip] & 0x1F;
+		}
+		n++;
+		nal = next;
+	}
+	return n;
+}
+
+static void check_index(const uint8_t *data, size_t len)
+{
+	h264_nal_index_t idx;
+	h264_nal_t ref[H264_NAL_INDEX_MAX];
+
+	size_t n = h264_nal_index_build(data, len, &idx);
+	size_t ref_n = legacy_walk(data, len, ref, H264_NAL_INDEX_MAX);
+	CHECK(idx.len == len);
+	if (!CHECK(n == ref_n))
+		return;
+	for (size_t i = 0; i < n; i++)
+	{
+		// The legacy walk keeps the zero_byte of a following 4-byte start code
+		uint32_t ref_len = ref[i].len;
+		while (ref_len > 0 && data[ref[i].offset + ref_len - 1] == 0)
+			ref_len--;
+		CHECK(idx.nals[i].offset == ref[i].offset);
+		CHECK(idx.nals[i].len == ref_len);
+		CHECK(idx.nals[i].type == ref[i].type);
+		CHECK(idx.nals[i].idr == (ref[i].type == H264_NAL_IDR));
+	}
+	s_scanned = 0;
+	CHECK(idx.idr == legacy_is_idr(data, len));
+}
+
+static void bench(const test_stream_t *s, const char *name)
+{
+	static const int clients[] = {1, 4, 8};
+	h264_nal_t nals[H264_NAL_INDEX_MAX];
+	h264_nal_index_t idx;
+
+	printf("\n%s: %zu frames, %zu IDR, %.1f KB/frame\n", name, s->count, s->idr_count,
+		   s->len / 1024.0 / s->count);
+	printf("clients  legacy positions/frame  frame B (one pass)  legacy ns/frame  index ns/frame\n");
+	for (size_t c = 0; c < sizeof(clients) / sizeof(clients[0]); c++)
+	{
+		uint64_t legacy_bytes = 0;
+		volatile size_t sink = 0;
+
+		int64_t t0 = test_now_ns();
+		for (size_t f = 0; f < s->count; f++)
+		{
+			const uint8_t *au = s->data + s->offset[f];
+			size_t len = s->offset[f + 1] - s->offset[f];
+			s_scanned = 0;
+			sink += legacy_is_idr(au, len);
+			for (int i = 0; i < clients[c]; i++)
+				sink += legacy_walk(au, len, nals, H264_NAL_INDEX_MAX);
+			legacy_bytes += s_scanned;
+		}
+		int64_t t1 = test_now_ns();
+		for (size_t f = 0; f < s->count; f++)
+		{
+			const uint8_t *au = s->data + s->offset[f];
+			size_t len = s->offset[f + 1] - s->offset[f];
+			sink += h264_nal_index_build(au, len, &idx);
+		}
+		int64_t t2 = test_now_ns();
+		(void)sink;
+
+		// The index passes over each frame once, whatever the number of
+		// clients; the legacy scans tested every position once per client
+		printf("%7d  %22.0f  %18.0f  %15.0f  %14.0f\n", clients[c], (double)legacy_bytes / s->count,
+			   (double)s->len / s->count, (double)(t1 - t0) / s->count, (double)(t2 - t1) / s->count);
+		CHECK(legacy_bytes >= (uint64_t)clients[c] * (s->len - 4 * s->count));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	test_stream_t s;
+
+	// Start codes of both lengths, trailing zeros, a NAL ending in zeros
+	static const uint8_t mixed[] = {0, 0, 0, 1, 0x67, 0x42, 0xC0, 0x28, 0, 0, 1, 0x68, 0xCE, 0x3C, 0x80,
+									0, 0, 0, 1, 0x65, 0x88, 0x84, 0, 0, 0, 0, 1, 0x06, 0x05, 0x01, 0x80,
+									0, 0};
+	check_index(mixed, sizeof(mixed));
+	h264_nal_index_t idx;
+	CHECK(h264_nal_index_build(mixed, sizeof(mixed), &idx) == 4);
+	CHECK(idx.idr && idx.sps == 0 && idx.pps == 1);
+	CHECK(idx.nals[2].len == 3);
+	CHECK(idx.nals[3].type == H264_NAL_SEI);
+
+	// No start code at all
+	static const uint8_t raw[] = {0x41, 0x9A, 0x00, 0x00, 0x03, 0x01};
+	CHECK(h264_nal_index_build(raw, sizeof(raw), &idx) == 0);
+	CHECK(!idx.idr && idx.sps < 0 && idx.pps < 0);
+
+	test_stream_synthetic(&s, 120, 30, 1);
+	for (size_t f = 0; f < s.count; f++)
+		check_index(s.data + s.offset[f], s.offset[f + 1] - s.offset[f]);
+	bench(&s, "synthetic 1080p, 4 Mbit/s");
+	test_stream_free(&s);
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!CHECK(test_stream_load(&s, argv[i])))
+			continue;
+		for (size_t f = 0; f < s.count; f++)
+			check_index(s.data + s.offset[f], s.offset[f + 1] - s.offset[f]);
+		bench(&s, argv[i]);
+		test_stream_free(&s);
+	}
+	return TEST_RESULT();
+}
@@ -0,0 +1,248 @@
+// RTP pacer on a simulated 100 Mbit/s link: peak transmit queue occupancy
+// unpaced and paced, and how long each frame takes to leave
+#include "test_util.h"
+#include "h264_nal.h"
+#include "rtp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LINK_BPS 100000000
+#define WIRE_OVERHEAD 62 // Preamble, Ethernet, IPv4 and UDP headers, interframe gap
+#define SEND_US 20		 // CPU time of one socket call into lwIP
+#define FRAME_US 33333
+#define FPS 30
+#define PACER_SPREAD_PERCENT 80 // As in rtsp_server.c
+#define CLIENTS_MAX 4
+
+/**
+ * @brief Transmit queue in front of the link: packets handed to the driver
+ * and not yet on the wire
+ */
+typedef struct
+{
+	int64_t depart[4096]; // Departure times of queued packets, a ring
+	size_t head;
+	size_t count;
+	int64_t link_free; // When the link finishes the last queued packet
+	size_t peak;
+	uint64_t over;	   // Packets that found the DMA ring full
+} link_t;
+
+static void link_send(link_t *l, int64_t now, size_t bytes)
+{
+	while (l->count > 0 && l->depart[l->head] <= now)
+	{
+		l->head = (l->head + 1) % 4096;
+		l->count--;
+	}
+	if (l->count >= CONFIG_ETH_DMA_TX_BUFFER_NUM)
+		l->over++;
+
+	int64_t start = l->link_free > now ? l->link_free : now;
+	l->link_free = start + (int64_t)(bytes + WIRE_OVERHEAD) * 8 * 1000000 / LINK_BPS;
+	l->depart[(l->head + l->count) % 4096] = l->link_free;
+	l->count++;
+	if (l->count > l->peak)
+		l->peak = l->count;
+}
+
+static size_t wire_bytes(const rtp_packet_t *p)
+{
+	return RTP_HEADER_LEN + p->prefix_len + p->len;
+}
+
+// transmit_burst(): every run to every client, back to back
+static int64_t send_burst(link_t *l, const rtp_packet_list_t *au, int clients, int64_t now)
+{
+	for (uint16_t p = 0; p < au->count; p += RTP_BATCH_MAX)
+	{
+		uint16_t end = p + RTP_BATCH_MAX < au->count ? p + RTP_BATCH_MAX : au->count;
+		for (int c = 0; c < clients; c++)
+		{
+			for (uint16_t i = p; i < end; i++)
+			{
+				now += SEND_US;
+				link_send(l, now, wire_bytes(&au->pkts[i]));
+			}
+		}
+	}
+	return now;
+}
+
+// The loop of transmit_paced(), in simulated time
+static int64_t send_paced(link_t *l, const rtp_packet_list_t *au, rtp_bucket_t *buckets, int clients, int64_t now)
+{
+	uint16_t next[CLIENTS_MAX] = {0};
+	uint16_t batch = CONFIG_RTP_PACING_BURST_BYTES / (RTP_HEADER_LEN + RTP_PREFIX_MAX + RTP_MTU);
+	batch = batch < 1 ? 1 : (batch > RTP_BATCH_MAX ? RTP_BATCH_MAX : batch);
+
+	uint64_t bits = 0;
+	for (uint16_t p = 0; p < au->count; p++)
+		bits += wire_bytes(&au->pkts[p]) * 8;
+	uint64_t min_rate = bits * FPS * 100 / PACER_SPREAD_PERCENT;
+	uint32_t rate = CONFIG_RTP_PACING_RATE_KBPS * 1000;
+	if (min_rate > rate)
+		rate = min_rate;
+	for (int c = 0; c < clients; c++)
+		rtp_bucket_set_rate(&buckets[c], rate, now);
+
+	int remaining = clients;
+	while (remaining > 0)
+	{
+		int64_t wait = INT64_MAX;
+		for (int c = 0; c < clients; c++)
+		{
+			if (next[c] >= au->count)
+				continue;
+			uint16_t n = au->count - next[c] < batch ? au->count - next[c] : batch;
+			size_t bytes = 0;
+			for (uint16_t p = next[c]; p < next[c] + n; p++)
+				bytes += wire_bytes(&au->pkts[p]);
+
+			int64_t w = rtp_bucket_wait_us(&buckets[c], bytes, now);
+			if (w > 0)
+			{
+				wait = w < wait ? w : wait;
+				continue;
+			}
+
+			for (uint16_t p = next[c]; p < next[c] + n; p++)
+			{
+				now += SEND_US;
+				link_send(l, now, wire_bytes(&au->pkts[p]));
+			}
+			next[c] += n;
+			rtp_bucket_consume(&buckets[c], bytes);
+			if (next[c] >= au->count)
+				remaining--;
+			else
+				wait = 0;
+		}
+		if (remaining > 0 && wait > 0)
+			now += wait;
+	}
+	return now;
+}
+
+typedef struct
+{
+	size_t peak;		 // Deepest transmit queue, packets
+	uint64_t over;		 // Packets beyond CONFIG_ETH_DMA_TX_BUFFER_NUM
+	int64_t spread_us;	 // Longest time from frame start to its last packet on the wire
+	int64_t late_us;	 // Longest a frame started after its capture slot
+	uint64_t packets;
+} result_t;
+
+static result_t run(const test_stream_t *s, bool paced, int clients)
+{
+	static rtp_packet_t pkts[RTP_PACKET_LIST_MAX];
+	static uint8_t arena[RTP_STAP_ARENA];
+	static link_t link;
+	rtp_bucket_t buckets[CLIENTS_MAX];
+	h264_nal_index_t idx;
+	result_t r = {0};
+	int64_t now = 0;
+
+	memset(&link, 0, sizeof(link));
+	for (int c = 0; c < clients; c++)
+		rtp_bucket_init(&buckets[c], CONFIG_RTP_PACING_RATE_KBPS * 1000, CONFIG_RTP_PACING_BURST_BYTES, 0);
+
+	for (size_t f = 0; f < s->count; f++)
+	{
+		const uint8_t *au = s->data + s->offset[f];
+		h264_nal_index_build(au, s->offset[f + 1] - s->offset[f], &idx);
+
+		rtp_packet_list_t list;
+		rtp_packet_list_init(&list, pkts, RTP_PACKET_LIST_MAX, f * 3000);
+		rtp_packet_list_set_arena(&list, arena, sizeof(arena));
+		for (size_t i = 0; i < idx.count; i++)
+			rtp_packetize_h264(&list, au + idx.nals[i].offset, idx.nals[i].len);
+		rtp_packet_list_end_au(&list);
+		r.packets += (uint64_t)list.count * clients;
+
+		int64_t slot = (int64_t)f * FRAME_US;
+		if (now < slot)
+			now = slot;
+		if (now - slot > r.late_us)
+			r.late_us = now - slot;
+		now = paced ? send_paced(&link, &list, buckets, clients, now) : send_burst(&link, &list, clients, now);
+		if (link.link_free - slot > r.spread_us)
+			r.spread_us = link.link_free - slot;
+	}
+	r.peak = link.peak;
+	r.over = link.over;
+	return r;
+}
+
+static void bench(const test_stream_t *s, const char *name)
+{
+	printf("\n%s: %zu frames, %zu IDR, %.1f KB/frame\n", name, s->count, s->idr_count, s->len / 1024.0 / s->count);
+	printf("%d kbit/s pacing, %d byte burst, %u TX DMA buffers, %d Mbit/s link\n", CONFIG_RTP_PACING_RATE_KBPS,
+		   CONFIG_RTP_PACING_BURST_BYTES, CONFIG_ETH_DMA_TX_BUFFER_NUM, LINK_BPS / 1000000);
+	printf("clients  mode      peak queue  over DMA ring  frame spread ms  start late ms\n");
+	for (int clients = 1; clients <= CLIENTS_MAX; clients *= 2)
+	{
+		result_t burst = run(s, false, clients);
+		result_t paced = run(s, true, clients);
+		const result_t *results[] = {&burst, &paced};
+		for (int m = 0; m < 2; m++)
+		{
+			printf("%7d  %-8s  %10zu  %13llu  %15.1f  %13.1f\n", clients, m ? "paced" : "unpaced", results[m]->peak,
+				   (unsigned long long)results[m]->over, results[m]->spread_us / 1000.0, results[m]->late_us / 1000.0);
+		}
+
+		// The pacer never falls a frame behind. Where the link can carry an
+		// IDR to every client within the frame interval, bursts are cut to
+		// the bucket depth of each client; beyond that the link itself queues
+		CHECK(paced.peak < burst.peak);
+		CHECK(paced.late_us == 0);
+		if (burst.spread_us <= FRAME_US)
+		{
+			CHECK(paced.spread_us <= FRAME_US);
+			CHECK(paced.peak <= (size_t)clients * (CONFIG_RTP_PACING_BURST_BYTES / (RTP_HEADER_LEN + RTP_MTU)));
+		}
+		if (clients == 1)
+			CHECK(paced.over == 0);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	test_stream_t s;
+
+	// 8 Mbit/s refills a byte per microsecond; runs wait for their tokens
+	rtp_bucket_t b;
+	rtp_bucket_init(&b, 8000000, 10000, 0);
+	CHECK(rtp_bucket_wait_us(&b, 10000, 0) == 0);
+	rtp_bucket_consume(&b, 10000);
+	CHECK(rtp_bucket_wait_us(&b, 1000, 0) == 1000);
+	CHECK(rtp_bucket_wait_us(&b, 1000, 999) == 1);
+	CHECK(rtp_bucket_wait_us(&b, 1000, 1000) == 0);
+
+	// A run larger than the depth waits for a full bucket, then overdraws it
+	CHECK(rtp_bucket_wait_us(&b, 20000, 1000) == 9000);
+	CHECK(rtp_bucket_wait_us(&b, 20000, 10000) == 0);
+	rtp_bucket_consume(&b, 20000);
+	CHECK(rtp_bucket_wait_us(&b, 1, 10000) == 10001);
+	rtp_bucket_set_rate(&b, 16000000, 10000);
+	CHECK(rtp_bucket_wait_us(&b, 1, 10000) == 5001);
+
+	// Refilled to the depth, not beyond
+	CHECK(rtp_bucket_wait_us(&b, 10000, 1000000) == 0);
+	rtp_bucket_consume(&b, 10000);
+	CHECK(rtp_bucket_wait_us(&b, 1, 1000000) > 0);
+
+	test_stream_synthetic(&s, 90, 30, 12);
+	bench(&s, "synthetic 1080p, 4 Mbit/s");
+	test_stream_free(&s);
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!CHECK(test_stream_load(&s, argv[i])))
+			continue;
+		bench(&s, argv[i]);
+		test_stream_free(&s);
+	}
+	return TEST_RESULT();
+}
@@ -0,0 +1,423 @@
+// RTCP: sender reports we build, receiver reports, SDES/BYE and keyframe
+// requests we parse, round trip time, and compound packets that are
+// truncated or malformed
+#include "test_util.h"
+#include "rtcp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEDIA_SSRC 0x11223344u
+#define PEER_SSRC 0xCAFEF00Du
+
+/**
+ * @brief Compound packet under construction
+ */
+typedef struct
+{
+	uint8_t buf[1024];
+	size_t len;
+	size_t start; // Of the packet being written
+} pkt_t;
+
+static void put8(pkt_t *p, uint8_t v)
+{
+	p->buf[p->len++] = v;
+}
+
+static void put32(pkt_t *p, uint32_t v)
+{
+	put8(p, v >> 24);
+	put8(p, v >> 16);
+	put8(p, v >> 8);
+	put8(p, v);
+}
+
+static void begin(pkt_t *p, uint8_t count, uint8_t pt)
+{
+	p->start = p->len;
+	put8(p, 0x80 | count);
+	put8(p, pt);
+	put8(p, 0);
+	put8(p, 0);
+}
+
+// Pad to 32 bits and fill in the length field
+static void end(pkt_t *p)
+{
+	while (p->len % 4)
+		put8(p, 0);
+	size_t words = (p->len - p->start) / 4 - 1;
+	p->buf[p->start + 2] = words >> 8;
+	p->buf[p->start + 3] = words & 0xFF;
+}
+
+static void report_block(pkt_t *p, uint32_t ssrc, uint8_t fraction, uint32_t lost24, uint32_t highest, uint32_t jitter,
+						 uint32_t lsr, uint32_t dlsr)
+{
+	put32(p, ssrc);
+	put32(p, (uint32_t)fraction << 24 | (lost24 & 0xFFFFFF));
+	put32(p, highest);
+	put32(p, jitter);
+	put32(p, lsr);
+	put32(p, dlsr);
+}
+
+static void rr(pkt_t *p, int blocks, const uint32_t *ssrcs)
+{
+	begin(p, blocks, RTCP_PT_RR);
+	put32(p, PEER_SSRC);
+	for (int i = 0; i < blocks; i++)
+		report_block(p, ssrcs[i], 25 + i, 1000 + i, 70000 + i, 40 + i, 0x12345678, 0x8000);
+	end(p);
+}
+
+static void sdes(pkt_t *p, uint32_t ssrc, const char *cname)
+{
+	begin(p, 1, RTCP_PT_SDES);
+	put32(p, ssrc);
+	put8(p, 1);
+	put8(p, strlen(cname));
+	for (const char *c = cname; *c; c++)
+		put8(p, *c);
+	put8(p, 0);
+	end(p);
+}
+
+// Parse from a heap copy of exactly len bytes, so a sanitizer build
+// catches any read past the end
+static esp_err_t parse(const uint8_t *buf, size_t len, rtcp_feedback_t *fb)
+{
+	uint8_t *copy = malloc(len ? len : 1);
+	memcpy(copy, buf, len);
+	esp_err_t err = rtcp_parse(copy, len, MEDIA_SSRC, fb);
+	free(copy);
+	return err;
+}
+
+static void check_sr(void)
+{
+	uint8_t buf[RTCP_PACKET_MAX];
+	rtcp_sender_info_t si = {.ssrc = MEDIA_SSRC, .ntp = 0xE1234567ABCDEF01ULL, .rtp_ts = 90000,
+							 .packets = 1234, .octets = 567890};
+	rtcp_feedback_t fb;
+
+	size_t len = rtcp_build_sr(buf, sizeof(buf), &si, "esp32p4-cam", false);
+	CHECK(len == 28 + 24 && len % 4 == 0);
+	CHECK(buf[0] == 0x80 && buf[1] == RTCP_PT_SR && buf[3] == 6);
+	CHECK(buf[28] == 0x81 && buf[29] == RTCP_PT_SDES);
+	CHECK(parse(buf, len, &fb) == ESP_OK);
+	CHECK(fb.ssrc == MEDIA_SSRC && strcmp(fb.cname, "esp32p4-cam") == 0 && !fb.bye && !fb.has_report);
+
+	// With BYE; too small a buffer writes nothing
+	len = rtcp_build_sr(buf, sizeof(buf), &si, "esp32p4-cam", true);
+	CHECK(len == 28 + 24 + 8);
+	CHECK(parse(buf, len, &fb) == ESP_OK && fb.bye);
+	CHECK(rtcp_build_sr(buf, len - 1, &si, "esp32p4-cam", true) == 0);
+
+	// The longest CNAME is cut, and the packet still fits the maximum
+	char cname[100];
+	memset(cname, 'x', sizeof(cname) - 1);
+	cname[sizeof(cname) - 1] = 0;
+	len = rtcp_build_sr(buf, sizeof(buf), &si, cname, true);
+	CHECK(len > 0 && len <= RTCP_PACKET_MAX && len % 4 == 0);
+	CHECK(parse(buf, len, &fb) == ESP_OK && strlen(fb.cname) == RTCP_CNAME_MAX - 1);
+}
+
+static void check_reports(void)
+{
+	pkt_t p = {0};
+	rtcp_feedback_t fb;
+
+	// The block about our stream is picked out of those about others
+	uint32_t ssrcs[] = {0x01010101, MEDIA_SSRC, 0x02020202};
+	rr(&p, 3, ssrcs);
+	sdes(&p, PEER_SSRC, "viewer@host");
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK);
+	CHECK(fb.ssrc == PEER_SSRC && fb.has_report);
+	CHECK(fb.fraction_lost == 26 && fb.cumulative_lost == 1001 && fb.highest_seq == 70001 && fb.jitter == 41);
+	CHECK(fb.lsr == 0x12345678 && fb.dlsr == 0x8000);
+	CHECK(strcmp(fb.cname, "viewer@host") == 0);
+
+	// Blocks about other sources only
+	ssrcs[1] = 0x03030303;
+	p.len = 0;
+	rr(&p, 3, ssrcs);
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK && !fb.has_report && fb.ssrc == PEER_SSRC);
+
+	// Cumulative loss is 24-bit signed: duplicates make it negative
+	p.len = 0;
+	begin(&p, 1, RTCP_PT_RR);
+	put32(&p, PEER_SSRC);
+	report_block(&p, MEDIA_SSRC, 0, 0xFFFFFE, 5, 0, 0, 0);
+	end(&p);
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK && fb.cumulative_lost == -2);
+
+	// An SR from the receiver carries its report blocks after sender info
+	p.len = 0;
+	begin(&p, 1, RTCP_PT_SR);
+	put32(&p, PEER_SSRC);
+	for (int i = 0; i < 5; i++)
+		put32(&p, 0xAAAAAAAA);
+	report_block(&p, MEDIA_SSRC, 7, 8, 9, 10, 11, 12);
+	end(&p);
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK && fb.has_report && fb.fraction_lost == 7 && fb.dlsr == 12);
+
+	// BYE alone names the reporter
+	p.len = 0;
+	begin(&p, 1, RTCP_PT_BYE);
+	put32(&p, PEER_SSRC);
+	end(&p);
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK && fb.bye && fb.ssrc == PEER_SSRC);
+
+	// Unknown packet types are passed over
+	p.len = 0;
+	begin(&p, 0, 204); // APP
+	put32(&p, PEER_SSRC);
+	put32(&p, 0x54455354);
+	end(&p);
+	sdes(&p, PEER_SSRC, "after-app");
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK && strcmp(fb.cname, "after-app") == 0);
+}
+
+static void check_rtt(void)
+{
+	rtcp_stats_t st = {0};
+	rtcp_feedback_t fb = {.ssrc = PEER_SSRC, .has_report = true, .fraction_lost = 3, .jitter = 90};
+
+	// Our SR left at t0, the receiver held it 0.5 s, the report came back
+	// at t0 + 0.6 s: 100 ms round trip
+	uint64_t t0 = 0xE1000000ULL << 32 | 0x40000000;
+	fb.lsr = (t0 >> 16) & 0xFFFFFFFF;
+	fb.dlsr = 0x8000;
+	uint64_t now = t0 + (uint64_t)(0.6 * 4294967296.0);
+	rtcp_update_stats(&st, &fb, now, 42);
+	CHECK(st.rr_received == 1 && st.peer_ssrc == PEER_SSRC && st.last_rr_us == 42);
+	CHECK(st.fraction_lost == 3 && st.jitter == 90);
+	CHECK(st.rtt_us >= 99980 && st.rtt_us <= 100020);
+
+	// No SR seen yet, or a delay longer than the time elapsed: no RTT
+	st.rtt_us = 0;
+	fb.lsr = 0;
+	rtcp_update_stats(&st, &fb, now, 43);
+	CHECK(st.rtt_us == 0 && st.rr_received == 2);
+	fb.lsr = (t0 >> 16) & 0xFFFFFFFF;
+	fb.dlsr = 0x10000;
+	rtcp_update_stats(&st, &fb, now, 44);
+	CHECK(st.rtt_us == 0);
+
+	// The middle 32 bits wrap every 18 hours
+	t0 = 0xE100FFFFULL << 32 | 0xFFFF0000;
+	fb.lsr = (t0 >> 16) & 0xFFFFFFFF;
+	fb.dlsr = 0;
+	rtcp_update_stats(&st, &fb, t0 + (1ULL << 31), 45);
+	CHECK(st.rtt_us >= 499990 && st.rtt_us <= 500010);
+
+	// Feedback without a report block changes nothing but the reporter
+	rtcp_feedback_t empty = {.ssrc = 0x77};
+	rtcp_update_stats(&st, &empty, now, 46);
+	CHECK(st.rr_received == 4 && st.peer_ssrc == 0x77 && st.last_rr_us == 45);
+}
+
+// PLI or FIR from PEER_SSRC; a FIR names each target in an FCI entry
+static void keyframe_request(pkt_t *p, int fmt, uint32_t media_ssrc, const uint32_t *targets, int n)
+{
+	begin(p, fmt, RTCP_PT_PSFB);
+	put32(p, PEER_SSRC);
+	put32(p, media_ssrc);
+	for (int i = 0; i < n; i++)
+	{
+		put32(p, targets[i]);
+		put32(p, (uint32_t)(i + 1) << 24);
+	}
+	end(p);
+}
+
+static void check_keyframe_requests(void)
+{
+	pkt_t p = {0};
+	rtcp_feedback_t fb;
+	rtcp_stats_t st = {0};
+
+	// PLI about our stream, in a compound packet behind an RR
+	uint32_t ssrcs[] = {MEDIA_SSRC};
+	rr(&p, 1, ssrcs);
+	keyframe_request(&p, RTCP_FMT_PLI, MEDIA_SSRC, NULL, 0);
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK && fb.keyframe_request && fb.has_report);
+	rtcp_update_stats(&st, &fb, 0, 1);
+	CHECK(st.keyframe_requests == 1);
+
+	// PLI alone names the reporter; about another source it is ignored
+	p.len = 0;
+	keyframe_request(&p, RTCP_FMT_PLI, MEDIA_SSRC, NULL, 0);
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK && fb.keyframe_request && fb.ssrc == PEER_SSRC);
+	p.len = 0;
+	keyframe_request(&p, RTCP_FMT_PLI, 0x0BADC0DE, NULL, 0);
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK && !fb.keyframe_request && fb.ssrc == 0);
+	rtcp_update_stats(&st, &fb, 0, 2);
+	CHECK(st.keyframe_requests == 1);
+
+	// FIR: the media SSRC field is unused, the FCI entries name targets
+	uint32_t targets[] = {0x01010101, MEDIA_SSRC, 0x02020202};
+	p.len = 0;
+	keyframe_request(&p, RTCP_FMT_FIR, 0, targets, 3);
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK && fb.keyframe_request && fb.ssrc == PEER_SSRC);
+	p.len = 0;
+	keyframe_request(&p, RTCP_FMT_FIR, MEDIA_SSRC, targets, 1);
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK && !fb.keyframe_request && fb.ssrc == 0);
+
+	// A FIR entry cut short, and feedback without its two SSRCs
+	p.len = 0;
+	begin(&p, RTCP_FMT_FIR, RTCP_PT_PSFB);
+	put32(&p, PEER_SSRC);
+	put32(&p, 0);
+	put32(&p, MEDIA_SSRC);
+	end(&p);
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK && !fb.keyframe_request);
+	p.len = 0;
+	begin(&p, RTCP_FMT_PLI, RTCP_PT_PSFB);
+	put32(&p, PEER_SSRC);
+	end(&p);
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK && !fb.keyframe_request);
+
+	// Other payload-specific formats are passed over
+	p.len = 0;
+	keyframe_request(&p, 2, MEDIA_SSRC, NULL, 0); // SLI
+	keyframe_request(&p, 15, MEDIA_SSRC, NULL, 0); // Application layer
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK && !fb.keyframe_request);
+}
+
+static void check_malformed(void)
+{
+	pkt_t p = {0};
+	rtcp_feedback_t fb;
+	uint32_t ssrcs[] = {MEDIA_SSRC};
+
+	CHECK(parse(p.buf, 0, &fb) == ESP_ERR_INVALID_ARG);
+	CHECK(parse(p.buf, 3, &fb) == ESP_ERR_INVALID_ARG);
+
+	// Wrong version
+	rr(&p, 1, ssrcs);
+	p.buf[0] = 0x40 | 1;
+	CHECK(parse(p.buf, p.len, &fb) == ESP_ERR_INVALID_ARG);
+
+	// A length running past the datagram, in the first or a later packet
+	p.len = 0;
+	rr(&p, 1, ssrcs);
+	size_t first = p.len;
+	sdes(&p, PEER_SSRC, "cut");
+	for (size_t len = 4; len < p.len; len += 4)
+	{
+		if (len == first)
+			continue;
+		CHECK(parse(p.buf, len, &fb) == ESP_ERR_INVALID_ARG);
+	}
+
+	// Counts larger than the packet holds: only whole blocks are read
+	p.len = 0;
+	begin(&p, 31, RTCP_PT_RR);
+	put32(&p, PEER_SSRC);
+	report_block(&p, MEDIA_SSRC, 1, 2, 3, 4, 5, 6);
+	put32(&p, MEDIA_SSRC);
+	end(&p);
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK && fb.has_report && fb.jitter == 4);
+
+	// An SR or RR too short for its fixed part
+	p.len = 0;
+	begin(&p, 1, RTCP_PT_SR);
+	put32(&p, PEER_SSRC);
+	put32(&p, 0);
+	end(&p);
+	begin(&p, 1, RTCP_PT_RR);
+	end(&p);
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK && !fb.has_report && fb.ssrc == PEER_SSRC);
+
+	// SDES item running past its packet, and a chunk without items
+	p.len = 0;
+	begin(&p, 1, RTCP_PT_SDES);
+	put32(&p, PEER_SSRC);
+	put8(&p, 1);
+	put8(&p, 200);
+	put8(&p, 'a');
+	end(&p);
+	begin(&p, 1, RTCP_PT_SDES);
+	end(&p);
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK && fb.cname[0] == 0 && fb.ssrc == 0);
+
+	// BYE without a source
+	p.len = 0;
+	begin(&p, 0, RTCP_PT_BYE);
+	end(&p);
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK && fb.bye && fb.ssrc == 0);
+
+	// Trailing bytes shorter than a header are left alone
+	p.len = 0;
+	rr(&p, 1, ssrcs);
+	put8(&p, 0x80);
+	put8(&p, RTCP_PT_RR);
+	CHECK(parse(p.buf, p.len, &fb) == ESP_OK && fb.has_report);
+}
+
+// Mutations of a valid compound packet: whatever comes in, the parser stays
+// inside the datagram and returns well-formed feedback
+static void fuzz(const pkt_t *valid)
+{
+	test_rng_t rng;
+	test_rng_seed(&rng, 16);
+	int accepted = 0;
+
+	for (int i = 0; i < 50000; i++)
+	{
+		uint8_t buf[sizeof(valid->buf)];
+		size_t len = valid->len;
+		memcpy(buf, valid->buf, len);
+		int edits = 1 + test_rng_below(&rng, 4);
+		for (int e = 0; e < edits; e++)
+		{
+			switch (test_rng_below(&rng, 3))
+			{
+			case 0:
+				buf[test_rng_below(&rng, len)] = test_rng_next(&rng);
+				break;
+			case 1:
+				// Header bytes: version, count, type, length
+				buf[test_rng_below(&rng, len) & ~3u] ^= 1 << test_rng_below(&rng, 8);
+				break;
+			default:
+				len = test_rng_below(&rng, len + 1);
+				break;
+			}
+			if (len == 0)
+				break;
+		}
+
+		rtcp_feedback_t fb;
+		if (parse(buf, len, &fb) == ESP_OK)
+			accepted++;
+		CHECK(fb.nack_count <= RTCP_NACK_MAX);
+		CHECK(memchr(fb.cname, 0, sizeof(fb.cname)) != NULL);
+	}
+	printf("fuzz: %d of 50000 mutated packets accepted\n", accepted);
+	CHECK(accepted > 0 && accepted < 50000);
+}
+
+int main(void)
+{
+	check_sr();
+	check_reports();
+	check_rtt();
+	check_keyframe_requests();
+	check_malformed();
+
+	pkt_t valid = {0};
+	uint32_t ssrcs[] = {0x01010101, MEDIA_SSRC};
+	rr(&valid, 2, ssrcs);
+	sdes(&valid, PEER_SSRC, "viewer@host");
+	keyframe_request(&valid, RTCP_FMT_PLI, MEDIA_SSRC, NULL, 0);
+	keyframe_request(&valid, RTCP_FMT_FIR, 0, ssrcs, 2);
+	begin(&valid, 1, RTCP_PT_BYE);
+	put32(&valid, PEER_SSRC);
+	end(&valid);
+	fuzz(&valid);
+	return TEST_RESULT();
+}
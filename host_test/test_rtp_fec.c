@@ -0,0 +1,376 @@
+// ULPFEC: drop packets and recover them with an RFC 5109 receiver; the XOR
+// kernel against a byte loop
+#include "test_util.h"
+#include "h264_nal.h"
+#include "rtp.h"
+#include "rtp_fec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEDIA_SSRC 0x11223344
+#define FEC_SSRC 0x55667788
+#define PKT_MAX (RTP_FEC_HEADERS_MAX + RTP_FEC_PAYLOAD_MAX)
+
+typedef struct
+{
+	uint8_t data[PKT_MAX];
+	size_t len;
+	bool lost;
+} wire_t;
+
+// One access unit as sent to a client: media and FEC packets
+typedef struct
+{
+	wire_t media[RTP_PACKET_LIST_MAX];
+	wire_t fec[RTP_FEC_MAX];
+	uint16_t media_count;
+	uint16_t fec_count;
+	uint16_t seq; // Sequence number of media[0]
+} frame_t;
+
+static rtp_packet_t s_pkts[RTP_PACKET_LIST_MAX];
+static uint8_t s_arena[RTP_STAP_ARENA];
+static rtp_fec_list_t s_fec;
+static uint16_t s_seq = 0xFFE0, s_fec_seq = 0xFFFA; // Both wrap early on
+
+static uint32_t be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Packetize, protect and serialize one access unit, as send_au() and send_fec() do
+static void send_frame(frame_t *f, const uint8_t *au, size_t len, uint32_t ts, h264_nal_index_t *idx)
+{
+	rtp_packet_list_t list;
+	h264_nal_index_build(au, len, idx);
+	rtp_packet_list_init(&list, s_pkts, RTP_PACKET_LIST_MAX, ts);
+	rtp_packet_list_set_arena(&list, s_arena, sizeof(s_arena));
+	for (size_t i = 0; i < idx->count; i++)
+		CHECK(rtp_packetize_h264(&list, au + idx->nals[i].offset, idx->nals[i].len) == ESP_OK);
+	rtp_packet_list_end_au(&list);
+	rtp_fec_generate(&s_fec, &list, idx->idr ? CONFIG_RTP_FEC_IDR_PERCENT : CONFIG_RTP_FEC_PERCENT);
+
+	f->seq = s_seq;
+	f->media_count = list.count;
+	for (uint16_t i = 0; i < list.count; i++)
+	{
+		const rtp_packet_t *p = &list.pkts[i];
+		wire_t *w = &f->media[i];
+		size_t hdr = rtp_write_header(w->data, p, ts, s_seq++, MEDIA_SSRC);
+		memcpy(w->data + hdr, p->payload, p->len);
+		w->len = hdr + p->len;
+		w->lost = false;
+	}
+
+	f->fec_count = s_fec.count;
+	for (uint16_t i = 0; i < s_fec.count; i++)
+	{
+		const rtp_fec_packet_t *fp = &s_fec.pkts[i];
+		wire_t *w = &f->fec[i];
+		size_t hdr = rtp_fec_write_header(w->data, fp, ts, s_fec_seq++, FEC_SSRC, f->seq + fp->first);
+		memcpy(w->data + hdr, fp->payload, fp->len);
+		w->len = hdr + fp->len;
+		w->lost = false;
+	}
+}
+
+/**
+ * @brief Rebuild one lost media packet from a FEC packet (RFC 5109 10.2)
+ *
+ * @return true if the FEC packet protected exactly one lost packet
+ */
+static bool recover_one(frame_t *f, const wire_t *fw, wire_t *out, uint16_t *out_index)
+{
+	const uint8_t *p = fw->data;
+	CHECK((p[1] & 0x7F) == RTP_PT_ULPFEC && be32(p + 8) == FEC_SSRC);
+	const uint8_t *fh = p + RTP_HEADER_LEN;
+	const uint8_t *lh = fh + RTP_FEC_HEADER_LEN;
+	bool long_mask = fh[0] & 0x40;
+	size_t lh_len = long_mask ? RTP_FEC_LEVEL_LEN : 4;
+	uint16_t sn_base = (fh[2] << 8) | fh[3];
+	uint16_t prot_len = (lh[0] << 8) | lh[1];
+	uint64_t mask = 0;
+	for (size_t i = 0; i < lh_len - 2; i++)
+		mask |= (uint64_t)lh[2 + i] << (40 - 8 * i);
+	const uint8_t *payload = lh + lh_len;
+	if (!CHECK(payload + prot_len == fw->data + fw->len))
+		return false;
+
+	// Exactly one protected packet missing
+	int missing = -1;
+	for (int b = 0; b < 48; b++)
+	{
+		if (!(mask & (1ULL << (47 - b))))
+			continue;
+		uint16_t i = (uint16_t)(sn_base + b - f->seq);
+		if (!CHECK(i < f->media_count))
+			return false;
+		if (f->media[i].lost)
+		{
+			if (missing >= 0)
+				return false;
+			missing = i;
+		}
+	}
+	if (missing < 0)
+		return false;
+
+	uint8_t bits = fh[0] & 0x3F, mpt = fh[1];
+	uint32_t ts = be32(fh + 4);
+	uint16_t len = (fh[8] << 8) | fh[9];
+	uint8_t body[RTP_FEC_PAYLOAD_MAX] = {0};
+	memcpy(body, payload, prot_len);
+	for (int b = 0; b < 48; b++)
+	{
+		uint16_t i = (uint16_t)(sn_base + b - f->seq);
+		if (!(mask & (1ULL << (47 - b))) || i == missing)
+			continue;
+		const wire_t *m = &f->media[i];
+		bits ^= m->data[0] & 0x3F;
+		mpt ^= m->data[1];
+		ts ^= be32(m->data + 4);
+		len ^= m->len - RTP_HEADER_LEN;
+		rtp_fec_xor(body, m->data + RTP_HEADER_LEN, m->len - RTP_HEADER_LEN);
+	}
+	if (!CHECK(len <= prot_len))
+		return false;
+
+	uint16_t seq = f->seq + missing;
+	out->data[0] = 0x80 | bits;
+	out->data[1] = mpt;
+	out->data[2] = seq >> 8;
+	out->data[3] = seq & 0xFF;
+	for (int i = 0; i < 4; i++)
+	{
+		out->data[4 + i] = ts >> (24 - 8 * i);
+		out->data[8 + i] = MEDIA_SSRC >> (24 - 8 * i);
+	}
+	memcpy(out->data + RTP_HEADER_LEN, body, len);
+	out->len = RTP_HEADER_LEN + len;
+	out->lost = false;
+	*out_index = missing;
+	return true;
+}
+
+/**
+ * @brief Recover what the FEC packets allow, repeating while any succeeds
+ *
+ * @return Packets recovered; each must match the packet that was sent
+ */
+static uint32_t recover(frame_t *f, const frame_t *sent)
+{
+	uint32_t recovered = 0;
+	bool progress = true;
+	while (progress)
+	{
+		progress = false;
+		for (uint16_t j = 0; j < f->fec_count; j++)
+		{
+			wire_t rec;
+			uint16_t i;
+			if (f->fec[j].lost || !recover_one(f, &f->fec[j], &rec, &i))
+				continue;
+			CHECK(rec.len == sent->media[i].len && memcmp(rec.data, sent->media[i].data, rec.len) == 0);
+			f->media[i] = rec;
+			recovered++;
+			progress = true;
+		}
+	}
+	return recovered;
+}
+
+static bool complete(const frame_t *f)
+{
+	for (uint16_t i = 0; i < f->media_count; i++)
+	{
+		if (f->media[i].lost)
+			return false;
+	}
+	return true;
+}
+
+// A repaired frame must depacketize to the access unit that was sent
+static void check_decodes(const frame_t *f, const uint8_t *au, const h264_nal_index_t *idx)
+{
+	static test_depack_t d;
+	if (!d.data)
+		test_depack_init(&d, 512 * 1024);
+	test_depack_reset(&d);
+	d.packets = 0;
+	d.seq_gaps = 0;
+	for (uint16_t i = 0; i < f->media_count; i++)
+		CHECK(test_depack_rtp(&d, f->media[i].data, f->media[i].len));
+	if (!CHECK(d.count == idx->count && d.seq_gaps == 0 && d.marker))
+		return;
+	for (size_t i = 0; i < idx->count; i++)
+	{
+		CHECK(d.nal_len[i] == idx->nals[i].len);
+		CHECK(memcmp(d.data + d.offset[i], au + idx->nals[i].offset, idx->nals[i].len) == 0);
+	}
+}
+
+// Every single loss, and every burst as long as a block has FEC packets
+static void check_patterns(const uint8_t *au, size_t len, const char *name)
+{
+	static frame_t sent, f;
+	h264_nal_index_t idx;
+	send_frame(&sent, au, len, 90000, &idx);
+	printf("%s: %u media packets, %u FEC packets\n", name, sent.media_count, sent.fec_count);
+
+	for (uint16_t i = 0; i < sent.media_count; i++)
+	{
+		f = sent;
+		f.media[i].lost = true;
+		CHECK(recover(&f, &sent) == 1);
+		CHECK(complete(&f));
+	}
+
+	for (uint16_t base = 0; base < sent.media_count; base += RTP_FEC_SPAN)
+	{
+		uint16_t n = sent.media_count - base < RTP_FEC_SPAN ? sent.media_count - base : RTP_FEC_SPAN;
+		uint16_t k = 0;
+		for (uint16_t j = 0; j < sent.fec_count; j++)
+			k += s_fec.pkts[j].first >= base && s_fec.pkts[j].first < base + n;
+		for (uint16_t start = base; start + k <= base + n; start++)
+		{
+			f = sent;
+			for (uint16_t i = start; i < start + k; i++)
+				f.media[i].lost = true;
+			CHECK(recover(&f, &sent) == k);
+			if (!CHECK(complete(&f)))
+				break;
+		}
+	}
+	check_decodes(&f, au, &idx);
+}
+
+static void check_random_loss(const test_stream_t *s, uint32_t loss_permille)
+{
+	static frame_t sent, f;
+	test_rng_t rng;
+	test_rng_seed(&rng, 18 + loss_permille);
+	uint32_t damaged = 0, repaired = 0, media = 0, fec = 0;
+
+	for (size_t n = 0; n < s->count; n++)
+	{
+		const uint8_t *au = s->data + s->offset[n];
+		h264_nal_index_t idx;
+		send_frame(&sent, au, s->offset[n + 1] - s->offset[n], n * 3000, &idx);
+		media += sent.media_count;
+		fec += sent.fec_count;
+
+		f = sent;
+		for (uint16_t i = 0; i < f.media_count; i++)
+			f.media[i].lost = test_rng_below(&rng, 1000) < loss_permille;
+		for (uint16_t i = 0; i < f.fec_count; i++)
+			f.fec[i].lost = test_rng_below(&rng, 1000) < loss_permille;
+		if (complete(&f))
+			continue;
+
+		damaged++;
+		recover(&f, &sent);
+		if (complete(&f))
+		{
+			repaired++;
+			check_decodes(&f, au, &idx);
+		}
+	}
+	printf("%4.1f%% loss: %3u of %zu frames damaged, %3u repaired (%.0f%% overhead)\n", loss_permille / 10.0,
+		   damaged, s->count, repaired, 100.0 * fec / media);
+	CHECK(damaged > 0);
+	CHECK(repaired * 2 > damaged);
+}
+
+static void check_xor(void)
+{
+	test_rng_t rng;
+	test_rng_seed(&rng, 180);
+	uint8_t src[128 + 8], dst[128 + 8], ref[128 + 8];
+
+	// Every alignment of both sides and every length through the word loops
+	for (size_t sa = 0; sa < 8; sa++)
+	{
+		for (size_t da = 0; da < 8; da++)
+		{
+			for (size_t len = 0; len <= 128; len++)
+			{
+				for (size_t i = 0; i < sizeof(src); i++)
+				{
+					src[i] = test_rng_next(&rng);
+					dst[i] = ref[i] = test_rng_next(&rng);
+				}
+				for (size_t i = 0; i < len; i++)
+					ref[da + i] ^= src[sa + i];
+				rtp_fec_xor(dst + da, src + sa, len);
+				if (!CHECK(memcmp(dst, ref, sizeof(dst)) == 0))
+					return;
+			}
+		}
+	}
+}
+
+static void bench_generate(const test_stream_t *s)
+{
+	static rtp_packet_t pkts[RTP_PACKET_LIST_MAX];
+	h264_nal_index_t idx;
+	uint64_t bytes = 0;
+	int64_t ns = 0;
+
+	for (size_t n = 0; n < s->count; n++)
+	{
+		const uint8_t *au = s->data + s->offset[n];
+		rtp_packet_list_t list;
+		h264_nal_index_build(au, s->offset[n + 1] - s->offset[n], &idx);
+		rtp_packet_list_init(&list, pkts, RTP_PACKET_LIST_MAX, 0);
+		for (size_t i = 0; i < idx.count; i++)
+			rtp_packetize_h264(&list, au + idx.nals[i].offset, idx.nals[i].len);
+		rtp_packet_list_end_au(&list);
+
+		int64_t t0 = test_now_ns();
+		rtp_fec_generate(&s_fec, &list, idx.idr ? CONFIG_RTP_FEC_IDR_PERCENT : CONFIG_RTP_FEC_PERCENT);
+		ns += test_now_ns() - t0;
+		for (uint16_t p = 0; p < list.count; p++)
+			bytes += list.pkts[p].prefix_len + list.pkts[p].len;
+	}
+	printf("parity: %.1f us/frame, %.0f MB/s protected\n", ns / 1000.0 / s->count, bytes * 1000.0 / ns);
+}
+
+int main(int argc, char **argv)
+{
+	test_stream_t s;
+	test_rng_t rng;
+	uint8_t *au = malloc(256 * 1024);
+	s_fec.arena = malloc(RTP_FEC_MAX * RTP_FEC_PAYLOAD_MAX);
+	test_rng_seed(&rng, 1800);
+
+	check_xor();
+
+	// A P frame in one block, an IDR over two, tiny frames in one packet
+	size_t len = test_make_au(au, 256 * 1024, false, 14000, &rng);
+	check_patterns(au, len, "P frame");
+	len = test_make_au(au, 256 * 1024, true, 90000, &rng);
+	check_patterns(au, len, "IDR frame");
+	len = test_make_au(au, 256 * 1024, false, 200, &rng);
+	check_patterns(au, len, "small P frame");
+
+	test_stream_synthetic(&s, 300, 30, 19);
+	check_random_loss(&s, 10);
+	check_random_loss(&s, 20);
+	check_random_loss(&s, 50);
+	bench_generate(&s);
+	test_stream_free(&s);
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!CHECK(test_stream_load(&s, argv[i])))
+			continue;
+		printf("\n%s\n", argv[i]);
+		check_random_loss(&s, 20);
+		bench_generate(&s);
+		test_stream_free(&s);
+	}
+	free(s_fec.arena);
+	free(au);
+	return TEST_RESULT();
+}
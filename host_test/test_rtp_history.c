@@ -0,0 +1,307 @@
+// Retransmission history: what it keeps and for how long, the frames it
+// pins, spilled payloads, and NACKs parsed and looked up across the
+// sequence number wrap
+#include "test_util.h"
+#include "frame_store.h"
+#include "h264_nal.h"
+#include "rtcp.h"
+#include "rtp.h"
+#include "rtp_history.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAME_US 33333
+#define WINDOW_MS 500
+#define MEDIA_SSRC 0x11223344u
+
+/**
+ * @brief What was sent under each sequence number
+ */
+typedef struct
+{
+	uint32_t hash; // Of prefix and payload
+	uint32_t ts;
+	uint16_t len;
+	bool marker;
+	bool sent;
+} sent_t;
+
+static sent_t s_sent[65536];
+static rtp_packet_t s_pkts[RTP_PACKET_LIST_MAX];
+static uint8_t s_arena[RTP_STAP_ARENA];
+
+static uint32_t packet_hash(const rtp_packet_t *p)
+{
+	uint32_t h = 2166136261u;
+	for (uint8_t i = 0; i < p->prefix_len; i++)
+		h = (h ^ p->prefix[i]) * 16777619u;
+	for (uint16_t i = 0; i < p->len; i++)
+		h = (h ^ p->payload[i]) * 16777619u;
+	return h;
+}
+
+static uint32_t frames_alive(void)
+{
+	frame_store_stats_t st;
+	frame_store_get_stats(&st);
+	return st.frames;
+}
+
+/**
+ * @brief Store, packetize and remember one access unit, as the sender does
+ *
+ * @return Packets pushed
+ */
+static uint16_t push_frame(rtp_history_t *h, uint16_t *seq, uint32_t ts, bool idr, size_t slice_len, int64_t now_us,
+						   test_rng_t *rng)
+{
+	static uint8_t au[256 * 1024];
+	size_t len = test_make_au(au, sizeof(au), idr, slice_len, rng);
+	h264_nal_index_t idx;
+	h264_nal_index_build(au, len, &idx);
+	stream_frame_t *f = frame_store_put(au, &idx, ts, now_us);
+	if (!CHECK(f != NULL))
+		return 0;
+
+	rtp_packet_list_t list;
+	rtp_packet_list_init(&list, s_pkts, RTP_PACKET_LIST_MAX, ts);
+	rtp_packet_list_set_arena(&list, s_arena, sizeof(s_arena));
+	for (size_t i = 0; i < f->idx.count; i++)
+		rtp_packetize_h264(&list, f->data + f->idx.nals[i].offset, f->idx.nals[i].len);
+	rtp_packet_list_end_au(&list);
+
+	for (uint16_t i = 0; i < list.count; i++)
+	{
+		sent_t *s = &s_sent[(uint16_t)(*seq + i)];
+		s->hash = packet_hash(&list.pkts[i]);
+		s->ts = ts;
+		s->len = list.pkts[i].len;
+		s->marker = list.pkts[i].marker;
+		s->sent = true;
+	}
+	rtp_history_push(h, &list, 0, list.count, *seq, f, now_us);
+	*seq += list.count;
+	frame_unref(f);
+
+	// The arena is reused by the next frame, as on the sender
+	memset(s_arena, 0xEE, sizeof(s_arena));
+	return list.count;
+}
+
+// Look a packet up and compare it with what went out
+static esp_err_t get(rtp_history_t *h, uint16_t seq, int64_t now_us)
+{
+	uint8_t buf[RTP_MTU];
+	rtp_packet_t pkt;
+	uint32_t ts;
+	esp_err_t err = rtp_history_get(h, seq, 0, now_us, &pkt, buf, &ts);
+	if (err == ESP_OK)
+	{
+		const sent_t *s = &s_sent[seq];
+		CHECK(s->sent && pkt.len == s->len && ts == s->ts && pkt.marker == s->marker);
+		CHECK(packet_hash(&pkt) == s->hash);
+	}
+	return err;
+}
+
+// 2 s of 100 KB frames: the window releases frames, the newest read back
+static void check_window(rtp_history_t *h, test_rng_t *rng)
+{
+	uint16_t seq = 65000; // Wraps within the first frames
+	uint16_t first = seq;
+	int64_t now = 1000000;
+	uint32_t peak = 0;
+
+	CHECK(rtp_history_open(h, WINDOW_MS) == ESP_OK);
+	for (int f = 0; f < 60; f++)
+	{
+		push_frame(h, &seq, f * 3000, f % 30 == 0, 100 * 1024, now, rng);
+		uint32_t alive = frames_alive();
+		peak = alive > peak ? alive : peak;
+
+		// Everything sent within the window is there
+		for (uint16_t s = (uint16_t)(seq - 1); s != (uint16_t)(first - 1); s--)
+		{
+			if (!s_sent[s].sent)
+				break;
+			const sent_t *e = &s_sent[s];
+			int64_t age_us = (int64_t)(f - e->ts / 3000) * FRAME_US;
+			if (age_us > WINDOW_MS * 1000)
+			{
+				CHECK(get(h, s, now) == ESP_ERR_NOT_FOUND);
+				break;
+			}
+			// The packet bound ends the history first with 100 KB frames
+			if ((uint16_t)(seq - 1 - s) >= RTP_HISTORY_PACKETS)
+			{
+				CHECK(get(h, s, now) == ESP_ERR_NOT_FOUND);
+				break;
+			}
+			CHECK(get(h, s, now) == ESP_OK);
+		}
+		now += FRAME_US;
+	}
+	printf("100 KB frames at 30 fps, %d ms window: at most %u frames pinned\n", WINDOW_MS, peak);
+	CHECK(peak <= WINDOW_MS * 1000 / FRAME_US + 2);
+	CHECK(peak >= RTP_HISTORY_PACKETS / 80);
+
+	// Not sent yet, and sent too long ago
+	CHECK(get(h, seq, now) == ESP_ERR_NOT_FOUND);
+	CHECK(get(h, first, now) == ESP_ERR_NOT_FOUND);
+
+	// Time alone expires what is left, on the next push
+	now += 2 * WINDOW_MS * 1000LL;
+	uint16_t before = seq - 1;
+	push_frame(h, &seq, 61 * 3000, false, 2000, now, rng);
+	CHECK(get(h, before, now) == ESP_ERR_NOT_FOUND);
+	CHECK(get(h, seq - 1, now) == ESP_OK);
+	CHECK(frames_alive() == 1);
+
+	rtp_history_close(h);
+	CHECK(frames_alive() == 0);
+	CHECK(get(h, seq - 1, now) == ESP_ERR_NOT_FOUND);
+}
+
+// Small frames: the packet bound and the spill ring end the history
+static void check_bounds(rtp_history_t *h, test_rng_t *rng)
+{
+	uint16_t seq = 100;
+	int64_t now = 0;
+
+	CHECK(rtp_history_open(h, 60000) == ESP_OK);
+	for (int f = 0; f < 1500; f++)
+	{
+		push_frame(h, &seq, f * 3000, f % 30 == 0, 200, now, rng);
+		now += FRAME_US;
+	}
+	CHECK(frames_alive() <= RTP_HISTORY_PACKETS);
+	CHECK(get(h, seq - RTP_HISTORY_PACKETS - 1, now) == ESP_ERR_NOT_FOUND);
+	CHECK(get(h, seq - RTP_HISTORY_PACKETS + 1, now) == ESP_OK);
+	CHECK(get(h, seq - 1, now) == ESP_OK);
+
+	// A packet just resent is refused until the gap has passed
+	uint8_t buf[RTP_MTU];
+	rtp_packet_t pkt;
+	uint32_t ts;
+	CHECK(rtp_history_get(h, seq - 2, 20000, now, &pkt, buf, &ts) == ESP_OK);
+	CHECK(rtp_history_get(h, seq - 2, 20000, now + 10000, &pkt, buf, &ts) == ESP_ERR_INVALID_STATE);
+	CHECK(rtp_history_get(h, seq - 2, 20000, now + 20000, &pkt, buf, &ts) == ESP_OK);
+
+	// Sequence numbers skipped by a failed send still count as sent
+	uint16_t gap = seq;
+	seq += 10;
+	push_frame(h, &seq, 1501 * 3000, false, 200, now, rng);
+	CHECK(get(h, gap, now) == ESP_ERR_NOT_FOUND);
+	CHECK(get(h, seq - 1, now) == ESP_OK);
+
+	rtp_history_close(h);
+	CHECK(frames_alive() == 0);
+
+	// Small IDRs go out as one STAP-A each, copied to the spill ring: they
+	// pin no frame, the newest RTP_HISTORY_SPILL bytes of them read back
+	// intact after the arena was reused, older ones are gone
+	CHECK(rtp_history_open(h, 60000) == ESP_OK);
+	uint16_t start = seq;
+	for (int f = 0; f < 200; f++)
+	{
+		CHECK(push_frame(h, &seq, f * 3000, true, 200, now, rng) == 1);
+		now += FRAME_US;
+	}
+	CHECK(frames_alive() == 0);
+	size_t back = 0;
+	int kept = 0;
+	for (uint16_t s = seq - 1; s != (uint16_t)(start - 1); s--)
+	{
+		back += s_sent[s].len;
+		if (back <= RTP_HISTORY_SPILL - RTP_STAP_NAL_MAX)
+			kept += CHECK(get(h, s, now) == ESP_OK);
+		else if (back > 2 * RTP_HISTORY_SPILL)
+			CHECK(get(h, s, now) == ESP_ERR_NOT_FOUND);
+	}
+	printf("spill ring: %d STAP-A payloads of %u bytes read back\n", kept, s_sent[(uint16_t)(seq - 1)].len);
+	CHECK(kept >= (RTP_HISTORY_SPILL - RTP_STAP_NAL_MAX) / RTP_STAP_NAL_MAX);
+	rtp_history_close(h);
+
+	// A closed history takes nothing and holds nothing
+	push_frame(h, &seq, 0, true, 200, now, rng);
+	CHECK(frames_alive() == 0);
+	CHECK(get(h, seq - 1, now) == ESP_ERR_NOT_FOUND);
+}
+
+static size_t nack(uint8_t *buf, uint32_t media_ssrc, const uint16_t *pid_blp, int pairs)
+{
+	size_t len = 12 + 4 * pairs;
+	buf[0] = 0x80 | RTCP_FMT_NACK;
+	buf[1] = RTCP_PT_RTPFB;
+	buf[2] = 0;
+	buf[3] = len / 4 - 1;
+	memset(buf + 4, 0x5A, 4);
+	buf[8] = media_ssrc >> 24;
+	buf[9] = media_ssrc >> 16;
+	buf[10] = media_ssrc >> 8;
+	buf[11] = media_ssrc;
+	for (int i = 0; i < pairs; i++)
+	{
+		buf[12 + 4 * i] = pid_blp[2 * i] >> 8;
+		buf[13 + 4 * i] = pid_blp[2 * i] & 0xFF;
+		buf[14 + 4 * i] = pid_blp[2 * i + 1] >> 8;
+		buf[15 + 4 * i] = pid_blp[2 * i + 1] & 0xFF;
+	}
+	return len;
+}
+
+static void check_nack(rtp_history_t *h, test_rng_t *rng)
+{
+	uint8_t buf[256];
+	rtcp_feedback_t fb;
+
+	// PID and the BLP bits after it, past 65535
+	uint16_t wrap[] = {65534, 0x0007};
+	CHECK(rtcp_parse(buf, nack(buf, MEDIA_SSRC, wrap, 1), MEDIA_SSRC, &fb) == ESP_OK);
+	CHECK(fb.nack_count == 4 && fb.ssrc == 0x5A5A5A5A);
+	CHECK(fb.nack[0] == 65534 && fb.nack[1] == 65535 && fb.nack[2] == 0 && fb.nack[3] == 1);
+
+	// Every BLP bit, then more pairs than RTCP_NACK_MAX holds
+	uint16_t full[] = {100, 0xFFFF, 200, 0xFFFF, 300, 0xFFFF, 400, 0xFFFF, 500, 0xFFFF};
+	CHECK(rtcp_parse(buf, nack(buf, MEDIA_SSRC, full, 5), MEDIA_SSRC, &fb) == ESP_OK);
+	CHECK(fb.nack_count == RTCP_NACK_MAX);
+	CHECK(fb.nack[0] == 100 && fb.nack[16] == 116 && fb.nack[17] == 200 && fb.nack[RTCP_NACK_MAX - 1] == 412);
+
+	// About another stream, or without its FCI
+	CHECK(rtcp_parse(buf, nack(buf, 0x0BADC0DE, wrap, 1), MEDIA_SSRC, &fb) == ESP_OK);
+	CHECK(fb.nack_count == 0 && fb.ssrc == 0);
+	CHECK(rtcp_parse(buf, nack(buf, MEDIA_SSRC, wrap, 0), MEDIA_SSRC, &fb) == ESP_OK && fb.nack_count == 0);
+	size_t len = nack(buf, MEDIA_SSRC, wrap, 1);
+	buf[3]++;
+	CHECK(rtcp_parse(buf, len, MEDIA_SSRC, &fb) == ESP_ERR_INVALID_ARG);
+
+	// From NACK to the packets it names, across the wrap
+	uint16_t seq = 65500;
+	int64_t now = 0;
+	CHECK(rtp_history_open(h, WINDOW_MS) == ESP_OK);
+	while (seq >= 65500 || seq < 20)
+	{
+		push_frame(h, &seq, now / FRAME_US * 3000, false, 8000, now, rng);
+		now += FRAME_US;
+	}
+	uint16_t lost[] = {65533, 0x00FF};
+	CHECK(rtcp_parse(buf, nack(buf, MEDIA_SSRC, lost, 1), MEDIA_SSRC, &fb) == ESP_OK && fb.nack_count == 9);
+	for (int i = 0; i < fb.nack_count; i++)
+		CHECK(get(h, fb.nack[i], now) == ESP_OK);
+	rtp_history_close(h);
+	CHECK(frames_alive() == 0);
+}
+
+int main(void)
+{
+	static rtp_history_t h;
+	test_rng_t rng;
+	test_rng_seed(&rng, 17);
+
+	CHECK(rtp_history_create(&h) == ESP_OK);
+	check_window(&h, &rng);
+	check_bounds(&h, &rng);
+	check_nack(&h, &rng);
+	return TEST_RESULT();
+}
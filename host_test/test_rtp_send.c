@@ -0,0 +1,286 @@
+// RTP send path over loopback: payloads as received, bytes copied, packets
+// per socket call and CPU per frame against the copying send_nal()/send_rtp()
+// it replaced, at 1, 4 and 8 clients
+#include "test_util.h"
+#include "h264_nal.h"
+#include "rtp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define CLIENTS_MAX 8
+
+typedef struct
+{
+	int rx;					 // Receiving socket of the client
+	struct sockaddr_in dest; // Where the server sends to
+	uint16_t seq;
+	uint32_t ssrc;
+	test_depack_t depack;
+} client_t;
+
+typedef enum
+{
+	MODE_LEGACY,	// send_nal() and send_rtp(): two copies, one sendto() per packet
+	MODE_ZERO_COPY, // rtp_send_batch() one packet at a time
+	MODE_BATCHED,	// rtp_send_batch() in runs of RTP_BATCH_MAX, fanned out per run
+	MODE_COUNT,
+} send_mode_t;
+
+static const char *const s_mode_names[] = {"send_nal() copies", "rtp_send_batch() x1", "rtp_send_batch() x16"};
+
+static int s_sock;
+static client_t s_clients[CLIENTS_MAX];
+static uint64_t s_copied; // Payload bytes copied by the send path
+
+// send_rtp() as it was: header and payload copied into one stack buffer
+static void legacy_send_rtp(client_t *c, const uint8_t *data, size_t len, bool m, uint32_t ts)
+{
+	uint8_t pkt[12 + RTP_MTU];
+	pkt[0] = 0x80;
+	pkt[1] = 96 | (m ? 0x80 : 0);
+	pkt[2] = (c->seq >> 8) & 0xFF;
+	pkt[3] = c->seq & 0xFF;
+	pkt[4] = (ts >> 24) & 0xFF;
+	pkt[5] = (ts >> 16) & 0xFF;
+	pkt[6] = (ts >> 8) & 0xFF;
+	pkt[7] = ts & 0xFF;
+	pkt[8] = (c->ssrc >> 24) & 0xFF;
+	pkt[9] = (c->ssrc >> 16) & 0xFF;
+	pkt[10] = (c->ssrc >> 8) & 0xFF;
+	pkt[11] = c->ssrc & 0xFF;
+	c->seq++;
+
+	memcpy(pkt + 12, data, len);
+	s_copied += len;
+	CHECK(sendto(s_sock, pkt, len + 12, 0, (struct sockaddr *)&c->dest, sizeof(c->dest)) == (ssize_t)len + 12);
+}
+
+// send_nal() as it was: each FU-A fragment copied behind its FU header
+static void legacy_send_nal(client_t *c, const uint8_t *nal, size_t len, uint32_t ts)
+{
+	if (len <= RTP_MTU)
+	{
+		legacy_send_rtp(c, nal, len, true, ts);
+		return;
+	}
+
+	uint8_t hdr = nal[0];
+	uint8_t fu_ind = (hdr & 0xE0) | 28;
+	const uint8_t *data = nal + 1;
+	size_t rem = len - 1;
+	bool first = true;
+
+	while (rem > 0)
+	{
+		size_t sz = (rem > RTP_MTU - 2) ? (RTP_MTU - 2) : rem;
+		uint8_t fu_hdr = (hdr & 0x1F);
+		if (first)
+		{
+			fu_hdr |= 0x80;
+			first = false;
+		}
+		if (sz == rem)
+			fu_hdr |= 0x40;
+
+		uint8_t frag[RTP_MTU];
+		frag[0] = fu_ind;
+		frag[1] = fu_hdr;
+		memcpy(frag + 2, data, sz);
+		s_copied += sz;
+
+		legacy_send_rtp(c, frag, sz + 2, (sz == rem), ts);
+		data += sz;
+		rem -= sz;
+	}
+}
+
+static void open_clients(int n)
+{
+	s_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	CHECK(s_sock >= 0);
+	for (int i = 0; i < n; i++)
+	{
+		client_t *c = &s_clients[i];
+		struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+		socklen_t addr_len = sizeof(addr);
+		int rcvbuf = 4 << 20;
+
+		c->rx = socket(AF_INET, SOCK_DGRAM, 0);
+		setsockopt(c->rx, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+		CHECK(bind(c->rx, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+		CHECK(getsockname(c->rx, (struct sockaddr *)&addr, &addr_len) == 0);
+		c->dest = addr;
+		c->seq = 1000 * i;
+		c->ssrc = 0x10000 + i;
+		test_depack_init(&c->depack, 512 * 1024);
+	}
+}
+
+static void close_clients(int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		close(s_clients[i].rx);
+		test_depack_free(&s_clients[i].depack);
+	}
+	close(s_sock);
+}
+
+// Take everything queued for a client; the frame must arrive whole
+static bool receive_frame(client_t *c, const uint8_t *au, const h264_nal_index_t *idx)
+{
+	uint8_t pkt[2048];
+	ssize_t n;
+
+	test_depack_reset(&c->depack);
+	while ((n = recv(c->rx, pkt, sizeof(pkt), MSG_DONTWAIT)) > 0)
+		test_depack_rtp(&c->depack, pkt, n);
+
+	test_depack_t *d = &c->depack;
+	if (d->errors || d->seq_gaps || d->count != idx->count || !d->marker || d->ssrc != c->ssrc)
+		return false;
+	for (size_t i = 0; i < idx->count; i++)
+	{
+		if (d->nal_len[i] != idx->nals[i].len ||
+			memcmp(d->data + d->offset[i], au + idx->nals[i].offset, idx->nals[i].len) != 0)
+			return false;
+	}
+	return true;
+}
+
+typedef struct
+{
+	double copied;	 // Payload bytes copied per frame
+	double cpu_ns;	 // Sender CPU per frame
+	double per_call; // Packets per socket call
+	uint32_t bad;	 // Frames a client did not receive intact
+} result_t;
+
+static result_t run(const test_stream_t *s, send_mode_t mode, int clients)
+{
+	static rtp_packet_t pkts[RTP_PACKET_LIST_MAX];
+	static uint8_t arena[RTP_STAP_ARENA];
+	h264_nal_index_t idx;
+	rtp_tx_stats_t before, after;
+	result_t r = {0};
+	int64_t cpu = 0;
+	uint64_t legacy_packets = 0;
+
+	open_clients(clients);
+	s_copied = 0;
+	rtp_get_tx_stats(&before);
+	for (size_t f = 0; f < s->count; f++)
+	{
+		const uint8_t *au = s->data + s->offset[f];
+		uint32_t ts = f * 3000;
+		h264_nal_index_build(au, s->offset[f + 1] - s->offset[f], &idx);
+
+		// Packetized once per frame, as the sender task does
+		int64_t t0 = test_thread_cpu_ns();
+		rtp_packet_list_t list;
+		if (mode != MODE_LEGACY)
+		{
+			rtp_packet_list_init(&list, pkts, RTP_PACKET_LIST_MAX, ts);
+			rtp_packet_list_set_arena(&list, arena, sizeof(arena));
+			for (size_t i = 0; i < idx.count; i++)
+				rtp_packetize_h264(&list, au + idx.nals[i].offset, idx.nals[i].len);
+			rtp_packet_list_end_au(&list);
+			s_copied += list.arena_used;
+		}
+		cpu += test_thread_cpu_ns() - t0;
+
+		t0 = test_thread_cpu_ns();
+		if (mode == MODE_BATCHED)
+		{
+			// As the sender task fans out: each run to every client in turn
+			for (uint16_t p = 0; p < list.count; p += RTP_BATCH_MAX)
+			{
+				for (int i = 0; i < clients; i++)
+				{
+					client_t *c = &s_clients[i];
+					CHECK(rtp_send_batch(s_sock, &c->dest, &list, p, RTP_BATCH_MAX, &c->seq, c->ssrc) > 0);
+				}
+			}
+		}
+		for (int i = 0; i < clients && mode != MODE_BATCHED; i++)
+		{
+			client_t *c = &s_clients[i];
+			if (mode == MODE_LEGACY)
+			{
+				uint16_t seq = c->seq;
+				for (size_t n = 0; n < idx.count; n++)
+					legacy_send_nal(c, au + idx.nals[n].offset, idx.nals[n].len, ts);
+				legacy_packets += (uint16_t)(c->seq - seq);
+			}
+			else
+			{
+				for (uint16_t p = 0; p < list.count; p++)
+					CHECK(rtp_send_batch(s_sock, &c->dest, &list, p, 1, &c->seq, c->ssrc) == 1);
+			}
+		}
+		cpu += test_thread_cpu_ns() - t0;
+
+		for (int i = 0; i < clients; i++)
+		{
+			if (!receive_frame(&s_clients[i], au, &idx))
+				r.bad++;
+		}
+	}
+	rtp_get_tx_stats(&after);
+	close_clients(clients);
+
+	r.copied = (double)s_copied / s->count;
+	r.cpu_ns = (double)cpu / s->count;
+	if (mode == MODE_LEGACY)
+		r.per_call = 1;
+	else
+		r.per_call = (double)(after.packets - before.packets) / (after.syscalls - before.syscalls);
+	return r;
+}
+
+static void bench(const test_stream_t *s, const char *name)
+{
+	static const int clients[] = {1, 4, 8};
+
+	printf("\n%s: %zu frames, %zu IDR, %.1f KB/frame\n", name, s->count, s->idr_count, s->len / 1024.0 / s->count);
+	printf("clients  %-22s  copied B/frame  packets/call  CPU us/frame\n", "path");
+	for (size_t n = 0; n < sizeof(clients) / sizeof(clients[0]); n++)
+	{
+		result_t r[MODE_COUNT];
+		for (int m = 0; m < MODE_COUNT; m++)
+		{
+			r[m] = run(s, m, clients[n]);
+			printf("%7d  %-22s  %14.0f  %12.1f  %12.1f\n", clients[n], s_mode_names[m], r[m].copied, r[m].per_call,
+				   r[m].cpu_ns / 1000);
+			CHECK(r[m].bad == 0);
+		}
+
+		// Fragments were copied twice per client; now only STAP-A
+		// aggregation copies, once per frame and only small NAL units
+		CHECK(r[MODE_LEGACY].copied > 1.9 * clients[n] * s->len / s->count);
+		CHECK(r[MODE_ZERO_COPY].copied <= RTP_STAP_ARENA && r[MODE_BATCHED].copied <= RTP_STAP_ARENA);
+		CHECK(r[MODE_ZERO_COPY].per_call == 1);
+		CHECK(r[MODE_BATCHED].per_call > 4);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	test_stream_t s;
+
+	test_stream_synthetic(&s, 90, 30, 9);
+	bench(&s, "synthetic 1080p, 4 Mbit/s");
+	test_stream_free(&s);
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!CHECK(test_stream_load(&s, argv[i])))
+			continue;
+		bench(&s, argv[i]);
+		test_stream_free(&s);
+	}
+	return TEST_RESULT();
+}
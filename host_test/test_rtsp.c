@@ -0,0 +1,212 @@
+#define _GNU_SOURCE // memmem()
+#include "test_rtsp.h"
+#include "camera_encoder_common.h"
+#include "h264_nal.h"
+#include "rtsp_server.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+static const test_stream_t *s_stream;
+static uint32_t s_fps;
+static uint32_t s_gop;
+static volatile bool s_feeding;
+static bool s_reopened;
+static pthread_t s_feeder;
+
+// Services of the firmware the encoder helpers link against; a reopened
+// encoder starts its next frame with an IDR
+esp_h264_err_t esp_h264_enc_open(esp_h264_enc_handle_t enc)
+{
+	s_reopened = true;
+	return ESP_H264_ERR_OK;
+}
+
+esp_h264_err_t esp_h264_enc_close(esp_h264_enc_handle_t enc)
+{
+	return ESP_H264_ERR_OK;
+}
+
+void test_sleep_ms(uint32_t ms)
+{
+	struct timespec t = {.tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000};
+	nanosleep(&t, NULL);
+}
+
+// The frame loop of camera_encoder.c, with the stream standing in for the
+// hardware encoder
+static void *feeder(void *arg)
+{
+	const test_stream_t *s = s_stream;
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	size_t g = 0;
+	h264_nal_index_t idx;
+
+	for (uint32_t frame = 0; s_feeding; frame++)
+	{
+		int64_t capture_us = test_now_ns() / 1000;
+		s_reopened = false;
+		CHECK(idr_request_apply(NULL, capture_us) == ESP_OK);
+		if (s_reopened && g % s_gop != 0)
+			g = (g / s_gop + 1) * s_gop % s->count;
+
+		const uint8_t *au = s->data + s->offset[g];
+		h264_nal_index_build(au, s->offset[g + 1] - s->offset[g], &idx);
+		idr_request_done(idx.idr, capture_us);
+		if (idx.idr)
+			update_param_sets(au, &idx);
+		rtsp_send_h264_nals(au, &idx, frame * (90000 / s_fps));
+		g = (g + 1) % s->count;
+
+		next.tv_nsec += 1000000000L / s_fps;
+		if (next.tv_nsec >= 1000000000L)
+		{
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	return NULL;
+}
+
+void test_camera_start(const test_stream_t *s, uint32_t fps, uint32_t gop)
+{
+	s_stream = s;
+	s_fps = fps;
+	s_gop = gop;
+	s_feeding = true;
+	pthread_create(&s_feeder, NULL, feeder, NULL);
+}
+
+void test_camera_stop(void)
+{
+	s_feeding = false;
+	pthread_join(s_feeder, NULL);
+}
+
+int test_udp_open(uint16_t *port)
+{
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	socklen_t addr_len = sizeof(addr);
+	int rcvbuf = 4 << 20;
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+		getsockname(sock, (struct sockaddr *)&addr, &addr_len) != 0)
+	{
+		close(sock);
+		return -1;
+	}
+	*port = ntohs(addr.sin_port);
+	return sock;
+}
+
+int test_rtsp_connect(int rcvbuf)
+{
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+							   .sin_port = htons(TEST_RTSP_PORT)};
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (rcvbuf > 0)
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	for (int tries = 0; tries < 50; tries++)
+	{
+		if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+			return sock;
+		test_sleep_ms(20);
+	}
+	close(sock);
+	return -1;
+}
+
+bool test_rtsp_send(int sock, const char *method, int cseq, const char *headers)
+{
+	char req[512];
+	int len = snprintf(req, sizeof(req), "%s rtsp://127.0.0.1:%d/stream RTSP/1.0\r\nCSeq: %d\r\n%s\r\n", method,
+					   TEST_RTSP_PORT, cseq, headers);
+	return send(sock, req, len, MSG_NOSIGNAL) == len;
+}
+
+size_t test_rtsp_response_len(const char *buf, size_t len)
+{
+	const char *end = memmem(buf, len, "\r\n\r\n", 4);
+	if (!end)
+		return 0;
+	size_t head = end - buf + 4;
+	size_t body = 0;
+	const char *cl = memmem(buf, head, "Content-Length:", 15);
+	if (cl)
+		body = strtoul(cl + 15, NULL, 10);
+	return len >= head + body ? head + body : 0;
+}
+
+int test_rtsp_status(const char *rsp, int cseq)
+{
+	int status = -1, got_cseq = -1;
+	const char *c = strstr(rsp, "CSeq:");
+	if (sscanf(rsp, "RTSP/1.0 %d", &status) != 1 || !c || sscanf(c, "CSeq: %d", &got_cseq) != 1 || got_cseq != cseq)
+		return -1;
+	return status;
+}
+
+int test_rtsp_request(int sock, const char *method, int cseq, const char *headers, char *rsp, size_t cap)
+{
+	if (!test_rtsp_send(sock, method, cseq, headers))
+		return -1;
+
+	size_t got = 0;
+	while (got == 0 || !test_rtsp_response_len(rsp, got))
+	{
+		ssize_t n = recv(sock, rsp + got, cap - 1 - got, 0);
+		if (n <= 0)
+			return -1;
+		got += n;
+		rsp[got] = '\0';
+	}
+	return test_rtsp_status(rsp, cseq);
+}
+
+uint32_t test_rtsp_setup(int sock, const char *transport, int *cseq, char *rsp, size_t cap)
+{
+	char hdr[160];
+	snprintf(hdr, sizeof(hdr), "Transport: %s\r\n", transport);
+	if (test_rtsp_request(sock, "SETUP", ++*cseq, hdr, rsp, cap) != 200)
+		return 0;
+	const char *p = strstr(rsp, "Session: ");
+	return p ? (uint32_t)strtoul(p + 9, NULL, 16) : 0;
+}
+
+int test_rtsp_play(int sock, uint32_t session, int *cseq)
+{
+	char rsp[1024], hdr[64];
+	snprintf(hdr, sizeof(hdr), "Session: %08" PRIX32 "\r\n", session);
+	return test_rtsp_request(sock, "PLAY", ++*cseq, hdr, rsp, sizeof(rsp));
+}
+
+int test_rtsp_teardown(int sock, uint32_t session, int *cseq)
+{
+	char rsp[1024], hdr[64];
+	snprintf(hdr, sizeof(hdr), "Session: %08" PRIX32 "\r\n", session);
+	return test_rtsp_request(sock, "TEARDOWN", ++*cseq, hdr, rsp, sizeof(rsp));
+}
+
+int test_rtsp_server_end(int sock)
+{
+	struct sockaddr_in local, peer;
+	socklen_t len = sizeof(local);
+	if (getsockname(sock, (struct sockaddr *)&local, &len) != 0)
+		return -1;
+	for (int fd = 0; fd < 1024; fd++)
+	{
+		len = sizeof(peer);
+		if (fd != sock && getpeername(fd, (struct sockaddr *)&peer, &len) == 0 && peer.sin_family == AF_INET &&
+			peer.sin_port == local.sin_port && peer.sin_addr.s_addr == local.sin_addr.s_addr)
+			return fd;
+	}
+	return -1;
+}
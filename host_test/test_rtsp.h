@@ -0,0 +1,107 @@
+#ifndef TEST_RTSP_H
+#define TEST_RTSP_H
+
+#include "test_util.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// As in rtsp_server.c
+#define TEST_RTSP_PORT 8554
+
+	void test_sleep_ms(uint32_t ms);
+
+	/**
+	 * @brief Stand in for the camera: feed the RTSP server a stream in real time
+	 *
+	 * Runs the frame loop of camera_encoder.c on its own thread. A requested
+	 * IDR reopens the encoder, after which the feed jumps to the next IDR of
+	 * the stream. Links the encoder open and close the firmware would.
+	 *
+	 * @param s Access units, looped; kept until test_camera_stop()
+	 * @param fps Frame rate
+	 * @param gop Frames per GOP of s
+	 */
+	void test_camera_start(const test_stream_t *s, uint32_t fps, uint32_t gop);
+
+	void test_camera_stop(void);
+
+	/**
+	 * @brief Open a UDP socket on an ephemeral loopback port
+	 *
+	 * @param port Output, the port
+	 * @return Socket, -1 on failure
+	 */
+	int test_udp_open(uint16_t *port);
+
+	/**
+	 * @brief Connect to the RTSP server, waiting for it to listen
+	 *
+	 * @param rcvbuf Receive buffer size, 0 for the default
+	 * @return Socket, -1 on failure
+	 */
+	int test_rtsp_connect(int rcvbuf);
+
+	/**
+	 * @brief Find the server's end of a control connection
+	 *
+	 * The server runs in the test process, so its socket can be tuned, e.g.
+	 * to the small send buffer lwIP has.
+	 *
+	 * @param sock Client socket
+	 * @return Server socket, -1 if not found
+	 */
+	int test_rtsp_server_end(int sock);
+
+	/**
+	 * @brief Send one request for the stream URL
+	 *
+	 * @param headers Extra header lines, each ending in CRLF
+	 * @return true if the request was sent whole
+	 */
+	bool test_rtsp_send(int sock, const char *method, int cseq, const char *headers);
+
+	/**
+	 * @brief Length of the RTSP response at the start of buf, body included
+	 *
+	 * @return Response length, 0 while incomplete
+	 */
+	size_t test_rtsp_response_len(const char *buf, size_t len);
+
+	/**
+	 * @brief Status of a response, -1 if it is not one or answers another CSeq
+	 */
+	int test_rtsp_status(const char *rsp, int cseq);
+
+	/**
+	 * @brief Send one request and read its response, body included
+	 *
+	 * Only for a connection nothing else arrives on.
+	 *
+	 * @return Status code, -1 if the connection failed
+	 */
+	int test_rtsp_request(int sock, const char *method, int cseq, const char *headers, char *rsp, size_t cap);
+
+	/**
+	 * @brief SETUP with the given transport
+	 *
+	 * @param transport Value of the Transport header
+	 * @param rsp Output, the response
+	 * @return Session, 0 on failure
+	 */
+	uint32_t test_rtsp_setup(int sock, const char *transport, int *cseq, char *rsp, size_t cap);
+
+	// Status of PLAY or TEARDOWN, -1 if the connection failed
+	int test_rtsp_play(int sock, uint32_t session, int *cseq);
+	int test_rtsp_teardown(int sock, uint32_t session, int *cseq);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TEST_RTSP_H
@@ -0,0 +1,424 @@
+// RTSP request tokenizer: a corpus fed pipelined, split at random and
+// mutated, and the cost per request against the strstr() dispatch it replaced
+#include "test_util.h"
+#include "rtsp_request.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RX_BUF_SIZE 2048 // Receive buffer of a session
+
+typedef struct
+{
+	const char *text;
+	rtsp_method_t method;
+	const char *uri;
+	int32_t cseq;
+	const char *session;
+	const char *transport;
+	const char *range;
+	const char *body;
+} sample_t;
+
+// What players send, and what the old dispatch got wrong
+static const sample_t s_corpus[] = {
+	{"OPTIONS rtsp://192.168.1.50:8554/stream RTSP/1.0\r\nCSeq: 2\r\n"
+	 "User-Agent: LibVLC/3.0.20 (LIVE555 Streaming Media v2016.11.28)\r\n\r\n",
+	 RTSP_METHOD_OPTIONS, "rtsp://192.168.1.50:8554/stream", 2},
+	{"DESCRIBE rtsp://192.168.1.50:8554/stream RTSP/1.0\r\nCSeq: 3\r\n"
+	 "User-Agent: LibVLC/3.0.20 (LIVE555 Streaming Media v2016.11.28)\r\nAccept: application/sdp\r\n\r\n",
+	 RTSP_METHOD_DESCRIBE, "rtsp://192.168.1.50:8554/stream", 3},
+	{"SETUP rtsp://192.168.1.50:8554/stream/trackID=0 RTSP/1.0\r\nCSeq: 4\r\n"
+	 "User-Agent: LibVLC/3.0.20 (LIVE555 Streaming Media v2016.11.28)\r\n"
+	 "Transport: RTP/AVP;unicast;client_port=50000-50001\r\n\r\n",
+	 RTSP_METHOD_SETUP, "rtsp://192.168.1.50:8554/stream/trackID=0", 4, NULL,
+	 "RTP/AVP;unicast;client_port=50000-50001"},
+	{"PLAY rtsp://192.168.1.50:8554/stream RTSP/1.0\r\nCSeq: 5\r\n"
+	 "User-Agent: LibVLC/3.0.20 (LIVE555 Streaming Media v2016.11.28)\r\nSession: 1A2B3C4D\r\nRange: npt=0.000-\r\n\r\n",
+	 RTSP_METHOD_PLAY, "rtsp://192.168.1.50:8554/stream", 5, "1A2B3C4D", NULL, "npt=0.000-"},
+	{"GET_PARAMETER rtsp://192.168.1.50:8554/stream RTSP/1.0\r\nCSeq: 6\r\nSession: 1A2B3C4D\r\n\r\n",
+	 RTSP_METHOD_GET_PARAMETER, "rtsp://192.168.1.50:8554/stream", 6, "1A2B3C4D"},
+	{"TEARDOWN rtsp://192.168.1.50:8554/stream RTSP/1.0\r\nCSeq: 7\r\nSession: 1A2B3C4D\r\n\r\n",
+	 RTSP_METHOD_TEARDOWN, "rtsp://192.168.1.50:8554/stream", 7, "1A2B3C4D"},
+
+	// FFmpeg: interleaved transport, session with timeout
+	{"SETUP rtsp://10.0.0.2/stream/trackID=0 RTSP/1.0\r\nTransport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n"
+	 "CSeq: 3\r\nUser-Agent: Lavf60.16.100\r\n\r\n",
+	 RTSP_METHOD_SETUP, "rtsp://10.0.0.2/stream/trackID=0", 3, NULL, "RTP/AVP/TCP;unicast;interleaved=0-1"},
+	{"PLAY rtsp://10.0.0.2/stream RTSP/1.0\r\nRange: npt=0.000-\r\nCSeq: 4\r\nUser-Agent: Lavf60.16.100\r\n"
+	 "Session: 5E6F7081;timeout=60\r\n\r\n",
+	 RTSP_METHOD_PLAY, "rtsp://10.0.0.2/stream", 4, "5E6F7081;timeout=60", NULL, "npt=0.000-"},
+
+	// Bodies holding method names and header lines
+	{"SET_PARAMETER rtsp://10.0.0.2/stream RTSP/1.0\r\nCSeq: 8\r\nContent-Type: text/parameters\r\n"
+	 "Content-Length: 33\r\n\r\nnote: PLAY then TEARDOWN\r\nCSeq: 1",
+	 RTSP_METHOD_SET_PARAMETER, "rtsp://10.0.0.2/stream", 8, NULL, NULL, NULL, "note: PLAY then TEARDOWN\r\nCSeq: 1"},
+	{"GET_PARAMETER rtsp://10.0.0.2/stream RTSP/1.0\r\nCSeq: 9\r\nContent-Length: 10\r\n\r\nposition\r\n",
+	 RTSP_METHOD_GET_PARAMETER, "rtsp://10.0.0.2/stream", 9, NULL, NULL, NULL, "position\r\n"},
+
+	// Loose formatting: bare LF, odd case, tabs, folded and unknown fields
+	{"OPTIONS * RTSP/1.0\ncseq:\t10\nx-custom: PLAY\n\n", RTSP_METHOD_OPTIONS, "*", 10},
+	{"PAUSE rtsp://cam/stream RTSP/1.0\r\nCSEQ :  11  \r\nSESSION: abc\r\nX-Folded: a\r\n  b\r\n\r\n",
+	 RTSP_METHOD_PAUSE, "rtsp://cam/stream", 11, "abc"},
+	{"ANNOUNCE rtsp://cam/stream RTSP/1.0\r\nCSeq: 12\r\n\r\n", RTSP_METHOD_UNKNOWN, "rtsp://cam/stream", 12},
+	{"DESCRIBE rtsp://cam/OPTIONS RTSP/1.0\r\n\r\n", RTSP_METHOD_DESCRIBE, "rtsp://cam/OPTIONS", -1},
+};
+
+#define CORPUS_SIZE (sizeof(s_corpus) / sizeof(s_corpus[0]))
+
+static bool slice_is(rtsp_slice_t s, const char *want)
+{
+	if (!want)
+		return s.len == 0 && s.ptr == NULL;
+	return s.len == strlen(want) && memcmp(s.ptr, want, s.len) == 0;
+}
+
+static bool matches(const rtsp_request_t *req, const sample_t *want)
+{
+	return req->method == want->method && slice_is(req->uri, want->uri) && req->cseq == want->cseq &&
+		   slice_is(req->session, want->session) && slice_is(req->transport, want->transport) &&
+		   slice_is(req->range, want->range) && slice_is(req->body, want->body) &&
+		   req->len == strlen(want->text);
+}
+
+// Slices of a request lie in the message
+static bool inside(const rtsp_request_t *req, const char *msg)
+{
+	const rtsp_slice_t *s[] = {&req->method_name, &req->uri, &req->session, &req->transport, &req->range, &req->body};
+	for (size_t i = 0; i < sizeof(s) / sizeof(s[0]); i++)
+	{
+		if (s[i]->len && (s[i]->ptr < msg || s[i]->ptr + s[i]->len > msg + req->len))
+			return false;
+	}
+	return req->len > 0;
+}
+
+/**
+ * @brief What a session makes of a byte stream
+ */
+typedef struct
+{
+	int requests;
+	int32_t cseq_sum;
+	uint32_t method_mix; // Order-sensitive hash of methods and lengths
+	esp_err_t error;	 // First error, ESP_OK if none
+	size_t consumed;
+} outcome_t;
+
+/**
+ * @brief Feed a byte stream as client_task() receives it
+ *
+ * Reads of random size land in a RX_BUF_SIZE buffer; complete requests are
+ * taken from the front and the rest moved down, as handle_input() does.
+ */
+static outcome_t feed_stream(const char *stream, size_t len, test_rng_t *rng, uint32_t max_read, const sample_t *expect,
+							 size_t expect_count)
+{
+	char rx[RX_BUF_SIZE + 1];
+	size_t rx_len = 0, sent = 0;
+	rtsp_parser_t parser;
+	outcome_t o = {.error = ESP_OK};
+
+	rtsp_parser_reset(&parser, RX_BUF_SIZE);
+	while (o.error == ESP_OK && (sent < len || rx_len > 0))
+	{
+		size_t room = RX_BUF_SIZE - rx_len;
+		size_t n = max_read ? 1 + test_rng_below(rng, max_read) : len - sent;
+		n = n < room ? n : room;
+		n = n < len - sent ? n : len - sent;
+		memcpy(rx + rx_len, stream + sent, n);
+		sent += n;
+		rx_len += n;
+		rx[rx_len] = '\0';
+
+		size_t pos = 0;
+		while (pos < rx_len)
+		{
+			if (rtsp_parser_idle(&parser) && (rx[pos] == '\r' || rx[pos] == '\n'))
+			{
+				pos++;
+				continue;
+			}
+			rtsp_request_t req;
+			esp_err_t ret = rtsp_parser_feed(&parser, rx + pos, rx_len - pos, &req);
+			if (ret == ESP_ERR_NOT_FINISHED)
+				break;
+			if (ret != ESP_OK)
+			{
+				o.error = ret;
+				break;
+			}
+			CHECK(req.len <= rx_len - pos && inside(&req, rx + pos));
+			if (expect && CHECK((size_t)o.requests < expect_count))
+				CHECK(matches(&req, &expect[o.requests]));
+			o.requests++;
+			o.cseq_sum += req.cseq;
+			o.method_mix = o.method_mix * 31 + req.method * 7 + req.len;
+			pos += req.len;
+		}
+		o.consumed += pos;
+		memmove(rx, rx + pos, rx_len - pos);
+		rx_len -= pos;
+
+		// Out of input with a partial message: nothing more will come
+		if (n == 0)
+			break;
+	}
+	return o;
+}
+
+static void check_corpus(void)
+{
+	rtsp_parser_t p;
+	rtsp_request_t req;
+
+	// One at a time, whole
+	for (size_t i = 0; i < CORPUS_SIZE; i++)
+	{
+		const char *text = s_corpus[i].text;
+		rtsp_parser_reset(&p, RX_BUF_SIZE);
+		if (!CHECK(rtsp_parser_feed(&p, text, strlen(text), &req) == ESP_OK))
+			printf("  sample %zu\n", i);
+		else
+			CHECK(matches(&req, &s_corpus[i]));
+		CHECK(rtsp_parser_idle(&p));
+	}
+
+	// One byte at a time: every prefix is unfinished
+	for (size_t i = 0; i < CORPUS_SIZE; i++)
+	{
+		const char *text = s_corpus[i].text;
+		size_t len = strlen(text);
+		rtsp_parser_reset(&p, RX_BUF_SIZE);
+		for (size_t n = 1; n < len; n++)
+			CHECK(rtsp_parser_feed(&p, text, n, &req) == ESP_ERR_NOT_FINISHED);
+		CHECK(rtsp_parser_feed(&p, text, len, &req) == ESP_OK && matches(&req, &s_corpus[i]));
+	}
+}
+
+static void check_pipelined(void)
+{
+	test_rng_t rng;
+	test_rng_seed(&rng, 21);
+	static char stream[64 * 1024];
+	static sample_t expect[256];
+
+	for (int round = 0; round < 300; round++)
+	{
+		size_t len = 0, count = 0;
+		while (count < 256)
+		{
+			const sample_t *s = &s_corpus[test_rng_below(&rng, CORPUS_SIZE)];
+			size_t n = strlen(s->text);
+			if (len + n + 2 > sizeof(stream))
+				break;
+			memcpy(stream + len, s->text, n);
+			len += n;
+			// Stray line ends between messages are skipped
+			if (test_rng_below(&rng, 8) == 0)
+			{
+				memcpy(stream + len, "\r\n", 2);
+				len += 2;
+			}
+			expect[count++] = *s;
+		}
+
+		// Split into reads of 1 byte, small and up to a full buffer
+		static const uint32_t max_read[] = {1, 7, 100, RX_BUF_SIZE};
+		outcome_t o = feed_stream(stream, len, &rng, max_read[round % 4], expect, count);
+		CHECK(o.error == ESP_OK);
+		CHECK(o.requests == (int)count);
+		CHECK(o.consumed == len);
+	}
+}
+
+// Random damage must never crash, and the outcome must not depend on how the
+// stream was split across reads
+static void check_mutations(void)
+{
+	test_rng_t rng;
+	test_rng_seed(&rng, 2121);
+	static char stream[16 * 1024];
+	int errors = 0, complete = 0;
+
+	static const char *const fragments[] = {"\r\n", "\n", ":", " ", "\t", "\r\n\r\n", "Content-Length: 5\r\n",
+											"Content-Length: 99999\r\n", "CSeq: x\r\n", "RTSP/1.0", "\0"};
+	for (int round = 0; round < 20000; round++)
+	{
+		size_t len = 0;
+		int msgs = 1 + test_rng_below(&rng, 4);
+		for (int m = 0; m < msgs; m++)
+		{
+			const char *text = s_corpus[test_rng_below(&rng, CORPUS_SIZE)].text;
+			size_t n = strlen(text);
+			memcpy(stream + len, text, n);
+			len += n;
+		}
+
+		int edits = 1 + test_rng_below(&rng, 4);
+		for (int e = 0; e < edits && len > 0; e++)
+		{
+			size_t at = test_rng_below(&rng, len);
+			switch (test_rng_below(&rng, 4))
+			{
+			case 0: // Flip a byte
+				stream[at] = test_rng_next(&rng);
+				break;
+			case 1: // Delete a run
+			{
+				size_t n = 1 + test_rng_below(&rng, 16);
+				n = n < len - at ? n : len - at;
+				memmove(stream + at, stream + at + n, len - at - n);
+				len -= n;
+				break;
+			}
+			case 2: // Insert a fragment that matters to the grammar
+			{
+				const char *f = fragments[test_rng_below(&rng, sizeof(fragments) / sizeof(fragments[0]))];
+				size_t n = f[0] ? strlen(f) : 1;
+				if (len + n > sizeof(stream))
+					break;
+				memmove(stream + at + n, stream + at, len - at);
+				memcpy(stream + at, f, n);
+				len += n;
+				break;
+			}
+			default: // Truncate
+				len = at;
+				break;
+			}
+		}
+
+		outcome_t whole = feed_stream(stream, len, &rng, 0, NULL, 0);
+		outcome_t split = feed_stream(stream, len, &rng, 1 + test_rng_below(&rng, 64), NULL, 0);
+		CHECK(whole.requests == split.requests);
+		CHECK(whole.cseq_sum == split.cseq_sum);
+		CHECK(whole.method_mix == split.method_mix);
+		CHECK(whole.error == split.error);
+		errors += whole.error != ESP_OK;
+		complete += whole.requests;
+	}
+	printf("mutations: 20000 streams, %d rejected, %d requests parsed\n", errors, complete);
+}
+
+static void check_limits(void)
+{
+	rtsp_parser_t p;
+	rtsp_request_t req;
+	static char big[4096];
+
+	// A header block longer than the buffer
+	int n = snprintf(big, sizeof(big), "DESCRIBE rtsp://cam/stream RTSP/1.0\r\nCSeq: 1\r\nX-Pad: ");
+	memset(big + n, 'a', sizeof(big) - n);
+	rtsp_parser_reset(&p, RX_BUF_SIZE);
+	CHECK(rtsp_parser_feed(&p, big, RX_BUF_SIZE, &req) == ESP_ERR_INVALID_SIZE);
+
+	// A body that cannot fit
+	const char *body = "SET_PARAMETER * RTSP/1.0\r\nCSeq: 1\r\nContent-Length: 4000\r\n\r\n";
+	rtsp_parser_reset(&p, RX_BUF_SIZE);
+	CHECK(rtsp_parser_feed(&p, body, strlen(body), &req) == ESP_ERR_INVALID_SIZE);
+
+	// Malformed request lines and headers
+	static const char *const bad[] = {
+		"PLAY\r\n\r\n",
+		"PLAY rtsp://cam HTTP/1.1\r\n\r\n",
+		" PLAY rtsp://cam RTSP/1.0\r\n\r\n",
+		"PLAY rtsp://cam RTSP/1.0\r\nNo colon here\r\n\r\n",
+		"PLAY rtsp://cam RTSP/1.0\r\nCSeq: 12a\r\n\r\n",
+		"PLAY rtsp://cam RTSP/1.0\r\nCSeq: 99999999999\r\n\r\n",
+		"PLAY rtsp://cam RTSP/1.0\r\nContent-Length: -1\r\n\r\n",
+	};
+	for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+	{
+		rtsp_parser_reset(&p, RX_BUF_SIZE);
+		if (!CHECK(rtsp_parser_feed(&p, bad[i], strlen(bad[i]), &req) == ESP_ERR_INVALID_ARG))
+			printf("  accepted: %s\n", bad[i]);
+	}
+
+	// Slice search
+	rtsp_slice_t s = {.ptr = "RTP/AVP;unicast;client_port=5000-5001", .len = 37};
+	CHECK(rtsp_slice_find(s, "client_port=") == s.ptr + 16);
+	CHECK(rtsp_slice_find(s, "interleaved=") == NULL);
+	s.len = 20; // Needle runs past the slice
+	CHECK(rtsp_slice_find(s, "client_port=") == NULL);
+}
+
+static volatile int s_client_port;
+
+// parse_cseq() and the dispatch chain of the former client_task()
+static int legacy_dispatch(const char *buf, int *cseq)
+{
+	const char *p = strstr(buf, "CSeq:");
+	*cseq = p ? atoi(p + 5) : 1;
+	if (strstr(buf, "OPTIONS"))
+		return RTSP_METHOD_OPTIONS;
+	if (strstr(buf, "DESCRIBE"))
+		return RTSP_METHOD_DESCRIBE;
+	if (strstr(buf, "SETUP"))
+	{
+		// handle_setup() looked for the port with a scan of its own
+		p = strstr(buf, "client_port=");
+		s_client_port = p ? atoi(p + 12) : 0;
+		return RTSP_METHOD_SETUP;
+	}
+	if (strstr(buf, "PLAY"))
+		return RTSP_METHOD_PLAY;
+	if (strstr(buf, "TEARDOWN"))
+		return RTSP_METHOD_TEARDOWN;
+	return RTSP_METHOD_UNKNOWN;
+}
+
+static void bench(void)
+{
+	const int rounds = 20000;
+	static char rx[CORPUS_SIZE][RX_BUF_SIZE];
+	int wrong = 0;
+	volatile int sink = 0;
+
+	for (size_t i = 0; i < CORPUS_SIZE; i++)
+	{
+		int cseq;
+		strcpy(rx[i], s_corpus[i].text);
+		int method = legacy_dispatch(rx[i], &cseq);
+		wrong += method != (int)s_corpus[i].method || cseq != (s_corpus[i].cseq < 0 ? 1 : s_corpus[i].cseq);
+	}
+
+	int64_t t0 = test_now_ns();
+	for (int r = 0; r < rounds; r++)
+	{
+		for (size_t i = 0; i < CORPUS_SIZE; i++)
+		{
+			int cseq;
+			sink += legacy_dispatch(rx[i], &cseq) + cseq;
+		}
+	}
+	int64_t t1 = test_now_ns();
+	for (int r = 0; r < rounds; r++)
+	{
+		for (size_t i = 0; i < CORPUS_SIZE; i++)
+		{
+			rtsp_parser_t p;
+			rtsp_request_t req;
+			rtsp_parser_reset(&p, RX_BUF_SIZE);
+			rtsp_parser_feed(&p, rx[i], strlen(s_corpus[i].text), &req);
+			sink += req.method + req.cseq;
+		}
+	}
+	int64_t t2 = test_now_ns();
+	(void)sink;
+
+	printf("strstr() dispatch %6.0f ns/request, %d of %zu samples misread\n",
+		   (double)(t1 - t0) / rounds / CORPUS_SIZE, wrong, CORPUS_SIZE);
+	printf("rtsp_parser_feed() %5.0f ns/request, header fields included\n", (double)(t2 - t1) / rounds / CORPUS_SIZE);
+	CHECK(wrong > 0);
+}
+
+int main(void)
+{
+	check_corpus();
+	check_pipelined();
+	check_mutations();
+	check_limits();
+	bench();
+	return TEST_RESULT();
+}
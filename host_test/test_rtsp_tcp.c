@@ -0,0 +1,249 @@
+// RTP over the RTSP connection (RFC 2326 section 10.12): a client runs a
+// whole session with interleaved transport while the camera streams, and
+// stops reading now and then so the server has to queue. The connection must
+// carry nothing but whole $-framed records and whole responses; keepalives
+// answered mid-stream land between records.
+#include "test_rtsp.h"
+#include "h264_nal.h"
+#include "rtsp_server.h"
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define FPS 30
+#define GOP 30
+#define STREAM_MS 3000
+#define KEEPALIVE_MS 100	// GET_PARAMETER while frames flow
+#define RR_MS 500			// Receiver reports sent on the RTCP channel
+#define STALL_EVERY_MS 600	// The client stops reading...
+#define STALL_MS 250		// ... for this long
+#define RCVBUF (8 * 1024)
+#define CSEQ_MAX 64
+
+typedef struct
+{
+	int sock;
+	uint8_t buf[128 * 1024];
+	size_t len;
+	test_depack_t d;
+	uint32_t records;	// On the RTP channel
+	uint32_t frames;	// Whole access units
+	uint32_t reports;	// RTCP compounds on the RTCP channel
+	uint32_t byes;
+	uint32_t responses;
+	uint32_t broken;	// Bytes that start neither a record nor a response
+	int next_cseq;		// Of the next response; they come in order
+	uint32_t records_at[CSEQ_MAX]; // RTP records seen when the response to CSeq n came
+} conn_t;
+
+static test_stream_t s_stream;
+
+// One RTCP compound from the server: an SR, with a BYE when the session ends
+static void take_rtcp(conn_t *c, const uint8_t *p, size_t len)
+{
+	c->reports++;
+	CHECK(len >= 8 && (p[0] >> 6) == 2 && p[1] == 200);
+	for (size_t pos = 0; pos + 4 <= len; pos += 4 + 4 * (p[pos + 2] << 8 | p[pos + 3]))
+		c->byes += p[pos + 1] == 203;
+}
+
+static void take_rtp(conn_t *c, const uint8_t *p, size_t len)
+{
+	c->records++;
+	if (!test_depack_rtp(&c->d, p, len) || !c->d.marker)
+		return;
+	if (c->frames == 0)
+	{
+		// Parameter sets ahead of the first IDR
+		CHECK(c->d.count == 3);
+		CHECK(c->d.count > 0 && (c->d.data[c->d.offset[0]] & 0x1F) == H264_NAL_SPS);
+		CHECK(c->d.count > 1 && (c->d.data[c->d.offset[1]] & 0x1F) == H264_NAL_PPS);
+		CHECK(c->d.count > 2 && (c->d.data[c->d.offset[2]] & 0x1F) == H264_NAL_IDR);
+	}
+	c->frames++;
+	test_depack_reset(&c->d);
+}
+
+/**
+ * @brief Read what arrived within timeout_ms and take it apart
+ *
+ * @return false once the connection closed or broke
+ */
+static bool pump(conn_t *c, int timeout_ms)
+{
+	struct pollfd pfd = {.fd = c->sock, .events = POLLIN};
+	if (poll(&pfd, 1, timeout_ms) <= 0)
+		return true;
+	ssize_t n = recv(c->sock, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+	if (n <= 0)
+		return false;
+	c->len += n;
+
+	size_t pos = 0;
+	while (pos < c->len)
+	{
+		const uint8_t *p = c->buf + pos;
+		size_t avail = c->len - pos;
+		if (p[0] == '$')
+		{
+			if (avail < 4 || avail < 4 + (size_t)(p[2] << 8 | p[3]))
+				break;
+			size_t rec_len = p[2] << 8 | p[3];
+			if (p[1] == 0)
+				take_rtp(c, p + 4, rec_len);
+			else if (CHECK(p[1] == 1))
+				take_rtcp(c, p + 4, rec_len);
+			pos += 4 + rec_len;
+		}
+		else if (avail >= 8 && memcmp(p, "RTSP/1.0", 8) == 0)
+		{
+			size_t rsp_len = test_rtsp_response_len((const char *)p, avail);
+			if (rsp_len == 0)
+				break;
+			char rsp[512];
+			snprintf(rsp, sizeof(rsp), "%.*s", (int)rsp_len, (const char *)p);
+			CHECK(test_rtsp_status(rsp, c->next_cseq) == 200);
+			if (c->next_cseq < CSEQ_MAX)
+				c->records_at[c->next_cseq] = c->records;
+			c->next_cseq++;
+			c->responses++;
+			pos += rsp_len;
+		}
+		else if (avail >= 8 || p[0] != 'R')
+		{
+			c->broken++;
+			return false;
+		}
+		else
+		{
+			break;
+		}
+	}
+	memmove(c->buf, c->buf + pos, c->len - pos);
+	c->len -= pos;
+	return true;
+}
+
+// Wait for the response to cseq
+static bool pump_until(conn_t *c, int cseq, int timeout_ms)
+{
+	int64_t deadline = test_now_ns() + timeout_ms * 1000000LL;
+	while (c->next_cseq <= cseq && test_now_ns() < deadline)
+	{
+		if (!pump(c, 10))
+			return false;
+	}
+	return c->next_cseq > cseq;
+}
+
+// An empty RR from the client, as $-framed RTCP
+static bool send_rr(int sock)
+{
+	uint8_t rr[12] = {'$', 1, 0, 8, 0x80, 201, 0, 1, 0x12, 0x34, 0x56, 0x78};
+	return send(sock, rr, sizeof(rr), MSG_NOSIGNAL) == sizeof(rr);
+}
+
+int main(void)
+{
+	static conn_t c;
+	char rsp[4096], hdr[64];
+	int cseq = 0;
+
+	test_stream_synthetic(&s_stream, GOP * 3, GOP, 14);
+	if (!CHECK(rtsp_server_init() == ESP_OK) || !CHECK(rtsp_server_start() == ESP_OK))
+		return TEST_RESULT();
+	test_camera_start(&s_stream, FPS, GOP);
+	test_sleep_ms(500);
+
+	c.sock = test_rtsp_connect(RCVBUF);
+	if (!CHECK(c.sock >= 0))
+		goto out;
+	CHECK(test_rtsp_request(c.sock, "OPTIONS", ++cseq, "", rsp, sizeof(rsp)) == 200);
+
+	// As small a send buffer as lwIP has, so stalls reach the server's queue
+	int server_sock = test_rtsp_server_end(c.sock);
+	int sndbuf = CONFIG_LWIP_TCP_SND_BUF_DEFAULT;
+	CHECK(server_sock >= 0 && setsockopt(server_sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) == 0);
+	CHECK(test_rtsp_request(c.sock, "DESCRIBE", ++cseq, "Accept: application/sdp\r\n", rsp, sizeof(rsp)) == 200);
+	CHECK(strstr(rsp, "m=video") && strstr(rsp, "sprop-parameter-sets="));
+	uint32_t session = test_rtsp_setup(c.sock, "RTP/AVP/TCP;unicast;interleaved=0-1", &cseq, rsp, sizeof(rsp));
+	if (!CHECK(session != 0))
+		goto out;
+	CHECK(strstr(rsp, "Transport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n") != NULL);
+
+	// The PLAY response goes out ahead of the first record
+	snprintf(hdr, sizeof(hdr), "Session: %08" PRIX32 "\r\n", session);
+	test_depack_init(&c.d, 512 * 1024);
+	c.next_cseq = cseq + 1;
+	int play_cseq = ++cseq;
+	CHECK(test_rtsp_send(c.sock, "PLAY", play_cseq, hdr));
+	CHECK(pump_until(&c, play_cseq, 2000));
+	CHECK(c.records_at[play_cseq] == 0);
+
+	// Keepalives and receiver reports while the stream flows
+	int64_t start = test_now_ns(), next_keepalive = start, next_rr = start;
+	int64_t next_stall = start + STALL_EVERY_MS * 1000000LL;
+	uint32_t keepalives = 0;
+	while (test_now_ns() - start < STREAM_MS * 1000000LL)
+	{
+		int64_t now = test_now_ns();
+		if (now >= next_keepalive && cseq < CSEQ_MAX - 2)
+		{
+			CHECK(test_rtsp_send(c.sock, "GET_PARAMETER", ++cseq, hdr));
+			keepalives++;
+			next_keepalive = now + KEEPALIVE_MS * 1000000LL;
+		}
+		if (now >= next_rr)
+		{
+			CHECK(send_rr(c.sock));
+			next_rr = now + RR_MS * 1000000LL;
+		}
+		if (now >= next_stall)
+		{
+			test_sleep_ms(STALL_MS);
+			next_stall = test_now_ns() + STALL_EVERY_MS * 1000000LL;
+		}
+		if (!CHECK(pump(&c, 5)))
+			break;
+	}
+
+	// Responses came between records; the records around them are whole
+	CHECK(pump_until(&c, cseq, 1000));
+	uint32_t between = 0;
+	for (int i = play_cseq + 1; i <= cseq; i++)
+		between += c.records_at[i] > c.records_at[play_cseq];
+	CHECK(c.responses == (uint32_t)(cseq - play_cseq + 1));
+	CHECK(between >= keepalives - 1);
+
+	// TEARDOWN: a BYE ahead of the response, then nothing more for the session
+	uint32_t byes = c.byes;
+	int teardown_cseq = ++cseq;
+	CHECK(test_rtsp_send(c.sock, "TEARDOWN", teardown_cseq, hdr));
+	CHECK(pump_until(&c, teardown_cseq, 2000));
+	CHECK(c.byes == byes + 1);
+	uint32_t records = c.records;
+	int64_t quiet_until = test_now_ns() + 300 * 1000000LL;
+	while (test_now_ns() < quiet_until && pump(&c, 10))
+		;
+	CHECK(c.records == records);
+
+	printf("interleaved session: %u frames in %u RTP records, %u RTCP reports, %u keepalives answered between "
+		   "records\n",
+		   c.frames, c.records, c.reports, between);
+	CHECK(c.broken == 0 && c.len == 0);
+	CHECK(c.d.errors == 0 && c.d.seq_gaps == 0);
+	CHECK(c.frames >= STREAM_MS * FPS / 1000 * 8 / 10);
+	test_depack_free(&c.d);
+
+out:
+	if (c.sock >= 0)
+		close(c.sock);
+	test_camera_stop();
+	rtsp_server_stop();
+	test_sleep_ms(700);
+	test_stream_free(&s_stream);
+	return TEST_RESULT();
+}
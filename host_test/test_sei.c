@@ -0,0 +1,195 @@
+// Metadata SEI: parse it back out of the RTP packets a client receives
+#include "test_util.h"
+#include "camera_encoder_common.h"
+#include "h264_nal.h"
+#include "rtp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const uint8_t s_uuid[16] = {0x6b, 0x1f, 0x3c, 0x52, 0x8e, 0x0d, 0x4a, 0x77,
+								   0x9b, 0x25, 0xc4, 0x10, 0x5e, 0xa8, 0x31, 0xd6};
+
+// Services of the firmware the encoder helpers link against
+esp_h264_err_t esp_h264_enc_open(esp_h264_enc_handle_t enc)
+{
+	return ESP_H264_ERR_OK;
+}
+
+esp_h264_err_t esp_h264_enc_close(esp_h264_enc_handle_t enc)
+{
+	return ESP_H264_ERR_OK;
+}
+
+esp_err_t rtsp_set_sps_pps(const uint8_t *sps, size_t sps_len, const uint8_t *pps, size_t pps_len)
+{
+	return ESP_OK;
+}
+
+// Undo emulation prevention
+static size_t unescape(const uint8_t *nal, size_t len, uint8_t *out)
+{
+	size_t n = 0, zeros = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		if (zeros >= 2 && nal[i] == 3)
+		{
+			zeros = 0;
+			continue;
+		}
+		zeros = nal[i] == 0 ? zeros + 1 : 0;
+		out[n++] = nal[i];
+	}
+	return n;
+}
+
+static bool escaped(const uint8_t *nal, size_t len)
+{
+	for (size_t i = 0; i + 2 < len; i++)
+	{
+		if (nal[i] == 0 && nal[i + 1] == 0 && nal[i + 2] < 3)
+			return false;
+	}
+	return true;
+}
+
+static void check_sei(const uint8_t *nal, size_t len, uint32_t frame, int64_t capture_us)
+{
+	uint8_t rbsp[SEI_METADATA_HEADROOM];
+	const char *text = CONFIG_STREAM_SEI_USER_STRING;
+	size_t text_len = strlen(text) < 64 ? strlen(text) : 64;
+
+	CHECK(escaped(nal, len));
+	if (!CHECK(len > 1 && len <= sizeof(rbsp) && nal[0] == H264_NAL_SEI))
+		return;
+	size_t n = unescape(nal + 1, len - 1, rbsp);
+	if (!CHECK(n == 2 + 16 + 12 + text_len + 1))
+		return;
+
+	CHECK(rbsp[0] == 5); // user_data_unregistered
+	CHECK(rbsp[1] == 16 + 12 + text_len);
+	CHECK(memcmp(rbsp + 2, s_uuid, 16) == 0);
+	const uint8_t *p = rbsp + 18;
+	uint32_t got_frame = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	uint64_t got_us = 0;
+	for (int i = 0; i < 8; i++)
+		got_us = (got_us << 8) | p[4 + i];
+	CHECK(got_frame == frame);
+	CHECK((int64_t)got_us == capture_us);
+	CHECK(memcmp(p + 12, text, text_len) == 0);
+	CHECK(rbsp[n - 1] == 0x80);
+}
+
+// Encode, prepend, index and send one frame; a receiver must get the SEI first
+static void check_frame(uint8_t *buf, size_t cap, bool idr, size_t slice_len, uint32_t frame, int64_t capture_us,
+						bool stap, test_rng_t *rng)
+{
+	static rtp_packet_t pkts[RTP_PACKET_LIST_MAX];
+	static uint8_t arena[RTP_STAP_ARENA];
+	static test_depack_t d;
+	uint8_t *au = buf + SEI_METADATA_HEADROOM;
+	size_t len = test_make_au(au, cap - SEI_METADATA_HEADROOM, idr, slice_len, rng);
+
+	size_t sei_len = prepend_sei_metadata(au, frame, capture_us);
+	if (!CHECK(sei_len > 4 && sei_len <= SEI_METADATA_HEADROOM))
+		return;
+	const uint8_t *data = au - sei_len;
+	len += sei_len;
+
+	h264_nal_index_t idx;
+	size_t count = h264_nal_index_build(data, len, &idx);
+	if (!CHECK(count == (idr ? 4u : 2u) && idx.nals[0].type == H264_NAL_SEI))
+		return;
+	CHECK(idx.nals[0].offset == 4 && idx.nals[0].len == sei_len - 4);
+	CHECK(idx.idr == idr);
+
+	rtp_packet_list_t list;
+	rtp_packet_list_init(&list, pkts, RTP_PACKET_LIST_MAX, frame * 3000);
+	if (stap)
+		rtp_packet_list_set_arena(&list, arena, sizeof(arena));
+	for (size_t i = 0; i < count; i++)
+		CHECK(rtp_packetize_h264(&list, data + idx.nals[i].offset, idx.nals[i].len) == ESP_OK);
+	rtp_packet_list_end_au(&list);
+
+	// Headers and payloads as they go on the wire
+	if (!d.data)
+		test_depack_init(&d, 256 * 1024);
+	test_depack_reset(&d);
+	uint16_t seq = 0xFFF0;
+	for (uint16_t i = 0; i < list.count; i++)
+	{
+		uint8_t pkt[RTP_HEADER_LEN + RTP_PREFIX_MAX + RTP_MTU];
+		const rtp_packet_t *p = &list.pkts[i];
+		size_t hdr = rtp_write_header(pkt, p, list.ts, seq, 0x12345678);
+		CHECK(hdr == RTP_HEADER_LEN + p->prefix_len);
+		CHECK(hdr + p->len <= sizeof(pkt));
+		memcpy(pkt + hdr, p->payload, p->len);
+
+		CHECK(pkt[0] == 0x80);
+		CHECK((pkt[1] & 0x7F) == RTP_PT_H264);
+		CHECK(!!(pkt[1] & 0x80) == (i == list.count - 1));
+		CHECK(((pkt[2] << 8) | pkt[3]) == seq);
+		CHECK((((uint32_t)pkt[4] << 24) | (pkt[5] << 16) | (pkt[6] << 8) | pkt[7]) == list.ts);
+		CHECK(test_depack_payload(&d, pkt + RTP_HEADER_LEN, hdr - RTP_HEADER_LEN + p->len));
+		seq++;
+	}
+	CHECK(!d.in_fu);
+
+	// With an arena the SEI travels aggregated with a small unit after it
+	bool agg = stap && idx.nals[1].len <= RTP_STAP_NAL_MAX;
+	CHECK(agg == ((list.pkts[0].payload[0] & 0x1F) == 24));
+	if (!CHECK(d.count == count))
+		return;
+	for (size_t i = 0; i < count; i++)
+	{
+		CHECK(d.nal_len[i] == idx.nals[i].len);
+		CHECK(memcmp(d.data + d.offset[i], data + idx.nals[i].offset, idx.nals[i].len) == 0);
+	}
+	check_sei(d.data + d.offset[0], d.nal_len[0], frame, capture_us);
+}
+
+int main(void)
+{
+	// Values whose bytes need emulation prevention: runs of zeros followed
+	// by 00..03, frame numbers and timestamps at their extremes
+	static const struct
+	{
+		uint32_t frame;
+		int64_t capture_us;
+	} values[] = {
+		{0, 0},
+		{1, 1},
+		{0x00000100, 0x0000000100000002LL},
+		{0x00000003, 0x0000000000000300LL},
+		{0x00010000, 0x0000010000000000LL},
+		{0xFFFFFFFF, INT64_MAX},
+		{123456, 1717171717171717LL},
+	};
+	size_t cap = 512 * 1024;
+	uint8_t *buf = malloc(cap);
+	test_rng_t rng;
+	test_rng_seed(&rng, 7);
+
+	printf("user string \"%s\"\n", CONFIG_STREAM_SEI_USER_STRING);
+	for (size_t v = 0; v < sizeof(values) / sizeof(values[0]); v++)
+	{
+		for (int stap = 0; stap < 2; stap++)
+		{
+			// Small P frame (single packets), large P frame and IDR (FU-A)
+			check_frame(buf, cap, false, 300, values[v].frame, values[v].capture_us, stap, &rng);
+			check_frame(buf, cap, false, 14000, values[v].frame, values[v].capture_us, stap, &rng);
+			check_frame(buf, cap, true, 90000, values[v].frame, values[v].capture_us, stap, &rng);
+		}
+	}
+
+	// The SEI stays clear of the bytes in front of the headroom
+	memset(buf, 0xA5, SEI_METADATA_HEADROOM);
+	size_t sei_len = prepend_sei_metadata(buf + SEI_METADATA_HEADROOM, 0, 0);
+	for (size_t i = 0; i < SEI_METADATA_HEADROOM - sei_len; i++)
+	{
+		if (!CHECK(buf[i] == 0xA5))
+			break;
+	}
+	free(buf);
+	return TEST_RESULT();
+}
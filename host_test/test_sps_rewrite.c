@@ -0,0 +1,196 @@
+// SPS VUI rewrite: decode the result and check every field round-trips
+#include "test_util.h"
+#include "h264_nal.h"
+#include "h264_parse.h"
+#include <stdio.h>
+#include <string.h>
+
+// Fields outside the VUI must come back unchanged
+static void check_same_sps(const h264_sps_t *a, const h264_sps_t *b)
+{
+	CHECK(a->profile_idc == b->profile_idc);
+	CHECK(a->constraint_flags == b->constraint_flags);
+	CHECK(a->level_idc == b->level_idc);
+	CHECK(a->sps_id == b->sps_id);
+	CHECK(a->chroma_format_idc == b->chroma_format_idc);
+	CHECK(a->separate_colour_plane == b->separate_colour_plane);
+	CHECK(a->log2_max_frame_num == b->log2_max_frame_num);
+	CHECK(a->poc_type == b->poc_type);
+	CHECK(a->log2_max_poc_lsb == b->log2_max_poc_lsb);
+	CHECK(a->delta_pic_order_always_zero == b->delta_pic_order_always_zero);
+	CHECK(a->max_num_ref_frames == b->max_num_ref_frames);
+	CHECK(a->pic_width_in_mbs == b->pic_width_in_mbs);
+	CHECK(a->pic_height_in_map_units == b->pic_height_in_map_units);
+	CHECK(a->frame_mbs_only == b->frame_mbs_only);
+	CHECK(a->crop_left == b->crop_left);
+	CHECK(a->crop_right == b->crop_right);
+	CHECK(a->crop_top == b->crop_top);
+	CHECK(a->crop_bottom == b->crop_bottom);
+	CHECK(a->width == b->width);
+	CHECK(a->height == b->height);
+}
+
+// Descriptive VUI fields survive the rewrite
+static void check_same_description(const h264_vui_t *a, const h264_vui_t *b)
+{
+	CHECK(a->aspect_ratio_info_present == b->aspect_ratio_info_present);
+	CHECK(a->aspect_ratio_idc == b->aspect_ratio_idc);
+	CHECK(a->sar_width == b->sar_width);
+	CHECK(a->sar_height == b->sar_height);
+	CHECK(a->overscan_info_present == b->overscan_info_present);
+	CHECK(a->overscan_appropriate == b->overscan_appropriate);
+	CHECK(a->video_signal_type_present == b->video_signal_type_present);
+	CHECK(a->video_format == b->video_format);
+	CHECK(a->video_full_range == b->video_full_range);
+	CHECK(a->colour_description_present == b->colour_description_present);
+	CHECK(a->colour_primaries == b->colour_primaries);
+	CHECK(a->transfer_characteristics == b->transfer_characteristics);
+	CHECK(a->matrix_coefficients == b->matrix_coefficients);
+	CHECK(a->chroma_loc_info_present == b->chroma_loc_info_present);
+	CHECK(a->pic_struct_present == b->pic_struct_present);
+}
+
+// Emulation prevention leaves no 00 00 00, 00 00 01 or 00 00 02
+static bool escaped(const uint8_t *nal, size_t len)
+{
+	for (size_t i = 0; i + 2 < len; i++)
+	{
+		if (nal[i] == 0 && nal[i + 1] == 0 && nal[i + 2] < 3)
+			return false;
+	}
+	return len > 0 && nal[len - 1] != 0;
+}
+
+static void check_rewrite(const test_sps_params_t *p, uint32_t fps)
+{
+	uint8_t nal[H264_PARAM_SET_MAX], out[H264_PARAM_SET_MAX], again[H264_PARAM_SET_MAX];
+	h264_sps_t before, after;
+
+	printf("%ux%u profile %u, poc %u, vui %d, timing %d, %u fps\n", p->width, p->height, p->profile_idc,
+		   p->poc_type, p->vui, p->vui_timing, fps);
+	size_t len = test_make_sps(p, nal, sizeof(nal));
+	if (!CHECK(h264_parse_sps(nal, len, &before) == ESP_OK))
+		return;
+	CHECK(before.width == p->width && before.height == p->height);
+
+	size_t out_len = h264_sps_rewrite_vui(nal, len, fps, out, sizeof(out));
+	if (!CHECK(out_len > 0))
+		return;
+	CHECK(out[0] == nal[0]);
+	CHECK(escaped(out, out_len));
+	if (!CHECK(h264_parse_sps(out, out_len, &after) == ESP_OK))
+		return;
+
+	check_same_sps(&before, &after);
+	CHECK(after.vui_present);
+	check_same_description(&before.vui, &after.vui);
+
+	if (fps > 0)
+	{
+		CHECK(after.vui.timing_info_present);
+		CHECK(after.vui.num_units_in_tick == 1);
+		CHECK(after.vui.time_scale == 2 * fps);
+		CHECK(after.vui.fixed_frame_rate);
+		CHECK(h264_sps_framerate_milli(&after) == fps * 1000);
+	}
+	else
+	{
+		CHECK(after.vui.timing_info_present == before.vui.timing_info_present);
+		CHECK(after.vui.num_units_in_tick == before.vui.num_units_in_tick);
+		CHECK(after.vui.time_scale == before.vui.time_scale);
+		CHECK(after.vui.fixed_frame_rate == before.vui.fixed_frame_rate);
+	}
+	CHECK(!after.vui.nal_hrd_present && !after.vui.vcl_hrd_present);
+
+	CHECK(after.vui.bitstream_restriction);
+	CHECK(after.vui.motion_vectors_over_pic_boundaries);
+	CHECK(after.vui.max_num_reorder_frames == 0);
+	CHECK(after.vui.max_dec_frame_buffering == before.max_num_ref_frames);
+	CHECK(after.vui.log2_max_mv_length_horizontal == 16);
+	CHECK(after.vui.log2_max_mv_length_vertical == 16);
+
+	// Rewriting a rewritten SPS changes nothing
+	size_t again_len = h264_sps_rewrite_vui(out, out_len, fps, again, sizeof(again));
+	CHECK(again_len == out_len && memcmp(again, out, out_len) == 0);
+
+	// Too small an output buffer is refused, not overrun
+	CHECK(h264_sps_rewrite_vui(nal, len, fps, out, out_len - 1) == 0);
+}
+
+static void check_refused(void)
+{
+	uint8_t nal[H264_PARAM_SET_MAX], out[H264_PARAM_SET_MAX];
+
+	// A PPS is not an SPS
+	size_t len = test_make_pps(nal, sizeof(nal));
+	CHECK(h264_sps_rewrite_vui(nal, len, 30, out, sizeof(out)) == 0);
+
+	// Truncated
+	len = test_make_sps(&test_sps_1080p, nal, sizeof(nal));
+	CHECK(h264_sps_rewrite_vui(nal, 3, 30, out, sizeof(out)) == 0);
+
+	// HRD parameters present: left alone
+	test_bits_t b;
+	test_bits_init(&b);
+	test_bits_u(&b, 77, 8);
+	test_bits_u(&b, 0, 8);
+	test_bits_u(&b, 31, 8);
+	test_bits_ue(&b, 0);		// seq_parameter_set_id
+	test_bits_ue(&b, 0);		// log2_max_frame_num_minus4
+	test_bits_ue(&b, 2);		// pic_order_cnt_type
+	test_bits_ue(&b, 1);		// max_num_ref_frames
+	test_bits_u(&b, 0, 1);		// gaps_in_frame_num_value_allowed_flag
+	test_bits_ue(&b, 79);		// 1280
+	test_bits_ue(&b, 44);		// 720
+	test_bits_u(&b, 1, 1);		// frame_mbs_only_flag
+	test_bits_u(&b, 1, 1);		// direct_8x8_inference_flag
+	test_bits_u(&b, 0, 1);		// frame_cropping_flag
+	test_bits_u(&b, 1, 1);		// vui_parameters_present_flag
+	test_bits_u(&b, 0, 5);		// no aspect ratio, overscan, signal type, chroma loc, timing
+	test_bits_u(&b, 1, 1);		// nal_hrd_parameters_present_flag
+	test_bits_ue(&b, 0);		// cpb_cnt_minus1
+	test_bits_u(&b, 0, 4);		// bit_rate_scale
+	test_bits_u(&b, 0, 4);		// cpb_size_scale
+	test_bits_ue(&b, 3999);		// bit_rate_value_minus1
+	test_bits_ue(&b, 3999);		// cpb_size_value_minus1
+	test_bits_u(&b, 0, 1);		// cbr_flag
+	test_bits_u(&b, 23, 5);		// initial_cpb_removal_delay_length_minus1
+	test_bits_u(&b, 23, 5);		// cpb_removal_delay_length_minus1
+	test_bits_u(&b, 23, 5);		// dpb_output_delay_length_minus1
+	test_bits_u(&b, 24, 5);		// time_offset_length
+	test_bits_u(&b, 0, 1);		// vcl_hrd_parameters_present_flag
+	test_bits_u(&b, 0, 1);		// low_delay_hrd_flag
+	test_bits_u(&b, 0, 1);		// pic_struct_present_flag
+	test_bits_u(&b, 0, 1);		// bitstream_restriction_flag
+	len = test_bits_nal(&b, 0x67, nal, sizeof(nal));
+	h264_sps_t sps;
+	CHECK(h264_parse_sps(nal, len, &sps) == ESP_OK && sps.vui.nal_hrd_present);
+	CHECK(h264_sps_rewrite_vui(nal, len, 30, out, sizeof(out)) == 0);
+}
+
+int main(void)
+{
+	test_sps_params_t p = test_sps_1080p;
+
+	// As the hardware encoder writes it: no VUI at all
+	check_rewrite(&p, 30);
+	check_rewrite(&p, 0);
+
+	// Descriptive VUI to keep, with and without timing to replace
+	p.vui = true;
+	check_rewrite(&p, 30);
+	p.vui_timing = true;
+	check_rewrite(&p, 60);
+	check_rewrite(&p, 0);
+
+	// High profile fields, POC type 0, sizes with and without cropping
+	test_sps_params_t high = {.profile_idc = 100, .level_idc = 31, .width = 1280, .height = 720, .poc_type = 0};
+	check_rewrite(&high, 25);
+	high.width = 640;
+	high.height = 360;
+	high.vui = true;
+	check_rewrite(&high, 15);
+
+	check_refused();
+	return TEST_RESULT();
+}
@@ -0,0 +1,153 @@
+// Start-code search kernel: agreement with the byte loop, and throughput
+#include "test_util.h"
+#include "h264_nal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The byte loop h264_find_start_code() replaced
+static const uint8_t *byte_loop(const uint8_t *p, const uint8_t *end)
+{
+	for (; p + 3 <= end; p++)
+	{
+		if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+			return p;
+	}
+	return end;
+}
+
+// Every start code of a buffer, from every start offset, must match
+static void check_all(const uint8_t *buf, size_t len)
+{
+	const uint8_t *end = buf + len;
+	for (const uint8_t *p = buf; p <= end; p++)
+	{
+		const uint8_t *want = byte_loop(p, end);
+		if (!CHECK(h264_find_start_code(p, end) == want))
+		{
+			printf("  at offset %zu of %zu\n", (size_t)(p - buf), len);
+			return;
+		}
+	}
+}
+
+static void check_random(void)
+{
+	static const uint32_t zero_permille[] = {4, 100, 500, 900};
+	test_rng_t rng;
+	test_rng_seed(&rng, 2);
+
+	// Short buffers at every alignment, so the head, word and tail loops all
+	// see start codes at every position, split across words included
+	uint8_t *mem = malloc(64 + 16);
+	for (int round = 0; round < 20000; round++)
+	{
+		size_t align = test_rng_below(&rng, 16);
+		size_t len = test_rng_below(&rng, 64);
+		uint32_t zeros = zero_permille[round % 4];
+		uint8_t *buf = mem + align;
+		for (size_t i = 0; i < len; i++)
+		{
+			uint32_t r = test_rng_below(&rng, 1000);
+			buf[i] = r < zeros ? 0 : (r < zeros + 50 ? 1 : test_rng_next(&rng) & 0xFF);
+		}
+		check_all(buf, len);
+	}
+	free(mem);
+}
+
+static void check_stream(const test_stream_t *s)
+{
+	// Every frame whole, plus a sweep over the first kilobytes
+	for (size_t f = 0; f < s->count; f++)
+	{
+		const uint8_t *au = s->data + s->offset[f];
+		const uint8_t *end = s->data + s->offset[f + 1];
+		for (const uint8_t *p = au; p < end;)
+		{
+			const uint8_t *want = byte_loop(p, end);
+			if (!CHECK(h264_find_start_code(p, end) == want))
+				break;
+			p = want + 1;
+		}
+	}
+	check_all(s->data, s->len < 4096 ? s->len : 4096);
+}
+
+static double mb_per_s(size_t bytes, int64_t ns)
+{
+	return ns > 0 ? bytes * 1000.0 / ns : 0;
+}
+
+static void bench(const uint8_t *buf, size_t len, const char *name)
+{
+	const int rounds = 20;
+	size_t found_loop = 0, found_kernel = 0;
+	const uint8_t *end = buf + len;
+
+	int64_t t0 = test_now_ns();
+	for (int r = 0; r < rounds; r++)
+	{
+		for (const uint8_t *p = byte_loop(buf, end); p < end; p = byte_loop(p + 3, end))
+			found_loop++;
+	}
+	int64_t t1 = test_now_ns();
+	for (int r = 0; r < rounds; r++)
+	{
+		for (const uint8_t *p = h264_find_start_code(buf, end); p < end; p = h264_find_start_code(p + 3, end))
+			found_kernel++;
+	}
+	int64_t t2 = test_now_ns();
+
+	CHECK(found_loop == found_kernel);
+	printf("%-34s %8.1f MB  byte loop %7.0f MB/s  kernel %7.0f MB/s  x%.1f\n", name, len / 1e6,
+		   mb_per_s(len * rounds, t1 - t0), mb_per_s(len * rounds, t2 - t1),
+		   (double)(t1 - t0) / (t2 - t1 > 0 ? t2 - t1 : 1));
+}
+
+int main(int argc, char **argv)
+{
+	test_stream_t s;
+
+	// Edge cases: empty, too short, at the very end, 4-byte code at a word seam
+	static const uint8_t tail[] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x00, 0x00, 0x01};
+	static const uint8_t seam[] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x00, 0x00, 0x00,
+								   0x01, 0x66, 0x77, 0x88, 0x99, 0xAA, 0xBB, 0xCC};
+	CHECK(h264_find_start_code(tail, tail) == tail);
+	CHECK(h264_find_start_code(tail, tail + 2) == tail + 2);
+	CHECK(h264_find_start_code(tail, tail + sizeof(tail)) == tail + 7);
+	CHECK(h264_find_start_code(tail, tail + sizeof(tail) - 1) == tail + sizeof(tail) - 1);
+	CHECK(h264_find_start_code(seam, seam + sizeof(seam)) == seam + 6);
+	check_all(tail, sizeof(tail));
+	check_all(seam, sizeof(seam));
+
+	check_random();
+
+	test_stream_synthetic(&s, 90, 30, 3);
+	check_stream(&s);
+	printf("\n");
+	bench(s.data, s.len, "synthetic 1080p, 4 Mbit/s");
+	test_stream_free(&s);
+
+	// Worst case for the word skip: many zero bytes, few start codes
+	size_t len = 4 << 20;
+	uint8_t *buf = malloc(len);
+	test_rng_t rng;
+	test_rng_seed(&rng, 4);
+	for (size_t i = 0; i < len; i++)
+		buf[i] = test_rng_below(&rng, 8) == 0 ? 0 : 0x80 | (test_rng_next(&rng) & 0x7F);
+	bench(buf, len, "1 in 8 bytes zero");
+	memset(buf, 0, len);
+	bench(buf, len, "all zero");
+	free(buf);
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!CHECK(test_stream_load(&s, argv[i])))
+			continue;
+		check_stream(&s);
+		bench(s.data, s.len, argv[i]);
+		test_stream_free(&s);
+	}
+	return TEST_RESULT();
+}
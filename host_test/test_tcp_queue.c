@@ -0,0 +1,295 @@
+// tcp_queue against a reader that stalls: records are written whole or
+// dropped whole, never cut or interleaved, and go out in order
+#include "test_util.h"
+#include "tcp_queue.h"
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define RECORDS 20000
+#define RESPONSE_EVERY 40	  // An RTSP response between records
+#define QUEUE_SIZE (64 * 1024)
+#define SOCK_BUF (16 * 1024)
+#define STALL_BYTES (2 << 20) // Reader stops after this much...
+#define STALL_MS 150		  // ... for this long
+
+typedef struct
+{
+	tcp_queue_t q;
+	int sock;
+	volatile bool writing;
+	uint32_t records_ok;
+	uint32_t records_dropped;
+	uint32_t responses_ok;
+	uint32_t responses_dropped;
+	uint32_t failures;
+	bool flush_failed;
+} writer_t;
+
+typedef struct
+{
+	int sock;
+	uint32_t records;
+	uint32_t responses;
+	uint32_t bad; // Bytes that are neither a whole record nor a whole response
+	uint32_t out_of_order;
+	uint32_t stalls;
+} reader_t;
+
+static void sleep_us(uint32_t us)
+{
+	struct timespec t = {.tv_sec = us / 1000000, .tv_nsec = (long)(us % 1000000) * 1000};
+	nanosleep(&t, NULL);
+}
+
+// A connected loopback pair with small buffers, so the queue has to hold data
+static bool tcp_pair(int *wr, int *rd)
+{
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	socklen_t addr_len = sizeof(addr);
+	int buf = SOCK_BUF;
+	int lsock = socket(AF_INET, SOCK_STREAM, 0);
+	*wr = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(lsock, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+	setsockopt(*wr, SOL_SOCKET, SO_SNDBUF, &buf, sizeof(buf));
+	bool ok = bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(lsock, 1) == 0 &&
+			  getsockname(lsock, (struct sockaddr *)&addr, &addr_len) == 0 &&
+			  connect(*wr, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+	*rd = ok ? accept(lsock, NULL, NULL) : -1;
+	close(lsock);
+	return ok && *rd >= 0;
+}
+
+static uint32_t record_len(uint32_t index)
+{
+	return 4 + (index * 2654435761u >> 20) % 1400;
+}
+
+static uint8_t record_byte(uint32_t index, uint32_t i)
+{
+	return (uint8_t)(index * 7 + i);
+}
+
+// As the streaming code writes them: $-framed RTP, then the payload apart
+static esp_err_t write_record(tcp_queue_t *q, uint32_t index)
+{
+	static uint8_t body[2048];
+	uint32_t len = record_len(index);
+	uint8_t hdr[8] = {'$', 0, len >> 8, len & 0xFF, index >> 24, index >> 16, index >> 8, index};
+	for (uint32_t i = 4; i < len; i++)
+		body[i - 4] = record_byte(index, i);
+	struct iovec iov[2] = {{.iov_base = hdr, .iov_len = 8}, {.iov_base = body, .iov_len = len - 4}};
+	return tcp_queue_write(q, iov, 2);
+}
+
+static esp_err_t write_response(tcp_queue_t *q, uint32_t cseq)
+{
+	char rsp[64];
+	int len = snprintf(rsp, sizeof(rsp), "RTSP/1.0 200 OK\r\nCSeq: %u\r\n\r\n", cseq);
+	struct iovec iov = {.iov_base = rsp, .iov_len = len};
+	return tcp_queue_write(q, &iov, 1);
+}
+
+static void count(esp_err_t ret, uint32_t *ok, uint32_t *dropped, uint32_t *failures)
+{
+	if (ret == ESP_OK)
+		(*ok)++;
+	else if (ret == ESP_ERR_NO_MEM)
+		(*dropped)++;
+	else
+		(*failures)++;
+}
+
+static void *writer(void *arg)
+{
+	writer_t *w = arg;
+	for (uint32_t i = 0; i < RECORDS; i++)
+	{
+		if (i % RESPONSE_EVERY == 0)
+			count(write_response(&w->q, i / RESPONSE_EVERY), &w->responses_ok, &w->responses_dropped, &w->failures);
+		count(write_record(&w->q, i), &w->records_ok, &w->records_dropped, &w->failures);
+		sleep_us(20);
+	}
+	w->writing = false;
+	return NULL;
+}
+
+// The server task: sends what is queued whenever the socket takes more
+static void *flusher(void *arg)
+{
+	writer_t *w = arg;
+	while (w->writing || tcp_queue_pending(&w->q) > 0)
+	{
+		struct pollfd pfd = {.fd = w->sock, .events = POLLOUT};
+		if (poll(&pfd, 1, 1) > 0 && tcp_queue_flush(&w->q) != ESP_OK)
+		{
+			w->flush_failed = true;
+			break;
+		}
+	}
+	shutdown(w->sock, SHUT_WR);
+	return NULL;
+}
+
+/**
+ * @brief Take the stream apart; it must hold nothing but whole records and
+ * whole responses, each in order
+ */
+static void *reader(void *arg)
+{
+	reader_t *r = arg;
+	static uint8_t buf[64 * 1024];
+	size_t len = 0, since_stall = 0;
+	int64_t next_index = 0, next_cseq = 0;
+
+	for (;;)
+	{
+		ssize_t n = recv(r->sock, buf + len, sizeof(buf) - len, 0);
+		if (n <= 0)
+			break;
+		len += n;
+		since_stall += n;
+
+		size_t pos = 0;
+		while (pos < len)
+		{
+			const uint8_t *p = buf + pos;
+			size_t avail = len - pos;
+			if (p[0] == '$')
+			{
+				if (avail < 4 || avail < 4 + (size_t)(p[2] << 8 | p[3]))
+					break;
+				uint32_t rec_len = p[2] << 8 | p[3];
+				uint32_t index = (uint32_t)p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+				bool whole = p[1] == 0 && rec_len == record_len(index);
+				for (uint32_t i = 4; whole && i < rec_len; i++)
+					whole = p[4 + i] == record_byte(index, i);
+				r->bad += !whole;
+				r->out_of_order += (int64_t)index < next_index;
+				next_index = (int64_t)index + 1;
+				r->records++;
+				pos += 4 + rec_len;
+			}
+			else if (avail >= 8 && memcmp(p, "RTSP/1.0", 8) == 0)
+			{
+				const uint8_t *end = memchr(p, '\n', avail);
+				end = end ? memchr(end + 1, '\n', avail - (end + 1 - p)) : NULL;
+				end = end ? memchr(end + 1, '\n', avail - (end + 1 - p)) : NULL;
+				if (!end)
+					break;
+				unsigned cseq = 0;
+				r->bad += sscanf((const char *)p, "RTSP/1.0 200 OK\r\nCSeq: %u\r\n\r", &cseq) != 1;
+				r->out_of_order += (int64_t)cseq < next_cseq;
+				next_cseq = (int64_t)cseq + 1;
+				r->responses++;
+				pos = end + 1 - buf;
+			}
+			else if (avail >= 8 || p[0] != 'R')
+			{
+				// Nothing to resynchronise on: the stream is broken
+				r->bad++;
+				return NULL;
+			}
+			else
+			{
+				break;
+			}
+		}
+		memmove(buf, buf + pos, len - pos);
+		len -= pos;
+
+		if (since_stall >= STALL_BYTES)
+		{
+			since_stall = 0;
+			r->stalls++;
+			sleep_us(STALL_MS * 1000);
+		}
+	}
+	r->bad += len > 0;
+	return NULL;
+}
+
+static void check_slow_reader(void)
+{
+	writer_t w = {.writing = true};
+	reader_t r = {0};
+	if (!CHECK(tcp_pair(&w.sock, &r.sock)) || !CHECK(tcp_queue_create(&w.q) == ESP_OK) ||
+		!CHECK(tcp_queue_open(&w.q, w.sock, QUEUE_SIZE) == ESP_OK))
+		return;
+
+	pthread_t threads[3];
+	pthread_create(&threads[0], NULL, reader, &r);
+	pthread_create(&threads[1], NULL, writer, &w);
+	pthread_create(&threads[2], NULL, flusher, &w);
+	for (int i = 0; i < 3; i++)
+		pthread_join(threads[i], NULL);
+
+	printf("%d records through a %d KB queue to a reader stalling %d times: %u sent, %u dropped whole, "
+		   "peak %u bytes queued\n",
+		   RECORDS, QUEUE_SIZE / 1024, r.stalls, w.records_ok, w.records_dropped, (unsigned)w.q.peak);
+	CHECK(r.bad == 0);
+	CHECK(r.out_of_order == 0);
+	CHECK(w.failures == 0 && !w.flush_failed);
+	CHECK(r.records == w.records_ok);
+	CHECK(r.responses == w.responses_ok);
+	CHECK(w.records_ok + w.records_dropped == RECORDS);
+	CHECK(w.q.drops == w.records_dropped + w.responses_dropped);
+	CHECK(r.stalls > 0 && w.records_dropped > 0 && w.records_ok > RECORDS / 2);
+	CHECK(w.q.peak > QUEUE_SIZE - 2048 && w.q.peak <= QUEUE_SIZE);
+	CHECK(tcp_queue_pending(&w.q) == 0);
+
+	// A record larger than the whole ring is refused; the queue stays usable
+	uint8_t big[QUEUE_SIZE + 1];
+	memset(big, 0, sizeof(big));
+	struct iovec iov = {.iov_base = big, .iov_len = sizeof(big)};
+	uint32_t drops = w.q.drops;
+	CHECK(tcp_queue_write(&w.q, &iov, 1) == ESP_ERR_NO_MEM);
+	CHECK(w.q.drops == drops + 1);
+	CHECK(tcp_queue_pending(&w.q) == 0);
+
+	// Closed, nothing goes out
+	tcp_queue_close(&w.q);
+	CHECK(write_record(&w.q, 0) == ESP_FAIL);
+	CHECK(tcp_queue_flush(&w.q) == ESP_FAIL);
+	CHECK(tcp_queue_pending(&w.q) == 0);
+	vSemaphoreDelete(w.q.lock);
+	close(w.sock);
+	close(r.sock);
+}
+
+// A peer that went away fails the writes instead of filling the queue
+static void check_peer_closed(void)
+{
+	tcp_queue_t q;
+	int wr, rd;
+	if (!CHECK(tcp_pair(&wr, &rd)) || !CHECK(tcp_queue_create(&q) == ESP_OK) ||
+		!CHECK(tcp_queue_open(&q, wr, QUEUE_SIZE) == ESP_OK))
+		return;
+
+	CHECK(write_record(&q, 0) == ESP_OK);
+	close(rd);
+	esp_err_t ret = ESP_OK;
+	for (uint32_t i = 1; i < 1000 && ret == ESP_OK; i++)
+	{
+		ret = write_record(&q, i);
+		sleep_us(100);
+	}
+	CHECK(ret == ESP_FAIL);
+	tcp_queue_close(&q);
+	vSemaphoreDelete(q.lock);
+	close(wr);
+}
+
+int main(void)
+{
+	// lwIP raises no signal for a closed peer; errno tells
+	signal(SIGPIPE, SIG_IGN);
+	check_slow_reader();
+	check_peer_closed();
+	return TEST_RESULT();
+}
@@ -0,0 +1,518 @@
+#include "test_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static int s_checks;
+static int s_failures;
+
+bool test_check(bool cond, const char *expr, const char *file, int line)
+{
+	// Tests with helper threads check from more than one
+	__atomic_add_fetch(&s_checks, 1, __ATOMIC_RELAXED);
+	if (!cond)
+	{
+		__atomic_add_fetch(&s_failures, 1, __ATOMIC_RELAXED);
+		printf("FAIL %s:%d: %s\n", file, line, expr);
+	}
+	return cond;
+}
+
+int test_result(const char *name)
+{
+	printf("%s: %d checks, %d failed\n", name, s_checks, s_failures);
+	return s_failures ? 1 : 0;
+}
+
+static int64_t clock_ns(clockid_t id)
+{
+	struct timespec ts;
+	clock_gettime(id, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int64_t test_now_ns(void)
+{
+	return clock_ns(CLOCK_MONOTONIC);
+}
+
+int64_t test_thread_cpu_ns(void)
+{
+	return clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+int64_t test_process_cpu_ns(void)
+{
+	return clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void test_rng_seed(test_rng_t *rng, uint64_t seed)
+{
+	rng->state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+uint32_t test_rng_next(test_rng_t *rng)
+{
+	rng->state ^= rng->state >> 12;
+	rng->state ^= rng->state << 25;
+	rng->state ^= rng->state >> 27;
+	return (rng->state * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+uint32_t test_rng_below(test_rng_t *rng, uint32_t n)
+{
+	return (uint32_t)(((uint64_t)test_rng_next(rng) * n) >> 32);
+}
+
+void test_bits_init(test_bits_t *b)
+{
+	memset(b, 0, sizeof(*b));
+}
+
+void test_bits_u(test_bits_t *b, uint32_t value, int n)
+{
+	for (int i = n - 1; i >= 0; i--, b->bits++)
+	{
+		if (b->bits / 8 >= sizeof(b->rbsp))
+			return;
+		if ((value >> i) & 1)
+			b->rbsp[b->bits / 8] |= 0x80 >> (b->bits % 8);
+	}
+}
+
+void test_bits_ue(test_bits_t *b, uint32_t value)
+{
+	uint64_t v = (uint64_t)value + 1;
+	int len = 0;
+	while ((v >> len) > 1)
+		len++;
+	test_bits_u(b, 0, len);
+	test_bits_u(b, (uint32_t)v, len + 1);
+}
+
+void test_bits_se(test_bits_t *b, int32_t value)
+{
+	test_bits_ue(b, value > 0 ? 2 * (uint32_t)value - 1 : 2 * (uint32_t)-value);
+}
+
+// Escape an RBSP into a NAL payload (7.4.1)
+static size_t escape(const uint8_t *rbsp, size_t len, uint8_t *out, size_t cap)
+{
+	size_t o = 0;
+	int zeros = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		if (zeros == 2 && rbsp[i] <= 3)
+		{
+			if (o == cap)
+				return 0;
+			out[o++] = 3;
+			zeros = 0;
+		}
+		if (o == cap)
+			return 0;
+		out[o++] = rbsp[i];
+		zeros = rbsp[i] == 0 ? zeros + 1 : 0;
+	}
+	return o;
+}
+
+size_t test_bits_nal(test_bits_t *b, uint8_t header, uint8_t *out, size_t cap)
+{
+	test_bits_u(b, 1, 1);
+	while (b->bits % 8)
+		test_bits_u(b, 0, 1);
+	if (cap < 1)
+		return 0;
+	out[0] = header;
+	size_t n = escape(b->rbsp, b->bits / 8, out + 1, cap - 1);
+	return n ? n + 1 : 0;
+}
+
+const test_sps_params_t test_sps_1080p = {
+	.profile_idc = 66,
+	.level_idc = 40,
+	.width = 1920,
+	.height = 1080,
+	.poc_type = 2,
+};
+
+size_t test_make_sps(const test_sps_params_t *p, uint8_t *out, size_t cap)
+{
+	test_bits_t b;
+	test_bits_init(&b);
+
+	uint32_t mbs_w = (p->width + 15) / 16, mbs_h = (p->height + 15) / 16;
+	test_bits_u(&b, p->profile_idc, 8);
+	test_bits_u(&b, p->profile_idc == 66 ? 0xC0 : 0, 8); // constraint_set0/1
+	test_bits_u(&b, p->level_idc, 8);
+	test_bits_ue(&b, 0); // seq_parameter_set_id
+	if (p->profile_idc == 100)
+	{
+		test_bits_ue(&b, 1); // chroma_format_idc
+		test_bits_ue(&b, 0); // bit_depth_luma_minus8
+		test_bits_ue(&b, 0); // bit_depth_chroma_minus8
+		test_bits_u(&b, 0, 1);
+		test_bits_u(&b, 0, 1); // seq_scaling_matrix_present_flag
+	}
+	test_bits_ue(&b, 0); // log2_max_frame_num_minus4
+	test_bits_ue(&b, p->poc_type);
+	if (p->poc_type == 0)
+		test_bits_ue(&b, 2); // log2_max_pic_order_cnt_lsb_minus4
+	test_bits_ue(&b, 1);	 // max_num_ref_frames
+	test_bits_u(&b, 0, 1);	 // gaps_in_frame_num_value_allowed_flag
+	test_bits_ue(&b, mbs_w - 1);
+	test_bits_ue(&b, mbs_h - 1);
+	test_bits_u(&b, 1, 1); // frame_mbs_only_flag
+	test_bits_u(&b, 1, 1); // direct_8x8_inference_flag
+	bool crop = mbs_w * 16 != p->width || mbs_h * 16 != p->height;
+	test_bits_u(&b, crop, 1);
+	if (crop)
+	{
+		test_bits_ue(&b, 0);
+		test_bits_ue(&b, (mbs_w * 16 - p->width) / 2);
+		test_bits_ue(&b, 0);
+		test_bits_ue(&b, (mbs_h * 16 - p->height) / 2);
+	}
+	test_bits_u(&b, p->vui, 1);
+	if (p->vui)
+	{
+		test_bits_u(&b, 1, 1); // aspect_ratio_info_present_flag
+		test_bits_u(&b, 1, 8); // 1:1
+		test_bits_u(&b, 0, 1); // overscan_info_present_flag
+		test_bits_u(&b, 1, 1); // video_signal_type_present_flag
+		test_bits_u(&b, 5, 3); // unspecified video_format
+		test_bits_u(&b, 0, 1); // video_full_range_flag
+		test_bits_u(&b, 1, 1); // colour_description_present_flag
+		test_bits_u(&b, 1, 8); // BT.709 primaries, transfer, matrix
+		test_bits_u(&b, 1, 8);
+		test_bits_u(&b, 1, 8);
+		test_bits_u(&b, 0, 1); // chroma_loc_info_present_flag
+		test_bits_u(&b, p->vui_timing, 1);
+		if (p->vui_timing)
+		{
+			test_bits_u(&b, 1, 32);	 // num_units_in_tick
+			test_bits_u(&b, 50, 32); // time_scale: 25 fps
+			test_bits_u(&b, 1, 1);
+		}
+		test_bits_u(&b, 0, 1); // nal_hrd_parameters_present_flag
+		test_bits_u(&b, 0, 1); // vcl_hrd_parameters_present_flag
+		test_bits_u(&b, 0, 1); // pic_struct_present_flag
+		test_bits_u(&b, 0, 1); // bitstream_restriction_flag
+	}
+	return test_bits_nal(&b, 0x67, out, cap);
+}
+
+size_t test_make_pps(uint8_t *out, size_t cap)
+{
+	test_bits_t b;
+	test_bits_init(&b);
+	test_bits_ue(&b, 0);   // pic_parameter_set_id
+	test_bits_ue(&b, 0);   // seq_parameter_set_id
+	test_bits_u(&b, 0, 1); // entropy_coding_mode_flag
+	test_bits_u(&b, 0, 1); // bottom_field_pic_order_in_frame_present_flag
+	test_bits_ue(&b, 0);   // num_slice_groups_minus1
+	test_bits_ue(&b, 0);   // num_ref_idx_l0_default_active_minus1
+	test_bits_ue(&b, 0);   // num_ref_idx_l1_default_active_minus1
+	test_bits_u(&b, 0, 1); // weighted_pred_flag
+	test_bits_u(&b, 0, 2); // weighted_bipred_idc
+	test_bits_se(&b, 0);   // pic_init_qp_minus26
+	test_bits_se(&b, 0);   // pic_init_qs_minus26
+	test_bits_se(&b, 0);   // chroma_qp_index_offset
+	test_bits_u(&b, 1, 1); // deblocking_filter_control_present_flag
+	test_bits_u(&b, 0, 1); // constrained_intra_pred_flag
+	test_bits_u(&b, 0, 1); // redundant_pic_cnt_present_flag
+	return test_bits_nal(&b, 0x68, out, cap);
+}
+
+size_t test_make_nal(uint8_t *out, size_t cap, uint8_t header, size_t len, uint32_t zero_permille,
+					 test_rng_t *rng)
+{
+	static const uint8_t sc[4] = {0, 0, 0, 1};
+	if (cap < sizeof(sc) + 1)
+		return 0;
+	memcpy(out, sc, sizeof(sc));
+	out[4] = header;
+
+	size_t o = 5;
+	int zeros = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		uint8_t v;
+		if (i == 0)
+			v = 0x80 | (test_rng_next(rng) & 0x7F); // first_mb_in_slice = 0
+		else if (i == len - 1)
+			v = 0x80; // rbsp_stop_one_bit, so the NAL never ends in zero
+		else if (test_rng_below(rng, 1000) < zero_permille)
+			v = 0;
+		else
+			v = test_rng_next(rng) & 0xFF;
+
+		if (zeros == 2 && v <= 3)
+		{
+			if (o == cap)
+				return 0;
+			out[o++] = 3;
+			zeros = 0;
+		}
+		if (o == cap)
+			return 0;
+		out[o++] = v;
+		zeros = v == 0 ? zeros + 1 : 0;
+	}
+	return o;
+}
+
+size_t test_make_au(uint8_t *out, size_t cap, bool idr, size_t slice_len, test_rng_t *rng)
+{
+	size_t o = 0;
+	if (idr)
+	{
+		uint8_t nal[256];
+		size_t n = test_make_sps(&test_sps_1080p, nal, sizeof(nal));
+		if (o + 4 + n > cap)
+			return 0;
+		memcpy(out + o, "\0\0\0\1", 4);
+		memcpy(out + o + 4, nal, n);
+		o += 4 + n;
+
+		n = test_make_pps(nal, sizeof(nal));
+		if (o + 4 + n > cap)
+			return 0;
+		memcpy(out + o, "\0\0\0\1", 4);
+		memcpy(out + o + 4, nal, n);
+		o += 4 + n;
+	}
+	size_t n = test_make_nal(out + o, cap - o, idr ? 0x65 : 0x41, slice_len, 4, rng);
+	return n ? o + n : 0;
+}
+
+void test_stream_synthetic(test_stream_t *s, size_t frames, size_t gop, uint64_t seed)
+{
+	// 4 Mbit/s at 30 fps is 16.7 KB a frame; an IDR weighs about six P frames
+	const size_t idr_len = 90 * 1024, p_len = 14 * 1024;
+	test_rng_t rng;
+	test_rng_seed(&rng, seed);
+
+	memset(s, 0, sizeof(*s));
+	size_t cap = frames * (p_len * 3 / 2) + (frames / gop + 1) * (idr_len * 3 / 2);
+	s->data = malloc(cap);
+	s->offset = malloc((frames + 1) * sizeof(size_t));
+	if (!s->data || !s->offset)
+		abort();
+
+	for (size_t i = 0; i < frames; i++)
+	{
+		bool idr = i % gop == 0;
+		size_t base = idr ? idr_len : p_len;
+		size_t slice = base - base / 4 + test_rng_below(&rng, (uint32_t)(base / 2));
+		s->offset[i] = s->len;
+		s->len += test_make_au(s->data + s->len, cap - s->len, idr, slice, &rng);
+		s->idr_count += idr;
+	}
+	s->offset[frames] = s->len;
+	s->count = frames;
+}
+
+// First NAL unit of a new access unit, once the current one has a slice (7.4.1.2.3)
+static bool starts_au(const uint8_t *nal, size_t len)
+{
+	uint8_t type = nal[0] & 0x1F;
+	if (type == 9 || type == 7 || type == 8 || type == 6)
+		return true;
+	// first_mb_in_slice == 0 codes as a leading 1 bit
+	return (type == 1 || type == 5) && len > 1 && (nal[1] & 0x80);
+}
+
+bool test_stream_load(test_stream_t *s, const char *path)
+{
+	memset(s, 0, sizeof(*s));
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return false;
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	s->data = malloc(size > 0 ? size : 1);
+	s->len = (s->data && size > 0) ? fread(s->data, 1, size, f) : 0;
+	fclose(f);
+
+	size_t cap = 64;
+	s->offset = malloc(cap * sizeof(size_t));
+	if (!s->data || !s->offset)
+		abort();
+
+	bool have_slice = false, have_idr = false;
+	for (size_t i = 0; i + 3 < s->len; i++)
+	{
+		if (s->data[i] != 0 || s->data[i + 1] != 0 || s->data[i + 2] != 1)
+			continue;
+		size_t sc = (i > 0 && s->data[i - 1] == 0) ? i - 1 : i;
+		const uint8_t *nal = s->data + i + 3;
+		uint8_t type = nal[0] & 0x1F;
+		if (s->count == 0 || (have_slice && starts_au(nal, s->len - i - 3)))
+		{
+			if (s->count + 2 > cap)
+			{
+				cap *= 2;
+				s->offset = realloc(s->offset, cap * sizeof(size_t));
+				if (!s->offset)
+					abort();
+			}
+			s->offset[s->count] = s->count == 0 ? 0 : sc;
+			s->count++;
+			have_slice = false;
+			have_idr = false;
+		}
+		if (type == 1 || type == 5)
+			have_slice = true;
+		if (type == 5 && !have_idr)
+		{
+			have_idr = true;
+			s->idr_count++;
+		}
+		i += 2;
+	}
+	if (s->count > 0)
+		s->offset[s->count] = s->len;
+	return s->count > 0;
+}
+
+void test_stream_free(test_stream_t *s)
+{
+	free(s->data);
+	free(s->offset);
+	memset(s, 0, sizeof(*s));
+}
+
+void test_depack_init(test_depack_t *d, size_t cap)
+{
+	memset(d, 0, sizeof(*d));
+	d->data = malloc(cap);
+	if (!d->data)
+		abort();
+	d->cap = cap;
+}
+
+void test_depack_free(test_depack_t *d)
+{
+	free(d->data);
+	memset(d, 0, sizeof(*d));
+}
+
+void test_depack_reset(test_depack_t *d)
+{
+	d->len = 0;
+	d->count = 0;
+	d->in_fu = false;
+}
+
+static void nal_begin(test_depack_t *d)
+{
+	if (d->count < TEST_DEPACK_NAL_MAX)
+	{
+		d->offset[d->count] = d->len;
+		d->nal_len[d->count] = 0;
+	}
+}
+
+static void nal_add(test_depack_t *d, const uint8_t *p, size_t len)
+{
+	if (d->count >= TEST_DEPACK_NAL_MAX || d->len + len > d->cap)
+	{
+		d->errors++;
+		return;
+	}
+	memcpy(d->data + d->len, p, len);
+	d->len += len;
+	d->nal_len[d->count] += len;
+}
+
+static void nal_end(test_depack_t *d)
+{
+	if (d->count < TEST_DEPACK_NAL_MAX)
+		d->count++;
+}
+
+bool test_depack_payload(test_depack_t *d, const uint8_t *pl, size_t len)
+{
+	uint8_t type = len > 0 ? pl[0] & 0x1F : 0;
+	bool ok = false;
+
+	if (type >= 1 && type <= 23)
+	{
+		ok = !d->in_fu;
+		nal_begin(d);
+		nal_add(d, pl, len);
+		nal_end(d);
+	}
+	else if (type == 24)
+	{
+		ok = !d->in_fu && len > 3;
+		for (size_t i = 1; ok && i < len;)
+		{
+			size_t n = i + 2 <= len ? (size_t)((pl[i] << 8) | pl[i + 1]) : 0;
+			i += 2;
+			if (n == 0 || i + n > len)
+			{
+				ok = false;
+				break;
+			}
+			nal_begin(d);
+			nal_add(d, pl + i, n);
+			nal_end(d);
+			i += n;
+		}
+	}
+	else if (type == 28 && len > 2)
+	{
+		bool start = pl[1] & 0x80, end = pl[1] & 0x40;
+		ok = start != d->in_fu;
+		if (ok)
+		{
+			if (start)
+			{
+				uint8_t header = (pl[0] & 0xE0) | (pl[1] & 0x1F);
+				nal_begin(d);
+				nal_add(d, &header, 1);
+				d->in_fu = true;
+			}
+			nal_add(d, pl + 2, len - 2);
+			if (end)
+			{
+				d->in_fu = false;
+				nal_end(d);
+			}
+		}
+	}
+
+	if (!ok)
+		d->errors++;
+	return ok;
+}
+
+bool test_depack_rtp(test_depack_t *d, const uint8_t *pkt, size_t len)
+{
+	if (len <= 12 || (pkt[0] & 0xC0) != 0x80 || (pkt[1] & 0x7F) != 96)
+	{
+		d->errors++;
+		return false;
+	}
+	uint16_t seq = (pkt[2] << 8) | pkt[3];
+	if (d->packets > 0)
+		d->seq_gaps += (uint16_t)(seq - d->next_seq);
+	d->next_seq = seq + 1;
+	d->packets++;
+	d->marker = pkt[1] & 0x80;
+	d->ts = ((uint32_t)pkt[4] << 24) | (pkt[5] << 16) | (pkt[6] << 8) | pkt[7];
+	d->ssrc = ((uint32_t)pkt[8] << 24) | (pkt[9] << 16) | (pkt[10] << 8) | pkt[11];
+
+	size_t hdr = 12 + (pkt[0] & 0x0F) * 4;
+	if (hdr >= len)
+	{
+		d->errors++;
+		return false;
+	}
+	return test_depack_payload(d, pkt + hdr, len - hdr);
+}
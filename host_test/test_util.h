@@ -0,0 +1,230 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Recoverable check: reports and counts the failure, the test goes on
+#define CHECK(cond) test_check((cond), #cond, __FILE__, __LINE__)
+
+// Exit status of a test program
+#define TEST_RESULT() test_result(__FILE__)
+
+	/**
+	 * @brief Record one check
+	 *
+	 * @return cond, so a check can guard the code that depends on it
+	 */
+	bool test_check(bool cond, const char *expr, const char *file, int line);
+
+	/**
+	 * @brief Print the summary of a test program
+	 *
+	 * @return 0 if every check passed, 1 otherwise
+	 */
+	int test_result(const char *name);
+
+	// Monotonic wall clock
+	int64_t test_now_ns(void);
+
+	// CPU time of the calling thread
+	int64_t test_thread_cpu_ns(void);
+
+	// CPU time of the whole process, helper threads included
+	int64_t test_process_cpu_ns(void);
+
+	/**
+	 * @brief Deterministic random numbers (xorshift64*)
+	 */
+	typedef struct
+	{
+		uint64_t state;
+	} test_rng_t;
+
+	void test_rng_seed(test_rng_t *rng, uint64_t seed);
+	uint32_t test_rng_next(test_rng_t *rng);
+
+	// Uniform in [0, n)
+	uint32_t test_rng_below(test_rng_t *rng, uint32_t n);
+
+	/**
+	 * @brief Bit writer producing an RBSP, with emulation prevention on output
+	 */
+	typedef struct
+	{
+		uint8_t rbsp[512];
+		size_t bits;
+	} test_bits_t;
+
+	void test_bits_init(test_bits_t *b);
+	void test_bits_u(test_bits_t *b, uint32_t value, int n);
+	void test_bits_ue(test_bits_t *b, uint32_t value);
+	void test_bits_se(test_bits_t *b, int32_t value);
+
+	/**
+	 * @brief Add rbsp_trailing_bits and write the NAL unit
+	 *
+	 * @param b Bits written after the NAL header
+	 * @param header NAL header byte
+	 * @param out Output, NAL unit without start code
+	 * @param cap Size of out
+	 * @return NAL length, 0 if it does not fit
+	 */
+	size_t test_bits_nal(test_bits_t *b, uint8_t header, uint8_t *out, size_t cap);
+
+	/**
+	 * @brief Parameters of a synthetic SPS, as the hardware encoder writes it
+	 */
+	typedef struct
+	{
+		uint8_t profile_idc;
+		uint8_t level_idc;
+		uint32_t width;
+		uint32_t height;
+		uint32_t poc_type;
+		bool vui;			  // Add a VUI with aspect ratio and video signal type
+		bool vui_timing;	  // ... and timing info
+	} test_sps_params_t;
+
+	// 1920x1080 Baseline at level 4.0, no VUI
+	extern const test_sps_params_t test_sps_1080p;
+
+	/**
+	 * @brief Write an SPS NAL unit
+	 *
+	 * @return NAL length without start code
+	 */
+	size_t test_make_sps(const test_sps_params_t *p, uint8_t *out, size_t cap);
+
+	/**
+	 * @brief Write a PPS NAL unit for test_make_sps()
+	 *
+	 * @return NAL length without start code
+	 */
+	size_t test_make_pps(uint8_t *out, size_t cap);
+
+	/**
+	 * @brief Write a start code and a NAL unit with a random slice body
+	 *
+	 * The body goes through emulation prevention, so the result never holds
+	 * a start code before its end. zero_permille sets how many body bytes
+	 * are zero before escaping; real CABAC data has about 4.
+	 *
+	 * @param out Output
+	 * @param cap Size of out
+	 * @param header NAL header byte
+	 * @param len Body length before escaping
+	 * @param zero_permille Share of zero bytes in the body
+	 * @param rng Random source
+	 * @return Bytes written, start code included
+	 */
+	size_t test_make_nal(uint8_t *out, size_t cap, uint8_t header, size_t len, uint32_t zero_permille,
+						 test_rng_t *rng);
+
+	/**
+	 * @brief Write an access unit as the encoder outputs it
+	 *
+	 * An IDR carries SPS and PPS in front of its slice. Start codes are
+	 * 4 bytes.
+	 *
+	 * @param out Output
+	 * @param cap Size of out
+	 * @param idr IDR picture, else a P picture
+	 * @param slice_len Slice body length before escaping
+	 * @param rng Random source
+	 * @return Access unit length
+	 */
+	size_t test_make_au(uint8_t *out, size_t cap, bool idr, size_t slice_len, test_rng_t *rng);
+
+	/**
+	 * @brief Access units of a stream, in one buffer
+	 */
+	typedef struct
+	{
+		uint8_t *data;
+		size_t len;
+		size_t count;
+		size_t *offset; // count + 1 entries; AU i spans offset[i] to offset[i + 1]
+		size_t idr_count;
+	} test_stream_t;
+
+	/**
+	 * @brief Build a 1080p-like stream: IDR every gop frames, 4 Mbit/s at 30 fps
+	 *
+	 * @param s Output, released with test_stream_free()
+	 * @param frames Access units
+	 * @param gop Frames per GOP
+	 * @param seed Random seed
+	 */
+	void test_stream_synthetic(test_stream_t *s, size_t frames, size_t gop, uint64_t seed);
+
+	/**
+	 * @brief Load a recorded Annex-B stream, split into access units
+	 *
+	 * A new access unit starts at an AUD, SPS or PPS following a slice, or
+	 * at a slice starting at macroblock 0.
+	 *
+	 * @param s Output, released with test_stream_free()
+	 * @param path .h264 file
+	 * @return true on success
+	 */
+	bool test_stream_load(test_stream_t *s, const char *path);
+
+	void test_stream_free(test_stream_t *s);
+
+// NAL units a test receiver keeps per access unit
+#define TEST_DEPACK_NAL_MAX 64
+
+	/**
+	 * @brief RFC 6184 receiver: NAL units of one access unit, rebuilt from
+	 * single NAL unit, STAP-A and FU-A packets
+	 */
+	typedef struct
+	{
+		uint8_t *data;
+		size_t cap;
+		size_t len;
+		size_t offset[TEST_DEPACK_NAL_MAX];
+		size_t nal_len[TEST_DEPACK_NAL_MAX];
+		size_t count;
+		bool in_fu;
+		uint32_t errors;   // Malformed payloads, FU-A out of order, overflow
+		uint32_t packets;  // RTP packets taken
+		uint32_t seq_gaps; // Packets missing between consecutive ones
+		uint16_t next_seq;
+		uint32_t ts;	   // Timestamp of the last packet
+		uint32_t ssrc;
+		bool marker;	   // Last packet had the marker bit
+	} test_depack_t;
+
+	void test_depack_init(test_depack_t *d, size_t cap);
+	void test_depack_free(test_depack_t *d);
+
+	// Drop the NAL units collected so far, keep the sequence state
+	void test_depack_reset(test_depack_t *d);
+
+	/**
+	 * @brief Take one H.264 RTP payload
+	 *
+	 * @return false if the payload is malformed
+	 */
+	bool test_depack_payload(test_depack_t *d, const uint8_t *payload, size_t len);
+
+	/**
+	 * @brief Take one RTP packet of payload type 96
+	 *
+	 * @return false if the header or payload is malformed
+	 */
+	bool test_depack_rtp(test_depack_t *d, const uint8_t *pkt, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TEST_UTIL_H
@@ -3,7 +3,9 @@
 #include "camera_encoder_common.h"
 #include "camera_drawer.h"
 #include "rtsp_server.h"
+#include "h264_stats.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_h264_enc_single_hw.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -24,15 +26,16 @@ static uint8_t *s_h264_buf = NULL;
 static size_t s_h264_buf_size;
 static uint32_t s_frame_count;
 static bool s_running;
-static bool s_sps_pps_sent;
-static uint8_t s_cached_sps[256], s_cached_pps[256];
-static size_t s_cached_sps_len = 0, s_cached_pps_len = 0;
+static h264_nal_index_t s_nal_index;
 
 static void frame_callback(uint8_t *buf, uint8_t idx, uint32_t w, uint32_t h, size_t len)
 {
 	if (!s_running)
 		return;
 
+	int64_t capture_us = esp_timer_get_time();
+
+#if CONFIG_STREAM_TEXT_OVERLAY
 	// Draw text overlays on camera frame (YUV422 O_UYY_E_VYY format)
 	draw_text(buf, w, h, "Connected Experimental Camera", 32, 32, 16, 128, 128);
 
@@ -40,77 +43,55 @@ static void frame_callback(uint8_t *buf, uint8_t idx, uint32_t w, uint32_t h, si
 	char frame_text[64];
 	snprintf(frame_text, sizeof(frame_text), "1920x1080 30 FPS #%lu", (unsigned long)s_frame_count);
 	draw_text(buf, w, h, frame_text, 32, 52, 16, 128, 128);
+#endif
 
-	// O_UYY_E_VYY format passed to encoder
+	// O_UYY_E_VYY format passed to encoder; the headroom takes the metadata SEI
+	uint8_t *au = s_h264_buf + SEI_METADATA_HEADROOM;
 	esp_h264_enc_in_frame_t in = {.raw_data = {.buffer = buf, .len = len}};
-	esp_h264_enc_out_frame_t out = {.raw_data = {.buffer = s_h264_buf, .len = s_h264_buf_size}};
+	esp_h264_enc_out_frame_t out = {.raw_data = {.buffer = au, .len = s_h264_buf_size}};
+
+	// The encoder is closed after a failed reopen for an IDR; skip the frame
+	if (idr_request_apply(s_encoder, capture_us) != ESP_OK)
+		return;
 
 	if (esp_h264_enc_process(s_encoder, &in, &out) == ESP_H264_ERR_OK && out.raw_data.len > 0)
 	{
 		// Find actual H.264 data size
-		size_t actual_len = find_h264_data_end(out.raw_data.buffer, out.raw_data.len);
+		size_t actual_len = h264_frame_length(au, out.length, out.raw_data.len);
+
+		size_t sei_len = prepend_sei_metadata(au, s_frame_count, capture_us);
+		const uint8_t *data = au - sei_len;
+		actual_len += sei_len;
+
+		// Scan start codes once; everything below works on the index
+		h264_nal_index_build(data, actual_len, &s_nal_index);
+		h264_stats_record(data, &s_nal_index, capture_us);
+		idr_request_done(s_nal_index.idr, capture_us);
 
 		// Log first frame details
 		if (s_frame_count == 0)
 		{
-			ESP_LOGI(TAG, "First H.264 frame: %d bytes (searched %d bytes)",
-					 actual_len, out.raw_data.len);
-			extract_sps_pps(out.raw_data.buffer, actual_len, s_cached_sps, &s_cached_sps_len,
-							s_cached_pps, &s_cached_pps_len, &s_sps_pps_sent);
+			ESP_LOGI(TAG, "First H.264 frame: %d bytes, %d NAL units (searched %d bytes)",
+					 actual_len, s_nal_index.count, out.raw_data.len);
 		}
 		else if (s_frame_count % 300 == 0)
 		{
-			ESP_LOGI(TAG, "Frame %u: %d bytes", s_frame_count, actual_len);
+			ESP_LOGI(TAG, "Frame %u: %d bytes, %d NAL units", s_frame_count, actual_len, s_nal_index.count);
 		}
 
-		// For I-frames, prepend cached SPS/PPS if available
-		bool is_iframe = false;
-		const uint8_t *data = out.raw_data.buffer;
-		size_t data_len = actual_len;
-
-		// Scan ALL NAL units to check if this is an I-frame
-		for (size_t i = 0; i < data_len - 4; i++)
+		// Refresh the parameter-set store on every IDR; the RTSP server
+		// re-sends SPS/PPS to clients only when their bytes change
+		if (s_nal_index.idr)
 		{
-			size_t skip = 0;
-			if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 0 && data[i + 3] == 1)
-			{
-				skip = 4;
-			}
-			else if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+			if (s_frame_count < 5 || (s_frame_count % 30 == 0))
 			{
-				skip = 3;
+				ESP_LOGI(TAG, "Frame %u: Found IDR NAL", s_frame_count);
 			}
-			else
-			{
-				continue;
-			}
-
-			uint8_t nal_header = data[i + skip];
-			uint8_t nal_type = nal_header & 0x1F;
-
-			// Check if this NAL is an IDR frame (type 5)
-			if (nal_type == 5)
-			{
-				is_iframe = true;
-				if (s_frame_count < 5 || (s_frame_count % 30 == 0))
-				{
-					ESP_LOGI(TAG, "Frame %u: Found IDR NAL type %d at offset %u", s_frame_count, nal_type, i);
-				}
-				break;
-			}
-		}
-
-		if (is_iframe && s_cached_sps_len > 0 && s_cached_pps_len > 0)
-		{
-			// Send SPS first
-			rtsp_send_h264_frame(s_cached_sps, s_cached_sps_len, s_frame_count * (90000 / CAM_FPS));
-			// Send PPS
-			rtsp_send_h264_frame(s_cached_pps, s_cached_pps_len, s_frame_count * (90000 / CAM_FPS));
-			ESP_LOGI(TAG, "Prepended cached SPS/PPS to I-frame %u", s_frame_count);
+			update_param_sets(data, &s_nal_index);
 		}
 
 		uint32_t ts = s_frame_count * (90000 / CAM_FPS);
-		rtsp_send_h264_frame(out.raw_data.buffer, actual_len, ts);
+		rtsp_send_h264_nals(data, &s_nal_index, ts);
 		s_frame_count++;
 	}
 }
@@ -128,7 +109,7 @@ esp_err_t camera_encoder_init(void)
 		return ESP_FAIL;
 
 	s_h264_buf_size = 3072 * 1024;
-	s_h264_buf = alloc_aligned_buffer(s_h264_buf_size, "H264 buffer");
+	s_h264_buf = alloc_aligned_buffer(s_h264_buf_size + SEI_METADATA_HEADROOM, "H264 buffer");
 	if (!s_h264_buf)
 		return ESP_ERR_NO_MEM;
 
@@ -144,6 +125,7 @@ esp_err_t camera_encoder_init(void)
 		return ESP_FAIL;
 	if (esp_h264_enc_open(s_encoder) != ESP_H264_ERR_OK)
 		return ESP_FAIL;
+	rtsp_set_framerate(CAM_FPS);
 
 	ESP_LOGI(TAG, "Encoder ready (HW, YUV422 O_UYY_E_VYY): %dx%d@%d", CAM_WIDTH, CAM_HEIGHT, CAM_FPS);
 	return ESP_OK;
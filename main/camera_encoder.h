@@ -10,6 +10,12 @@ extern "C"
 {
 #endif
 
+// Shortest time between two IDRs forced by camera_encoder_request_idr()
+#define CAMERA_IDR_MIN_INTERVAL_MS 500
+
+// Failed encoder reopens in a row after which camera_encoder_get_status() reports it
+#define CAMERA_ENCODER_REOPEN_FAIL_FRAMES 30
+
 	/**
 	 * @brief VBR mode enumeration
 	 */
@@ -149,6 +155,27 @@ extern "C"
 	 */
 	esp_err_t camera_encoder_get_vbr_stats(vbr_stats_t *stats);
 
+	/**
+	 * @brief Ask the running encoder for an IDR frame
+	 *
+	 * Applied at the next frame boundary. Requests made within
+	 * CAMERA_IDR_MIN_INTERVAL_MS of the last IDR wait until that interval
+	 * has passed and are answered together, so a burst of joins or PLIs
+	 * costs one IDR. Safe to call from any task.
+	 */
+	void camera_encoder_request_idr(void);
+
+	/**
+	 * @brief Health of the encoder
+	 *
+	 * An IDR request reopens the encoder. When that fails, frames are
+	 * skipped and the open is retried every frame.
+	 *
+	 * @return ESP_OK while frames are encoded, ESP_ERR_INVALID_STATE after
+	 *         CAMERA_ENCODER_REOPEN_FAIL_FRAMES failed reopens in a row
+	 */
+	esp_err_t camera_encoder_get_status(void);
+
 	/**
 	 * @brief Register network feedback callback
 	 *
@@ -1,11 +1,24 @@
 #include "camera_encoder_common.h"
+#include "camera_encoder.h"
+#include "h264_parse.h"
+#include "h264_stats.h"
 #include "esp_log.h"
 #include "rtsp_server.h"
 #include "esp_heap_caps.h"
 #include <string.h>
+#include <inttypes.h>
 
 static const char *TAG = "encoder_common";
 
+// Bumped by any task; the encoder task owns the rest
+static uint32_t s_idr_requests;
+static uint32_t s_idr_seen;		// s_idr_requests when the current frame was started
+static uint32_t s_idr_answered; // Requests up to here were answered by an IDR
+static int64_t s_last_idr_us;
+static bool s_had_idr;
+static bool s_enc_closed;			 // Closed for an IDR and not reopened yet
+static uint32_t s_reopen_failures; // Failed opens in a row, read by any task
+
 void *alloc_aligned_buffer(size_t size, const char *name)
 {
 	uint8_t *buf = (uint8_t *)heap_caps_aligned_alloc(64, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
@@ -28,157 +41,126 @@ void *alloc_aligned_buffer(size_t size, const char *name)
 	return buf;
 }
 
-size_t find_h264_data_end(const uint8_t *data, size_t max_len)
+void update_param_sets(const uint8_t *data, const h264_nal_index_t *idx)
 {
-	// Search backwards for NAL start codes (00 00 00 01 or 00 00 01)
-	// Start from the end but leave room for a potential small NAL
-	for (size_t i = max_len - 10; i > 0; i--)
+	if (idx->sps < 0 || idx->pps < 0)
 	{
-		// Check for 00 00 00 01
-		if (i < max_len - 4 &&
-			data[i] == 0 && data[i + 1] == 0 &&
-			data[i + 2] == 0 && data[i + 3] == 1)
-		{
-			// Found a start code - data continues after this NAL
-			// Continue searching backwards
-		}
-
-		// Check for 00 00 01
-		if (i < max_len - 3 &&
-			data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
-		{
-			// Found a start code - see if there's more data after it
-			for (size_t j = i + 3; j < max_len; j++)
-			{
-				// If we find non-zero data after this start code, this might be valid data
-				if (data[j] != 0)
-				{
-					// Found potential data, continue from here
-					// Find the end by looking for the next zero region
-					for (size_t k = j; k < max_len; k++)
-					{
-						// Check if we hit a large zero region (padding)
-						if (data[k] == 0)
-						{
-							size_t zero_count = 0;
-							for (size_t z = k; z < max_len && data[z] == 0; z++)
-							{
-								zero_count++;
-							}
-							// If we have 8+ zeros, this is likely padding
-							if (zero_count >= 8)
-							{
-								return k;
-							}
-							k += zero_count - 1;
-						}
-					}
-					return max_len;
-				}
-			}
-		}
+		ESP_LOGD(TAG, "IDR without in-band SPS/PPS (%d NAL units)", idx->count);
+		return;
 	}
 
-	// Fallback: search for the last non-zero byte
-	for (size_t i = max_len - 1; i > 0; i--)
+	const h264_nal_t *sps = &idx->nals[idx->sps];
+	const h264_nal_t *pps = &idx->nals[idx->pps];
+	if (rtsp_set_sps_pps(data + sps->offset, sps->len, data + pps->offset, pps->len) != ESP_OK)
 	{
-		if (data[i] != 0)
-		{
-			// Round up to next 4-byte boundary for safety
-			return ((i + 4) & ~3);
-		}
+		ESP_LOGW(TAG, "SPS/PPS rejected (SPS=%u, PPS=%u bytes)", (unsigned)sps->len, (unsigned)pps->len);
 	}
-
-	return max_len;
 }
 
-void extract_sps_pps(const uint8_t *data, size_t len,
-					uint8_t *cached_sps, size_t *cached_sps_len,
-					uint8_t *cached_pps, size_t *cached_pps_len,
-					bool *sps_pps_sent)
+size_t prepend_sei_metadata(uint8_t *au, uint32_t frame, int64_t capture_us)
 {
-	if (*sps_pps_sent)
-		return;
+#if CONFIG_STREAM_SEI_METADATA
+	// Identifies the payload layout below to stream consumers
+	static const uint8_t uuid[16] = {0x6b, 0x1f, 0x3c, 0x52, 0x8e, 0x0d, 0x4a, 0x77,
+									 0x9b, 0x25, 0xc4, 0x10, 0x5e, 0xa8, 0x31, 0xd6};
+	uint8_t payload[12 + 64];
+	uint8_t sei[SEI_METADATA_HEADROOM - 4];
+	size_t n = 0;
+
+	payload[n++] = frame >> 24;
+	payload[n++] = frame >> 16;
+	payload[n++] = frame >> 8;
+	payload[n++] = frame;
+	for (int shift = 56; shift >= 0; shift -= 8)
+		payload[n++] = (uint64_t)capture_us >> shift;
+
+	size_t text_len = strnlen(CONFIG_STREAM_SEI_USER_STRING, sizeof(payload) - n);
+	memcpy(payload + n, CONFIG_STREAM_SEI_USER_STRING, text_len);
+	n += text_len;
+
+	size_t sei_len = h264_build_sei_user_data(uuid, payload, n, sei, sizeof(sei));
+	if (sei_len == 0)
+		return 0;
+
+	uint8_t *p = au - sei_len - 4;
+	p[0] = 0;
+	p[1] = 0;
+	p[2] = 0;
+	p[3] = 1;
+	memcpy(p + 4, sei, sei_len);
+	return sei_len + 4;
+#else
+	return 0;
+#endif
+}
 
-	const uint8_t *sps = NULL, *pps = NULL;
-	size_t sps_len = 0, pps_len = 0;
-	const uint8_t *nal = data;
+esp_err_t camera_encoder_get_vbr_stats(vbr_stats_t *stats)
+{
+	h264_stats_t h264;
+
+	if (!stats)
+		return ESP_ERR_INVALID_ARG;
+	if (!h264_stats_get(&h264))
+		return ESP_ERR_INVALID_STATE;
+
+	// Rate control runs at a fixed target; report what the encoder produced
+	memset(stats, 0, sizeof(*stats));
+	stats->current_bitrate = h264.bitrate;
+	stats->avg_frame_size = h264.second.avg_frame_size;
+	stats->motion_level = h264.motion_level;
+	stats->mode = VBR_MODE_CONSTANT;
+	return ESP_OK;
+}
 
-	ESP_LOGI(TAG, "Searching for SPS/PPS in %d bytes (first 16: %02x %02x %02x %02x %02x %02x %02x %02x...)",
-			 len, data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7]);
+void camera_encoder_request_idr(void)
+{
+	__atomic_add_fetch(&s_idr_requests, 1, __ATOMIC_RELAXED);
+}
 
-	while (nal < data + len - 4)
+esp_err_t idr_request_apply(esp_h264_enc_handle_t enc, int64_t now_us)
+{
+	s_idr_seen = __atomic_load_n(&s_idr_requests, __ATOMIC_RELAXED);
+	if (!s_enc_closed)
 	{
-		// Track start code position
-		const uint8_t *start_code = nal;
-		size_t start_code_len = 0;
-
-		if (nal[0] == 0 && nal[1] == 0 && nal[2] == 0 && nal[3] == 1)
-		{
-			start_code_len = 4;
-			nal += 4;
-		}
-		else if (nal[0] == 0 && nal[1] == 0 && nal[2] == 1)
-		{
-			start_code_len = 3;
-			nal += 3;
-		}
-		else
-		{
-			nal++;
-			continue;
-		}
-
-		uint8_t nal_type = nal[0] & 0x1F;
-		ESP_LOGI(TAG, "Found NAL type %d at offset %td", nal_type, nal - data);
-
-		if (nal_type == 7 && !sps)
-		{ // SPS
-			const uint8_t *end = nal;
-			while (end < data + len - 3)
-			{
-				if ((end[0] == 0 && end[1] == 0 && end[2] == 1) ||
-					(end[0] == 0 && end[1] == 0 && end[2] == 0 && end[3] == 1))
-					break;
-				end++;
-			}
-			sps = start_code; // Include start code
-			sps_len = end - start_code;
-			ESP_LOGI(TAG, "Found SPS: %d bytes at offset %td (start_code_len=%d)", sps_len, sps - data, start_code_len);
-		}
-		else if (nal_type == 8 && !pps)
-		{ // PPS
-			const uint8_t *end = nal;
-			while (end < data + len - 3)
-			{
-				if ((end[0] == 0 && end[1] == 0 && end[2] == 1) ||
-					(end[0] == 0 && end[1] == 0 && end[2] == 0 && end[3] == 1))
-					break;
-				end++;
-			}
-			pps = start_code; // Include start code
-			pps_len = end - start_code;
-			ESP_LOGI(TAG, "Found PPS: %d bytes at offset %td (start_code_len=%d)", pps_len, pps - data, start_code_len);
-		}
-
-		if (sps && pps)
-		{
-			// Cache locally for prepending to I-frames
-			*cached_sps_len = (sps_len <= 256) ? sps_len : 256;
-			*cached_pps_len = (pps_len <= 256) ? pps_len : 256;
-			memcpy(cached_sps, sps, *cached_sps_len);
-			memcpy(cached_pps, pps, *cached_pps_len);
-
-			// Also send to RTSP server for SDP
-			rtsp_set_sps_pps(sps, sps_len, pps, pps_len);
-			*sps_pps_sent = true;
-			ESP_LOGI(TAG, "Cached SPS/PPS: SPS=%d bytes, PPS=%d bytes", *cached_sps_len, *cached_pps_len);
-			break;
-		}
+		if (s_idr_seen == s_idr_answered)
+			return ESP_OK;
+		if (s_had_idr && now_us - s_last_idr_us < CAMERA_IDR_MIN_INTERVAL_MS * 1000LL)
+			return ESP_OK;
+
+		ESP_LOGD(TAG, "Forcing IDR for %" PRIu32 " request(s)", s_idr_seen - s_idr_answered);
+		esp_h264_enc_close(enc);
+		s_enc_closed = true;
 	}
 
-	if (!sps || !pps)
+	// A failed open leaves the encoder closed and the requests pending; the
+	// next frame tries again
+	if (esp_h264_enc_open(enc) != ESP_H264_ERR_OK)
 	{
-		ESP_LOGW(TAG, "SPS/PPS not complete (SPS=%p, PPS=%p)", sps, pps);
+		uint32_t failures = __atomic_add_fetch(&s_reopen_failures, 1, __ATOMIC_RELAXED);
+		if (failures == 1)
+			ESP_LOGE(TAG, "Failed to reopen encoder for IDR, retrying every frame");
+		else if (failures == CAMERA_ENCODER_REOPEN_FAIL_FRAMES)
+			ESP_LOGE(TAG, "Encoder not reopened in %" PRIu32 " attempts, no frames are encoded", failures);
+		return ESP_FAIL;
 	}
+	uint32_t failures = __atomic_exchange_n(&s_reopen_failures, 0, __ATOMIC_RELAXED);
+	if (failures > 0)
+		ESP_LOGW(TAG, "Encoder reopened after %" PRIu32 " failed attempts", failures);
+	s_enc_closed = false;
+	return ESP_OK;
+}
+
+esp_err_t camera_encoder_get_status(void)
+{
+	uint32_t failures = __atomic_load_n(&s_reopen_failures, __ATOMIC_RELAXED);
+	return failures >= CAMERA_ENCODER_REOPEN_FAIL_FRAMES ? ESP_ERR_INVALID_STATE : ESP_OK;
+}
+
+void idr_request_done(bool idr, int64_t now_us)
+{
+	if (!idr)
+		return;
+	s_idr_answered = s_idr_seen;
+	s_last_idr_us = now_us;
+	s_had_idr = true;
 }
@@ -4,12 +4,18 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "esp_err.h"
+#include "h264_nal.h"
+#include "esp_h264_enc_single_hw.h"
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
+// Bytes reserved in front of the encoder output for the metadata SEI
+#define SEI_METADATA_HEADROOM 256
+
 	/**
 	 * @brief Allocate aligned buffer for video data
 	 *
@@ -20,32 +26,57 @@ extern "C"
 	void *alloc_aligned_buffer(size_t size, const char *name);
 
 	/**
-	 * @brief Find actual H.264 data end in encoder output buffer
+	 * @brief Refresh the RTSP parameter-set store from an indexed access unit
 	 *
-	 * The H.264 encoder returns the buffer size, not the actual encoded size.
-	 * This function searches for the end of the last NAL unit.
+	 * Cheap enough to call on every IDR: the store compares the bytes and only
+	 * bumps its version, rebuilds the SDP and re-sends to clients on a change.
 	 *
 	 * @param data H.264 data buffer
-	 * @param max_len Maximum buffer size
-	 * @return Actual data length
+	 * @param idx NAL index of data
 	 */
-	size_t find_h264_data_end(const uint8_t *data, size_t max_len);
+	void update_param_sets(const uint8_t *data, const h264_nal_index_t *idx);
 
 	/**
-	 * @brief Extract SPS and PPS from H.264 data
+	 * @brief Write the per-frame metadata SEI in front of an encoded frame
 	 *
-	 * @param data H.264 data buffer
-	 * @param len Data length
-	 * @param cached_sps Buffer to cache SPS
-	 * @param cached_sps_len Pointer to SPS length
-	 * @param cached_pps Buffer to cache PPS
-	 * @param cached_pps_len Pointer to PPS length
-	 * @param sps_pps_sent Pointer to flag indicating SPS/PPS were sent
+	 * The SEI (user_data_unregistered) carries, after its UUID, the frame
+	 * number (32-bit big endian), the capture time in microseconds (64-bit
+	 * big endian) and CONFIG_STREAM_SEI_USER_STRING. It is written with a
+	 * 4-byte start code so that it ends right at au, which needs
+	 * SEI_METADATA_HEADROOM writable bytes in front of it.
+	 *
+	 * @param au Start of the encoded access unit
+	 * @param frame Frame number
+	 * @param capture_us Capture timestamp in microseconds
+	 * @return Bytes written before au, 0 if metadata SEI is disabled
+	 */
+	size_t prepend_sei_metadata(uint8_t *au, uint32_t frame, int64_t capture_us);
+
+	/**
+	 * @brief Apply pending IDR requests before a frame is encoded
+	 *
+	 * The hardware encoder has no keyframe control, so a due request
+	 * reopens it, which restarts the GOP with an IDR.
+	 *
+	 * If the encoder does not open again it stays closed and the requests
+	 * stay pending: the caller skips the frame, and the next call retries.
+	 *
+	 * @param enc Encoder
+	 * @param now_us Capture time of the frame about to be encoded
+	 * @return ESP_OK to encode the frame, ESP_FAIL if the encoder is closed
+	 */
+	esp_err_t idr_request_apply(esp_h264_enc_handle_t enc, int64_t now_us);
+
+	/**
+	 * @brief Record the type of the frame just encoded
+	 *
+	 * An IDR, forced or not, answers every request made before the matching
+	 * idr_request_apply() call and starts the minimum interval.
+	 *
+	 * @param idr Frame is an IDR
+	 * @param now_us Capture time of the frame
 	 */
-	void extract_sps_pps(const uint8_t *data, size_t len,
-						uint8_t *cached_sps, size_t *cached_sps_len,
-						uint8_t *cached_pps, size_t *cached_pps_len,
-						bool *sps_pps_sent);
+	void idr_request_done(bool idr, int64_t now_us);
 
 #ifdef __cplusplus
 }
@@ -2,9 +2,11 @@
 #include "camera_drawer.h"
 #include "camera_encoder_common.h"
 #include "rtsp_server.h"
+#include "h264_stats.h"
 #include "esp_h264_enc_single_hw.h"
 #include "esp_heap_caps.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include <stdio.h>
@@ -23,9 +25,7 @@ static uint8_t *s_h264_buf = NULL;
 static size_t s_h264_buf_size;
 static TaskHandle_t s_pattern_task = NULL;
 static bool s_pattern_running = false;
-static bool s_sps_pps_sent;
-static uint8_t s_cached_sps[256], s_cached_pps[256];
-static size_t s_cached_sps_len = 0, s_cached_pps_len = 0;
+static h264_nal_index_t s_nal_index;
 
 /**
  * @brief Fill a region with white background (for text area)
@@ -116,7 +116,9 @@ static void pattern_task(void *arg)
 	while (s_pattern_running)
 	{
 		vTaskDelayUntil(&last_time, pdMS_TO_TICKS(1000 / CAM_FPS));
+		int64_t capture_us = esp_timer_get_time();
 
+#if CONFIG_STREAM_TEXT_OVERLAY
 		// Fill white background for text area
 		fill_white_background(yuv, CAM_WIDTH, CAM_HEIGHT, 32, 32, 360, 52);
 
@@ -127,23 +129,34 @@ static void pattern_task(void *arg)
 		char frame_text[64];
 		snprintf(frame_text, sizeof(frame_text), "1920x1080 30 FPS #%lu", (unsigned long)frame);
 		draw_text(yuv, CAM_WIDTH, CAM_HEIGHT, frame_text, 32, 60, 16, 128, 128);
+#endif
 
-		// Pass O_UYY_E_VYY format to encoder
+		// Pass O_UYY_E_VYY format to encoder; the headroom takes the metadata SEI
+		uint8_t *au = s_h264_buf + SEI_METADATA_HEADROOM;
 		esp_h264_enc_in_frame_t in = {.raw_data = {.buffer = yuv, .len = yuv_size}};
-		esp_h264_enc_out_frame_t out = {.raw_data = {.buffer = s_h264_buf, .len = s_h264_buf_size}};
+		esp_h264_enc_out_frame_t out = {.raw_data = {.buffer = au, .len = s_h264_buf_size}};
+
+		// The encoder is closed after a failed reopen for an IDR; skip the frame
+		if (idr_request_apply(s_encoder, capture_us) != ESP_OK)
+			continue;
 
 		if (esp_h264_enc_process(s_encoder, &in, &out) == ESP_H264_ERR_OK && out.raw_data.len > 0)
 		{
-			size_t len = find_h264_data_end(out.raw_data.buffer, out.raw_data.len);
-
-			if (frame == 0)
+			size_t len = h264_frame_length(au, out.length, out.raw_data.len);
+			size_t sei_len = prepend_sei_metadata(au, frame, capture_us);
+			const uint8_t *data = au - sei_len;
+			len += sei_len;
+			h264_nal_index_build(data, len, &s_nal_index);
+			h264_stats_record(data, &s_nal_index, capture_us);
+			idr_request_done(s_nal_index.idr, capture_us);
+
+			if (s_nal_index.idr)
 			{
-				extract_sps_pps(out.raw_data.buffer, len, s_cached_sps, &s_cached_sps_len,
-								s_cached_pps, &s_cached_pps_len, &s_sps_pps_sent);
+				update_param_sets(data, &s_nal_index);
 			}
 
 			uint32_t ts = frame * (90000 / CAM_FPS);
-			rtsp_send_h264_frame(out.raw_data.buffer, len, ts);
+			rtsp_send_h264_nals(data, &s_nal_index, ts);
 			frame++;
 		}
 	}
@@ -158,7 +171,7 @@ esp_err_t pattern_init(void)
 	ESP_LOGI(TAG, "Initializing pattern");
 
 	s_h264_buf_size = 3072 * 1024;
-	s_h264_buf = alloc_aligned_buffer(s_h264_buf_size, "H264 buffer");
+	s_h264_buf = alloc_aligned_buffer(s_h264_buf_size + SEI_METADATA_HEADROOM, "H264 buffer");
 	if (!s_h264_buf)
 		return ESP_ERR_NO_MEM;
 
@@ -173,6 +186,7 @@ esp_err_t pattern_init(void)
 		return ESP_FAIL;
 	if (esp_h264_enc_open(s_encoder) != ESP_H264_ERR_OK)
 		return ESP_FAIL;
+	rtsp_set_framerate(CAM_FPS);
 
 	return ESP_OK;
 }
@@ -0,0 +1,78 @@
+#include "frame_store.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include <string.h>
+
+static const char *TAG = "frame_store";
+
+static uint32_t s_frames;
+static uint32_t s_bytes;
+static uint32_t s_peak_bytes;
+static uint32_t s_drops;
+
+stream_frame_t *frame_store_put(const uint8_t *data, const h264_nal_index_t *idx, uint32_t ts, int64_t capture_us)
+{
+	size_t size = sizeof(stream_frame_t) + idx->len;
+	uint32_t budget = CONFIG_STREAM_FRAME_STORE_KB * 1024;
+
+	// Reserve the bytes first so concurrent producers cannot overshoot
+	uint32_t bytes = __atomic_add_fetch(&s_bytes, size, __ATOMIC_RELAXED);
+	if (bytes > budget)
+	{
+		__atomic_sub_fetch(&s_bytes, size, __ATOMIC_RELAXED);
+		if (__atomic_fetch_add(&s_drops, 1, __ATOMIC_RELAXED) % 100 == 0)
+			ESP_LOGW(TAG, "Budget of %d KB exhausted, frame dropped", CONFIG_STREAM_FRAME_STORE_KB);
+		return NULL;
+	}
+
+	stream_frame_t *f = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+	if (!f)
+	{
+		__atomic_sub_fetch(&s_bytes, size, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&s_drops, 1, __ATOMIC_RELAXED);
+		ESP_LOGW(TAG, "Out of memory for %u byte frame", (unsigned)size);
+		return NULL;
+	}
+
+	// Data follows the header in the same allocation
+	f->data = (uint8_t *)(f + 1);
+	f->len = idx->len;
+	memcpy(f->data, data, f->len);
+	f->idx = *idx;
+	f->ts = ts;
+	f->capture_us = capture_us;
+	f->refs = 1;
+
+	__atomic_add_fetch(&s_frames, 1, __ATOMIC_RELAXED);
+	uint32_t peak = __atomic_load_n(&s_peak_bytes, __ATOMIC_RELAXED);
+	while (bytes > peak && !__atomic_compare_exchange_n(&s_peak_bytes, &peak, bytes, true,
+														 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	return f;
+}
+
+stream_frame_t *frame_ref(stream_frame_t *f)
+{
+	__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+	return f;
+}
+
+void frame_unref(stream_frame_t *f)
+{
+	if (!f)
+		return;
+	if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	__atomic_sub_fetch(&s_bytes, sizeof(stream_frame_t) + f->len, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&s_frames, 1, __ATOMIC_RELAXED);
+	heap_caps_free(f);
+}
+
+void frame_store_get_stats(frame_store_stats_t *stats)
+{
+	stats->frames = __atomic_load_n(&s_frames, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&s_bytes, __ATOMIC_RELAXED);
+	stats->peak_bytes = __atomic_load_n(&s_peak_bytes, __ATOMIC_RELAXED);
+	stats->drops = __atomic_load_n(&s_drops, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,80 @@
+#ifndef FRAME_STORE_H
+#define FRAME_STORE_H
+
+#include "esp_err.h"
+#include "h264_nal.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	/**
+	 * @brief Encoded access unit kept beyond the encode callback
+	 *
+	 * One copy in PSRAM shared by every consumer; freed when the last
+	 * reference is dropped.
+	 */
+	typedef struct
+	{
+		uint8_t *data;		  // Annex-B access unit
+		size_t len;
+		h264_nal_index_t idx; // NAL index of data
+		uint32_t ts;		  // RTP timestamp
+		int64_t capture_us;
+		uint32_t refs;
+	} stream_frame_t;
+
+	/**
+	 * @brief Frame store usage
+	 */
+	typedef struct
+	{
+		uint32_t frames;	// Frames alive
+		uint32_t bytes;		// Bytes alive, headers included
+		uint32_t peak_bytes;
+		uint32_t drops;		// Frames refused for lack of budget or memory
+	} frame_store_stats_t;
+
+	/**
+	 * @brief Copy an access unit into the store
+	 *
+	 * @param data Annex-B access unit
+	 * @param idx NAL index of data; its len bytes are copied
+	 * @param ts RTP timestamp
+	 * @param capture_us Capture time in microseconds
+	 * @return Frame holding one reference, NULL if the budget
+	 *         (CONFIG_STREAM_FRAME_STORE_KB) or memory is exhausted
+	 */
+	stream_frame_t *frame_store_put(const uint8_t *data, const h264_nal_index_t *idx, uint32_t ts, int64_t capture_us);
+
+	/**
+	 * @brief Take another reference to a frame
+	 *
+	 * @param f Frame
+	 * @return f
+	 */
+	stream_frame_t *frame_ref(stream_frame_t *f);
+
+	/**
+	 * @brief Drop a reference; the frame is freed with the last one
+	 *
+	 * @param f Frame, NULL is ignored
+	 */
+	void frame_unref(stream_frame_t *f);
+
+	/**
+	 * @brief Get frame store usage
+	 *
+	 * @param stats Usage copy
+	 */
+	void frame_store_get_stats(frame_store_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FRAME_STORE_H
@@ -0,0 +1,166 @@
+#include "h264_nal.h"
+#include "esp_log.h"
+#include <string.h>
+
+static const char *TAG = "h264_nal";
+
+// Native word for the zero-byte test: 64-bit on the host, 32-bit on the ESP32-P4
+#if UINTPTR_MAX > 0xFFFFFFFFu
+typedef uint64_t nal_word_t;
+#define NAL_WORD_ONES 0x0101010101010101ULL
+#define NAL_WORD_HIGHS 0x8080808080808080ULL
+#else
+typedef uint32_t nal_word_t;
+#define NAL_WORD_ONES 0x01010101UL
+#define NAL_WORD_HIGHS 0x80808080UL
+#endif
+
+// Non-zero if any byte of the word is zero
+#define NAL_WORD_HAS_ZERO(w) (((w) - NAL_WORD_ONES) & ~(w) & NAL_WORD_HIGHS)
+
+// Zero run that marks the end of encoded data in the output buffer
+#define H264_PADDING_ZEROS 8
+
+const uint8_t *h264_find_start_code(const uint8_t *p, const uint8_t *end)
+{
+	// Byte loop up to the first aligned word
+	while (p + 3 <= end && ((uintptr_t)p & (sizeof(nal_word_t) - 1)))
+	{
+		if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+			return p;
+		p++;
+	}
+
+	// A start code beginning inside a word puts a zero byte in that word,
+	// so words without zero bytes are skipped whole. The two bytes after
+	// the word must be readable for the candidates found in it.
+	while (p + sizeof(nal_word_t) + 2 <= end)
+	{
+		nal_word_t w;
+		memcpy(&w, __builtin_assume_aligned(p, sizeof(nal_word_t)), sizeof(w));
+		if (NAL_WORD_HAS_ZERO(w))
+		{
+			for (size_t i = 0; i < sizeof(nal_word_t); i++)
+			{
+				if (p[i] == 0 && p[i + 1] == 0 && p[i + 2] == 1)
+					return p + i;
+			}
+		}
+		p += sizeof(nal_word_t);
+	}
+
+	for (; p + 3 <= end; p++)
+	{
+		if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+			return p;
+	}
+	return end;
+}
+
+size_t h264_nal_index_build(const uint8_t *data, size_t len, h264_nal_index_t *idx)
+{
+	const uint8_t *end = data + len;
+
+	idx->count = 0;
+	idx->idr = false;
+	idx->sps = -1;
+	idx->pps = -1;
+	idx->len = len;
+
+	const uint8_t *sc = h264_find_start_code(data, end);
+	while (sc < end)
+	{
+		const uint8_t *nal = sc + 3;
+		const uint8_t *next = h264_find_start_code(nal, end);
+
+		// Drop trailing_zero_8bits and the zero_byte of a following 4-byte start code
+		const uint8_t *nal_end = next;
+		while (nal_end > nal && nal_end[-1] == 0)
+			nal_end--;
+
+		if (nal_end > nal)
+		{
+			if (idx->count == H264_NAL_INDEX_MAX)
+			{
+				ESP_LOGW(TAG, "NAL index full (%d), ignoring rest of access unit", H264_NAL_INDEX_MAX);
+				break;
+			}
+
+			h264_nal_t *n = &idx->nals[idx->count];
+			n->offset = nal - data;
+			n->len = nal_end - nal;
+			n->type = nal[0] & 0x1F;
+			n->ref_idc = (nal[0] >> 5) & 0x03;
+			n->idr = (n->type == H264_NAL_IDR);
+
+			if (n->idr)
+				idx->idr = true;
+			else if (n->type == H264_NAL_SPS && idx->sps < 0)
+				idx->sps = idx->count;
+			else if (n->type == H264_NAL_PPS && idx->pps < 0)
+				idx->pps = idx->count;
+			idx->count++;
+		}
+		sc = next;
+	}
+
+	return idx->count;
+}
+
+size_t h264_start_code_len(const uint8_t *data, size_t len)
+{
+	if (len >= 4 && data[0] == 0 && data[1] == 0 && data[2] == 0 && data[3] == 1)
+		return 4;
+	if (len >= 3 && data[0] == 0 && data[1] == 0 && data[2] == 1)
+		return 3;
+	return 0;
+}
+
+/**
+ * @brief Find the first run of H264_PADDING_ZEROS zero bytes
+ *
+ * Emulation prevention keeps 00 00 00 out of NAL payloads and a 4-byte start
+ * code adds one more zero, so such a run can only be padding. Any run of 8
+ * zeros covers an aligned 32-bit word, so only aligned words are tested.
+ */
+static size_t find_padding(const uint8_t *data, size_t len)
+{
+	const uint8_t *end = data + len;
+	const uint8_t *p = data + ((4 - ((uintptr_t)data & 3)) & 3);
+
+	for (; p + 4 <= end; p += 4)
+	{
+		uint32_t w;
+		memcpy(&w, __builtin_assume_aligned(p, 4), sizeof(w));
+		if (w != 0)
+			continue;
+
+		const uint8_t *run = p;
+		while (run > data && run[-1] == 0)
+			run--;
+		const uint8_t *run_end = p + 4;
+		while (run_end < end && *run_end == 0 && run_end - run < H264_PADDING_ZEROS)
+			run_end++;
+		if (run_end - run >= H264_PADDING_ZEROS)
+			return run - data;
+	}
+	return len;
+}
+
+size_t h264_frame_length(const uint8_t *data, size_t reported, size_t buf_size)
+{
+	static bool s_scan_logged = false;
+
+	// A length equal to the buffer size is the buffer size, not the frame size
+	if (reported > 0 && reported < buf_size && h264_start_code_len(data, reported) != 0)
+		return reported;
+
+	size_t len = find_padding(data, buf_size);
+	if (!s_scan_logged)
+	{
+		ESP_LOGW(TAG, "Encoder length %u not usable, scanning for padding (found %u bytes)",
+				 (unsigned)reported, (unsigned)len);
+		s_scan_logged = true;
+	}
+	return len;
+}
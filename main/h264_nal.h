@@ -0,0 +1,97 @@
+#ifndef H264_NAL_H
+#define H264_NAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define H264_NAL_SLICE 1
+#define H264_NAL_IDR 5
+#define H264_NAL_SEI 6
+#define H264_NAL_SPS 7
+#define H264_NAL_PPS 8
+#define H264_NAL_AUD 9
+
+// Hardware encoder emits SPS, PPS and one slice per picture; leave headroom
+#define H264_NAL_INDEX_MAX 32
+
+	/**
+	 * @brief Descriptor of one NAL unit inside an Annex-B buffer
+	 */
+	typedef struct
+	{
+		uint32_t offset; // Offset of the NAL header byte (start code excluded)
+		uint32_t len;	 // NAL length without start code and trailing zero bytes
+		uint8_t type;	 // nal_unit_type
+		uint8_t ref_idc; // nal_ref_idc
+		bool idr;		 // IDR slice (type 5)
+	} h264_nal_t;
+
+	/**
+	 * @brief NAL units of one encoder output, built by a single scan
+	 */
+	typedef struct
+	{
+		h264_nal_t nals[H264_NAL_INDEX_MAX];
+		uint8_t count;
+		bool idr;		// Access unit contains an IDR slice
+		int8_t sps;		// Index of the first SPS in nals[], -1 if none
+		int8_t pps;		// Index of the first PPS in nals[], -1 if none
+		size_t len;		// Bytes of the access unit indexed
+	} h264_nal_index_t;
+
+	/**
+	 * @brief Find the next Annex-B start code prefix (00 00 01)
+	 *
+	 * Skips a machine word at a time while the word holds no zero byte.
+	 * A 4-byte start code is found at its last three bytes.
+	 *
+	 * @param p Search start
+	 * @param end End of the buffer
+	 * @return Pointer to the first zero of the prefix, or end if none
+	 */
+	const uint8_t *h264_find_start_code(const uint8_t *p, const uint8_t *end);
+
+	/**
+	 * @brief Index all NAL units of an Annex-B buffer in one pass
+	 *
+	 * @param data Annex-B data (3- or 4-byte start codes)
+	 * @param len Data length
+	 * @param idx Index to fill
+	 * @return Number of NAL units found
+	 */
+	size_t h264_nal_index_build(const uint8_t *data, size_t len, h264_nal_index_t *idx);
+
+	/**
+	 * @brief Get the length of the encoded data in an encoder output buffer
+	 *
+	 * Uses the length reported by the encoder when it is plausible. Otherwise
+	 * scans forward for the zero padding after the last NAL unit, so the cost
+	 * follows the frame size instead of the buffer size.
+	 *
+	 * @param data Encoder output buffer
+	 * @param reported Length reported by the encoder
+	 * @param buf_size Output buffer size
+	 * @return Encoded data length
+	 */
+	size_t h264_frame_length(const uint8_t *data, size_t reported, size_t buf_size);
+
+	/**
+	 * @brief Get the length of the start code at the beginning of a buffer
+	 *
+	 * @param data Data buffer
+	 * @param len Data length
+	 * @return 4 or 3 for a start code, 0 if the buffer starts with a raw NAL
+	 */
+	size_t h264_start_code_len(const uint8_t *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // H264_NAL_H
@@ -0,0 +1,720 @@
+#include "h264_parse.h"
+#include "h264_nal.h"
+#include <string.h>
+
+typedef struct
+{
+	const uint8_t *buf;
+	size_t size; // In bits
+	size_t pos;	 // In bits
+	bool overrun;
+} bit_reader_t;
+
+typedef struct
+{
+	uint8_t *buf;
+	size_t size; // In bits
+	size_t pos;	 // In bits
+	bool overrun;
+} bit_writer_t;
+
+/**
+ * @brief Remove emulation prevention bytes (00 00 03 -> 00 00)
+ *
+ * @return RBSP length, or 0 if it does not fit
+ */
+static size_t nal_to_rbsp(const uint8_t *nal, size_t len, uint8_t *rbsp, size_t cap)
+{
+	size_t out = 0;
+	int zeros = 0;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		if (zeros >= 2 && nal[i] == 3)
+		{
+			zeros = 0;
+			continue;
+		}
+		if (out == cap)
+			return 0;
+		rbsp[out++] = nal[i];
+		zeros = (nal[i] == 0) ? zeros + 1 : 0;
+	}
+	return out;
+}
+
+/**
+ * @brief Insert emulation prevention bytes (00 00 0x -> 00 00 03 0x)
+ *
+ * @return NAL length, or 0 if it does not fit
+ */
+static size_t rbsp_to_nal(const uint8_t *rbsp, size_t len, uint8_t *nal, size_t cap)
+{
+	size_t out = 0;
+	int zeros = 0;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		if (zeros >= 2 && rbsp[i] <= 3)
+		{
+			if (out == cap)
+				return 0;
+			nal[out++] = 3;
+			zeros = 0;
+		}
+		if (out == cap)
+			return 0;
+		nal[out++] = rbsp[i];
+		zeros = (rbsp[i] == 0) ? zeros + 1 : 0;
+	}
+	return out;
+}
+
+static uint32_t read_bits(bit_reader_t *br, int n)
+{
+	uint32_t val = 0;
+
+	if (br->pos + n > br->size)
+	{
+		br->overrun = true;
+		br->pos = br->size;
+		return 0;
+	}
+	for (int i = 0; i < n; i++)
+	{
+		val = (val << 1) | ((br->buf[br->pos >> 3] >> (7 - (br->pos & 7))) & 1);
+		br->pos++;
+	}
+	return val;
+}
+
+static bool read_flag(bit_reader_t *br)
+{
+	return read_bits(br, 1) != 0;
+}
+
+// Exp-Golomb ue(v)
+static uint32_t read_ue(bit_reader_t *br)
+{
+	int zeros = 0;
+
+	while (!read_bits(br, 1))
+	{
+		if (br->overrun || ++zeros > 31)
+		{
+			br->overrun = true;
+			return 0;
+		}
+	}
+	return ((1u << zeros) - 1) + read_bits(br, zeros);
+}
+
+// Exp-Golomb se(v)
+static int32_t read_se(bit_reader_t *br)
+{
+	uint32_t k = read_ue(br);
+	return (k & 1) ? (int32_t)((k + 1) / 2) : -(int32_t)(k / 2);
+}
+
+static void write_bits(bit_writer_t *bw, uint32_t val, int n)
+{
+	if (bw->pos + n > bw->size)
+	{
+		bw->overrun = true;
+		return;
+	}
+	for (int i = n - 1; i >= 0; i--)
+	{
+		uint8_t *byte = &bw->buf[bw->pos >> 3];
+		uint8_t mask = 0x80 >> (bw->pos & 7);
+		*byte = ((val >> i) & 1) ? (*byte | mask) : (*byte & ~mask);
+		bw->pos++;
+	}
+}
+
+static void write_flag(bit_writer_t *bw, bool flag)
+{
+	write_bits(bw, flag ? 1 : 0, 1);
+}
+
+static void write_ue(bit_writer_t *bw, uint32_t val)
+{
+	uint64_t code = (uint64_t)val + 1;
+	int bits = 0;
+
+	while ((code >> bits) > 1)
+		bits++;
+	write_bits(bw, 0, bits);
+	// Leading one plus the info bits; split to stay within 32 bits
+	write_bits(bw, 1, 1);
+	write_bits(bw, (uint32_t)(code & ((1ULL << bits) - 1)), bits);
+}
+
+static void skip_scaling_list(bit_reader_t *br, int size)
+{
+	int32_t last = 8, next = 8;
+
+	for (int j = 0; j < size && !br->overrun; j++)
+	{
+		if (next != 0)
+		{
+			next = (last + read_se(br) + 256) % 256;
+		}
+		last = (next == 0) ? last : next;
+	}
+}
+
+static void skip_hrd_parameters(bit_reader_t *br)
+{
+	uint32_t cpb_cnt = read_ue(br) + 1;
+
+	read_bits(br, 4); // bit_rate_scale
+	read_bits(br, 4); // cpb_size_scale
+	for (uint32_t i = 0; i < cpb_cnt && !br->overrun; i++)
+	{
+		read_ue(br); // bit_rate_value_minus1
+		read_ue(br); // cpb_size_value_minus1
+		read_flag(br); // cbr_flag
+	}
+	read_bits(br, 5); // initial_cpb_removal_delay_length_minus1
+	read_bits(br, 5); // cpb_removal_delay_length_minus1
+	read_bits(br, 5); // dpb_output_delay_length_minus1
+	read_bits(br, 5); // time_offset_length
+}
+
+static void parse_vui(bit_reader_t *br, h264_vui_t *vui)
+{
+	vui->aspect_ratio_info_present = read_flag(br);
+	if (vui->aspect_ratio_info_present)
+	{
+		vui->aspect_ratio_idc = read_bits(br, 8);
+		if (vui->aspect_ratio_idc == 255) // Extended_SAR
+		{
+			vui->sar_width = read_bits(br, 16);
+			vui->sar_height = read_bits(br, 16);
+		}
+	}
+
+	vui->overscan_info_present = read_flag(br);
+	if (vui->overscan_info_present)
+		vui->overscan_appropriate = read_flag(br);
+
+	vui->video_signal_type_present = read_flag(br);
+	if (vui->video_signal_type_present)
+	{
+		vui->video_format = read_bits(br, 3);
+		vui->video_full_range = read_flag(br);
+		vui->colour_description_present = read_flag(br);
+		if (vui->colour_description_present)
+		{
+			vui->colour_primaries = read_bits(br, 8);
+			vui->transfer_characteristics = read_bits(br, 8);
+			vui->matrix_coefficients = read_bits(br, 8);
+		}
+	}
+
+	vui->chroma_loc_info_present = read_flag(br);
+	if (vui->chroma_loc_info_present)
+	{
+		vui->chroma_sample_loc_top = read_ue(br);
+		vui->chroma_sample_loc_bottom = read_ue(br);
+	}
+
+	vui->timing_info_present = read_flag(br);
+	if (vui->timing_info_present)
+	{
+		vui->num_units_in_tick = read_bits(br, 32);
+		vui->time_scale = read_bits(br, 32);
+		vui->fixed_frame_rate = read_flag(br);
+	}
+
+	vui->nal_hrd_present = read_flag(br);
+	if (vui->nal_hrd_present)
+		skip_hrd_parameters(br);
+	vui->vcl_hrd_present = read_flag(br);
+	if (vui->vcl_hrd_present)
+		skip_hrd_parameters(br);
+	if (vui->nal_hrd_present || vui->vcl_hrd_present)
+		vui->low_delay_hrd = read_flag(br);
+
+	vui->pic_struct_present = read_flag(br);
+	vui->bitstream_restriction = read_flag(br);
+	if (vui->bitstream_restriction)
+	{
+		vui->motion_vectors_over_pic_boundaries = read_flag(br);
+		vui->max_bytes_per_pic_denom = read_ue(br);
+		vui->max_bits_per_mb_denom = read_ue(br);
+		vui->log2_max_mv_length_horizontal = read_ue(br);
+		vui->log2_max_mv_length_vertical = read_ue(br);
+		vui->max_num_reorder_frames = read_ue(br);
+		vui->max_dec_frame_buffering = read_ue(br);
+	}
+}
+
+static void write_vui(bit_writer_t *bw, const h264_vui_t *vui)
+{
+	write_flag(bw, vui->aspect_ratio_info_present);
+	if (vui->aspect_ratio_info_present)
+	{
+		write_bits(bw, vui->aspect_ratio_idc, 8);
+		if (vui->aspect_ratio_idc == 255)
+		{
+			write_bits(bw, vui->sar_width, 16);
+			write_bits(bw, vui->sar_height, 16);
+		}
+	}
+
+	write_flag(bw, vui->overscan_info_present);
+	if (vui->overscan_info_present)
+		write_flag(bw, vui->overscan_appropriate);
+
+	write_flag(bw, vui->video_signal_type_present);
+	if (vui->video_signal_type_present)
+	{
+		write_bits(bw, vui->video_format, 3);
+		write_flag(bw, vui->video_full_range);
+		write_flag(bw, vui->colour_description_present);
+		if (vui->colour_description_present)
+		{
+			write_bits(bw, vui->colour_primaries, 8);
+			write_bits(bw, vui->transfer_characteristics, 8);
+			write_bits(bw, vui->matrix_coefficients, 8);
+		}
+	}
+
+	write_flag(bw, vui->chroma_loc_info_present);
+	if (vui->chroma_loc_info_present)
+	{
+		write_ue(bw, vui->chroma_sample_loc_top);
+		write_ue(bw, vui->chroma_sample_loc_bottom);
+	}
+
+	write_flag(bw, vui->timing_info_present);
+	if (vui->timing_info_present)
+	{
+		write_bits(bw, vui->num_units_in_tick, 32);
+		write_bits(bw, vui->time_scale, 32);
+		write_flag(bw, vui->fixed_frame_rate);
+	}
+
+	// HRD parameters are never written; the rewriter refuses SPSs that carry them
+	write_flag(bw, false); // nal_hrd_parameters_present_flag
+	write_flag(bw, false); // vcl_hrd_parameters_present_flag
+	write_flag(bw, vui->pic_struct_present);
+
+	write_flag(bw, vui->bitstream_restriction);
+	if (vui->bitstream_restriction)
+	{
+		write_flag(bw, vui->motion_vectors_over_pic_boundaries);
+		write_ue(bw, vui->max_bytes_per_pic_denom);
+		write_ue(bw, vui->max_bits_per_mb_denom);
+		write_ue(bw, vui->log2_max_mv_length_horizontal);
+		write_ue(bw, vui->log2_max_mv_length_vertical);
+		write_ue(bw, vui->max_num_reorder_frames);
+		write_ue(bw, vui->max_dec_frame_buffering);
+	}
+}
+
+/**
+ * @brief Parse SPS fields from RBSP data
+ *
+ * @param vui_pos Set to the bit position of vui_parameters_present_flag
+ */
+static esp_err_t parse_sps_rbsp(const uint8_t *rbsp, size_t rbsp_len, h264_sps_t *sps, size_t *vui_pos)
+{
+	bit_reader_t br = {.buf = rbsp, .size = rbsp_len * 8};
+	memset(sps, 0, sizeof(*sps));
+
+	sps->profile_idc = read_bits(&br, 8);
+	sps->constraint_flags = read_bits(&br, 8);
+	sps->level_idc = read_bits(&br, 8);
+	sps->sps_id = read_ue(&br);
+	sps->chroma_format_idc = 1;
+
+	switch (sps->profile_idc)
+	{
+	case 100: case 110: case 122: case 244: case 44:
+	case 83: case 86: case 118: case 128: case 138:
+	case 139: case 134: case 135:
+		sps->chroma_format_idc = read_ue(&br);
+		if (sps->chroma_format_idc == 3)
+			sps->separate_colour_plane = read_flag(&br);
+		read_ue(&br);	// bit_depth_luma_minus8
+		read_ue(&br);	// bit_depth_chroma_minus8
+		read_flag(&br); // qpprime_y_zero_transform_bypass_flag
+		if (read_flag(&br)) // seq_scaling_matrix_present_flag
+		{
+			int lists = (sps->chroma_format_idc != 3) ? 8 : 12;
+			for (int i = 0; i < lists; i++)
+			{
+				if (read_flag(&br))
+					skip_scaling_list(&br, i < 6 ? 16 : 64);
+			}
+		}
+		break;
+	default:
+		break;
+	}
+
+	sps->log2_max_frame_num = read_ue(&br) + 4;
+	sps->poc_type = read_ue(&br);
+	if (sps->poc_type == 0)
+	{
+		sps->log2_max_poc_lsb = read_ue(&br) + 4;
+	}
+	else if (sps->poc_type == 1)
+	{
+		sps->delta_pic_order_always_zero = read_flag(&br);
+		read_se(&br); // offset_for_non_ref_pic
+		read_se(&br); // offset_for_top_to_bottom_field
+		uint32_t cycle = read_ue(&br);
+		for (uint32_t i = 0; i < cycle && !br.overrun; i++)
+			read_se(&br); // offset_for_ref_frame
+	}
+
+	sps->max_num_ref_frames = read_ue(&br);
+	read_flag(&br); // gaps_in_frame_num_value_allowed_flag
+	sps->pic_width_in_mbs = read_ue(&br) + 1;
+	sps->pic_height_in_map_units = read_ue(&br) + 1;
+	sps->frame_mbs_only = read_flag(&br);
+	if (!sps->frame_mbs_only)
+		read_flag(&br); // mb_adaptive_frame_field_flag
+	read_flag(&br);		// direct_8x8_inference_flag
+
+	if (read_flag(&br)) // frame_cropping_flag
+	{
+		sps->crop_left = read_ue(&br);
+		sps->crop_right = read_ue(&br);
+		sps->crop_top = read_ue(&br);
+		sps->crop_bottom = read_ue(&br);
+	}
+
+	*vui_pos = br.pos;
+	sps->vui_present = read_flag(&br);
+	if (sps->vui_present)
+		parse_vui(&br, &sps->vui);
+
+	if (br.overrun)
+		return ESP_ERR_INVALID_SIZE;
+
+	// Crop units depend on chroma subsampling (7.4.2.1.1)
+	uint32_t chroma_array_type = sps->separate_colour_plane ? 0 : sps->chroma_format_idc;
+	uint32_t sub_width_c = (chroma_array_type == 1 || chroma_array_type == 2) ? 2 : 1;
+	uint32_t sub_height_c = (chroma_array_type == 1) ? 2 : 1;
+	uint32_t crop_unit_x = chroma_array_type ? sub_width_c : 1;
+	uint32_t crop_unit_y = (chroma_array_type ? sub_height_c : 1) * (2 - sps->frame_mbs_only);
+
+	sps->width = sps->pic_width_in_mbs * 16 - crop_unit_x * (sps->crop_left + sps->crop_right);
+	sps->height = (2 - sps->frame_mbs_only) * sps->pic_height_in_map_units * 16 -
+				  crop_unit_y * (sps->crop_top + sps->crop_bottom);
+	return ESP_OK;
+}
+
+esp_err_t h264_parse_sps(const uint8_t *nal, size_t len, h264_sps_t *sps)
+{
+	uint8_t rbsp[H264_PARAM_SET_MAX];
+	size_t vui_pos;
+
+	if (!nal || len < 4 || (nal[0] & 0x1F) != H264_NAL_SPS)
+		return ESP_ERR_INVALID_ARG;
+
+	size_t rbsp_len = nal_to_rbsp(nal + 1, len - 1, rbsp, sizeof(rbsp));
+	if (rbsp_len == 0)
+		return ESP_ERR_INVALID_SIZE;
+
+	return parse_sps_rbsp(rbsp, rbsp_len, sps, &vui_pos);
+}
+
+esp_err_t h264_parse_pps(const uint8_t *nal, size_t len, h264_pps_t *pps)
+{
+	uint8_t rbsp[H264_PARAM_SET_MAX];
+
+	if (!nal || len < 2 || (nal[0] & 0x1F) != H264_NAL_PPS)
+		return ESP_ERR_INVALID_ARG;
+
+	size_t rbsp_len = nal_to_rbsp(nal + 1, len - 1, rbsp, sizeof(rbsp));
+	if (rbsp_len == 0)
+		return ESP_ERR_INVALID_SIZE;
+
+	bit_reader_t br = {.buf = rbsp, .size = rbsp_len * 8};
+	memset(pps, 0, sizeof(*pps));
+
+	pps->pps_id = read_ue(&br);
+	pps->sps_id = read_ue(&br);
+	pps->entropy_coding_mode = read_flag(&br);
+	pps->bottom_field_pic_order_in_frame_present = read_flag(&br);
+	pps->num_slice_groups = read_ue(&br) + 1;
+	if (pps->num_slice_groups > 1)
+		return ESP_ERR_NOT_SUPPORTED;
+	pps->num_ref_idx_l0_default_active = read_ue(&br) + 1;
+	pps->num_ref_idx_l1_default_active = read_ue(&br) + 1;
+	pps->weighted_pred = read_flag(&br);
+	pps->weighted_bipred_idc = read_bits(&br, 2);
+	pps->pic_init_qp = 26 + read_se(&br);
+	read_se(&br); // pic_init_qs_minus26
+	read_se(&br); // chroma_qp_index_offset
+	pps->deblocking_filter_control_present = read_flag(&br);
+	read_flag(&br); // constrained_intra_pred_flag
+	pps->redundant_pic_cnt_present = read_flag(&br);
+
+	return br.overrun ? ESP_ERR_INVALID_SIZE : ESP_OK;
+}
+
+static void skip_ref_pic_list_modification(bit_reader_t *br)
+{
+	if (!read_flag(br)) // ref_pic_list_modification_flag
+		return;
+
+	uint32_t idc;
+	do
+	{
+		idc = read_ue(br); // modification_of_pic_nums_idc
+		if (idc < 3)
+			read_ue(br); // abs_diff_pic_num_minus1 or long_term_pic_num
+	} while (idc != 3 && !br->overrun);
+}
+
+static void skip_pred_weight_table(bit_reader_t *br, uint32_t chroma_array_type, uint32_t l0, uint32_t l1)
+{
+	read_ue(br); // luma_log2_weight_denom
+	if (chroma_array_type != 0)
+		read_ue(br); // chroma_log2_weight_denom
+
+	for (uint32_t i = 0; i < l0 + l1 && !br->overrun; i++)
+	{
+		if (read_flag(br)) // luma_weight_flag
+		{
+			read_se(br);
+			read_se(br);
+		}
+		if (chroma_array_type != 0 && read_flag(br)) // chroma_weight_flag
+		{
+			for (int j = 0; j < 4; j++)
+				read_se(br);
+		}
+	}
+}
+
+static void skip_dec_ref_pic_marking(bit_reader_t *br, bool idr)
+{
+	if (idr)
+	{
+		read_flag(br); // no_output_of_prior_pics_flag
+		read_flag(br); // long_term_reference_flag
+		return;
+	}
+	if (!read_flag(br)) // adaptive_ref_pic_marking_mode_flag
+		return;
+
+	uint32_t op;
+	do
+	{
+		op = read_ue(br); // memory_management_control_operation
+		if (op == 1 || op == 3)
+			read_ue(br); // difference_of_pic_nums_minus1
+		if (op == 2)
+			read_ue(br); // long_term_pic_num
+		if (op == 3 || op == 6)
+			read_ue(br); // long_term_frame_idx
+		if (op == 4)
+			read_ue(br); // max_long_term_frame_idx_plus1
+	} while (op != 0 && !br->overrun);
+}
+
+esp_err_t h264_parse_slice_header(const uint8_t *nal, size_t len, const h264_sps_t *sps,
+								  const h264_pps_t *pps, h264_slice_header_t *hdr)
+{
+	// The header ends long before this unless the weight table is large
+	uint8_t rbsp[128];
+
+	if (!nal || len < 2)
+		return ESP_ERR_INVALID_ARG;
+	uint8_t type = nal[0] & 0x1F;
+	if (type != H264_NAL_SLICE && type != H264_NAL_IDR)
+		return ESP_ERR_INVALID_ARG;
+	bool idr = (type == H264_NAL_IDR);
+	bool ref = (nal[0] & 0x60) != 0;
+
+	// Unescaping never grows the data, so a bounded input always fits
+	size_t in_len = len - 1 < sizeof(rbsp) ? len - 1 : sizeof(rbsp);
+	size_t rbsp_len = nal_to_rbsp(nal + 1, in_len, rbsp, sizeof(rbsp));
+	bit_reader_t br = {.buf = rbsp, .size = rbsp_len * 8};
+	memset(hdr, 0, sizeof(*hdr));
+
+	hdr->first_mb_in_slice = read_ue(&br);
+	hdr->slice_type = read_ue(&br) % 5;
+	hdr->pps_id = read_ue(&br);
+	if (hdr->pps_id != pps->pps_id || pps->sps_id != sps->sps_id)
+		return ESP_ERR_INVALID_ARG;
+
+	if (sps->separate_colour_plane)
+		read_bits(&br, 2); // colour_plane_id
+	hdr->frame_num = read_bits(&br, sps->log2_max_frame_num);
+
+	bool field_pic = false;
+	if (!sps->frame_mbs_only)
+	{
+		field_pic = read_flag(&br);
+		if (field_pic)
+			read_flag(&br); // bottom_field_flag
+	}
+	if (idr)
+		hdr->idr_pic_id = read_ue(&br);
+
+	if (sps->poc_type == 0)
+	{
+		read_bits(&br, sps->log2_max_poc_lsb); // pic_order_cnt_lsb
+		if (pps->bottom_field_pic_order_in_frame_present && !field_pic)
+			read_se(&br); // delta_pic_order_cnt_bottom
+	}
+	else if (sps->poc_type == 1 && !sps->delta_pic_order_always_zero)
+	{
+		read_se(&br); // delta_pic_order_cnt[0]
+		if (pps->bottom_field_pic_order_in_frame_present && !field_pic)
+			read_se(&br); // delta_pic_order_cnt[1]
+	}
+	if (pps->redundant_pic_cnt_present)
+		read_ue(&br); // redundant_pic_cnt
+
+	bool is_b = (hdr->slice_type == H264_SLICE_B);
+	bool is_p = (hdr->slice_type == H264_SLICE_P || hdr->slice_type == H264_SLICE_SP);
+	uint32_t l0 = pps->num_ref_idx_l0_default_active;
+	uint32_t l1 = pps->num_ref_idx_l1_default_active;
+
+	if (is_b)
+		read_flag(&br); // direct_spatial_mv_pred_flag
+	if (is_p || is_b)
+	{
+		if (read_flag(&br)) // num_ref_idx_active_override_flag
+		{
+			l0 = read_ue(&br) + 1;
+			if (is_b)
+				l1 = read_ue(&br) + 1;
+		}
+	}
+	if (!is_b)
+		l1 = 0;
+
+	if (hdr->slice_type != H264_SLICE_I && hdr->slice_type != H264_SLICE_SI)
+	{
+		skip_ref_pic_list_modification(&br);
+		if (is_b)
+			skip_ref_pic_list_modification(&br);
+	}
+
+	if ((pps->weighted_pred && is_p) || (pps->weighted_bipred_idc == 1 && is_b))
+	{
+		uint32_t chroma_array_type = sps->separate_colour_plane ? 0 : sps->chroma_format_idc;
+		skip_pred_weight_table(&br, chroma_array_type, l0, l1);
+	}
+
+	if (ref)
+		skip_dec_ref_pic_marking(&br, idr);
+
+	if (pps->entropy_coding_mode && hdr->slice_type != H264_SLICE_I && hdr->slice_type != H264_SLICE_SI)
+		read_ue(&br); // cabac_init_idc
+
+	hdr->qp = pps->pic_init_qp + read_se(&br);
+
+	return br.overrun ? ESP_ERR_INVALID_SIZE : ESP_OK;
+}
+
+size_t h264_sps_rewrite_vui(const uint8_t *nal, size_t len, uint32_t fps, uint8_t *out, size_t cap)
+{
+	uint8_t rbsp[H264_PARAM_SET_MAX], new_rbsp[H264_PARAM_SET_MAX];
+	h264_sps_t sps;
+	size_t vui_pos;
+
+	if (!nal || len < 4 || (nal[0] & 0x1F) != H264_NAL_SPS || cap < 2)
+		return 0;
+
+	size_t rbsp_len = nal_to_rbsp(nal + 1, len - 1, rbsp, sizeof(rbsp));
+	if (rbsp_len == 0 || parse_sps_rbsp(rbsp, rbsp_len, &sps, &vui_pos) != ESP_OK)
+		return 0;
+
+	// Rewriting HRD parameters would need the full hrd_parameters() syntax
+	if (sps.vui.nal_hrd_present || sps.vui.vcl_hrd_present)
+		return 0;
+
+	// Keep the descriptive VUI fields, replace timing and decoder buffering
+	h264_vui_t vui = sps.vui;
+	if (fps > 0)
+	{
+		vui.timing_info_present = true;
+		vui.num_units_in_tick = 1;
+		vui.time_scale = fps * 2;
+		vui.fixed_frame_rate = true;
+	}
+	if (!vui.bitstream_restriction)
+	{
+		vui.bitstream_restriction = true;
+		vui.motion_vectors_over_pic_boundaries = true;
+		vui.max_bytes_per_pic_denom = 2;
+		vui.max_bits_per_mb_denom = 1;
+		vui.log2_max_mv_length_horizontal = 16;
+		vui.log2_max_mv_length_vertical = 16;
+	}
+	// IPPP: no reordering, and the DPB need not exceed the reference frames
+	vui.max_num_reorder_frames = 0;
+	vui.max_dec_frame_buffering = sps.max_num_ref_frames;
+
+	// Everything before vui_parameters_present_flag is copied bit for bit
+	memset(new_rbsp, 0, sizeof(new_rbsp));
+	bit_writer_t bw = {.buf = new_rbsp, .size = sizeof(new_rbsp) * 8};
+	bit_reader_t br = {.buf = rbsp, .size = rbsp_len * 8};
+	while (br.pos < vui_pos)
+	{
+		int n = (vui_pos - br.pos > 32) ? 32 : (int)(vui_pos - br.pos);
+		write_bits(&bw, read_bits(&br, n), n);
+	}
+	write_flag(&bw, true);
+	write_vui(&bw, &vui);
+
+	// rbsp_trailing_bits()
+	write_flag(&bw, true);
+	while (bw.pos & 7)
+		write_flag(&bw, false);
+	if (bw.overrun)
+		return 0;
+
+	out[0] = nal[0];
+	size_t nal_len = rbsp_to_nal(new_rbsp, bw.pos / 8, out + 1, cap - 1);
+	return nal_len ? nal_len + 1 : 0;
+}
+
+size_t h264_build_sei_user_data(const uint8_t uuid[16], const uint8_t *payload, size_t len,
+								 uint8_t *out, size_t cap)
+{
+	uint8_t rbsp[H264_SEI_PAYLOAD_MAX + 32];
+	size_t size = 16 + len;
+	size_t n = 0;
+
+	if (len > H264_SEI_PAYLOAD_MAX || cap < 2)
+		return 0;
+
+	rbsp[n++] = 5; // user_data_unregistered
+	while (size >= 255)
+	{
+		rbsp[n++] = 0xFF;
+		size -= 255;
+	}
+	rbsp[n++] = size;
+	memcpy(rbsp + n, uuid, 16);
+	n += 16;
+	memcpy(rbsp + n, payload, len);
+	n += len;
+	rbsp[n++] = 0x80; // rbsp_trailing_bits()
+
+	out[0] = H264_NAL_SEI;
+	size_t nal_len = rbsp_to_nal(rbsp, n, out + 1, cap - 1);
+	return nal_len ? nal_len + 1 : 0;
+}
+
+uint32_t h264_sps_framerate_milli(const h264_sps_t *sps)
+{
+	if (!sps->vui_present || !sps->vui.timing_info_present || sps->vui.num_units_in_tick == 0)
+		return 0;
+
+	// One frame is two field ticks
+	return (uint32_t)((uint64_t)sps->vui.time_scale * 1000 / (2ULL * sps->vui.num_units_in_tick));
+}
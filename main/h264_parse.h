@@ -0,0 +1,218 @@
+#ifndef H264_PARSE_H
+#define H264_PARSE_H
+
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Largest SPS/PPS handled by the parser and the parameter-set store
+#define H264_PARAM_SET_MAX 256
+
+// Largest user data payload (after the UUID) in a generated SEI
+#define H264_SEI_PAYLOAD_MAX 128
+
+	/**
+	 * @brief VUI fields of an SPS (Annex E)
+	 */
+	typedef struct
+	{
+		bool aspect_ratio_info_present;
+		uint8_t aspect_ratio_idc;
+		uint16_t sar_width;
+		uint16_t sar_height;
+		bool overscan_info_present;
+		bool overscan_appropriate;
+		bool video_signal_type_present;
+		uint8_t video_format;
+		bool video_full_range;
+		bool colour_description_present;
+		uint8_t colour_primaries;
+		uint8_t transfer_characteristics;
+		uint8_t matrix_coefficients;
+		bool chroma_loc_info_present;
+		uint32_t chroma_sample_loc_top;
+		uint32_t chroma_sample_loc_bottom;
+		bool timing_info_present;
+		uint32_t num_units_in_tick;
+		uint32_t time_scale;
+		bool fixed_frame_rate;
+		bool nal_hrd_present;
+		bool vcl_hrd_present;
+		bool low_delay_hrd;
+		bool pic_struct_present;
+		bool bitstream_restriction;
+		bool motion_vectors_over_pic_boundaries;
+		uint32_t max_bytes_per_pic_denom;
+		uint32_t max_bits_per_mb_denom;
+		uint32_t log2_max_mv_length_horizontal;
+		uint32_t log2_max_mv_length_vertical;
+		uint32_t max_num_reorder_frames;
+		uint32_t max_dec_frame_buffering;
+	} h264_vui_t;
+
+	/**
+	 * @brief Sequence parameter set fields (7.3.2.1.1)
+	 */
+	typedef struct
+	{
+		uint8_t profile_idc;
+		uint8_t constraint_flags;
+		uint8_t level_idc;
+		uint32_t sps_id;
+		uint32_t chroma_format_idc;
+		bool separate_colour_plane;
+		uint32_t log2_max_frame_num;
+		uint32_t poc_type;
+		uint32_t log2_max_poc_lsb;
+		bool delta_pic_order_always_zero;
+		uint32_t max_num_ref_frames;
+		uint32_t pic_width_in_mbs;
+		uint32_t pic_height_in_map_units;
+		bool frame_mbs_only;
+		uint32_t crop_left;
+		uint32_t crop_right;
+		uint32_t crop_top;
+		uint32_t crop_bottom;
+		uint32_t width;	 // Luma width after cropping
+		uint32_t height; // Luma height after cropping
+		bool vui_present;
+		h264_vui_t vui;
+	} h264_sps_t;
+
+	/**
+	 * @brief Picture parameter set fields (7.3.2.2) used by slice headers
+	 */
+	typedef struct
+	{
+		uint32_t pps_id;
+		uint32_t sps_id;
+		bool entropy_coding_mode; // CABAC
+		bool bottom_field_pic_order_in_frame_present;
+		uint32_t num_slice_groups;
+		uint32_t num_ref_idx_l0_default_active;
+		uint32_t num_ref_idx_l1_default_active;
+		bool weighted_pred;
+		uint8_t weighted_bipred_idc;
+		int32_t pic_init_qp; // 26 + pic_init_qp_minus26
+		bool deblocking_filter_control_present;
+		bool redundant_pic_cnt_present;
+	} h264_pps_t;
+
+	/**
+	 * @brief Slice types, normalized from slice_type modulo 5
+	 */
+	typedef enum
+	{
+		H264_SLICE_P = 0,
+		H264_SLICE_B = 1,
+		H264_SLICE_I = 2,
+		H264_SLICE_SP = 3,
+		H264_SLICE_SI = 4
+	} h264_slice_type_t;
+
+	/**
+	 * @brief Slice header fields up to slice_qp_delta (7.3.3)
+	 */
+	typedef struct
+	{
+		uint32_t first_mb_in_slice;
+		h264_slice_type_t slice_type;
+		uint32_t pps_id;
+		uint32_t frame_num;
+		uint32_t idr_pic_id;
+		int32_t qp; // SliceQPY
+	} h264_slice_header_t;
+
+	/**
+	 * @brief Parse a sequence parameter set
+	 *
+	 * @param nal SPS NAL unit without start code
+	 * @param len NAL length
+	 * @param sps Parsed fields
+	 * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the NAL is not an SPS,
+	 *         ESP_ERR_INVALID_SIZE if the SPS is truncated or too large
+	 */
+	esp_err_t h264_parse_sps(const uint8_t *nal, size_t len, h264_sps_t *sps);
+
+	/**
+	 * @brief Parse a picture parameter set
+	 *
+	 * Stops after redundant_pic_cnt_present_flag; the optional High profile
+	 * fields that follow do not affect the slice header.
+	 *
+	 * @param nal PPS NAL unit without start code
+	 * @param len NAL length
+	 * @param pps Parsed fields
+	 * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the NAL is not a PPS,
+	 *         ESP_ERR_INVALID_SIZE if the PPS is truncated or too large,
+	 *         ESP_ERR_NOT_SUPPORTED for slice groups (FMO)
+	 */
+	esp_err_t h264_parse_pps(const uint8_t *nal, size_t len, h264_pps_t *pps);
+
+	/**
+	 * @brief Parse a slice header up to slice_qp_delta
+	 *
+	 * Only the first bytes of the slice are read, so the cost does not
+	 * depend on the slice size.
+	 *
+	 * @param nal Slice NAL unit (type 1 or 5) without start code
+	 * @param len NAL length
+	 * @param sps Active SPS
+	 * @param pps Active PPS
+	 * @param hdr Parsed fields
+	 * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the NAL is not a slice
+	 *         or refers to another PPS, ESP_ERR_INVALID_SIZE if the header is
+	 *         truncated
+	 */
+	esp_err_t h264_parse_slice_header(const uint8_t *nal, size_t len, const h264_sps_t *sps,
+									  const h264_pps_t *pps, h264_slice_header_t *hdr);
+
+	/**
+	 * @brief Re-serialize an SPS with VUI set up for low-latency decoding
+	 *
+	 * Fields before the VUI are copied unchanged. The VUI keeps its descriptive
+	 * fields, gains timing_info for the given rate and a bitstream_restriction
+	 * with no reordering and a DPB no larger than the reference frames (IPPP).
+	 *
+	 * @param nal SPS NAL unit without start code
+	 * @param len NAL length
+	 * @param fps Frame rate for timing_info, 0 to leave timing untouched
+	 * @param out Buffer for the rewritten SPS NAL unit
+	 * @param cap Size of out
+	 * @return Length of the rewritten SPS, 0 if it cannot be rewritten
+	 *         (parse error, HRD parameters present or out too small)
+	 */
+	size_t h264_sps_rewrite_vui(const uint8_t *nal, size_t len, uint32_t fps, uint8_t *out, size_t cap);
+
+	/**
+	 * @brief Build a user_data_unregistered SEI NAL unit
+	 *
+	 * @param uuid uuid_iso_iec_11578 identifying the payload format
+	 * @param payload User data following the UUID
+	 * @param len Payload length (up to H264_SEI_PAYLOAD_MAX)
+	 * @param out Buffer for the SEI NAL unit (without start code)
+	 * @param cap Size of out
+	 * @return NAL length, 0 if it does not fit
+	 */
+	size_t h264_build_sei_user_data(const uint8_t uuid[16], const uint8_t *payload, size_t len,
+									 uint8_t *out, size_t cap);
+
+	/**
+	 * @brief Get the frame rate signalled in the SPS VUI timing info
+	 *
+	 * @param sps Parsed SPS
+	 * @return Frames per second in 1/1000 units, 0 if not signalled
+	 */
+	uint32_t h264_sps_framerate_milli(const h264_sps_t *sps);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // H264_PARSE_H
@@ -0,0 +1,204 @@
+#include "h264_stats.h"
+#include "h264_parse.h"
+#include "esp_log.h"
+#include <string.h>
+
+static const char *TAG = "h264_stats";
+
+typedef struct
+{
+	uint32_t size;
+	uint32_t time_ms; // Capture time, wraps
+	uint8_t qp;
+	uint8_t type;
+} frame_record_t;
+
+typedef struct
+{
+	uint32_t frames;
+	uint32_t i_frames;
+	uint32_t bytes;
+	uint32_t i_bytes;
+	uint32_t max_size;
+	uint32_t qp_sum;
+	uint8_t qp_min;
+	uint8_t qp_max;
+	uint32_t first_ms;
+	uint32_t last_ms;
+} window_acc_t;
+
+// Encode task state
+static frame_record_t s_history[H264_STATS_HISTORY];
+static h264_sps_t s_sps;
+static h264_pps_t s_pps;
+static bool s_have_params = false;
+static window_acc_t s_gop_acc;
+static uint32_t s_last_idr_frame;
+static bool s_seen_idr = false;
+static h264_stats_t s_work;
+
+// Published snapshot, guarded by a sequence counter (odd while writing)
+static h264_stats_t s_snapshot;
+static uint32_t s_seq = 0;
+
+static void acc_add(window_acc_t *acc, const frame_record_t *f)
+{
+	if (acc->frames == 0)
+	{
+		memset(acc, 0, sizeof(*acc));
+		acc->qp_min = 0xFF;
+		acc->first_ms = f->time_ms;
+	}
+	acc->frames++;
+	acc->bytes += f->size;
+	if (f->type == H264_SLICE_I)
+	{
+		acc->i_frames++;
+		acc->i_bytes += f->size;
+	}
+	if (f->size > acc->max_size)
+		acc->max_size = f->size;
+	acc->qp_sum += f->qp;
+	if (f->qp < acc->qp_min)
+		acc->qp_min = f->qp;
+	if (f->qp > acc->qp_max)
+		acc->qp_max = f->qp;
+	acc->last_ms = f->time_ms;
+}
+
+static void acc_finish(const window_acc_t *acc, h264_stats_window_t *w)
+{
+	memset(w, 0, sizeof(*w));
+	if (acc->frames == 0)
+		return;
+
+	uint32_t p_frames = acc->frames - acc->i_frames;
+	w->frames = acc->frames;
+	w->i_frames = acc->i_frames;
+	w->bytes = acc->bytes;
+	w->avg_frame_size = acc->bytes / acc->frames;
+	w->max_frame_size = acc->max_size;
+	w->avg_i_size = acc->i_frames ? acc->i_bytes / acc->i_frames : 0;
+	w->avg_p_size = p_frames ? (acc->bytes - acc->i_bytes) / p_frames : 0;
+	w->qp_min = acc->qp_min;
+	w->qp_max = acc->qp_max;
+	w->qp_avg = (acc->qp_sum + acc->frames / 2) / acc->frames;
+	w->duration_ms = acc->last_ms - acc->first_ms;
+}
+
+static void publish(void)
+{
+	uint32_t seq = __atomic_load_n(&s_seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&s_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&s_snapshot, &s_work, sizeof(s_snapshot));
+	__atomic_store_n(&s_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void h264_stats_record(const uint8_t *data, const h264_nal_index_t *idx, int64_t capture_us)
+{
+	const h264_nal_t *slice = NULL;
+	frame_record_t f = {.time_ms = (uint32_t)(capture_us / 1000)};
+
+	// Parameter sets precede the slice in the same access unit
+	if (idx->sps >= 0 && idx->pps >= 0)
+	{
+		const h264_nal_t *sps = &idx->nals[idx->sps];
+		const h264_nal_t *pps = &idx->nals[idx->pps];
+		s_have_params = h264_parse_sps(data + sps->offset, sps->len, &s_sps) == ESP_OK &&
+						h264_parse_pps(data + pps->offset, pps->len, &s_pps) == ESP_OK;
+	}
+
+	// Encoded size leaves out start codes and every SEI NAL unit: the
+	// hardware encoder writes none, so any SEI is metadata added after it
+	for (size_t i = 0; i < idx->count; i++)
+	{
+		const h264_nal_t *n = &idx->nals[i];
+		if (n->type != H264_NAL_SEI)
+			f.size += n->len;
+		if (!slice && (n->type == H264_NAL_SLICE || n->type == H264_NAL_IDR))
+			slice = n;
+	}
+	if (!slice)
+		return;
+
+	h264_slice_header_t hdr;
+	if (s_have_params &&
+		h264_parse_slice_header(data + slice->offset, slice->len, &s_sps, &s_pps, &hdr) == ESP_OK)
+	{
+		f.type = (hdr.slice_type == H264_SLICE_SI) ? H264_SLICE_I : hdr.slice_type;
+		f.qp = hdr.qp;
+	}
+	else
+	{
+		// Fall back to the NAL type so the windows stay usable
+		if (s_work.parse_errors++ == 0)
+			ESP_LOGW(TAG, "Slice header not parsed (parameter sets %s)", s_have_params ? "valid" : "missing");
+		f.type = idx->idr ? H264_SLICE_I : H264_SLICE_P;
+		f.qp = s_work.last_qp;
+	}
+
+	uint32_t frame = s_work.frames++;
+	s_history[frame % H264_STATS_HISTORY] = f;
+
+	if (idx->idr)
+	{
+		if (s_seen_idr)
+			s_work.idr_interval = frame - s_last_idr_frame;
+		s_last_idr_frame = frame;
+		s_seen_idr = true;
+		s_gop_acc.frames = 0;
+	}
+	acc_add(&s_gop_acc, &f);
+	acc_finish(&s_gop_acc, &s_work.gop);
+
+	// Rolling second: frames captured less than a second before this one
+	window_acc_t second = {0};
+	uint32_t depth = s_work.frames < H264_STATS_HISTORY ? s_work.frames : H264_STATS_HISTORY;
+	uint32_t n = 1;
+	while (n < depth && f.time_ms - s_history[(frame - n) % H264_STATS_HISTORY].time_ms < 1000)
+		n++;
+	for (uint32_t i = n; i-- > 0;)
+		acc_add(&second, &s_history[(frame - i) % H264_STATS_HISTORY]);
+	acc_finish(&second, &s_work.second);
+
+	uint32_t span_ms = s_work.second.duration_ms;
+	if (second.frames > 1 && span_ms > 0)
+	{
+		// Scale the window by one frame period so N frames cover N periods
+		uint64_t period_ms = span_ms / (second.frames - 1);
+		s_work.bitrate = (uint64_t)second.bytes * 8 * 1000 / (span_ms + period_ms);
+	}
+
+	// Static scenes give P frames a few percent of an I frame; full motion
+	// brings them to about half
+	const h264_stats_window_t *gop = &s_work.gop;
+	if (gop->avg_i_size > 0)
+	{
+		uint32_t level = (uint64_t)gop->avg_p_size * 200 / gop->avg_i_size;
+		s_work.motion_level = level > 100 ? 100 : level;
+	}
+
+	s_work.last_slice_type = f.type;
+	s_work.last_qp = f.qp;
+	s_work.last_size = f.size;
+	publish();
+}
+
+bool h264_stats_get(h264_stats_t *stats)
+{
+	for (int attempt = 0; attempt < 8; attempt++)
+	{
+		uint32_t seq = __atomic_load_n(&s_seq, __ATOMIC_ACQUIRE);
+		if (seq == 0)
+			return false;
+		if (seq & 1)
+			continue;
+
+		memcpy(stats, &s_snapshot, sizeof(*stats));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s_seq, __ATOMIC_RELAXED) == seq)
+			return true;
+	}
+	return false;
+}
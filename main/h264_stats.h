@@ -0,0 +1,79 @@
+#ifndef H264_STATS_H
+#define H264_STATS_H
+
+#include "h264_nal.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Frames kept for the rolling windows; covers one second up to 64 fps
+#define H264_STATS_HISTORY 64
+
+	/**
+	 * @brief Aggregates over a window of encoded frames
+	 */
+	typedef struct
+	{
+		uint32_t frames;
+		uint32_t i_frames;		// Frames made of I slices (IDR or not)
+		uint32_t bytes;			// Encoded bytes: NAL units without start codes, SEI left out
+		uint32_t avg_frame_size;
+		uint32_t max_frame_size;
+		uint32_t avg_i_size;	// 0 if the window holds no I frame
+		uint32_t avg_p_size;	// 0 if the window holds no P frame
+		uint8_t qp_min;
+		uint8_t qp_max;
+		uint8_t qp_avg;
+		uint32_t duration_ms;	// Capture time covered by the window
+	} h264_stats_window_t;
+
+	/**
+	 * @brief Encoder output analytics
+	 */
+	typedef struct
+	{
+		uint32_t frames;		// Frames recorded since start
+		uint32_t parse_errors;	// Frames whose slice header could not be parsed
+		uint8_t last_slice_type; // h264_slice_type_t of the last frame
+		uint8_t last_qp;
+		uint32_t last_size;		// Bytes of the last frame, counted as in the windows
+		uint32_t idr_interval;	// Frames between the last two IDRs, 0 until two are seen
+		uint32_t bitrate;		// Bits per second over the last second
+		uint8_t motion_level;	// 0-100, P frame size relative to I frame size in the GOP
+		h264_stats_window_t second; // Frames captured in the last second
+		h264_stats_window_t gop;	// Frames since the last IDR
+	} h264_stats_t;
+
+	/**
+	 * @brief Record one encoded access unit
+	 *
+	 * Parses SPS/PPS when present and the first slice header, then publishes
+	 * a new snapshot. Called from the encode task only.
+	 *
+	 * @param data Annex-B access unit
+	 * @param idx NAL index of data
+	 * @param capture_us Capture time of the frame in microseconds
+	 */
+	void h264_stats_record(const uint8_t *data, const h264_nal_index_t *idx, int64_t capture_us);
+
+	/**
+	 * @brief Get the latest snapshot
+	 *
+	 * Lock-free; retries while the encode task is publishing.
+	 *
+	 * @param stats Snapshot copy
+	 * @return true if a consistent snapshot was copied, false if no frame
+	 *         was recorded yet or the writer kept it busy
+	 */
+	bool h264_stats_get(h264_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // H264_STATS_H
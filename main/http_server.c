@@ -1,4 +1,7 @@
 #include "http_server.h"
+#include "camera_encoder.h"
+#include "h264_stats.h"
+#include "rtsp_server.h"
 #include "esp_log.h"
 #include "esp_http_server.h"
 #include "cJSON.h"
@@ -6,6 +9,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
+#include <inttypes.h>
 
 static const char *TAG = "http_server";
 static httpd_handle_t s_server = NULL;
@@ -21,6 +25,8 @@ static const char *s_stub_mode = "constant";
 static esp_err_t static_file_handler(httpd_req_t *req);
 static esp_err_t bitrate_get_handler(httpd_req_t *req);
 static esp_err_t bitrate_post_handler(httpd_req_t *req);
+static esp_err_t encoder_stats_handler(httpd_req_t *req);
+static esp_err_t rtsp_stats_handler(httpd_req_t *req);
 
 static esp_err_t static_file_handler(httpd_req_t *req)
 {
@@ -126,10 +132,14 @@ static esp_err_t bitrate_get_handler(httpd_req_t *req)
 	cJSON_AddNumberToObject(root, "variance_min", s_stub_variance_min);
 	cJSON_AddNumberToObject(root, "variance_max", s_stub_variance_max);
 
+	// Measured values once the encoder has produced frames
+	vbr_stats_t vbr = {.current_bitrate = s_stub_bitrate, .motion_level = s_stub_motion_level};
+	camera_encoder_get_vbr_stats(&vbr);
+
 	cJSON *stats_obj = cJSON_CreateObject();
-	cJSON_AddNumberToObject(stats_obj, "current_bitrate", s_stub_bitrate);
-	cJSON_AddNumberToObject(stats_obj, "avg_frame_size", 0);
-	cJSON_AddNumberToObject(stats_obj, "motion_level", s_stub_motion_level);
+	cJSON_AddNumberToObject(stats_obj, "current_bitrate", vbr.current_bitrate);
+	cJSON_AddNumberToObject(stats_obj, "avg_frame_size", vbr.avg_frame_size);
+	cJSON_AddNumberToObject(stats_obj, "motion_level", vbr.motion_level);
 	cJSON_AddItemToObject(root, "stats", stats_obj);
 
 	char *response = cJSON_PrintUnformatted(root);
@@ -285,6 +295,110 @@ static esp_err_t bitrate_post_handler(httpd_req_t *req)
 	return ESP_OK;
 }
 
+static cJSON *stats_window_json(const h264_stats_window_t *w)
+{
+	cJSON *obj = cJSON_CreateObject();
+	cJSON_AddNumberToObject(obj, "frames", w->frames);
+	cJSON_AddNumberToObject(obj, "i_frames", w->i_frames);
+	cJSON_AddNumberToObject(obj, "bytes", w->bytes);
+	cJSON_AddNumberToObject(obj, "avg_frame_size", w->avg_frame_size);
+	cJSON_AddNumberToObject(obj, "max_frame_size", w->max_frame_size);
+	cJSON_AddNumberToObject(obj, "avg_i_size", w->avg_i_size);
+	cJSON_AddNumberToObject(obj, "avg_p_size", w->avg_p_size);
+	cJSON_AddNumberToObject(obj, "qp_min", w->qp_min);
+	cJSON_AddNumberToObject(obj, "qp_max", w->qp_max);
+	cJSON_AddNumberToObject(obj, "qp_avg", w->qp_avg);
+	cJSON_AddNumberToObject(obj, "duration_ms", w->duration_ms);
+	return obj;
+}
+
+static esp_err_t encoder_stats_handler(httpd_req_t *req)
+{
+	static const char *slice_types[] = {"P", "B", "I", "SP", "SI"};
+	h264_stats_t stats;
+
+	if (!h264_stats_get(&stats))
+	{
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No encoder statistics yet");
+		return ESP_FAIL;
+	}
+
+	cJSON *root = cJSON_CreateObject();
+	cJSON_AddStringToObject(root, "status", esp_err_to_name(camera_encoder_get_status()));
+	cJSON_AddNumberToObject(root, "frames", stats.frames);
+	cJSON_AddNumberToObject(root, "parse_errors", stats.parse_errors);
+	cJSON_AddStringToObject(root, "last_slice_type", slice_types[stats.last_slice_type % 5]);
+	cJSON_AddNumberToObject(root, "last_qp", stats.last_qp);
+	cJSON_AddNumberToObject(root, "last_size", stats.last_size);
+	cJSON_AddNumberToObject(root, "idr_interval", stats.idr_interval);
+	cJSON_AddNumberToObject(root, "bitrate", stats.bitrate);
+	cJSON_AddNumberToObject(root, "motion_level", stats.motion_level);
+	cJSON_AddItemToObject(root, "second", stats_window_json(&stats.second));
+	cJSON_AddItemToObject(root, "gop", stats_window_json(&stats.gop));
+
+	char *response = cJSON_PrintUnformatted(root);
+	httpd_resp_set_type(req, "application/json");
+	httpd_resp_send(req, response, strlen(response));
+
+	free(response);
+	cJSON_Delete(root);
+	return ESP_OK;
+}
+
+static esp_err_t rtsp_stats_handler(httpd_req_t *req)
+{
+	rtsp_session_stats_t *sessions = malloc(RTSP_SERVER_MAX_CLIENTS * sizeof(*sessions));
+	if (!sessions)
+	{
+		httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to allocate buffer");
+		return ESP_FAIL;
+	}
+	int n = rtsp_server_get_session_stats(sessions, RTSP_SERVER_MAX_CLIENTS);
+
+	cJSON *root = cJSON_CreateObject();
+	cJSON *list = cJSON_AddArrayToObject(root, "sessions");
+	for (int i = 0; i < n; i++)
+	{
+		const rtsp_session_stats_t *st = &sessions[i];
+		char id[9];
+		snprintf(id, sizeof(id), "%08" PRIX32, st->session);
+
+		cJSON *obj = cJSON_CreateObject();
+		cJSON_AddStringToObject(obj, "session", id);
+		cJSON_AddStringToObject(obj, "addr", st->addr);
+		cJSON_AddStringToObject(obj, "transport", st->multicast ? "multicast" : (st->interleaved ? "tcp" : "udp"));
+		cJSON_AddStringToObject(obj, "cname", st->rtcp.cname);
+		cJSON_AddNumberToObject(obj, "idle_ms", st->idle_ms);
+		cJSON_AddNumberToObject(obj, "queued_frames", st->queued_frames);
+		cJSON_AddNumberToObject(obj, "dropped_frames", st->dropped_frames);
+		cJSON_AddNumberToObject(obj, "dropped_bytes", st->dropped_bytes);
+		cJSON_AddNumberToObject(obj, "first_frame_ms", st->first_frame_us / 1000.0);
+		cJSON_AddNumberToObject(obj, "packets_sent", st->rtcp.packets_sent);
+		cJSON_AddNumberToObject(obj, "octets_sent", st->rtcp.octets_sent);
+		cJSON_AddNumberToObject(obj, "sr_sent", st->rtcp.sr_sent);
+		cJSON_AddNumberToObject(obj, "rr_received", st->rtcp.rr_received);
+		cJSON_AddNumberToObject(obj, "fraction_lost", st->rtcp.fraction_lost / 256.0);
+		cJSON_AddNumberToObject(obj, "cumulative_lost", st->rtcp.cumulative_lost);
+		cJSON_AddNumberToObject(obj, "jitter_ms", st->rtcp.jitter / 90.0);
+		cJSON_AddNumberToObject(obj, "rtt_ms", st->rtcp.rtt_us / 1000.0);
+		cJSON_AddNumberToObject(obj, "nacks_received", st->rtcp.nacks_received);
+		cJSON_AddNumberToObject(obj, "nacked_packets", st->rtcp.nacked_packets);
+		cJSON_AddNumberToObject(obj, "retransmits", st->rtcp.retransmits);
+		cJSON_AddNumberToObject(obj, "retransmit_misses", st->rtcp.retransmit_misses);
+		cJSON_AddNumberToObject(obj, "keyframe_requests", st->rtcp.keyframe_requests);
+		cJSON_AddItemToArray(list, obj);
+	}
+	free(sessions);
+
+	char *response = cJSON_PrintUnformatted(root);
+	httpd_resp_set_type(req, "application/json");
+	httpd_resp_send(req, response, strlen(response));
+
+	free(response);
+	cJSON_Delete(root);
+	return ESP_OK;
+}
+
 esp_err_t http_server_init(void)
 {
 	ESP_LOGI(TAG, "Initializing HTTP server (stub - API exists but encoder functions not available)");
@@ -316,6 +430,18 @@ esp_err_t http_server_start(void)
 		.handler = bitrate_post_handler,
 		.user_ctx = NULL};
 
+	httpd_uri_t uri_encoder_stats = {
+		.uri = "/api/stats/encoder",
+		.method = HTTP_GET,
+		.handler = encoder_stats_handler,
+		.user_ctx = NULL};
+
+	httpd_uri_t uri_rtsp_stats = {
+		.uri = "/api/stats/rtsp",
+		.method = HTTP_GET,
+		.handler = rtsp_stats_handler,
+		.user_ctx = NULL};
+
 	httpd_uri_t uri_static = {
 		.uri = "/*",
 		.method = HTTP_GET,
@@ -327,6 +453,8 @@ esp_err_t http_server_start(void)
 		// Register API handlers first (more specific)
 		httpd_register_uri_handler(s_server, &uri_bitrate_get);
 		httpd_register_uri_handler(s_server, &uri_bitrate_post);
+		httpd_register_uri_handler(s_server, &uri_encoder_stats);
+		httpd_register_uri_handler(s_server, &uri_rtsp_stats);
 
 		// Register catch-all static handler last (for SPA)
 		httpd_register_uri_handler(s_server, &uri_static);
@@ -0,0 +1,260 @@
+#include "rtcp.h"
+#include "esp_random.h"
+#include <string.h>
+#include <sys/time.h>
+
+// Seconds from 1900 (NTP era 0) to 1970 (Unix epoch)
+#define NTP_UNIX_OFFSET 2208988800ULL
+
+#define RTCP_REPORT_BLOCK_LEN 24
+#define SDES_CNAME 1
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Common header; len is the packet length in bytes, a multiple of 4
+static void put_header(uint8_t *p, uint8_t count, uint8_t pt, size_t len)
+{
+	p[0] = 0x80 | count;
+	p[1] = pt;
+	p[2] = (len / 4 - 1) >> 8;
+	p[3] = (len / 4 - 1) & 0xFF;
+}
+
+uint64_t rtcp_ntp_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	uint64_t frac = ((uint64_t)tv.tv_usec << 32) / 1000000;
+	return ((uint64_t)(tv.tv_sec + NTP_UNIX_OFFSET) << 32) | frac;
+}
+
+int64_t rtcp_interval_us(bool initial)
+{
+	int64_t base = (int64_t)RTCP_INTERVAL_MS * 1000 / (initial ? 2 : 1);
+	int64_t permille = 500 + esp_random() % 1001;
+	return base * permille / 1218; // 1000 * (e - 3/2) = 1218
+}
+
+size_t rtcp_build_sr(uint8_t *buf, size_t cap, const rtcp_sender_info_t *si, const char *cname, bool bye)
+{
+	size_t cname_len = strnlen(cname, RTCP_CNAME_MAX - 1);
+	size_t sdes_len = (4 + 4 + 2 + cname_len + 1 + 3) & ~(size_t)3; // Null item ends the chunk
+	size_t len = 28 + sdes_len + (bye ? 8 : 0);
+	if (cap < len)
+		return 0;
+
+	uint8_t *p = buf;
+	put_header(p, 0, RTCP_PT_SR, 28);
+	put_be32(p + 4, si->ssrc);
+	put_be32(p + 8, si->ntp >> 32);
+	put_be32(p + 12, si->ntp & 0xFFFFFFFF);
+	put_be32(p + 16, si->rtp_ts);
+	put_be32(p + 20, si->packets);
+	put_be32(p + 24, si->octets);
+	p += 28;
+
+	memset(p, 0, sdes_len);
+	put_header(p, 1, RTCP_PT_SDES, sdes_len);
+	put_be32(p + 4, si->ssrc);
+	p[8] = SDES_CNAME;
+	p[9] = cname_len;
+	memcpy(p + 10, cname, cname_len);
+	p += sdes_len;
+
+	if (bye)
+	{
+		put_header(p, 1, RTCP_PT_BYE, 8);
+		put_be32(p + 4, si->ssrc);
+	}
+	return len;
+}
+
+static void parse_report_blocks(const uint8_t *p, size_t len, int count, uint32_t media_ssrc, rtcp_feedback_t *fb)
+{
+	for (int i = 0; i < count && len >= RTCP_REPORT_BLOCK_LEN; i++)
+	{
+		if (get_be32(p) == media_ssrc)
+		{
+			fb->has_report = true;
+			fb->fraction_lost = p[4];
+			// Sign-extend the 24-bit count
+			fb->cumulative_lost = (int32_t)(get_be32(p + 4) << 8) >> 8;
+			fb->highest_seq = get_be32(p + 8);
+			fb->jitter = get_be32(p + 12);
+			fb->lsr = get_be32(p + 16);
+			fb->dlsr = get_be32(p + 20);
+		}
+		p += RTCP_REPORT_BLOCK_LEN;
+		len -= RTCP_REPORT_BLOCK_LEN;
+	}
+}
+
+static void parse_sdes(const uint8_t *p, size_t len, int count, rtcp_feedback_t *fb)
+{
+	// First chunk only; receivers describe themselves alone
+	if (count < 1 || len < 4)
+		return;
+	uint32_t ssrc = get_be32(p);
+	p += 4;
+	len -= 4;
+	while (len >= 2 && p[0] != 0)
+	{
+		size_t item_len = p[1];
+		if (2 + item_len > len)
+			return;
+		if (p[0] == SDES_CNAME)
+		{
+			size_t n = item_len < RTCP_CNAME_MAX - 1 ? item_len : RTCP_CNAME_MAX - 1;
+			memcpy(fb->cname, p + 2, n);
+			fb->cname[n] = 0;
+			if (fb->ssrc == 0)
+				fb->ssrc = ssrc;
+		}
+		p += 2 + item_len;
+		len -= 2 + item_len;
+	}
+}
+
+static void parse_nack(const uint8_t *p, size_t len, uint32_t media_ssrc, rtcp_feedback_t *fb)
+{
+	// Sender SSRC, media SSRC, then PID/BLP pairs
+	if (len < 8 || get_be32(p + 4) != media_ssrc)
+		return;
+	if (fb->ssrc == 0)
+		fb->ssrc = get_be32(p);
+	for (p += 8, len -= 8; len >= 4; p += 4, len -= 4)
+	{
+		uint16_t pid = (p[0] << 8) | p[1];
+		uint16_t blp = (p[2] << 8) | p[3];
+		for (int bit = -1; bit < 16 && fb->nack_count < RTCP_NACK_MAX; bit++)
+		{
+			if (bit < 0 || (blp & (1 << bit)))
+				fb->nack[fb->nack_count++] = pid + bit + 1;
+		}
+	}
+}
+
+static void parse_keyframe_request(const uint8_t *p, size_t len, int fmt, uint32_t media_ssrc, rtcp_feedback_t *fb)
+{
+	// Sender SSRC, media SSRC, then the FCI
+	if (len < 8)
+		return;
+	if (fmt == RTCP_FMT_PLI)
+	{
+		if (get_be32(p + 4) != media_ssrc)
+			return;
+		fb->keyframe_request = true;
+	}
+	else
+	{
+		// FIR names its targets in 8-byte FCI entries: SSRC, seq nr, reserved
+		for (size_t off = 8; off + 8 <= len; off += 8)
+		{
+			if (get_be32(p + off) == media_ssrc)
+				fb->keyframe_request = true;
+		}
+		if (!fb->keyframe_request)
+			return;
+	}
+	if (fb->ssrc == 0)
+		fb->ssrc = get_be32(p);
+}
+
+esp_err_t rtcp_parse(const uint8_t *buf, size_t len, uint32_t media_ssrc, rtcp_feedback_t *fb)
+{
+	memset(fb, 0, sizeof(*fb));
+	if (len < 4)
+		return ESP_ERR_INVALID_ARG;
+
+	while (len >= 4)
+	{
+		if ((buf[0] >> 6) != 2)
+			return ESP_ERR_INVALID_ARG;
+		int count = buf[0] & 0x1F;
+		uint8_t pt = buf[1];
+		size_t plen = (((size_t)buf[2] << 8 | buf[3]) + 1) * 4;
+		if (plen > len)
+			return ESP_ERR_INVALID_ARG;
+
+		switch (pt)
+		{
+		case RTCP_PT_SR:
+		case RTCP_PT_RR:
+		{
+			size_t body = (pt == RTCP_PT_SR) ? 28 : 8;
+			if (plen < 8)
+				break;
+			if (fb->ssrc == 0)
+				fb->ssrc = get_be32(buf + 4);
+			if (plen >= body)
+				parse_report_blocks(buf + body, plen - body, count, media_ssrc, fb);
+			break;
+		}
+		case RTCP_PT_SDES:
+			parse_sdes(buf + 4, plen - 4, count, fb);
+			break;
+		case RTCP_PT_RTPFB:
+			if (count == RTCP_FMT_NACK)
+				parse_nack(buf + 4, plen - 4, media_ssrc, fb);
+			break;
+		case RTCP_PT_PSFB:
+			if (count == RTCP_FMT_PLI || count == RTCP_FMT_FIR)
+				parse_keyframe_request(buf + 4, plen - 4, count, media_ssrc, fb);
+			break;
+		case RTCP_PT_BYE:
+			fb->bye = true;
+			if (fb->ssrc == 0 && count > 0 && plen >= 8)
+				fb->ssrc = get_be32(buf + 4);
+			break;
+		default:
+			break;
+		}
+		buf += plen;
+		len -= plen;
+	}
+	return ESP_OK;
+}
+
+void rtcp_update_stats(rtcp_stats_t *st, const rtcp_feedback_t *fb, uint64_t ntp_now, int64_t now_us)
+{
+	if (fb->ssrc)
+		st->peer_ssrc = fb->ssrc;
+	if (fb->cname[0])
+		memcpy(st->cname, fb->cname, sizeof(st->cname));
+	if (fb->nack_count > 0)
+	{
+		st->nacks_received++;
+		st->nacked_packets += fb->nack_count;
+	}
+	if (fb->keyframe_request)
+		st->keyframe_requests++;
+	if (!fb->has_report)
+		return;
+
+	st->rr_received++;
+	st->fraction_lost = fb->fraction_lost;
+	st->cumulative_lost = fb->cumulative_lost;
+	st->highest_seq = fb->highest_seq;
+	st->jitter = fb->jitter;
+	st->last_rr_us = now_us;
+
+	// RFC 3550 6.4.1: A - LSR - DLSR, all in 1/65536 s
+	if (fb->lsr != 0)
+	{
+		uint32_t mid = (ntp_now >> 16) & 0xFFFFFFFF;
+		uint32_t rtt = mid - fb->lsr - fb->dlsr;
+		if ((int32_t)rtt >= 0)
+			st->rtt_us = ((uint64_t)rtt * 1000000) >> 16;
+	}
+}
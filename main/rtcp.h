@@ -0,0 +1,148 @@
+#ifndef RTCP_H
+#define RTCP_H
+
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define RTCP_PT_SR 200
+#define RTCP_PT_RR 201
+#define RTCP_PT_SDES 202
+#define RTCP_PT_BYE 203
+#define RTCP_PT_RTPFB 205 // Transport layer feedback (RFC 4585)
+#define RTCP_PT_PSFB 206 // Payload-specific feedback (RFC 4585)
+#define RTCP_FMT_NACK 1
+#define RTCP_FMT_PLI 1
+#define RTCP_FMT_FIR 4 // Full Intra Request (RFC 5104)
+
+// Lost packets taken from the NACKs of one compound packet
+#define RTCP_NACK_MAX 64
+
+// Largest compound packet we build: SR, SDES CNAME and BYE
+#define RTCP_PACKET_MAX 128
+#define RTCP_CNAME_MAX 32
+
+// Minimum report interval (RFC 3550 6.2); the first report comes after half
+#define RTCP_INTERVAL_MS 5000
+
+	/**
+	 * @brief What one compound RTCP packet from a receiver told us
+	 */
+	typedef struct
+	{
+		uint32_t ssrc;			 // Reporter, 0 if no RR/SR/SDES/BYE named one
+		bool has_report;		 // A report block about the media SSRC was found
+		uint8_t fraction_lost;	 // Since the previous report, in 1/256
+		int32_t cumulative_lost; // 24-bit signed
+		uint32_t highest_seq;	 // Extended highest sequence number received
+		uint32_t jitter;		 // Interarrival jitter in RTP timestamp units
+		uint32_t lsr;			 // Middle 32 bits of the NTP time of our last SR
+		uint32_t dlsr;			 // Delay since that SR in 1/65536 s
+		bool bye;
+		char cname[RTCP_CNAME_MAX]; // Empty if no SDES CNAME was present
+		uint16_t nack[RTCP_NACK_MAX]; // Sequence numbers reported lost
+		uint8_t nack_count;
+		bool keyframe_request; // PLI or FIR about the media SSRC
+	} rtcp_feedback_t;
+
+	/**
+	 * @brief Sender state of one RTP stream, as carried in an SR
+	 */
+	typedef struct
+	{
+		uint32_t ssrc;
+		uint64_t ntp;	 // Wallclock in NTP format
+		uint32_t rtp_ts; // RTP timestamp matching ntp
+		uint32_t packets;
+		uint32_t octets; // Payload octets, RTP headers excluded
+	} rtcp_sender_info_t;
+
+	/**
+	 * @brief Per-session RTCP statistics
+	 */
+	typedef struct
+	{
+		uint32_t packets_sent;
+		uint32_t octets_sent;
+		uint32_t sr_sent;
+		uint32_t rr_received;
+		uint32_t peer_ssrc;		 // Receiver SSRC, 0 until it reported
+		uint8_t fraction_lost;	 // From the last report, in 1/256
+		int32_t cumulative_lost;
+		uint32_t highest_seq;
+		uint32_t jitter;		 // RTP timestamp units (1/90000 s)
+		uint32_t rtt_us;		 // 0 until a report referenced one of our SRs
+		int64_t last_rr_us;		 // esp_timer time of the last report, 0 if none
+		char cname[RTCP_CNAME_MAX];
+		uint32_t nacks_received;  // Packets carrying a Generic NACK
+		uint32_t nacked_packets;  // Sequence numbers they reported lost
+		uint32_t retransmits;
+		uint32_t retransmit_misses; // Requested packets no longer in the history
+		uint32_t keyframe_requests; // Packets carrying a PLI or FIR
+	} rtcp_stats_t;
+
+	/**
+	 * @brief Get the wallclock in NTP format (RFC 5905)
+	 *
+	 * @return Seconds since 1900 in the upper 32 bits, fraction in the lower
+	 */
+	uint64_t rtcp_ntp_now(void);
+
+	/**
+	 * @brief Pick the time until the next report
+	 *
+	 * RTCP_INTERVAL_MS randomized over [0.5, 1.5] and divided by e - 3/2,
+	 * as RFC 3550 6.3.1 prescribes to avoid synchronized reports.
+	 *
+	 * @param initial Halve the interval for the first report
+	 * @return Interval in microseconds
+	 */
+	int64_t rtcp_interval_us(bool initial);
+
+	/**
+	 * @brief Build a compound SR + SDES (+ BYE) packet
+	 *
+	 * @param buf Output
+	 * @param cap Size of buf, RTCP_PACKET_MAX is always enough
+	 * @param si Sender state
+	 * @param cname SDES CNAME, truncated to RTCP_CNAME_MAX - 1
+	 * @param bye Append a BYE for si->ssrc
+	 * @return Packet length, 0 if buf is too small
+	 */
+	size_t rtcp_build_sr(uint8_t *buf, size_t cap, const rtcp_sender_info_t *si, const char *cname, bool bye);
+
+	/**
+	 * @brief Parse a compound RTCP packet from a receiver
+	 *
+	 * Report blocks and feedback about other sources are ignored, as are
+	 * packet types other than SR, RR, SDES, BYE, Generic NACK, PLI and FIR.
+	 *
+	 * @param buf Packet
+	 * @param len Packet length
+	 * @param media_ssrc SSRC of our stream to this receiver
+	 * @param fb Parsed feedback
+	 * @return ESP_OK, ESP_ERR_INVALID_ARG if the packet is malformed
+	 */
+	esp_err_t rtcp_parse(const uint8_t *buf, size_t len, uint32_t media_ssrc, rtcp_feedback_t *fb);
+
+	/**
+	 * @brief Fold receiver feedback into session statistics
+	 *
+	 * @param st Session statistics
+	 * @param fb Feedback from rtcp_parse()
+	 * @param ntp_now Arrival time in NTP format, for the round trip time
+	 * @param now_us Arrival time from esp_timer
+	 */
+	void rtcp_update_stats(rtcp_stats_t *st, const rtcp_feedback_t *fb, uint64_t ntp_now, int64_t now_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RTCP_H
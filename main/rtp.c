@@ -0,0 +1,295 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // sendmmsg()
+#endif
+#include "rtp.h"
+#include <string.h>
+#include <errno.h>
+
+static rtp_tx_stats_t s_tx_stats;
+
+void rtp_packet_list_init(rtp_packet_list_t *list, rtp_packet_t *storage, uint16_t cap, uint32_t ts)
+{
+	list->pkts = storage;
+	list->cap = cap;
+	list->count = 0;
+	list->ts = ts;
+	list->arena = NULL;
+	list->arena_cap = 0;
+	list->arena_used = 0;
+	list->agg = -1;
+	list->agg_stap = false;
+}
+
+void rtp_packet_list_set_arena(rtp_packet_list_t *list, uint8_t *arena, uint16_t cap)
+{
+	list->arena = arena;
+	list->arena_cap = cap;
+	list->arena_used = 0;
+}
+
+/**
+ * @brief Add a small NAL unit to the last packet as a STAP-A
+ *
+ * A single-NAL packet is turned into a STAP-A holding it on the first
+ * addition. The open STAP-A always sits at the end of the arena.
+ *
+ * @return true if the NAL was aggregated
+ */
+static bool stap_append(rtp_packet_list_t *list, const uint8_t *nal, size_t len)
+{
+	if (!list->arena || len > RTP_STAP_NAL_MAX || list->agg < 0 || list->agg != list->count - 1)
+		return false;
+
+	rtp_packet_t *p = &list->pkts[list->agg];
+	size_t need = list->agg_stap ? 2 + len : 1 + 2 + p->len + 2 + len;
+	size_t total = list->agg_stap ? p->len + 2 + len : need;
+	if (total > RTP_MTU || list->arena_used + need > list->arena_cap)
+		return false;
+
+	uint8_t *w = list->arena + list->arena_used;
+	uint8_t *stap = list->agg_stap ? w - p->len : w;
+	if (!list->agg_stap)
+	{
+		*w++ = (p->payload[0] & 0xE0) | 24;
+		*w++ = p->len >> 8;
+		*w++ = p->len & 0xFF;
+		memcpy(w, p->payload, p->len);
+		w += p->len;
+		list->agg_stap = true;
+	}
+
+	// F is set if any unit has it, NRI is the highest of all units
+	uint8_t nri = (stap[0] & 0x60) > (nal[0] & 0x60) ? (stap[0] & 0x60) : (nal[0] & 0x60);
+	stap[0] = ((stap[0] | nal[0]) & 0x80) | nri | 24;
+	*w++ = len >> 8;
+	*w++ = len & 0xFF;
+	memcpy(w, nal, len);
+	w += len;
+
+	p->payload = stap;
+	p->len = w - stap;
+	list->arena_used = w - list->arena;
+	return true;
+}
+
+esp_err_t rtp_packetize_h264(rtp_packet_list_t *list, const uint8_t *nal, size_t len)
+{
+	if (len == 0)
+		return ESP_OK;
+
+	if (stap_append(list, nal, len))
+		return ESP_OK;
+
+	if (len <= RTP_MTU)
+	{
+		if (list->count == list->cap)
+			return ESP_ERR_NO_MEM;
+		rtp_packet_t *p = &list->pkts[list->count++];
+		p->payload = nal;
+		p->len = len;
+		p->prefix_len = 0;
+		p->marker = false;
+
+		// Small units may open a STAP-A with the ones that follow
+		list->agg = (len <= RTP_STAP_NAL_MAX) ? list->count - 1 : -1;
+		list->agg_stap = false;
+		return ESP_OK;
+	}
+
+	// FU-A: the NAL header is carried in the FU indicator and FU header
+	const size_t chunk = RTP_MTU - 2;
+	size_t frags = (len - 1 + chunk - 1) / chunk;
+	if (list->count + frags > list->cap)
+		return ESP_ERR_NO_MEM;
+
+	list->agg = -1;
+	uint8_t fu_ind = (nal[0] & 0xE0) | 28;
+	const uint8_t *data = nal + 1;
+	size_t rem = len - 1;
+
+	for (size_t i = 0; i < frags; i++)
+	{
+		size_t sz = (rem > chunk) ? chunk : rem;
+		rtp_packet_t *p = &list->pkts[list->count++];
+		p->payload = data;
+		p->len = sz;
+		p->prefix[0] = fu_ind;
+		p->prefix[1] = (nal[0] & 0x1F) | (i == 0 ? 0x80 : 0) | (sz == rem ? 0x40 : 0);
+		p->prefix_len = 2;
+		p->marker = false;
+		data += sz;
+		rem -= sz;
+	}
+	return ESP_OK;
+}
+
+void rtp_packet_list_end_au(rtp_packet_list_t *list)
+{
+	for (uint16_t i = 0; i < list->count; i++)
+		list->pkts[i].marker = false;
+	if (list->count > 0)
+		list->pkts[list->count - 1].marker = true;
+}
+
+size_t rtp_write_header(uint8_t *hdr, const rtp_packet_t *pkt, uint32_t ts, uint16_t seq, uint32_t ssrc)
+{
+	hdr[0] = 0x80;
+	hdr[1] = RTP_PT_H264 | (pkt->marker ? 0x80 : 0);
+	hdr[2] = (seq >> 8) & 0xFF;
+	hdr[3] = seq & 0xFF;
+	hdr[4] = (ts >> 24) & 0xFF;
+	hdr[5] = (ts >> 16) & 0xFF;
+	hdr[6] = (ts >> 8) & 0xFF;
+	hdr[7] = ts & 0xFF;
+	hdr[8] = (ssrc >> 24) & 0xFF;
+	hdr[9] = (ssrc >> 16) & 0xFF;
+	hdr[10] = (ssrc >> 8) & 0xFF;
+	hdr[11] = ssrc & 0xFF;
+
+	if (pkt->prefix_len > 0)
+		memcpy(hdr + RTP_HEADER_LEN, pkt->prefix, pkt->prefix_len);
+	return RTP_HEADER_LEN + pkt->prefix_len;
+}
+
+int rtp_send_batch(int sock, const struct sockaddr_in *dest, const rtp_packet_list_t *list,
+				   uint16_t first, uint16_t count, uint16_t *seq, uint32_t ssrc)
+{
+	uint8_t hdrs[RTP_BATCH_MAX][RTP_HEADER_LEN + RTP_PREFIX_MAX];
+	struct iovec iov[RTP_BATCH_MAX][2];
+
+	if (first >= list->count)
+		return 0;
+	if (count > list->count - first)
+		count = list->count - first;
+	if (count > RTP_BATCH_MAX)
+		count = RTP_BATCH_MAX;
+
+	for (uint16_t i = 0; i < count; i++)
+	{
+		const rtp_packet_t *pkt = &list->pkts[first + i];
+		iov[i][0].iov_base = hdrs[i];
+		iov[i][0].iov_len = rtp_write_header(hdrs[i], pkt, list->ts, (*seq)++, ssrc);
+		iov[i][1].iov_base = (void *)pkt->payload;
+		iov[i][1].iov_len = pkt->len;
+	}
+
+#if defined(__linux__)
+	struct mmsghdr msgs[RTP_BATCH_MAX];
+	memset(msgs, 0, sizeof(msgs[0]) * count);
+	for (uint16_t i = 0; i < count; i++)
+	{
+		msgs[i].msg_hdr.msg_name = (void *)dest;
+		msgs[i].msg_hdr.msg_namelen = sizeof(*dest);
+		msgs[i].msg_hdr.msg_iov = iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	int sent = 0;
+	while (sent < count)
+	{
+		int n = sendmmsg(sock, msgs + sent, count - sent, 0);
+		s_tx_stats.syscalls++;
+		if (n < 0)
+		{
+			s_tx_stats.errors++;
+			return -1;
+		}
+		sent += n;
+		s_tx_stats.packets += n;
+	}
+	return sent;
+#else
+	struct msghdr msg = {
+		.msg_name = (void *)dest,
+		.msg_namelen = sizeof(*dest),
+		.msg_iovlen = 2};
+
+	for (uint16_t i = 0; i < count; i++)
+	{
+		msg.msg_iov = iov[i];
+		s_tx_stats.syscalls++;
+		if (sendmsg(sock, &msg, 0) < 0)
+		{
+			s_tx_stats.errors++;
+			return -1;
+		}
+		s_tx_stats.packets++;
+	}
+	return count;
+#endif
+}
+
+void rtp_tx_record_frame(uint32_t us)
+{
+	s_tx_stats.frames++;
+	s_tx_stats.last_frame_us = us;
+	if (s_tx_stats.avg_frame_us == 0)
+		s_tx_stats.avg_frame_us = us;
+	else
+		s_tx_stats.avg_frame_us += ((int32_t)us - (int32_t)s_tx_stats.avg_frame_us) / 16;
+}
+
+void rtp_tx_record_queue(uint32_t frames, uint32_t packets)
+{
+	s_tx_stats.queued_frames = frames;
+	s_tx_stats.queued_packets = packets;
+	if (packets > s_tx_stats.peak_queued_packets)
+		s_tx_stats.peak_queued_packets = packets;
+}
+
+void rtp_tx_record_drop(void)
+{
+	s_tx_stats.dropped_frames++;
+}
+
+void rtp_tx_record_fec(uint32_t packets)
+{
+	s_tx_stats.fec_packets += packets;
+}
+
+static void bucket_refill(rtp_bucket_t *b, int64_t now_us)
+{
+	if (now_us > b->last_us)
+	{
+		b->tokens += (now_us - b->last_us) * (int64_t)b->rate_bps;
+		if (b->tokens > b->depth)
+			b->tokens = b->depth;
+	}
+	b->last_us = now_us;
+}
+
+void rtp_bucket_init(rtp_bucket_t *b, uint32_t rate_bps, uint32_t burst, int64_t now_us)
+{
+	b->rate_bps = rate_bps;
+	b->depth = (int64_t)burst * 8 * 1000000;
+	b->tokens = b->depth;
+	b->last_us = now_us;
+}
+
+void rtp_bucket_set_rate(rtp_bucket_t *b, uint32_t rate_bps, int64_t now_us)
+{
+	bucket_refill(b, now_us);
+	b->rate_bps = rate_bps;
+}
+
+int64_t rtp_bucket_wait_us(rtp_bucket_t *b, size_t bytes, int64_t now_us)
+{
+	int64_t need = (int64_t)bytes * 8 * 1000000;
+	if (need > b->depth)
+		need = b->depth;
+
+	bucket_refill(b, now_us);
+	if (b->tokens >= need || b->rate_bps == 0)
+		return 0;
+	return (need - b->tokens + b->rate_bps - 1) / b->rate_bps;
+}
+
+void rtp_bucket_consume(rtp_bucket_t *b, size_t bytes)
+{
+	b->tokens -= (int64_t)bytes * 8 * 1000000;
+}
+
+void rtp_get_tx_stats(rtp_tx_stats_t *stats)
+{
+	*stats = s_tx_stats;
+}
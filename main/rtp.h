@@ -0,0 +1,247 @@
+#ifndef RTP_H
+#define RTP_H
+
+#include "esp_err.h"
+#include "lwip/sockets.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define RTP_HEADER_LEN 12
+#define RTP_MTU 1400		 // Largest RTP payload
+#define RTP_PREFIX_MAX 2	 // FU indicator and FU header
+#define RTP_PT_H264 96
+#define RTP_PT_RTX 97 // Retransmissions of RTP_PT_H264 (RFC 4588)
+
+// Packets of one access unit; 1400-byte payloads cover 1.4 MB
+#define RTP_PACKET_LIST_MAX 1024
+
+// NAL units up to this size are aggregated into STAP-A packets (copied)
+#define RTP_STAP_NAL_MAX 512
+
+// Aggregation space per access unit: parameter sets, SEI and small slices
+#define RTP_STAP_ARENA 4096
+
+// Packets handed to the socket layer per call; also the fan-out granularity
+#define RTP_BATCH_MAX 16
+
+	/**
+	 * @brief One RTP packet of an access unit, payload referenced in place
+	 */
+	typedef struct
+	{
+		const uint8_t *payload;			 // Payload bytes after the prefix
+		uint16_t len;					 // Payload length without prefix
+		uint8_t prefix[RTP_PREFIX_MAX];	 // Payload header built by the packetizer
+		uint8_t prefix_len;
+		bool marker;					 // Last packet of the access unit
+	} rtp_packet_t;
+
+	/**
+	 * @brief Packets shared by every client receiving an access unit
+	 *
+	 * Descriptors only: sequence number and SSRC are filled in per client
+	 * when the header is written.
+	 */
+	typedef struct
+	{
+		rtp_packet_t *pkts;
+		uint16_t cap;
+		uint16_t count;
+		uint32_t ts;
+		uint8_t *arena;	   // STAP-A payloads, NULL disables aggregation
+		uint16_t arena_cap;
+		uint16_t arena_used;
+		int16_t agg;	   // Last packet if more NAL units may join it, else -1
+		bool agg_stap;	   // agg is already a STAP-A
+	} rtp_packet_list_t;
+
+	/**
+	 * @brief Transmit counters of the batched send path
+	 */
+	typedef struct
+	{
+		uint32_t frames;		// Access units sent
+		uint32_t packets;		// Packets handed to the socket layer
+		uint32_t syscalls;		// Socket calls made for them
+		uint32_t errors;		// Failed socket calls
+		uint32_t last_frame_us; // Fan-out time of the last access unit
+		uint32_t avg_frame_us;	// Moving average (1/16) of the fan-out time
+		uint32_t queued_frames;	 // Deepest session queue
+		uint32_t queued_packets; // Packets the pacer still holds back
+		uint32_t peak_queued_packets;
+		uint32_t dropped_frames; // Frames the frame store could not take
+		uint32_t fec_packets;	 // ULPFEC packets sent
+	} rtp_tx_stats_t;
+
+	/**
+	 * @brief Token bucket; tokens may go negative to let a run larger than
+	 * the depth through
+	 *
+	 * Tokens are kept in bit-microseconds so refills are exact.
+	 */
+	typedef struct
+	{
+		uint32_t rate_bps;
+		int64_t tokens;
+		int64_t depth; // Burst size
+		int64_t last_us;
+	} rtp_bucket_t;
+
+	/**
+	 * @brief Start an empty packet list
+	 *
+	 * @param list List to initialize
+	 * @param storage Descriptor array owned by the caller
+	 * @param cap Number of descriptors in storage
+	 * @param ts RTP timestamp of the access unit
+	 */
+	void rtp_packet_list_init(rtp_packet_list_t *list, rtp_packet_t *storage, uint16_t cap, uint32_t ts);
+
+	/**
+	 * @brief Enable STAP-A aggregation for a packet list
+	 *
+	 * @param list Packet list
+	 * @param arena Buffer for aggregated payloads, valid until the list is sent
+	 * @param cap Arena size
+	 */
+	void rtp_packet_list_set_arena(rtp_packet_list_t *list, uint8_t *arena, uint16_t cap);
+
+	/**
+	 * @brief Append the packets of one H.264 NAL unit (RFC 6184)
+	 *
+	 * NAL units up to RTP_MTU go in a single packet, larger ones are split
+	 * into FU-A fragments. With an arena, consecutive NAL units up to
+	 * RTP_STAP_NAL_MAX are copied into shared STAP-A packets; all other
+	 * data is referenced in place and must stay valid until the list is sent.
+	 *
+	 * @param list Packet list
+	 * @param nal NAL unit without start code
+	 * @param len NAL length
+	 * @return ESP_OK, ESP_ERR_NO_MEM if the list is full (NAL not added)
+	 */
+	esp_err_t rtp_packetize_h264(rtp_packet_list_t *list, const uint8_t *nal, size_t len);
+
+	/**
+	 * @brief Set the marker bit on the last packet and clear it elsewhere
+	 *
+	 * @param list Packet list holding one complete access unit
+	 */
+	void rtp_packet_list_end_au(rtp_packet_list_t *list);
+
+	/**
+	 * @brief Write the fixed RTP header and the packet's payload prefix
+	 *
+	 * @param hdr Output, at least RTP_HEADER_LEN + RTP_PREFIX_MAX bytes
+	 * @param pkt Packet descriptor
+	 * @param ts RTP timestamp
+	 * @param seq Sequence number
+	 * @param ssrc Synchronization source
+	 * @return Bytes written
+	 */
+	size_t rtp_write_header(uint8_t *hdr, const rtp_packet_t *pkt, uint32_t ts, uint16_t seq, uint32_t ssrc);
+
+	/**
+	 * @brief Send a run of packets from a list to one destination
+	 *
+	 * Headers for up to RTP_BATCH_MAX packets are built on the stack and the
+	 * payloads are referenced in place. On a Linux host the run goes out in a
+	 * single sendmmsg() call; on lwIP, which has no batched socket call, one
+	 * sendmsg() per packet.
+	 *
+	 * @param sock UDP socket
+	 * @param dest Destination address
+	 * @param list Packet list
+	 * @param first Index of the first packet to send
+	 * @param count Number of packets (clamped to RTP_BATCH_MAX and the list)
+	 * @param seq Sequence number of the first packet, advanced past the run
+	 * @param ssrc Synchronization source
+	 * @return Number of packets sent, -1 if the socket reported an error
+	 */
+	int rtp_send_batch(int sock, const struct sockaddr_in *dest, const rtp_packet_list_t *list,
+					   uint16_t first, uint16_t count, uint16_t *seq, uint32_t ssrc);
+
+	/**
+	 * @brief Account the fan-out time of one access unit
+	 *
+	 * @param us Time spent sending the access unit to all clients
+	 */
+	void rtp_tx_record_frame(uint32_t us);
+
+	/**
+	 * @brief Account the pacer backlog
+	 *
+	 * @param frames Frames waiting in the deepest session queue
+	 * @param packets Packets held back by the pacer
+	 */
+	void rtp_tx_record_queue(uint32_t frames, uint32_t packets);
+
+	/**
+	 * @brief Account a frame the frame store refused
+	 */
+	void rtp_tx_record_drop(void);
+
+	/**
+	 * @brief Account FEC packets sent to one client
+	 *
+	 * @param packets Packets sent
+	 */
+	void rtp_tx_record_fec(uint32_t packets);
+
+	/**
+	 * @brief Start a full token bucket
+	 *
+	 * @param b Bucket
+	 * @param rate_bps Refill rate in bits per second
+	 * @param burst Bucket depth in bytes
+	 * @param now_us Current time
+	 */
+	void rtp_bucket_init(rtp_bucket_t *b, uint32_t rate_bps, uint32_t burst, int64_t now_us);
+
+	/**
+	 * @brief Change the refill rate, keeping the current tokens
+	 *
+	 * @param b Bucket
+	 * @param rate_bps Refill rate in bits per second
+	 * @param now_us Current time
+	 */
+	void rtp_bucket_set_rate(rtp_bucket_t *b, uint32_t rate_bps, int64_t now_us);
+
+	/**
+	 * @brief Get the time until the bucket allows sending a run of bytes
+	 *
+	 * A run waits for tokens to cover it, or for a full bucket if it is
+	 * larger than the depth, so back-to-back data never exceeds the depth.
+	 *
+	 * @param b Bucket
+	 * @param bytes Bytes about to be sent
+	 * @param now_us Current time
+	 * @return 0 if sending is allowed now, otherwise microseconds to wait
+	 */
+	int64_t rtp_bucket_wait_us(rtp_bucket_t *b, size_t bytes, int64_t now_us);
+
+	/**
+	 * @brief Take tokens for sent bytes
+	 *
+	 * @param b Bucket
+	 * @param bytes Bytes sent
+	 */
+	void rtp_bucket_consume(rtp_bucket_t *b, size_t bytes);
+
+	/**
+	 * @brief Get the transmit counters
+	 *
+	 * @param stats Counter copy
+	 */
+	void rtp_get_tx_stats(rtp_tx_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RTP_H
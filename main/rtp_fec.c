@@ -0,0 +1,116 @@
+#include "rtp_fec.h"
+#include <string.h>
+
+void rtp_fec_xor(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	// Bytes up to a word boundary of dst, then words; src loads go through
+	// memcpy so they stay legal whatever its alignment
+	while (len > 0 && ((uintptr_t)dst & (sizeof(uint32_t) - 1)))
+	{
+		*dst++ ^= *src++;
+		len--;
+	}
+
+	uint32_t *d = (uint32_t *)dst;
+	for (; len >= 4 * sizeof(uint32_t); len -= 4 * sizeof(uint32_t))
+	{
+		uint32_t w[4];
+		memcpy(w, src, sizeof(w));
+		d[0] ^= w[0];
+		d[1] ^= w[1];
+		d[2] ^= w[2];
+		d[3] ^= w[3];
+		d += 4;
+		src += sizeof(w);
+	}
+	for (; len >= sizeof(uint32_t); len -= sizeof(uint32_t))
+	{
+		uint32_t w;
+		memcpy(&w, src, sizeof(w));
+		*d++ ^= w;
+		src += sizeof(w);
+	}
+
+	dst = (uint8_t *)d;
+	while (len-- > 0)
+		*dst++ ^= *src++;
+}
+
+void rtp_fec_generate(rtp_fec_list_t *fec, const rtp_packet_list_t *list, uint8_t percent)
+{
+	fec->count = 0;
+	if (percent == 0)
+		return;
+
+	for (uint16_t base = 0; base < list->count; base += RTP_FEC_SPAN)
+	{
+		uint16_t n = (list->count - base < RTP_FEC_SPAN) ? list->count - base : RTP_FEC_SPAN;
+		uint16_t k = (n * percent + 99) / 100;
+		if (k > n)
+			k = n;
+
+		for (uint16_t j = 0; j < k; j++)
+		{
+			if (fec->count == RTP_FEC_MAX)
+				return;
+
+			rtp_fec_packet_t *fp = &fec->pkts[fec->count++];
+			fp->first = base + j;
+			fp->mask = 0;
+			fp->mpt_rec = 0;
+			fp->ts_rec = 0;
+			fp->len_rec = 0;
+			fp->len = 0;
+			fp->payload = fec->arena + (size_t)(fec->count - 1) * RTP_FEC_PAYLOAD_MAX;
+
+			// Every k-th packet of the block, so burst losses spread over FEC packets
+			for (uint16_t i = j; i < n; i += k)
+			{
+				const rtp_packet_t *pkt = &list->pkts[base + i];
+				uint16_t len = pkt->prefix_len + pkt->len;
+				if (len > fp->len)
+				{
+					memset(fp->payload + fp->len, 0, len - fp->len);
+					fp->len = len;
+				}
+				rtp_fec_xor(fp->payload, pkt->prefix, pkt->prefix_len);
+				rtp_fec_xor(fp->payload + pkt->prefix_len, pkt->payload, pkt->len);
+
+				fp->mask |= 1ULL << (47 - (i - j));
+				fp->mpt_rec ^= (pkt->marker ? 0x80 : 0) | RTP_PT_H264;
+				fp->ts_rec ^= list->ts;
+				fp->len_rec ^= len;
+			}
+		}
+	}
+}
+
+size_t rtp_fec_write_header(uint8_t *hdr, const rtp_fec_packet_t *fp, uint32_t ts, uint16_t seq, uint32_t ssrc,
+							uint16_t sn_base)
+{
+	const rtp_packet_t bare = {.prefix_len = 0, .marker = false};
+	rtp_write_header(hdr, &bare, ts, seq, ssrc);
+	hdr[1] = RTP_PT_ULPFEC;
+
+	// The long mask is only needed when packets beyond the first 16 are covered
+	bool long_mask = (fp->mask & 0xFFFFFFFFULL) != 0;
+	uint8_t *f = hdr + RTP_HEADER_LEN;
+	f[0] = long_mask ? 0x40 : 0x00; // E = 0, L, P/X/CC recovery = 0
+	f[1] = fp->mpt_rec;
+	f[2] = sn_base >> 8;
+	f[3] = sn_base & 0xFF;
+	f[4] = fp->ts_rec >> 24;
+	f[5] = fp->ts_rec >> 16;
+	f[6] = fp->ts_rec >> 8;
+	f[7] = fp->ts_rec & 0xFF;
+	f[8] = fp->len_rec >> 8;
+	f[9] = fp->len_rec & 0xFF;
+
+	uint8_t *l = f + RTP_FEC_HEADER_LEN;
+	int mask_bytes = long_mask ? 6 : 2;
+	l[0] = fp->len >> 8;
+	l[1] = fp->len & 0xFF;
+	for (int i = 0; i < mask_bytes; i++)
+		l[2 + i] = fp->mask >> (40 - 8 * i);
+	return RTP_HEADER_LEN + RTP_FEC_HEADER_LEN + 2 + mask_bytes;
+}
@@ -0,0 +1,96 @@
+#ifndef RTP_FEC_H
+#define RTP_FEC_H
+
+#include "esp_err.h"
+#include "rtp.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define RTP_PT_ULPFEC 127
+#define RTP_FEC_HEADER_LEN 10 // FEC header (RFC 5109 7.3)
+#define RTP_FEC_LEVEL_LEN 8	  // Level 0 header with the 48-bit mask
+#define RTP_FEC_HEADERS_MAX (RTP_HEADER_LEN + RTP_FEC_HEADER_LEN + RTP_FEC_LEVEL_LEN)
+
+// Media packets one FEC packet can cover: the span of the long mask
+#define RTP_FEC_SPAN 48
+
+// FEC packets per access unit; protection is truncated beyond
+#define RTP_FEC_MAX 96
+
+// Protected bytes per media packet: payload header and payload
+#define RTP_FEC_PAYLOAD_MAX (RTP_PREFIX_MAX + RTP_MTU)
+
+	/**
+	 * @brief One ULPFEC packet of an access unit
+	 *
+	 * Everything but the SN base is the same for every client, so parity is
+	 * computed once per access unit.
+	 */
+	typedef struct
+	{
+		uint16_t first;	// Packet list index of the SN base
+		uint64_t mask;	 // Bit 47 protects the SN base, bit 46 the next packet...
+		uint8_t mpt_rec; // M and PT recovery; P, X and CC are always 0
+		uint32_t ts_rec;
+		uint16_t len_rec;
+		uint16_t len;	  // Protection length
+		uint8_t *payload; // XOR of the protected payloads, len bytes
+	} rtp_fec_packet_t;
+
+	/**
+	 * @brief FEC packets of one access unit
+	 */
+	typedef struct
+	{
+		rtp_fec_packet_t pkts[RTP_FEC_MAX];
+		uint16_t count;
+		uint8_t *arena; // RTP_FEC_MAX * RTP_FEC_PAYLOAD_MAX bytes
+	} rtp_fec_list_t;
+
+	/**
+	 * @brief XOR src into dst, a machine word at a time
+	 *
+	 * @param dst Accumulator
+	 * @param src Data, any alignment
+	 * @param len Bytes
+	 */
+	void rtp_fec_xor(uint8_t *dst, const uint8_t *src, size_t len);
+
+	/**
+	 * @brief Compute the ULPFEC packets protecting an access unit
+	 *
+	 * Packets are split into blocks of at most RTP_FEC_SPAN. A block of n
+	 * packets gets ceil(n * percent / 100) FEC packets, FEC packet j covering
+	 * packets j, j + k, j + 2k... so a burst of up to k losses is recoverable.
+	 *
+	 * @param fec Output, arena set by the caller
+	 * @param list Packets of the access unit, marker already set
+	 * @param percent Protection overhead, 0 disables
+	 */
+	void rtp_fec_generate(rtp_fec_list_t *fec, const rtp_packet_list_t *list, uint8_t percent);
+
+	/**
+	 * @brief Write the RTP, FEC and level 0 headers of a FEC packet
+	 *
+	 * @param hdr Output, RTP_FEC_HEADERS_MAX bytes
+	 * @param fp FEC packet
+	 * @param ts RTP timestamp of the access unit
+	 * @param seq Sequence number of the FEC stream
+	 * @param ssrc SSRC of the FEC stream
+	 * @param sn_base Media sequence number of packet fp->first
+	 * @return Bytes written; the payload follows
+	 */
+	size_t rtp_fec_write_header(uint8_t *hdr, const rtp_fec_packet_t *fp, uint32_t ts, uint16_t seq, uint32_t ssrc,
+								uint16_t sn_base);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RTP_FEC_H
@@ -0,0 +1,187 @@
+#include "rtp_history.h"
+#include "esp_heap_caps.h"
+#include <string.h>
+
+#define SLOT(seq) ((seq) & (RTP_HISTORY_PACKETS - 1))
+
+esp_err_t rtp_history_create(rtp_history_t *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->lock = xSemaphoreCreateMutex();
+	return h->lock ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+// Caller holds the lock
+static void release_locked(rtp_history_entry_t *e)
+{
+	frame_unref(e->frame);
+	e->frame = NULL;
+	e->valid = false;
+}
+
+// Caller holds the lock
+static void clear_locked(rtp_history_t *h)
+{
+	for (int i = 0; i < RTP_HISTORY_PACKETS; i++)
+	{
+		if (h->entries[i].valid)
+			release_locked(&h->entries[i]);
+	}
+	h->count = 0;
+	h->spill_total = 0;
+}
+
+esp_err_t rtp_history_open(rtp_history_t *h, uint32_t window_ms)
+{
+	rtp_history_entry_t *entries = heap_caps_calloc(RTP_HISTORY_PACKETS, sizeof(*entries), MALLOC_CAP_SPIRAM);
+	uint8_t *spill = heap_caps_malloc(RTP_HISTORY_SPILL, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+	if (!entries || !spill)
+	{
+		heap_caps_free(entries);
+		heap_caps_free(spill);
+		return ESP_ERR_NO_MEM;
+	}
+
+	xSemaphoreTake(h->lock, portMAX_DELAY);
+	if (h->entries)
+	{
+		clear_locked(h);
+		heap_caps_free(h->entries);
+		heap_caps_free(h->spill);
+	}
+	h->entries = entries;
+	h->spill = spill;
+	h->spill_total = 0;
+	h->window_us = window_ms * 1000;
+	h->count = 0;
+	xSemaphoreGive(h->lock);
+	return ESP_OK;
+}
+
+void rtp_history_close(rtp_history_t *h)
+{
+	xSemaphoreTake(h->lock, portMAX_DELAY);
+	if (h->entries)
+	{
+		clear_locked(h);
+		heap_caps_free(h->entries);
+		heap_caps_free(h->spill);
+		h->entries = NULL;
+		h->spill = NULL;
+	}
+	xSemaphoreGive(h->lock);
+}
+
+// Caller holds the lock; copies are contiguous, a run that would wrap starts over at 0
+static uint32_t spill_locked(rtp_history_t *h, const uint8_t *data, size_t len)
+{
+	uint32_t off = h->spill_total % RTP_HISTORY_SPILL;
+	if (off + len > RTP_HISTORY_SPILL)
+	{
+		h->spill_total += RTP_HISTORY_SPILL - off;
+		off = 0;
+	}
+	uint32_t pos = h->spill_total;
+	memcpy(h->spill + off, data, len);
+	h->spill_total += len;
+	return pos;
+}
+
+void rtp_history_push(rtp_history_t *h, const rtp_packet_list_t *list, uint16_t first, uint16_t count,
+					  uint16_t seq, stream_frame_t *frame, int64_t now_us)
+{
+	xSemaphoreTake(h->lock, portMAX_DELAY);
+	if (!h->entries)
+	{
+		xSemaphoreGive(h->lock);
+		return;
+	}
+
+	for (uint16_t i = first; i < list->count && i < first + count; i++, seq++)
+	{
+		const rtp_packet_t *pkt = &list->pkts[i];
+		rtp_history_entry_t *e = &h->entries[SLOT(seq)];
+		if (e->valid)
+			release_locked(e);
+
+		if (frame && pkt->payload >= frame->data && pkt->payload + pkt->len <= frame->data + frame->len)
+		{
+			e->frame = frame_ref(frame);
+			e->payload = pkt->payload;
+		}
+		else
+		{
+			e->payload = NULL;
+			e->spill_pos = spill_locked(h, pkt->payload, pkt->len);
+		}
+		e->ts = list->ts;
+		e->sent_us = now_us;
+		e->resent_us = 0;
+		e->seq = seq;
+		e->len = pkt->len;
+		memcpy(e->prefix, pkt->prefix, pkt->prefix_len);
+		e->prefix_len = pkt->prefix_len;
+		e->marker = pkt->marker;
+		e->valid = true;
+
+		// Packets lost to a failed send leave gaps that still count
+		uint32_t span = h->count + (h->count ? (uint16_t)(seq - h->newest) : 1);
+		h->count = span < RTP_HISTORY_PACKETS ? span : RTP_HISTORY_PACKETS;
+		h->newest = seq;
+	}
+
+	// Expire from the oldest end so frames are not pinned beyond the window
+	while (h->count > 0)
+	{
+		rtp_history_entry_t *e = &h->entries[SLOT((uint16_t)(h->newest - h->count + 1))];
+		if (e->valid && now_us - e->sent_us <= h->window_us)
+			break;
+		if (e->valid)
+			release_locked(e);
+		h->count--;
+	}
+	xSemaphoreGive(h->lock);
+}
+
+// Caller holds the lock
+static rtp_history_entry_t *find_locked(rtp_history_t *h, uint16_t seq, int64_t now_us)
+{
+	if (!h->entries || (uint16_t)(h->newest - seq) >= h->count)
+		return NULL;
+	rtp_history_entry_t *e = &h->entries[SLOT(seq)];
+	if (!e->valid || e->seq != seq || now_us - e->sent_us > h->window_us)
+		return NULL;
+
+	// Spilled copies are lost once the ring has moved a full turn past them
+	if (!e->payload && h->spill_total - e->spill_pos > RTP_HISTORY_SPILL)
+		return NULL;
+	return e;
+}
+
+esp_err_t rtp_history_get(rtp_history_t *h, uint16_t seq, uint32_t min_gap_us, int64_t now_us,
+						  rtp_packet_t *pkt, uint8_t *buf, uint32_t *ts)
+{
+	xSemaphoreTake(h->lock, portMAX_DELAY);
+	rtp_history_entry_t *e = find_locked(h, seq, now_us);
+	if (!e)
+	{
+		xSemaphoreGive(h->lock);
+		return ESP_ERR_NOT_FOUND;
+	}
+	if (e->resent_us != 0 && now_us - e->resent_us < min_gap_us)
+	{
+		xSemaphoreGive(h->lock);
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	memcpy(buf, e->payload ? e->payload : h->spill + e->spill_pos % RTP_HISTORY_SPILL, e->len);
+	pkt->payload = buf;
+	pkt->len = e->len;
+	memcpy(pkt->prefix, e->prefix, e->prefix_len);
+	pkt->prefix_len = e->prefix_len;
+	pkt->marker = e->marker;
+	*ts = e->ts;
+	e->resent_us = now_us;
+	xSemaphoreGive(h->lock);
+	return ESP_OK;
+}
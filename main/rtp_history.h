@@ -0,0 +1,119 @@
+#ifndef RTP_HISTORY_H
+#define RTP_HISTORY_H
+
+#include "esp_err.h"
+#include "rtp.h"
+#include "frame_store.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Packets remembered per stream, a power of two; the time window usually ends first
+#define RTP_HISTORY_PACKETS 1024
+
+// Copies of payloads that do not live in frame storage (STAP-A, parameter sets)
+#define RTP_HISTORY_SPILL 16384
+
+	/**
+	 * @brief One sent packet; the payload is referenced in its frame or copied
+	 */
+	typedef struct
+	{
+		stream_frame_t *frame;	// Reference held while the payload points into it
+		const uint8_t *payload; // In frame, or NULL if spilled
+		uint32_t spill_pos;		// Absolute spill offset of a copied payload
+		uint32_t ts;
+		int64_t sent_us;
+		int64_t resent_us;		// Last retransmission, 0 if none
+		uint16_t seq;
+		uint16_t len;
+		uint8_t prefix[RTP_PREFIX_MAX];
+		uint8_t prefix_len;
+		bool marker;
+		bool valid;
+	} rtp_history_entry_t;
+
+	/**
+	 * @brief Recently sent packets of one RTP stream, for retransmission
+	 *
+	 * Memory is bounded by RTP_HISTORY_PACKETS entries, the spill ring and
+	 * the time window: entries older than the window release their frame.
+	 */
+	typedef struct
+	{
+		rtp_history_entry_t *entries; // NULL while closed
+		uint8_t *spill;
+		uint32_t spill_total; // Bytes ever written to the spill ring
+		uint32_t window_us;
+		uint16_t newest;	  // Sequence number of the newest entry
+		uint16_t count;		  // Entries from newest backwards
+		SemaphoreHandle_t lock;
+	} rtp_history_t;
+
+	/**
+	 * @brief Create the lock of a history; done once per history lifetime
+	 *
+	 * @param h History
+	 * @return ESP_OK, ESP_ERR_NO_MEM
+	 */
+	esp_err_t rtp_history_create(rtp_history_t *h);
+
+	/**
+	 * @brief Allocate the storage of a history
+	 *
+	 * @param h History
+	 * @param window_ms How long packets are kept
+	 * @return ESP_OK, ESP_ERR_NO_MEM
+	 */
+	esp_err_t rtp_history_open(rtp_history_t *h, uint32_t window_ms);
+
+	/**
+	 * @brief Release all frame references and free the storage
+	 *
+	 * @param h History
+	 */
+	void rtp_history_close(rtp_history_t *h);
+
+	/**
+	 * @brief Remember a run of packets just sent
+	 *
+	 * @param h History, ignored while closed
+	 * @param list Packet list
+	 * @param first Index of the first packet sent
+	 * @param count Number of packets sent
+	 * @param seq Sequence number of the first packet
+	 * @param frame Frame holding the access unit, or NULL; payloads outside
+	 *              it are copied
+	 * @param now_us Send time
+	 */
+	void rtp_history_push(rtp_history_t *h, const rtp_packet_list_t *list, uint16_t first, uint16_t count,
+						  uint16_t seq, stream_frame_t *frame, int64_t now_us);
+
+	/**
+	 * @brief Look up a packet for retransmission
+	 *
+	 * @param h History
+	 * @param seq Sequence number
+	 * @param min_gap_us Refuse packets retransmitted less than this ago
+	 * @param now_us Current time
+	 * @param pkt Packet, its payload pointing into buf
+	 * @param buf Payload copy, at least RTP_MTU bytes
+	 * @param ts RTP timestamp of the packet
+	 * @return ESP_OK, ESP_ERR_NOT_FOUND if the packet is no longer kept,
+	 *         ESP_ERR_INVALID_STATE if it was just retransmitted
+	 */
+	esp_err_t rtp_history_get(rtp_history_t *h, uint16_t seq, uint32_t min_gap_us, int64_t now_us,
+							  rtp_packet_t *pkt, uint8_t *buf, uint32_t *ts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RTP_HISTORY_H
@@ -0,0 +1,229 @@
+#include "rtsp_request.h"
+#include <string.h>
+#include <strings.h>
+
+#define STATE_REQUEST_LINE 0
+#define STATE_HEADERS 1
+#define STATE_BODY 2
+
+static const struct
+{
+	const char *name;
+	rtsp_method_t method;
+} s_methods[] = {
+	{"OPTIONS", RTSP_METHOD_OPTIONS},
+	{"DESCRIBE", RTSP_METHOD_DESCRIBE},
+	{"SETUP", RTSP_METHOD_SETUP},
+	{"PLAY", RTSP_METHOD_PLAY},
+	{"PAUSE", RTSP_METHOD_PAUSE},
+	{"TEARDOWN", RTSP_METHOD_TEARDOWN},
+	{"GET_PARAMETER", RTSP_METHOD_GET_PARAMETER},
+	{"SET_PARAMETER", RTSP_METHOD_SET_PARAMETER},
+};
+
+void rtsp_parser_reset(rtsp_parser_t *p, size_t max_len)
+{
+	memset(p, 0, sizeof(*p));
+	p->max_len = max_len < UINT16_MAX ? max_len : UINT16_MAX;
+	p->cseq = -1;
+}
+
+bool rtsp_parser_idle(const rtsp_parser_t *p)
+{
+	return p->state == STATE_REQUEST_LINE && p->scanned == 0;
+}
+
+static bool is_space(char ch)
+{
+	return ch == ' ' || ch == '\t';
+}
+
+// Decimal field value; false if empty, not a number or above max
+static bool parse_number(const char *s, size_t len, size_t max, size_t *out)
+{
+	size_t v = 0;
+	if (len == 0)
+		return false;
+	for (size_t i = 0; i < len; i++)
+	{
+		if (s[i] < '0' || s[i] > '9')
+			return false;
+		v = v * 10 + (s[i] - '0');
+		if (v > max)
+			return false;
+	}
+	*out = v;
+	return true;
+}
+
+// METHOD SP URI SP RTSP/x.y, line from off to end (CRLF excluded)
+static esp_err_t parse_request_line(rtsp_parser_t *p, const char *buf, size_t off, size_t end)
+{
+	const char *line = buf + off;
+	size_t len = end - off;
+
+	const char *sp1 = memchr(line, ' ', len);
+	if (!sp1 || sp1 == line)
+		return ESP_ERR_INVALID_ARG;
+	const char *uri = sp1 + 1;
+	const char *sp2 = memchr(uri, ' ', line + len - uri);
+	if (!sp2 || sp2 == uri)
+		return ESP_ERR_INVALID_ARG;
+	const char *version = sp2 + 1;
+	if (line + len - version < 5 || memcmp(version, "RTSP/", 5) != 0)
+		return ESP_ERR_INVALID_ARG;
+
+	p->method_name = (rtsp_span_t){.off = off, .len = sp1 - line};
+	p->uri = (rtsp_span_t){.off = uri - buf, .len = sp2 - uri};
+	p->method = RTSP_METHOD_UNKNOWN;
+	for (size_t i = 0; i < sizeof(s_methods) / sizeof(s_methods[0]); i++)
+	{
+		if (strlen(s_methods[i].name) == p->method_name.len &&
+			memcmp(s_methods[i].name, line, p->method_name.len) == 0)
+		{
+			p->method = s_methods[i].method;
+			break;
+		}
+	}
+	return ESP_OK;
+}
+
+// Name: value, line from off to end (CRLF excluded); unknown fields are skipped
+static esp_err_t parse_header(rtsp_parser_t *p, const char *buf, size_t off, size_t end)
+{
+	const char *line = buf + off;
+	size_t len = end - off;
+
+	// Folded continuation of the previous field; nothing we use is folded
+	if (is_space(line[0]))
+		return ESP_OK;
+
+	const char *colon = memchr(line, ':', len);
+	if (!colon || colon == line)
+		return ESP_ERR_INVALID_ARG;
+	size_t name_len = colon - line;
+	while (name_len > 0 && is_space(line[name_len - 1]))
+		name_len--;
+
+	const char *value = colon + 1;
+	const char *value_end = line + len;
+	while (value < value_end && is_space(*value))
+		value++;
+	while (value_end > value && is_space(value_end[-1]))
+		value_end--;
+	rtsp_span_t span = {.off = value - buf, .len = value_end - value};
+
+#define NAME_IS(s) (name_len == sizeof(s) - 1 && strncasecmp(line, s, name_len) == 0)
+	if (NAME_IS("CSeq"))
+	{
+		size_t cseq;
+		if (!parse_number(value, span.len, INT32_MAX, &cseq))
+			return ESP_ERR_INVALID_ARG;
+		p->cseq = cseq;
+	}
+	else if (NAME_IS("Content-Length"))
+	{
+		if (!parse_number(value, span.len, INT32_MAX, &p->content_length))
+			return ESP_ERR_INVALID_ARG;
+	}
+	else if (NAME_IS("Session"))
+	{
+		p->session = span;
+	}
+	else if (NAME_IS("Transport"))
+	{
+		p->transport = span;
+	}
+	else if (NAME_IS("Range"))
+	{
+		p->range = span;
+	}
+#undef NAME_IS
+	return ESP_OK;
+}
+
+static rtsp_slice_t slice(const char *buf, rtsp_span_t span)
+{
+	return (rtsp_slice_t){.ptr = span.len ? buf + span.off : NULL, .len = span.len};
+}
+
+esp_err_t rtsp_parser_feed(rtsp_parser_t *p, const char *buf, size_t len, rtsp_request_t *req)
+{
+	while (p->state != STATE_BODY)
+	{
+		const char *nl = memchr(buf + p->scanned, '\n', len - p->scanned);
+		if (!nl)
+		{
+			p->scanned = len;
+			return len >= p->max_len ? ESP_ERR_INVALID_SIZE : ESP_ERR_NOT_FINISHED;
+		}
+		size_t next = nl - buf + 1;
+		if (next > p->max_len)
+			return ESP_ERR_INVALID_SIZE;
+		size_t end = next - 1;
+		if (end > p->line && buf[end - 1] == '\r')
+			end--;
+
+		esp_err_t ret = ESP_OK;
+		if (p->state == STATE_REQUEST_LINE)
+		{
+			// Blank lines ahead of a request are tolerated (RFC 2326 15.1)
+			if (end > p->line)
+			{
+				ret = parse_request_line(p, buf, p->line, end);
+				p->state = STATE_HEADERS;
+			}
+		}
+		else if (end == p->line)
+		{
+			p->head_len = next;
+			p->state = STATE_BODY;
+		}
+		else
+		{
+			ret = parse_header(p, buf, p->line, end);
+		}
+		if (ret != ESP_OK)
+			return ret;
+		p->line = next;
+		p->scanned = next;
+	}
+
+	size_t total = p->head_len + p->content_length;
+	if (total > p->max_len)
+		return ESP_ERR_INVALID_SIZE;
+	if (len < total)
+		return ESP_ERR_NOT_FINISHED;
+
+	req->method = p->method;
+	req->method_name = slice(buf, p->method_name);
+	req->uri = slice(buf, p->uri);
+	req->cseq = p->cseq;
+	req->session = slice(buf, p->session);
+	req->transport = slice(buf, p->transport);
+	req->range = slice(buf, p->range);
+	req->body = (rtsp_slice_t){.ptr = p->content_length ? buf + p->head_len : NULL, .len = p->content_length};
+	req->len = total;
+	rtsp_parser_reset(p, p->max_len);
+	return ESP_OK;
+}
+
+const char *rtsp_slice_find(rtsp_slice_t s, const char *needle)
+{
+	size_t n = strlen(needle);
+	if (n == 0 || s.len < n)
+		return NULL;
+
+	const char *p = s.ptr;
+	const char *last = s.ptr + s.len - n;
+	while (p <= last)
+	{
+		p = memchr(p, needle[0], last - p + 1);
+		if (!p)
+			return NULL;
+		if (memcmp(p, needle, n) == 0)
+			return p;
+		p++;
+	}
+	return NULL;
+}
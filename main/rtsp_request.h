@@ -0,0 +1,132 @@
+#ifndef RTSP_REQUEST_H
+#define RTSP_REQUEST_H
+
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	typedef enum
+	{
+		RTSP_METHOD_UNKNOWN,
+		RTSP_METHOD_OPTIONS,
+		RTSP_METHOD_DESCRIBE,
+		RTSP_METHOD_SETUP,
+		RTSP_METHOD_PLAY,
+		RTSP_METHOD_PAUSE,
+		RTSP_METHOD_TEARDOWN,
+		RTSP_METHOD_GET_PARAMETER,
+		RTSP_METHOD_SET_PARAMETER,
+	} rtsp_method_t;
+
+	/**
+	 * @brief Part of the receive buffer; not NUL terminated
+	 */
+	typedef struct
+	{
+		const char *ptr;
+		size_t len; // 0 if absent
+	} rtsp_slice_t;
+
+	/**
+	 * @brief One complete request, all slices pointing into the buffer fed
+	 */
+	typedef struct
+	{
+		rtsp_method_t method;
+		rtsp_slice_t method_name;
+		rtsp_slice_t uri;
+		int32_t cseq; // -1 if absent
+		rtsp_slice_t session;
+		rtsp_slice_t transport;
+		rtsp_slice_t range;
+		rtsp_slice_t body; // Content-Length bytes after the header block
+		size_t len;		   // Bytes of the whole message
+	} rtsp_request_t;
+
+	/**
+	 * @brief Header field as an offset into the message, until it completes
+	 */
+	typedef struct
+	{
+		uint16_t off;
+		uint16_t len;
+	} rtsp_span_t;
+
+	/**
+	 * @brief Tokenizer state carried across reads of one connection
+	 *
+	 * Offsets are relative to the start of the message, so the caller may
+	 * move an incomplete message within its buffer between reads.
+	 */
+	typedef struct
+	{
+		uint8_t state;
+		size_t max_len;		   // Longest message accepted
+		size_t scanned;		   // Bytes searched for line ends so far
+		size_t line;		   // Start of the line being read
+		size_t head_len;	   // Header block with its blank line, once seen
+		size_t content_length; // Body bytes announced
+		rtsp_method_t method;
+		rtsp_span_t method_name;
+		rtsp_span_t uri;
+		int32_t cseq;
+		rtsp_span_t session;
+		rtsp_span_t transport;
+		rtsp_span_t range;
+	} rtsp_parser_t;
+
+	/**
+	 * @brief Prepare a parser for the next message
+	 *
+	 * @param p Parser
+	 * @param max_len Longest message accepted, at most 65535 bytes
+	 */
+	void rtsp_parser_reset(rtsp_parser_t *p, size_t max_len);
+
+	/**
+	 * @brief Check whether a parser has seen no byte of the current message
+	 *
+	 * Interleaved binary records can only start at such a point.
+	 *
+	 * @param p Parser
+	 * @return true between messages
+	 */
+	bool rtsp_parser_idle(const rtsp_parser_t *p);
+
+	/**
+	 * @brief Tokenize what arrived of a message
+	 *
+	 * Only bytes not examined by an earlier call are scanned. On ESP_OK the
+	 * parser is reset for the next message, which may already follow in buf.
+	 *
+	 * @param p Parser
+	 * @param buf Message start; bytes fed earlier must still be in place
+	 * @param len Bytes available from buf
+	 * @param req Output, filled on ESP_OK
+	 * @return ESP_OK if req holds a complete message, ESP_ERR_NOT_FINISHED if
+	 *         more data is needed, ESP_ERR_INVALID_ARG for a malformed
+	 *         request line or header, ESP_ERR_INVALID_SIZE if the message
+	 *         exceeds max_len
+	 */
+	esp_err_t rtsp_parser_feed(rtsp_parser_t *p, const char *buf, size_t len, rtsp_request_t *req);
+
+	/**
+	 * @brief Find a string inside a slice
+	 *
+	 * @param s Slice
+	 * @param needle NUL-terminated string
+	 * @return First occurrence, or NULL
+	 */
+	const char *rtsp_slice_find(rtsp_slice_t s, const char *needle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RTSP_REQUEST_H
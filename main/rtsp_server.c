@@ -1,40 +1,72 @@
 #include "rtsp_server.h"
+#include "h264_parse.h"
+#include "rtp.h"
+#include "rtcp.h"
+#include "frame_store.h"
+#include "tcp_queue.h"
+#include "rtp_history.h"
+#include "rtp_fec.h"
+#include "rtsp_request.h"
+#include "camera_encoder.h"
 #include <string.h>
 #include <inttypes.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 #include "lwip/sockets.h"
 #include "esp_system.h"
 
 static const char *TAG = "rtsp";
 
-// SDP for H.264
+// SDP for H.264, session part; the media part is cached in s_sdp_media
 static const char *sdp_template =
 	"v=0\r\n"
 	"o=- %u %u IN IP4 %s\r\n"
 	"s=Connected Experimental 0.1\r\n"
 	"c=IN IP4 0.0.0.0\r\n"
 	"t=0 0\r\n"
-	"m=video %d RTP/AVP 96\r\n"
+	"%s";
+
+#if CONFIG_RTP_RTX
+#define SDP_PT_RTX " 97"
+#else
+#define SDP_PT_RTX ""
+#endif
+#if CONFIG_RTP_FEC
+#define SDP_PT_FEC " 127"
+#else
+#define SDP_PT_FEC ""
+#endif
+#define SDP_PAYLOAD_TYPES "96" SDP_PT_RTX SDP_PT_FEC
+
+// Media description used until the encoder has produced an SPS
+static const char *sdp_media_default =
+	"m=video %d RTP/AVP " SDP_PAYLOAD_TYPES "\r\n"
 	"a=rtpmap:96 H264/90000\r\n"
 	"a=fmtp:96 packetization-mode=1;profile-level-id=42001f\r\n"
+	"%s"
 	"a=control:track0\r\n";
 
-#define MAX_CLIENTS 4
+#define MAX_TARGETS (RTSP_SERVER_MAX_CLIENTS + 1) // Unicast clients and the multicast group
 #define RTSP_PORT 8554
 #define RTP_PORT 5004
 #define RTCP_PORT 5005
-#define RTSP_BUF 2048
-#define RTP_MTU 1400
+// Frames a session may have waiting for the sender; beyond that it drops to the next IDR
+#define SESSION_QUEUE_LEN 8
+#define GOP_CACHE_MAX_FRAMES 128 // Frames of the cached GOP, whatever their size
+#define RTSP_RX_BUF 768 // Per connection; holds one request or interleaved RTCP record
+#define STR_(x) #x
+#define STR(x) STR_(x)
+#define SESSION_TIMEOUT ";timeout=" STR(CONFIG_RTSP_SESSION_TIMEOUT_S) // Session header parameter
 
 typedef struct
 {
-	int sock;
-	int rtp_sock;
-	int rtcp_sock;
+	int sock; // Control connection, -1 while the slot is free
 	rtsp_state_t state;
 	uint32_t session;
 	uint16_t rtp_seq;
@@ -42,124 +74,474 @@ typedef struct
 	struct sockaddr_in addr;
 	uint16_t rtp_port;
 	uint16_t rtcp_port;
+	uint32_t param_version; // Parameter-set version last sent to this client
+	rtp_bucket_t bucket;	// Pacing of this client's RTP stream
+	tcp_queue_t *txq;		// Control socket writer when RTP is interleaved, else NULL
+	uint8_t rtp_channel;	// Interleaved channel numbers
+	uint8_t rtcp_channel;
+	bool skip_to_idr;		// Part of a frame was lost; resume at the next IDR
+	bool drop_to_idr;		// The frame queue overflowed; admit nothing before the next IDR
+	stream_frame_t *queue[SESSION_QUEUE_LEN]; // Frames waiting for the sender, under s_queue_lock
+	uint8_t queue_head;
+	uint8_t queue_len;
+	uint32_t dropped_frames; // Frames never sent to this session
+	uint64_t dropped_bytes;
+	bool catching_up;		 // Fed from the GOP cache, not the queue, under s_queue_lock
+	uint16_t gop_next;		 // Next cached frame to send while catching up
+	int64_t play_us;		 // When PLAY started the stream
+	uint32_t first_frame_us; // PLAY to the first video frame sent, 0 until then
+	bool multicast;			// Receives the shared multicast group stream
+	bool mcast_joined;		// Counted in s_mcast_viewers
+	rtp_history_t *history; // Sent packets kept for NACKs, NULL if none
+	uint32_t rtx_ssrc;		// Retransmission stream (RFC 4588)
+	uint16_t rtx_seq;
+	uint32_t fec_ssrc;		// ULPFEC stream (RFC 5109)
+	uint16_t fec_seq;
+	uint16_t au_seq;		// Sequence number of the first packet of the current access unit
+	rtcp_stats_t rtcp;		// Sender counters and receiver feedback
+	int64_t rtcp_next_us;	// Due time of the next sender report
 	bool active;
+	uint32_t last_seen_ms;	// Last request or RTCP from the client, esp_timer ms
+	uint16_t rx_len;		// Bytes buffered in rx
+	uint16_t rx_skip;		// Bytes of an oversized interleaved record still to discard
+	rtsp_parser_t parser;	// State of the request in rx
+	char rx[RTSP_RX_BUF];	// Partial request, NUL terminated
 } client_t;
 
-static client_t s_clients[MAX_CLIENTS];
+// Slots are claimed and freed only by server_task; other tasks read them
+static client_t *s_clients;
+static int s_num_clients; // Slots in s_clients, 0 before rtsp_server_init()
+static int s_max_clients = CONFIG_RTSP_MAX_CLIENTS;
+static tcp_queue_t *s_tcp_queues; // One per client slot, never freed
+#if CONFIG_RTP_NACK
+static rtp_history_t *s_histories; // Likewise, storage only while playing over UDP
+
+// A packet is resent at most once per round trip, or this often before one is known
+#define RTX_MIN_GAP_US 20000
+#endif
+#if CONFIG_RTSP_MULTICAST
+static client_t s_mcast = {.sock = -1}; // Group sender shared by all multicast sessions
+static uint32_t s_mcast_viewers;			  // Multicast sessions in PLAYING
+static SemaphoreHandle_t s_mcast_lock;
+#endif
 static int s_listen_sock = -1;
+static int s_rtp_sock = -1;	 // RTP_PORT, shared by all sessions
+static int s_rtcp_sock = -1; // RTCP_PORT, likewise
 static TaskHandle_t s_server_task = NULL;
 static bool s_running = false;
-static uint8_t s_sps[256], s_pps[256];
+static uint8_t s_sps[H264_PARAM_SET_MAX], s_pps[H264_PARAM_SET_MAX];
 static size_t s_sps_len, s_pps_len;
+static uint8_t s_sps_raw[H264_PARAM_SET_MAX]; // SPS as produced by the encoder
+static size_t s_sps_raw_len;
 static bool s_sps_pps_ready = false;
+static uint32_t s_param_version; // Bumped whenever the SPS/PPS bytes change
+static uint32_t s_framerate;
+static SemaphoreHandle_t s_param_lock;
+static char s_sdp_media[512];
+static uint32_t s_last_ts;	 // RTP timestamp of the last access unit sent
+static int64_t s_last_ts_us; // and when it was sent; both under s_param_lock
+static char s_cname[RTCP_CNAME_MAX];
+static TaskHandle_t s_rtcp_task;
+static rtp_packet_t s_au_pkts[RTP_PACKET_LIST_MAX]; // Packets of the access unit being sent
+#if CONFIG_RTP_STAP_A
+static uint8_t s_au_arena[RTP_STAP_ARENA]; // STAP-A payloads of that access unit
+#endif
+#if CONFIG_RTP_FEC
+static rtp_fec_list_t s_au_fec; // Parity of that access unit, arena in PSRAM
+#endif
+
+static SemaphoreHandle_t s_queue_lock; // Session frame queues
+static SemaphoreHandle_t s_send_lock;  // Held by the sender while it uses sessions
+static SemaphoreHandle_t s_send_sem;   // Given when a frame was queued
+static TaskHandle_t s_sender_task;
+#if CONFIG_RTSP_GOP_CACHE
+// The current GOP, IDR first, under s_queue_lock; empty until an IDR
+// arrives and after the GOP outgrew CONFIG_RTSP_GOP_CACHE_KB
+static stream_frame_t *s_gop[GOP_CACHE_MAX_FRAMES];
+static uint16_t s_gop_len;
+static size_t s_gop_bytes;
+#endif
+
+#if CONFIG_RTP_PACING
+// Share of the frame interval an access unit may be spread over
+#define PACER_SPREAD_PERCENT 80
+// Cached GOP frames leave this many times faster than real time
+#define CATCHUP_SPEEDUP 4
+
+static esp_timer_handle_t s_pacer_timer;
+#endif
+
+#if CONFIG_RTP_PACING
+static void pacer_timer_cb(void *arg);
+#endif
+static void sender_task(void *arg);
+static void send_au(stream_frame_t *frame, uint32_t ts, bool catchup, client_t **sessions, int n_sessions);
+static void session_flush(client_t *c);
+#if CONFIG_RTSP_GOP_CACHE
+static uint16_t gop_cache_join_locked(client_t *c);
+#endif
+static int stream_senders(client_t **senders);
+
+static size_t base64_encode(const uint8_t *in, size_t len, char *out, size_t cap)
+{
+	static const char tbl[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t o = 0;
+
+	if (cap < ((len + 2) / 3) * 4 + 1)
+		return 0;
+	for (size_t i = 0; i < len; i += 3)
+	{
+		uint32_t v = in[i] << 16;
+		if (i + 1 < len)
+			v |= in[i + 1] << 8;
+		if (i + 2 < len)
+			v |= in[i + 2];
+		out[o++] = tbl[(v >> 18) & 0x3F];
+		out[o++] = tbl[(v >> 12) & 0x3F];
+		out[o++] = (i + 1 < len) ? tbl[(v >> 6) & 0x3F] : '=';
+		out[o++] = (i + 2 < len) ? tbl[v & 0x3F] : '=';
+	}
+	out[o] = 0;
+	return o;
+}
+
+/**
+ * @brief Derive the served SPS from the encoder's SPS
+ *
+ * Adds VUI timing and bitstream_restriction so players do not hold frames
+ * back for reordering. Called with s_param_lock held, once per change of the
+ * encoder SPS or the frame rate.
+ *
+ * @return true if the served SPS bytes changed
+ */
+static bool rewrite_sps(void)
+{
+	uint8_t sps[H264_PARAM_SET_MAX];
+	size_t len = h264_sps_rewrite_vui(s_sps_raw, s_sps_raw_len, s_framerate, sps, sizeof(sps));
+
+	if (len == 0)
+	{
+		// Serve the encoder's SPS unchanged
+		memcpy(sps, s_sps_raw, s_sps_raw_len);
+		len = s_sps_raw_len;
+	}
+	if (len == s_sps_len && memcmp(sps, s_sps, len) == 0)
+		return false;
+
+	memcpy(s_sps, sps, len);
+	s_sps_len = len;
+	return true;
+}
 
-static const uint8_t *find_nal(const uint8_t *data, size_t len)
+/**
+ * @brief Write the feedback, retransmission and FEC attributes of the media
+ */
+static void sdp_media_extra(char *buf, size_t cap)
 {
-	for (size_t i = 0; i < len - 3; i++)
+	int n = 0;
+	buf[0] = 0;
+#if CONFIG_RTP_NACK
+	n += snprintf(buf + n, cap - n, "a=rtcp-fb:96 nack\r\n");
+#endif
+	n += snprintf(buf + n, cap - n, "a=rtcp-fb:96 nack pli\r\na=rtcp-fb:96 ccm fir\r\n");
+#if CONFIG_RTP_RTX
+	n += snprintf(buf + n, cap - n, "a=rtpmap:97 rtx/90000\r\na=fmtp:97 apt=96;rtx-time=%d\r\n",
+				  CONFIG_RTP_NACK_HISTORY_MS);
+#endif
+#if CONFIG_RTP_FEC
+	n += snprintf(buf + n, cap - n, "a=rtpmap:127 ulpfec/90000\r\n");
+#endif
+	(void)n;
+}
+
+/**
+ * @brief Rebuild the cached SDP media description from the stored SPS/PPS
+ *
+ * Called with s_param_lock held, only when the parameter sets change.
+ */
+static void build_sdp_media(void)
+{
+	char sps_b64[((H264_PARAM_SET_MAX + 2) / 3) * 4 + 1];
+	char pps_b64[((H264_PARAM_SET_MAX + 2) / 3) * 4 + 1];
+	char extra[192];
+	h264_sps_t sps;
+
+	sdp_media_extra(extra, sizeof(extra));
+	if (s_sps_len == 0 || s_pps_len == 0 || h264_parse_sps(s_sps, s_sps_len, &sps) != ESP_OK)
 	{
-		if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
-			return &data[i];
-		if (i < len - 4 && data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 0 && data[i + 3] == 1)
-			return &data[i];
+		snprintf(s_sdp_media, sizeof(s_sdp_media), sdp_media_default, RTP_PORT, extra);
+		return;
 	}
-	return NULL;
+
+	base64_encode(s_sps, s_sps_len, sps_b64, sizeof(sps_b64));
+	base64_encode(s_pps, s_pps_len, pps_b64, sizeof(pps_b64));
+
+	int n = snprintf(s_sdp_media, sizeof(s_sdp_media),
+					 "m=video %d RTP/AVP " SDP_PAYLOAD_TYPES "\r\n"
+					 "a=rtpmap:96 H264/90000\r\n"
+					 "a=fmtp:96 packetization-mode=1;profile-level-id=%02X%02X%02X;sprop-parameter-sets=%s,%s\r\n"
+					 "a=framesize:96 %" PRIu32 "-%" PRIu32 "\r\n"
+					 "%s",
+					 RTP_PORT, sps.profile_idc, sps.constraint_flags, sps.level_idc, sps_b64, pps_b64,
+					 sps.width, sps.height, extra);
+
+	// Prefer the rate signalled in the stream, fall back to the configured one
+	uint32_t fps_milli = h264_sps_framerate_milli(&sps);
+	if (fps_milli == 0)
+		fps_milli = s_framerate * 1000;
+	if (fps_milli > 0 && n > 0 && n < (int)sizeof(s_sdp_media))
+	{
+		n += snprintf(s_sdp_media + n, sizeof(s_sdp_media) - n, "a=framerate:%" PRIu32 ".%02" PRIu32 "\r\n",
+					  fps_milli / 1000, (fps_milli % 1000) / 10);
+	}
+	if (n > 0 && n < (int)sizeof(s_sdp_media))
+		snprintf(s_sdp_media + n, sizeof(s_sdp_media) - n, "a=control:track0\r\n");
+
+	ESP_LOGI(TAG, "SDP updated: profile %d level %d, %" PRIu32 "x%" PRIu32,
+			 sps.profile_idc, sps.level_idc, sps.width, sps.height);
 }
 
-static esp_err_t send_rtp(client_t *c, const uint8_t *data, size_t len, bool m, uint32_t ts)
+/**
+ * @brief Queue a run of packets as $-framed records on the control socket
+ *
+ * @return ESP_ERR_NO_MEM when the client's queue is full; the client then
+ *         skips frames until the next IDR
+ */
+static esp_err_t send_batch_interleaved(client_t *c, const rtp_packet_list_t *list, uint16_t first, uint16_t count)
+{
+	for (uint16_t i = first; i < list->count && i < first + count; i++)
+	{
+		const rtp_packet_t *pkt = &list->pkts[i];
+		uint8_t hdr[4 + RTP_HEADER_LEN + RTP_PREFIX_MAX];
+		size_t hdr_len = rtp_write_header(hdr + 4, pkt, list->ts, c->rtp_seq++, c->ssrc);
+		size_t rtp_len = hdr_len + pkt->len;
+		hdr[0] = '$';
+		hdr[1] = c->rtp_channel;
+		hdr[2] = rtp_len >> 8;
+		hdr[3] = rtp_len & 0xFF;
+
+		struct iovec iov[2] = {
+			{.iov_base = hdr, .iov_len = 4 + hdr_len},
+			{.iov_base = (void *)pkt->payload, .iov_len = pkt->len}};
+		esp_err_t ret = tcp_queue_write(c->txq, iov, 2);
+		if (ret == ESP_ERR_NO_MEM)
+			c->skip_to_idr = true;
+		if (ret != ESP_OK)
+			return ret;
+	}
+	return ESP_OK;
+}
+
+/**
+ * @brief Send a run of packets to one client
+ *
+ * Payloads go to the socket in place; see rtp_send_batch(). Packets sent
+ * over UDP are remembered for retransmission, referencing frame when their
+ * payload lies in it.
+ */
+static esp_err_t send_batch(client_t *c, const rtp_packet_list_t *list, uint16_t first, uint16_t count,
+							stream_frame_t *frame)
 {
 	if (!c->active || c->state != RTSP_STATE_PLAYING)
 		return ESP_OK;
 
-	uint8_t pkt[12 + RTP_MTU];
-	pkt[0] = 0x80;
-	pkt[1] = 96 | (m ? 0x80 : 0);
-	pkt[2] = (c->rtp_seq >> 8) & 0xFF;
-	pkt[3] = c->rtp_seq & 0xFF;
-	pkt[4] = (ts >> 24) & 0xFF;
-	pkt[5] = (ts >> 16) & 0xFF;
-	pkt[6] = (ts >> 8) & 0xFF;
-	pkt[7] = ts & 0xFF;
-	pkt[8] = (c->ssrc >> 24) & 0xFF;
-	pkt[9] = (c->ssrc >> 16) & 0xFF;
-	pkt[10] = (c->ssrc >> 8) & 0xFF;
-	pkt[11] = c->ssrc & 0xFF;
-	c->rtp_seq++;
-
-	memcpy(pkt + 12, data, len);
+	// Sender report counters; payload octets only, as RFC 3550 defines them
+	uint16_t end = (first + count < list->count) ? first + count : list->count;
+	uint32_t octets = 0;
+	for (uint16_t i = first; i < end; i++)
+		octets += list->pkts[i].prefix_len + list->pkts[i].len;
+
+	if (c->txq)
+	{
+		esp_err_t ret = send_batch_interleaved(c, list, first, count);
+		if (ret == ESP_OK)
+		{
+			c->rtcp.packets_sent += end - first;
+			c->rtcp.octets_sent += octets;
+		}
+		return ret;
+	}
 
 	struct sockaddr_in dest = {
 		.sin_family = AF_INET,
 		.sin_addr.s_addr = c->addr.sin_addr.s_addr,
 		.sin_port = htons(c->rtp_port)};
 
-	int sent = sendto(c->rtp_sock, pkt, len + 12, 0, (struct sockaddr *)&dest, sizeof(dest));
+	uint16_t seq = c->rtp_seq;
+	int sent = rtp_send_batch(s_rtp_sock, &dest, list, first, count, &c->rtp_seq, c->ssrc);
 	if (sent < 0)
 	{
-		ESP_LOGE(TAG, "Failed to send RTP packet: errno %d", errno);
+		// The rest of the access unit is skipped; the client cannot decode until the next IDR
+		ESP_LOGE(TAG, "Failed to send RTP packets: errno %d", errno);
+		c->skip_to_idr = true;
 		return ESP_FAIL;
 	}
+	if (c->history)
+		rtp_history_push(c->history, list, first, sent, seq, frame, esp_timer_get_time());
+	c->rtcp.packets_sent += sent;
+	c->rtcp.octets_sent += octets;
 	return ESP_OK;
 }
 
-static esp_err_t send_nal(client_t *c, const uint8_t *nal, size_t len, uint32_t ts)
+static esp_err_t send_packets(client_t *c, const rtp_packet_list_t *list)
 {
-	if (len <= RTP_MTU)
+	for (uint16_t i = 0; i < list->count; i += RTP_BATCH_MAX)
 	{
-		return send_rtp(c, nal, len, true, ts);
+		esp_err_t ret = send_batch(c, list, i, RTP_BATCH_MAX, NULL);
+		if (ret != ESP_OK)
+			return ret;
 	}
+	return ESP_OK;
+}
 
-	// FU-A fragment
-	uint8_t hdr = nal[0];
-	uint8_t fu_ind = (hdr & 0xE0) | 28;
-	const uint8_t *data = nal + 1;
-	size_t rem = len - 1;
-	bool first = true;
+/**
+ * @brief Send a compound SR + SDES packet, with a BYE when the stream ends
+ *
+ * The RTP timestamp is extrapolated from the last access unit sent, so
+ * receivers can map it to the NTP wallclock.
+ */
+static void send_sender_report(client_t *c, bool bye)
+{
+	xSemaphoreTake(s_param_lock, portMAX_DELAY);
+	uint32_t ts = s_last_ts;
+	int64_t ts_us = s_last_ts_us;
+	xSemaphoreGive(s_param_lock);
+
+	int64_t now_us = esp_timer_get_time();
+	rtcp_sender_info_t si = {
+		.ssrc = c->ssrc,
+		.ntp = rtcp_ntp_now(),
+		.rtp_ts = ts + (uint32_t)((now_us - ts_us) * 90 / 1000),
+		.packets = c->rtcp.packets_sent,
+		.octets = c->rtcp.octets_sent};
 
-	while (rem > 0)
+	uint8_t pkt[4 + RTCP_PACKET_MAX];
+	size_t len = rtcp_build_sr(pkt + 4, RTCP_PACKET_MAX, &si, s_cname, bye);
+	if (len == 0)
+		return;
+
+	if (c->txq)
 	{
-		size_t sz = (rem > RTP_MTU - 2) ? (RTP_MTU - 2) : rem;
-		uint8_t fu_hdr = (hdr & 0x1F);
-		if (first)
-		{
-			fu_hdr |= 0x80;
-			first = false;
-		}
-		if (sz == rem)
-			fu_hdr |= 0x40;
+		pkt[0] = '$';
+		pkt[1] = c->rtcp_channel;
+		pkt[2] = len >> 8;
+		pkt[3] = len & 0xFF;
+		struct iovec iov = {.iov_base = pkt, .iov_len = 4 + len};
+		if (tcp_queue_write(c->txq, &iov, 1) != ESP_OK)
+			return;
+	}
+	else
+	{
+		struct sockaddr_in dest = {
+			.sin_family = AF_INET,
+			.sin_addr.s_addr = c->addr.sin_addr.s_addr,
+			.sin_port = htons(c->rtcp_port)};
+		if (c->rtcp_port == 0 || sendto(s_rtcp_sock, pkt + 4, len, 0, (struct sockaddr *)&dest, sizeof(dest)) < 0)
+			return;
+	}
+	c->rtcp.sr_sent++;
+}
 
-		uint8_t frag[RTP_MTU];
-		frag[0] = fu_ind;
-		frag[1] = fu_hdr;
-		memcpy(frag + 2, data, sz);
+/**
+ * @brief Send an RTSP response on the control socket
+ *
+ * With interleaved transport the response goes through the client's queue,
+ * so it never lands inside a partly sent RTP frame.
+ */
+static void send_response(client_t *c, const char *rsp)
+{
+	if (c->txq)
+	{
+		struct iovec iov = {.iov_base = (void *)rsp, .iov_len = strlen(rsp)};
+		if (tcp_queue_write(c->txq, &iov, 1) != ESP_OK)
+			ESP_LOGW(TAG, "Response to session %08" PRIX32 " not sent", c->session);
+		return;
+	}
+	send(c->sock, rsp, strlen(rsp), 0);
+}
 
-		esp_err_t ret = send_rtp(c, frag, sz + 2, (sz == rem), ts);
-		if (ret != ESP_OK)
-			return ret;
+#if CONFIG_RTSP_MULTICAST
+/**
+ * @brief Count a multicast session in; the first one starts the group
+ */
+static esp_err_t mcast_join(client_t *c)
+{
+	esp_err_t ret = (s_rtp_sock >= 0) ? ESP_OK : ESP_ERR_INVALID_STATE;
 
-		data += sz;
-		rem -= sz;
+	xSemaphoreTake(s_mcast_lock, portMAX_DELAY);
+	if (!c->mcast_joined)
+	{
+		if (ret == ESP_OK && s_mcast_viewers++ == 0)
+		{
+			// The group goes out on the interface the session came in on;
+			// the default route may lead elsewhere (AP and STA, or host loopback)
+			struct sockaddr_in local;
+			socklen_t local_len = sizeof(local);
+			if (getsockname(c->sock, (struct sockaddr *)&local, &local_len) == 0)
+			{
+				setsockopt(s_rtp_sock, IPPROTO_IP, IP_MULTICAST_IF, &local.sin_addr, sizeof(local.sin_addr));
+				setsockopt(s_rtcp_sock, IPPROTO_IP, IP_MULTICAST_IF, &local.sin_addr, sizeof(local.sin_addr));
+			}
+			s_mcast.addr.sin_addr.s_addr = inet_addr(CONFIG_RTSP_MULTICAST_ADDR);
+			s_mcast.rtp_port = CONFIG_RTSP_MULTICAST_PORT;
+			s_mcast.rtcp_port = CONFIG_RTSP_MULTICAST_PORT + 1;
+			memset(&s_mcast.rtcp, 0, sizeof(s_mcast.rtcp));
+			s_mcast.rtcp_next_us = esp_timer_get_time() + rtcp_interval_us(true);
+			s_mcast.ssrc = esp_random();
+			s_mcast.rtp_seq = esp_random();
+			s_mcast.fec_ssrc = esp_random();
+			s_mcast.fec_seq = esp_random();
+			s_mcast.param_version = s_param_version - 1; // Parameter sets with the next IDR
+			s_mcast.skip_to_idr = true;
+#if CONFIG_RTP_PACING
+			rtp_bucket_init(&s_mcast.bucket, CONFIG_RTP_PACING_RATE_KBPS * 1000, CONFIG_RTP_PACING_BURST_BYTES,
+							esp_timer_get_time());
+#endif
+			xSemaphoreTake(s_queue_lock, portMAX_DELAY);
+			s_mcast.state = RTSP_STATE_PLAYING;
+			s_mcast.active = true;
+			xSemaphoreGive(s_queue_lock);
+			ESP_LOGI(TAG, "Multicast group %s:%d started", CONFIG_RTSP_MULTICAST_ADDR, CONFIG_RTSP_MULTICAST_PORT);
+		}
+		c->mcast_joined = (ret == ESP_OK);
 	}
-	return ESP_OK;
+	xSemaphoreGive(s_mcast_lock);
+	return ret;
 }
 
-static int parse_cseq(const char *req)
+/**
+ * @brief Count a multicast session out; the last one stops the group
+ */
+static void mcast_leave(client_t *c)
 {
-	const char *p = strstr(req, "CSeq:");
-	return p ? atoi(p + 5) : 1;
+	xSemaphoreTake(s_mcast_lock, portMAX_DELAY);
+	if (c->mcast_joined)
+	{
+		c->mcast_joined = false;
+		if (--s_mcast_viewers == 0)
+		{
+			send_sender_report(&s_mcast, true);
+			s_mcast.active = false;
+			session_flush(&s_mcast);
+			ESP_LOGI(TAG, "Multicast group stopped");
+		}
+	}
+	xSemaphoreGive(s_mcast_lock);
 }
+#endif
 
-static void handle_options(client_t *c, const char *req)
+static void handle_options(client_t *c, const rtsp_request_t *req)
 {
 	char rsp[256];
-	int cseq = parse_cseq(req);
+	int cseq = req->cseq;
 	snprintf(rsp, sizeof(rsp),
-			 "RTSP/1.0 200 OK\r\nCSeq: %d\r\nPublic: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN\r\n\r\n", cseq);
-	send(c->sock, rsp, strlen(rsp), 0);
+			 "RTSP/1.0 200 OK\r\nCSeq: %d\r\nPublic: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN, GET_PARAMETER\r\n\r\n", cseq);
+	send_response(c, rsp);
 }
 
-static void handle_describe(client_t *c, const char *req)
+static void handle_describe(client_t *c, const rtsp_request_t *req)
 {
-	char ip[16], sdp[512], rsp[1024];
+	char ip[16], sdp[1024], rsp[1536];
 	struct sockaddr_in addr;
 	socklen_t len = sizeof(addr);
 	getsockname(c->sock, (struct sockaddr *)&addr, &len);
@@ -168,132 +550,654 @@ static void handle_describe(client_t *c, const char *req)
 	uint32_t sid = esp_random();
 
 	// Build SDP
+	xSemaphoreTake(s_param_lock, portMAX_DELAY);
 	snprintf(sdp, sizeof(sdp), sdp_template,
-			 (unsigned int)sid, (unsigned int)sid, ip, RTP_PORT);
+			 (unsigned int)sid, (unsigned int)sid, ip, s_sdp_media);
+	xSemaphoreGive(s_param_lock);
 
-	int cseq = parse_cseq(req);
+	int cseq = req->cseq;
 	snprintf(rsp, sizeof(rsp),
 			 "RTSP/1.0 200 OK\r\nCSeq: %d\r\nContent-Type: application/sdp\r\nContent-Length: %d\r\n\r\n%s",
 			 cseq, (int)strlen(sdp), sdp);
-	send(c->sock, rsp, strlen(rsp), 0);
+	send_response(c, rsp);
 	ESP_LOGI(TAG, "Sent DESCRIBE response");
 }
 
-static void handle_setup(client_t *c, const char *req)
+static void handle_setup(client_t *c, const rtsp_request_t *req)
 {
-	const char *p = strstr(req, "client_port=");
+	char rsp[320];
+	int cseq = req->cseq;
+	c->session = esp_random();
+	c->ssrc = esp_random();
+	c->fec_ssrc = esp_random();
+	c->fec_seq = esp_random();
+
+	if (rtsp_slice_find(req->transport, "RTP/AVP/TCP"))
+	{
+		// RTP and RTCP as $-framed records on the control connection
+		unsigned rtp_ch = 0, rtcp_ch = 1;
+		const char *p = rtsp_slice_find(req->transport, "interleaved=");
+		if (p)
+			sscanf(p, "interleaved=%u-%u", &rtp_ch, &rtcp_ch);
+
+		tcp_queue_t *q = &s_tcp_queues[c - s_clients];
+		if (rtp_ch > 255 || rtcp_ch > 255 || tcp_queue_open(q, c->sock, CONFIG_RTSP_TCP_QUEUE_KB * 1024) != ESP_OK)
+		{
+			snprintf(rsp, sizeof(rsp), "RTSP/1.0 461 Unsupported Transport\r\nCSeq: %d\r\n\r\n", cseq);
+			send_response(c, rsp);
+			return;
+		}
+		c->txq = q;
+		c->rtp_channel = rtp_ch;
+		c->rtcp_channel = rtcp_ch;
+		c->state = RTSP_STATE_READY;
+
+		snprintf(rsp, sizeof(rsp),
+				 "RTSP/1.0 200 OK\r\nCSeq: %d\r\nSession: %08" PRIX32 SESSION_TIMEOUT "\r\nTransport: RTP/AVP/TCP;unicast;interleaved=%u-%u\r\n\r\n",
+				 cseq, c->session, rtp_ch, rtcp_ch);
+		send_response(c, rsp);
+		return;
+	}
+
+#if CONFIG_RTSP_MULTICAST
+	if (rtsp_slice_find(req->transport, "multicast"))
+	{
+		// Every multicast session receives the one group stream
+		c->multicast = true;
+		c->state = RTSP_STATE_READY;
+
+		snprintf(rsp, sizeof(rsp),
+				 "RTSP/1.0 200 OK\r\nCSeq: %d\r\nSession: %08" PRIX32 SESSION_TIMEOUT "\r\nTransport: RTP/AVP;multicast;destination=%s;port=%d-%d;ttl=%d\r\n\r\n",
+				 cseq, c->session, CONFIG_RTSP_MULTICAST_ADDR, CONFIG_RTSP_MULTICAST_PORT,
+				 CONFIG_RTSP_MULTICAST_PORT + 1, CONFIG_RTSP_MULTICAST_TTL);
+		send_response(c, rsp);
+		return;
+	}
+#endif
+
+	const char *p = rtsp_slice_find(req->transport, "client_port=");
 	if (p)
 	{
 		sscanf(p, "client_port=%hu-%hu", &c->rtp_port, &c->rtcp_port);
 	}
-	c->session = esp_random();
-	c->ssrc = esp_random();
 	c->state = RTSP_STATE_READY;
 
-	char rsp[256];
-	int cseq = parse_cseq(req);
 	snprintf(rsp, sizeof(rsp),
-			 "RTSP/1.0 200 OK\r\nCSeq: %d\r\nSession: %08" PRIX32 "\r\nTransport: RTP/AVP;unicast;client_port=%d-%d;server_port=%d-%d\r\n\r\n",
+			 "RTSP/1.0 200 OK\r\nCSeq: %d\r\nSession: %08" PRIX32 SESSION_TIMEOUT "\r\nTransport: RTP/AVP;unicast;client_port=%d-%d;server_port=%d-%d\r\n\r\n",
 			 cseq, c->session, c->rtp_port, c->rtcp_port, RTP_PORT, RTCP_PORT);
-	send(c->sock, rsp, strlen(rsp), 0);
+	send_response(c, rsp);
 }
 
-static void handle_play(client_t *c, const char *req)
+static void handle_play(client_t *c, const rtsp_request_t *req)
 {
-	c->state = RTSP_STATE_PLAYING;
-	c->active = true;
-
 	char rsp[256];
-	int cseq = parse_cseq(req);
-	snprintf(rsp, sizeof(rsp),
-			 "RTSP/1.0 200 OK\r\nCSeq: %d\r\nSession: %08" PRIX32 "\r\nRange: npt=0.000-\r\n\r\n",
-			 cseq, c->session);
-	send(c->sock, rsp, strlen(rsp), 0);
+	int cseq = req->cseq;
+	bool starting = c->state != RTSP_STATE_PLAYING;
+	if (starting)
+	{
+		c->play_us = esp_timer_get_time();
+		c->first_frame_us = 0;
+	}
 
-	// Send SPS/PPS
-	if (s_sps_len > 0 && s_pps_len > 0)
+#if CONFIG_RTSP_MULTICAST
+	// A multicast member sees the group stream where it is
+	if (c->multicast)
 	{
-		const uint8_t *nal = find_nal(s_sps, s_sps_len);
-		if (nal)
+		if (mcast_join(c) != ESP_OK)
 		{
-			// Skip start code
-			size_t skip = (nal[0] == 0 && nal[1] == 0 && nal[2] == 1) ? 3 : ((nal[0] == 0 && nal[1] == 0 && nal[2] == 0 && nal[3] == 1) ? 4 : 0);
-			send_nal(c, nal + skip, s_sps_len - (nal - s_sps) - skip, 0);
+			c->state = RTSP_STATE_READY;
+			snprintf(rsp, sizeof(rsp), "RTSP/1.0 500 Internal Server Error\r\nCSeq: %d\r\n\r\n", cseq);
+			send_response(c, rsp);
+			return;
 		}
-		nal = find_nal(s_pps, s_pps_len);
-		if (nal)
+		c->state = RTSP_STATE_PLAYING;
+		c->active = true;
+		snprintf(rsp, sizeof(rsp),
+				 "RTSP/1.0 200 OK\r\nCSeq: %d\r\nSession: %08" PRIX32 SESSION_TIMEOUT "\r\nRange: npt=0.000-\r\n\r\n",
+				 cseq, c->session);
+		send_response(c, rsp);
+		camera_encoder_request_idr();
+		return;
+	}
+#endif
+
+	// Everything the sender uses is set up before it can see the session
+	if (starting)
+	{
+#if CONFIG_RTP_PACING
+		rtp_bucket_init(&c->bucket, CONFIG_RTP_PACING_RATE_KBPS * 1000, CONFIG_RTP_PACING_BURST_BYTES,
+						esp_timer_get_time());
+#endif
+		// A new unicast client starts at an IDR, with the parameter sets ahead of it
+		c->skip_to_idr = true;
+		xSemaphoreTake(s_param_lock, portMAX_DELAY);
+		c->param_version = s_param_version - 1;
+		xSemaphoreGive(s_param_lock);
+		c->rtcp_next_us = esp_timer_get_time() + rtcp_interval_us(true);
+
+#if CONFIG_RTP_NACK
+		// Interleaved RTP is never lost
+		if (!c->txq && !c->history)
 		{
-			// Skip start code
-			size_t skip = (nal[0] == 0 && nal[1] == 0 && nal[2] == 1) ? 3 : ((nal[0] == 0 && nal[1] == 0 && nal[2] == 0 && nal[3] == 1) ? 4 : 0);
-			send_nal(c, nal + skip, s_pps_len - (nal - s_pps) - skip, 0);
+			rtp_history_t *h = &s_histories[c - s_clients];
+			if (rtp_history_open(h, CONFIG_RTP_NACK_HISTORY_MS) == ESP_OK)
+			{
+				c->rtx_ssrc = esp_random();
+				c->rtx_seq = esp_random();
+				c->history = h;
+			}
+			else
+			{
+				ESP_LOGW(TAG, "No memory for the retransmission history of session %08" PRIX32, c->session);
+			}
 		}
+#endif
 	}
+
+	snprintf(rsp, sizeof(rsp),
+			 "RTSP/1.0 200 OK\r\nCSeq: %d\r\nSession: %08" PRIX32 SESSION_TIMEOUT "\r\nRange: npt=0.000-\r\n\r\n",
+			 cseq, c->session);
+	send_response(c, rsp);
+
+	// Frames are queued for the session from here on
+	xSemaphoreTake(s_queue_lock, portMAX_DELAY);
+	c->state = RTSP_STATE_PLAYING;
+	c->active = true;
+#if CONFIG_RTSP_GOP_CACHE
+	uint16_t cached = starting ? gop_cache_join_locked(c) : 0;
+#endif
+	xSemaphoreGive(s_queue_lock);
+
+	// The IDR comes from the GOP cache, else it is asked for now instead of
+	// up to a GOP away
+#if CONFIG_RTSP_GOP_CACHE
+	if (cached)
+	{
+		ESP_LOGI(TAG, "Session %08" PRIX32 " starts from %u cached frames", c->session, cached);
+		xSemaphoreGive(s_send_sem);
+		return;
+	}
+#endif
+	if (starting)
+		camera_encoder_request_idr();
 }
 
-static void handle_teardown(client_t *c, const char *req)
+static void handle_teardown(client_t *c, const rtsp_request_t *req)
 {
+	if (c->state == RTSP_STATE_PLAYING && !c->multicast)
+		send_sender_report(c, true);
 	c->state = RTSP_STATE_TEARDOWN;
 	c->active = false;
+#if CONFIG_RTSP_MULTICAST
+	mcast_leave(c);
+#endif
 
 	char rsp[128];
-	int cseq = parse_cseq(req);
+	int cseq = req->cseq;
 	snprintf(rsp, sizeof(rsp), "RTSP/1.0 200 OK\r\nCSeq: %d\r\nSession: %08" PRIX32 "\r\n\r\n", cseq, c->session);
-	send(c->sock, rsp, strlen(rsp), 0);
+	send_response(c, rsp);
 }
 
-static void client_task(void *arg)
+/**
+ * @brief Answer a keepalive; the request itself refreshed the session
+ */
+static void handle_get_parameter(client_t *c, const rtsp_request_t *req)
 {
-	client_t *c = (client_t *)arg;
-	char buf[RTSP_BUF];
+	char rsp[128];
+	int cseq = req->cseq;
+	snprintf(rsp, sizeof(rsp), "RTSP/1.0 200 OK\r\nCSeq: %d\r\nSession: %08" PRIX32 SESSION_TIMEOUT "\r\n\r\n", cseq,
+			 c->session);
+	send_response(c, rsp);
+}
 
+static uint32_t now_ms(void)
+{
+	return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+/**
+ * @brief End a session the client left with an RTCP BYE
+ *
+ * Shutting the control socket down wakes server_task, which frees the slot.
+ */
+static void end_session(client_t *c)
+{
+	c->state = RTSP_STATE_TEARDOWN;
+	c->active = false;
+#if CONFIG_RTSP_MULTICAST
+	mcast_leave(c);
+#endif
+	shutdown(c->sock, SHUT_RDWR);
+}
+
+#if CONFIG_RTP_NACK
+/**
+ * @brief Resend packets a receiver reported lost
+ *
+ * With RTX the packets go out on their own SSRC and sequence space, the
+ * original sequence number ahead of the payload (RFC 4588); otherwise they
+ * are repeated as first sent.
+ */
+static void retransmit(client_t *c, const rtcp_feedback_t *fb)
+{
+	uint8_t payload[RTP_MTU];
+	int64_t now = esp_timer_get_time();
+	uint32_t min_gap = c->rtcp.rtt_us ? c->rtcp.rtt_us : RTX_MIN_GAP_US;
+	struct sockaddr_in dest = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = c->addr.sin_addr.s_addr,
+		.sin_port = htons(c->rtp_port)};
+
+	for (int i = 0; i < fb->nack_count; i++)
+	{
+		rtp_packet_t pkt;
+		uint32_t ts;
+		esp_err_t ret = rtp_history_get(c->history, fb->nack[i], min_gap, now, &pkt, payload, &ts);
+		if (ret == ESP_ERR_NOT_FOUND)
+			c->rtcp.retransmit_misses++;
+		if (ret != ESP_OK)
+			continue;
+
+		uint8_t hdr[RTP_HEADER_LEN + 2 + RTP_PREFIX_MAX];
+		size_t hdr_len;
+#if CONFIG_RTP_RTX
+		rtp_packet_t bare = pkt;
+		bare.prefix_len = 0;
+		rtp_write_header(hdr, &bare, ts, c->rtx_seq++, c->rtx_ssrc);
+		hdr[1] = (hdr[1] & 0x80) | RTP_PT_RTX;
+		hdr[RTP_HEADER_LEN] = fb->nack[i] >> 8;
+		hdr[RTP_HEADER_LEN + 1] = fb->nack[i] & 0xFF;
+		memcpy(hdr + RTP_HEADER_LEN + 2, pkt.prefix, pkt.prefix_len);
+		hdr_len = RTP_HEADER_LEN + 2 + pkt.prefix_len;
+#else
+		hdr_len = rtp_write_header(hdr, &pkt, ts, fb->nack[i], c->ssrc);
+#endif
+
+		struct iovec iov[2] = {
+			{.iov_base = hdr, .iov_len = hdr_len},
+			{.iov_base = payload, .iov_len = pkt.len}};
+		struct msghdr msg = {
+			.msg_name = &dest,
+			.msg_namelen = sizeof(dest),
+			.msg_iov = iov,
+			.msg_iovlen = 2};
+		if (sendmsg(s_rtp_sock, &msg, 0) < 0)
+			break;
+		c->rtcp.retransmits++;
+	}
+}
+#endif
+
+static void apply_feedback(client_t *c, const rtcp_feedback_t *fb)
+{
+	c->last_seen_ms = now_ms();
+	rtcp_update_stats(&c->rtcp, fb, rtcp_ntp_now(), esp_timer_get_time());
+#if CONFIG_RTP_NACK
+	if (fb->nack_count > 0 && c->history)
+		retransmit(c, fb);
+#endif
+	if (fb->keyframe_request)
+		camera_encoder_request_idr();
+	if (fb->bye)
+	{
+		ESP_LOGI(TAG, "RTCP BYE from session %08" PRIX32, c->session);
+		end_session(c);
+	}
+}
+
+/**
+ * @brief Handle RTCP received on an interleaved channel
+ */
+static void handle_rtcp(client_t *c, const uint8_t *buf, size_t len)
+{
+	rtcp_feedback_t fb;
+	if (rtcp_parse(buf, len, c->ssrc, &fb) == ESP_OK)
+		apply_feedback(c, &fb);
+}
+
+static void handle_request(client_t *c, const rtsp_request_t *req)
+{
 	char ip_str[INET_ADDRSTRLEN];
 	inet_ntop(AF_INET, &c->addr.sin_addr, ip_str, sizeof(ip_str));
 	uint16_t port = ntohs(c->addr.sin_port);
-	ESP_LOGI(TAG, "New client connected (%s:%d)", ip_str, port);
+	char rsp[128];
 
-	while (c->state != RTSP_STATE_TEARDOWN)
+	c->last_seen_ms = now_ms();
+	if (req->cseq < 0)
 	{
-		int len = recv(c->sock, buf, sizeof(buf) - 1, 0);
-		if (len <= 0)
-			break;
-		buf[len] = 0;
+		send_response(c, "RTSP/1.0 400 Bad Request\r\n\r\n");
+		return;
+	}
+
+	switch (req->method)
+	{
+	case RTSP_METHOD_OPTIONS:
+		handle_options(c, req);
+		ESP_LOGI(TAG, "OPTIONS sent (client=%s:%d)", ip_str, port);
+		break;
+	case RTSP_METHOD_DESCRIBE:
+		handle_describe(c, req);
+		ESP_LOGI(TAG, "DESCRIBE sent (client=%s:%d)", ip_str, port);
+		break;
+	case RTSP_METHOD_SETUP:
+		handle_setup(c, req);
+		ESP_LOGI(TAG, "SETUP sent (client=%s:%d, ports=%d-%d)", ip_str, port, c->rtp_port, c->rtcp_port);
+		break;
+	case RTSP_METHOD_PLAY:
+		handle_play(c, req);
+		ESP_LOGI(TAG, "PLAY sent (client=%s:%d)", ip_str, port);
+		break;
+	case RTSP_METHOD_TEARDOWN:
+		handle_teardown(c, req);
+		ESP_LOGI(TAG, "TEARDOWN sent (client=%s:%d)", ip_str, port);
+		break;
+	case RTSP_METHOD_GET_PARAMETER:
+		handle_get_parameter(c, req);
+		break;
+	default:
+		snprintf(rsp, sizeof(rsp), "RTSP/1.0 501 Not Implemented\r\nCSeq: %d\r\n\r\n", (int)req->cseq);
+		send_response(c, rsp);
+		ESP_LOGW(TAG, "Unsupported method %.*s (client=%s:%d)", (int)req->method_name.len, req->method_name.ptr,
+				 ip_str, port);
+		break;
+	}
+}
+
+/**
+ * @brief Read what a control connection sent and act on complete messages
+ *
+ * Requests go through the connection's incremental parser, which picks up
+ * where the previous read stopped; interleaved RTCP arrives as $-framed
+ * binary records between requests. Anything incomplete stays in rx until
+ * the next read.
+ *
+ * @return false when the connection should be closed
+ */
+static bool client_read(client_t *c)
+{
+	int len = recv(c->sock, c->rx + c->rx_len, RTSP_RX_BUF - 1 - c->rx_len, 0);
+	if (len <= 0)
+		return len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+	c->rx_len += len;
+	c->rx[c->rx_len] = 0;
+
+	size_t pos = 0;
+	while (pos < c->rx_len && c->state != RTSP_STATE_TEARDOWN)
+	{
+		char *p = c->rx + pos;
+		size_t avail = c->rx_len - pos;
+		if (c->rx_skip > 0)
+		{
+			size_t n = avail < c->rx_skip ? avail : c->rx_skip;
+			pos += n;
+			c->rx_skip -= n;
+		}
+		else if (rtsp_parser_idle(&c->parser) && *p == '$')
+		{
+			if (avail < 4)
+				break;
+			size_t rec_len = ((uint8_t)p[2] << 8) | (uint8_t)p[3];
+			if (4 + rec_len > RTSP_RX_BUF - 1)
+			{
+				// Larger than any report we act on; drop it as it streams in
+				c->rx_skip = 4 + rec_len;
+				continue;
+			}
+			if (avail < 4 + rec_len)
+				break;
+			if (c->txq && (uint8_t)p[1] == c->rtcp_channel)
+				handle_rtcp(c, (const uint8_t *)p + 4, rec_len);
+			pos += 4 + rec_len;
+		}
+		else if (rtsp_parser_idle(&c->parser) && (*p == '\r' || *p == '\n'))
+		{
+			pos++; // Line ends between messages
+		}
+		else
+		{
+			rtsp_request_t req;
+			esp_err_t ret = rtsp_parser_feed(&c->parser, p, avail, &req);
+			if (ret == ESP_ERR_NOT_FINISHED)
+				break;
+			if (ret != ESP_OK)
+			{
+				send_response(c, ret == ESP_ERR_INVALID_SIZE ? "RTSP/1.0 413 Request Entity Too Large\r\n\r\n"
+															 : "RTSP/1.0 400 Bad Request\r\n\r\n");
+				ESP_LOGW(TAG, "Malformed request from session %08" PRIX32 ": %s", c->session, esp_err_to_name(ret));
+				return false;
+			}
+			handle_request(c, &req);
+			pos += req.len;
+		}
+	}
+
+	memmove(c->rx, c->rx + pos, c->rx_len - pos + 1);
+	c->rx_len -= pos;
+	return c->state != RTSP_STATE_TEARDOWN;
+}
+
+/**
+ * @brief Stop a session's streams and free its slot
+ */
+static void client_close(client_t *c)
+{
+	char ip_str[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &c->addr.sin_addr, ip_str, sizeof(ip_str));
+	ESP_LOGI(TAG, "Client disconnected (%s:%d)", ip_str, ntohs(c->addr.sin_port));
+
+	// Wait out a frame the sender may be sending to this session
+	xSemaphoreTake(s_send_lock, portMAX_DELAY);
+	c->active = false;
+#if CONFIG_RTSP_MULTICAST
+	mcast_leave(c);
+#endif
+	if (c->txq)
+	{
+		tcp_queue_flush(c->txq);
+		tcp_queue_close(c->txq);
+	}
+	session_flush(c);
+	if (c->history)
+		rtp_history_close(c->history);
+	xSemaphoreGive(s_send_lock);
+	close(c->sock);
+	c->sock = -1;
+}
 
-		if (strstr(buf, "OPTIONS"))
+/**
+ * @brief Match RTCP from a UDP receiver to its session
+ *
+ * All receivers report to the one RTCP socket, so the session is found by
+ * the report block about its SSRC, its own SSRC or its address.
+ */
+static void receive_rtcp(const uint8_t *buf, size_t len, const struct sockaddr_in *src)
+{
+	for (int i = 0; i < s_num_clients; i++)
+	{
+		client_t *c = &s_clients[i];
+		if (!c->active || c->txq || c->multicast)
+			continue;
+
+		rtcp_feedback_t fb;
+		if (rtcp_parse(buf, len, c->ssrc, &fb) != ESP_OK)
+			return;
+		bool from_peer = src->sin_addr.s_addr == c->addr.sin_addr.s_addr && ntohs(src->sin_port) == c->rtcp_port;
+		if (fb.has_report || fb.nack_count > 0 || fb.keyframe_request || from_peer ||
+			(fb.ssrc != 0 && fb.ssrc == c->rtcp.peer_ssrc))
 		{
-			handle_options(c, buf);
-			ESP_LOGI(TAG, "OPTIONS sent (client=%s:%d)", ip_str, port);
+			apply_feedback(c, &fb);
+			return;
 		}
-		else if (strstr(buf, "DESCRIBE"))
+	}
+}
+
+/**
+ * @brief Read receiver reports and send sender reports when due
+ */
+static void rtcp_task(void *arg)
+{
+	uint8_t buf[512];
+
+	while (true)
+	{
+		int sock = s_rtcp_sock;
+		fd_set fds;
+		FD_ZERO(&fds);
+		struct timeval tv = {.tv_sec = 0, .tv_usec = 100000};
+
+		if (sock < 0)
 		{
-			handle_describe(c, buf);
-			ESP_LOGI(TAG, "DESCRIBE sent (client=%s:%d)", ip_str, port);
+			vTaskDelay(pdMS_TO_TICKS(100));
 		}
-		else if (strstr(buf, "SETUP"))
+		else
 		{
-			handle_setup(c, buf);
-			ESP_LOGI(TAG, "SETUP sent (client=%s:%d, ports=%d-%d)", ip_str, port, c->rtp_port, c->rtcp_port);
+			FD_SET(sock, &fds);
+			if (select(sock + 1, &fds, NULL, NULL, &tv) > 0)
+			{
+				// Drain what arrived; a report per session per interval is little
+				struct sockaddr_in src;
+				socklen_t slen = sizeof(src);
+				int n;
+				while ((n = recvfrom(sock, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&src, &slen)) > 0)
+				{
+					receive_rtcp(buf, n, &src);
+					slen = sizeof(src);
+				}
+			}
 		}
-		else if (strstr(buf, "PLAY"))
+
+		client_t *senders[MAX_TARGETS];
+		int n_senders = stream_senders(senders);
+		int64_t now = esp_timer_get_time();
+		for (int i = 0; i < n_senders; i++)
 		{
-			handle_play(c, buf);
-			ESP_LOGI(TAG, "PLAY sent (client=%s:%d)", ip_str, port);
+			client_t *c = senders[i];
+			if (!c->active || c->state != RTSP_STATE_PLAYING || now < c->rtcp_next_us)
+				continue;
+			send_sender_report(c, false);
+			c->rtcp_next_us = now + rtcp_interval_us(false);
 		}
-		else if (strstr(buf, "TEARDOWN"))
+	}
+}
+
+/**
+ * @brief Create a UDP socket bound to a server port
+ *
+ * @return Socket, -1 on failure
+ */
+static int open_udp(uint16_t port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+		.sin_port = htons(port)};
+
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock < 0)
+		return -1;
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		ESP_LOGE(TAG, "Failed to bind UDP port %d: errno %d", port, errno);
+		close(sock);
+		return -1;
+	}
+#if CONFIG_RTSP_MULTICAST
+	uint8_t ttl = CONFIG_RTSP_MULTICAST_TTL;
+	setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+#endif
+	return sock;
+}
+
+/**
+ * @brief Take a new control connection into a free slot
+ */
+static void client_accept(void)
+{
+	struct sockaddr_in src;
+	socklen_t slen = sizeof(src);
+	int sock = accept(s_listen_sock, (struct sockaddr *)&src, &slen);
+	if (sock < 0)
+		return;
+
+	client_t *c = NULL;
+	for (int i = 0; i < s_num_clients; i++)
+	{
+		if (s_clients[i].sock < 0)
 		{
-			handle_teardown(c, buf);
-			ESP_LOGI(TAG, "TEARDOWN sent (client=%s:%d)", ip_str, port);
+			c = &s_clients[i];
 			break;
 		}
 	}
+	if (!c)
+	{
+		ESP_LOGW(TAG, "All %d sessions in use, connection refused", s_num_clients);
+		close(sock);
+		return;
+	}
 
-	ESP_LOGI(TAG, "Client disconnected (%s:%d)", ip_str, port);
-	close(c->sock);
-	close(c->rtp_sock);
-	close(c->rtcp_sock);
-	c->active = false;
-	vTaskDelete(NULL);
+	if (!s_cname[0])
+	{
+		struct sockaddr_in local;
+		socklen_t llen = sizeof(local);
+		char local_ip[INET_ADDRSTRLEN] = "0.0.0.0";
+		if (getsockname(sock, (struct sockaddr *)&local, &llen) == 0)
+			inet_ntop(AF_INET, &local.sin_addr, local_ip, sizeof(local_ip));
+		snprintf(s_cname, sizeof(s_cname), "rtsp@%s", local_ip);
+	}
+
+	// Responses are small, but a peer that stops reading must not stall the others
+	struct timeval tv = {.tv_sec = 1, .tv_usec = 0};
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	// The sender never sees the slot half reset
+	xSemaphoreTake(s_send_lock, portMAX_DELAY);
+	xSemaphoreTake(s_queue_lock, portMAX_DELAY);
+	memset(c, 0, sizeof(*c));
+	c->sock = sock;
+	c->addr = src;
+	c->state = RTSP_STATE_INIT;
+	c->last_seen_ms = now_ms();
+	xSemaphoreGive(s_queue_lock);
+	xSemaphoreGive(s_send_lock);
+	rtsp_parser_reset(&c->parser, RTSP_RX_BUF - 1);
+
+	char ip_str[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &src.sin_addr, ip_str, sizeof(ip_str));
+	ESP_LOGI(TAG, "New client connected (%s:%d)", ip_str, ntohs(src.sin_port));
 }
 
+/**
+ * @brief Free the slots of clients silent for longer than the session timeout
+ *
+ * Requests on the control connection (GET_PARAMETER and OPTIONS keepalives
+ * included) and RTCP reports count as signs of life. A client that vanished
+ * without TEARDOWN stops receiving media here.
+ */
+static void reap_idle(void)
+{
+	uint32_t now = now_ms();
+	for (int i = 0; i < s_num_clients; i++)
+	{
+		client_t *c = &s_clients[i];
+		// Signed: the RTCP task may have refreshed the stamp after now was read
+		int32_t idle = (int32_t)(now - c->last_seen_ms);
+		if (c->sock < 0 || idle <= CONFIG_RTSP_SESSION_TIMEOUT_S * 1000)
+			continue;
+
+		ESP_LOGW(TAG, "Session %08" PRIX32 " timed out after %" PRId32 " ms", c->session, idle);
+		if (c->state == RTSP_STATE_PLAYING && !c->multicast)
+			send_sender_report(c, true);
+		client_close(c);
+	}
+}
+
+/**
+ * @brief Serve the listen socket and every control connection
+ *
+ * One task multiplexes all connections with select(); a connection costs
+ * its slot and no stack of its own. Interleaved data the socket did not
+ * take is flushed when the socket becomes writable.
+ */
 static void server_task(void *arg)
 {
 	struct sockaddr_in addr = {
@@ -305,71 +1209,156 @@ static void server_task(void *arg)
 	int opt = 1;
 	setsockopt(s_listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 	bind(s_listen_sock, (struct sockaddr *)&addr, sizeof(addr));
-	listen(s_listen_sock, MAX_CLIENTS);
+	listen(s_listen_sock, s_num_clients);
+
+	// Every session sends from and reports to the same two ports
+	s_rtp_sock = open_udp(RTP_PORT);
+	s_rtcp_sock = open_udp(RTCP_PORT);
 
 	ESP_LOGI(TAG, "Listening on port %d", RTSP_PORT);
 	s_running = true;
 
 	while (s_running)
 	{
-		struct sockaddr_in src;
-		socklen_t slen = sizeof(src);
-		int sock = accept(s_listen_sock, (struct sockaddr *)&src, &slen);
-		if (sock < 0)
-			continue;
-
-		client_t *c = NULL;
-		for (int i = 0; i < MAX_CLIENTS; i++)
+		fd_set rfds, wfds;
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_SET(s_listen_sock, &rfds);
+		int max_fd = s_listen_sock;
+		for (int i = 0; i < s_num_clients; i++)
 		{
-			if (!s_clients[i].active)
-			{
-				c = &s_clients[i];
-				break;
-			}
+			client_t *c = &s_clients[i];
+			if (c->sock < 0)
+				continue;
+			FD_SET(c->sock, &rfds);
+			if (c->txq && tcp_queue_pending(c->txq) > 0)
+				FD_SET(c->sock, &wfds);
+			max_fd = c->sock > max_fd ? c->sock : max_fd;
 		}
-		if (!c)
+
+		struct timeval tv = {.tv_sec = 0, .tv_usec = 500000};
+		int n = select(max_fd + 1, &rfds, &wfds, NULL, &tv);
+		if (n < 0)
 		{
-			close(sock);
+			ESP_LOGE(TAG, "select failed: errno %d", errno);
+			vTaskDelay(pdMS_TO_TICKS(100));
 			continue;
 		}
+		reap_idle();
+		if (n == 0)
+			continue;
 
-		memset(c, 0, sizeof(*c));
-		c->sock = sock;
-		c->addr = src;
-		c->state = RTSP_STATE_INIT;
-
-		// Create RTP socket
-		c->rtp_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-		struct sockaddr_in rtp = {
-			.sin_family = AF_INET,
-			.sin_addr.s_addr = htonl(INADDR_ANY),
-			.sin_port = htons(RTP_PORT)};
-		bind(c->rtp_sock, (struct sockaddr *)&rtp, sizeof(rtp));
-
-		// Create RTCP socket
-		c->rtcp_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-		struct sockaddr_in rtcp = {
-			.sin_family = AF_INET,
-			.sin_addr.s_addr = htonl(INADDR_ANY),
-			.sin_port = htons(RTCP_PORT)};
-		bind(c->rtcp_sock, (struct sockaddr *)&rtcp, sizeof(rtcp));
-
-		xTaskCreate(client_task, "rtsp_client", 8192, c, 5, NULL);
+		// Slots freed below are not reused until the next round
+		for (int i = 0; i < s_num_clients; i++)
+		{
+			client_t *c = &s_clients[i];
+			if (c->sock < 0)
+				continue;
+			bool ok = !FD_ISSET(c->sock, &wfds) || tcp_queue_flush(c->txq) == ESP_OK;
+			if (ok && FD_ISSET(c->sock, &rfds))
+				ok = client_read(c);
+			if (!ok)
+				client_close(c);
+		}
+		if (FD_ISSET(s_listen_sock, &rfds))
+			client_accept();
 	}
 
+	for (int i = 0; i < s_num_clients; i++)
+	{
+		if (s_clients[i].sock >= 0)
+			client_close(&s_clients[i]);
+	}
 	close(s_listen_sock);
+	s_listen_sock = -1;
+	close(s_rtp_sock);
+	close(s_rtcp_sock);
+	s_rtp_sock = -1;
+	s_rtcp_sock = -1;
+	s_server_task = NULL;
 	vTaskDelete(NULL);
 }
 
+esp_err_t rtsp_server_set_max_clients(int max)
+{
+	if (max < 1 || max > RTSP_SERVER_MAX_CLIENTS)
+		return ESP_ERR_INVALID_ARG;
+	if (s_clients)
+		return ESP_ERR_INVALID_STATE;
+	s_max_clients = max;
+	return ESP_OK;
+}
+
 esp_err_t rtsp_server_init(void)
 {
-	memset(s_clients, 0, sizeof(s_clients));
-	for (int i = 0; i < MAX_CLIENTS; i++)
+	if (!s_param_lock)
+	{
+		s_param_lock = xSemaphoreCreateMutex();
+		if (!s_param_lock)
+			return ESP_ERR_NO_MEM;
+	}
+	build_sdp_media();
+
+#if CONFIG_RTSP_MULTICAST
+	if (!s_mcast_lock)
+	{
+		s_mcast_lock = xSemaphoreCreateMutex();
+		if (!s_mcast_lock)
+			return ESP_ERR_NO_MEM;
+	}
+#endif
+
+	if (!s_sender_task)
+	{
+		s_queue_lock = xSemaphoreCreateMutex();
+		s_send_lock = xSemaphoreCreateMutex();
+		s_send_sem = xSemaphoreCreateBinary();
+		if (!s_queue_lock || !s_send_lock || !s_send_sem)
+			return ESP_ERR_NO_MEM;
+#if CONFIG_RTP_PACING
+		const esp_timer_create_args_t timer_args = {.callback = pacer_timer_cb, .name = "rtp_pacer"};
+		if (esp_timer_create(&timer_args, &s_pacer_timer) != ESP_OK)
+			return ESP_ERR_NO_MEM;
+#endif
+		if (xTaskCreate(sender_task, "rtp_sender", 6144, NULL, 6, &s_sender_task) != pdPASS)
+			return ESP_ERR_NO_MEM;
+	}
+
+#if CONFIG_RTP_FEC
+	if (!s_au_fec.arena)
+	{
+		s_au_fec.arena = heap_caps_malloc(RTP_FEC_MAX * RTP_FEC_PAYLOAD_MAX, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+		if (!s_au_fec.arena)
+			return ESP_ERR_NO_MEM;
+	}
+#endif
+
+	if (!s_rtcp_task && xTaskCreate(rtcp_task, "rtcp", 6144, NULL, 4, &s_rtcp_task) != pdPASS)
+		return ESP_ERR_NO_MEM;
+
+	if (!s_clients)
+	{
+		s_clients = heap_caps_calloc(s_max_clients, sizeof(client_t), MALLOC_CAP_8BIT);
+		s_tcp_queues = heap_caps_calloc(s_max_clients, sizeof(tcp_queue_t), MALLOC_CAP_8BIT);
+#if CONFIG_RTP_NACK
+		s_histories = heap_caps_calloc(s_max_clients, sizeof(rtp_history_t), MALLOC_CAP_8BIT);
+		if (!s_histories)
+			return ESP_ERR_NO_MEM;
+#endif
+		if (!s_clients || !s_tcp_queues)
+			return ESP_ERR_NO_MEM;
+	}
+	for (int i = 0; i < s_max_clients; i++)
 	{
+		if (!s_tcp_queues[i].lock && tcp_queue_create(&s_tcp_queues[i]) != ESP_OK)
+			return ESP_ERR_NO_MEM;
+#if CONFIG_RTP_NACK
+		if (!s_histories[i].lock && rtp_history_create(&s_histories[i]) != ESP_OK)
+			return ESP_ERR_NO_MEM;
+#endif
 		s_clients[i].sock = -1;
-		s_clients[i].rtp_sock = -1;
-		s_clients[i].rtcp_sock = -1;
 	}
+	s_num_clients = s_max_clients;
 	return ESP_OK;
 }
 
@@ -383,74 +1372,774 @@ esp_err_t rtsp_server_start(void)
 
 void rtsp_server_stop(void)
 {
+	// server_task notices within one select() timeout and closes everything
 	s_running = false;
-	if (s_listen_sock >= 0)
-		close(s_listen_sock);
-	for (int i = 0; i < MAX_CLIENTS; i++)
+}
+
+// Caller holds s_queue_lock
+static void drop_frame_locked(client_t *c, size_t bytes)
+{
+	c->dropped_frames++;
+	c->dropped_bytes += bytes;
+}
+
+// Caller holds s_queue_lock
+static void flush_locked(client_t *c)
+{
+	for (; c->queue_len > 0; c->queue_len--)
 	{
-		if (s_clients[i].sock >= 0)
-			close(s_clients[i].sock);
-		if (s_clients[i].rtp_sock >= 0)
-			close(s_clients[i].rtp_sock);
-		if (s_clients[i].rtcp_sock >= 0)
-			close(s_clients[i].rtcp_sock);
+		stream_frame_t *f = c->queue[c->queue_head];
+		c->queue_head = (c->queue_head + 1) % SESSION_QUEUE_LEN;
+		drop_frame_locked(c, f->len);
+		frame_unref(f);
 	}
+	c->catching_up = false;
 }
 
-esp_err_t rtsp_send_h264_frame(const uint8_t *data, size_t len, uint32_t ts)
+/**
+ * @brief Drop the frames a session still has waiting
+ */
+static void session_flush(client_t *c)
 {
-	if (!data || len == 0)
-		return ESP_ERR_INVALID_ARG;
+	xSemaphoreTake(s_queue_lock, portMAX_DELAY);
+	flush_locked(c);
+	xSemaphoreGive(s_queue_lock);
+}
 
-	for (int i = 0; i < MAX_CLIENTS; i++)
+/**
+ * @brief Offer a frame to a session's queue
+ *
+ * A session whose queue is full loses what is queued and takes nothing
+ * before the next IDR, so it never receives part of a GOP. Caller holds
+ * s_queue_lock.
+ *
+ * @param c Session
+ * @param f Frame, or NULL if it could not be stored
+ * @param bytes Size of the access unit
+ */
+static void enqueue_locked(client_t *c, stream_frame_t *f, size_t bytes)
+{
+	bool idr = f && f->idx.idr;
+	if (!f || c->queue_len == SESSION_QUEUE_LEN)
 	{
-		if (s_clients[i].active && s_clients[i].state == RTSP_STATE_PLAYING)
+		if (!c->drop_to_idr)
+			ESP_LOGW(TAG, "Session %08" PRIX32 " fell behind, dropping to the next IDR", c->session);
+		flush_locked(c);
+		c->drop_to_idr = true;
+	}
+	if (c->drop_to_idr && !idr)
+	{
+		drop_frame_locked(c, bytes);
+		return;
+	}
+	c->drop_to_idr = false;
+	c->queue[(c->queue_head + c->queue_len) % SESSION_QUEUE_LEN] = frame_ref(f);
+	c->queue_len++;
+}
+
+#if CONFIG_RTSP_GOP_CACHE
+/**
+ * @brief Add a frame to the GOP cache
+ *
+ * An IDR starts a new GOP; sessions still catching up on the old one go
+ * live with it. A frame that is missing or does not fit empties the cache
+ * until the next IDR, which sessions catching up then wait for and ask
+ * the encoder for. Caller holds s_queue_lock.
+ *
+ * @param f Frame, or NULL if it could not be stored
+ */
+static void gop_cache_add_locked(stream_frame_t *f)
+{
+	bool idr = f && f->idx.idr;
+	if (!idr && s_gop_len == 0)
+		return;
+
+	bool fits = f && s_gop_len < GOP_CACHE_MAX_FRAMES &&
+				s_gop_bytes + f->len <= CONFIG_RTSP_GOP_CACHE_KB * 1024;
+	if (idr || !fits)
+	{
+		bool cut_off = false;
+		for (int i = 0; i < s_num_clients; i++)
+		{
+			client_t *c = &s_clients[i];
+			if (!c->catching_up)
+				continue;
+			c->catching_up = false;
+			c->drop_to_idr = !fits;
+			cut_off |= !fits;
+		}
+		if (cut_off)
+			camera_encoder_request_idr();
+		if (!fits && f)
+			ESP_LOGW(TAG, "GOP outgrew the cache at %u frames, %u KB", (unsigned)s_gop_len,
+					 (unsigned)((s_gop_bytes + f->len) / 1024));
+		for (uint16_t i = 0; i < s_gop_len; i++)
+			frame_unref(s_gop[i]);
+		s_gop_len = 0;
+		s_gop_bytes = 0;
+		if (!fits)
+			return;
+	}
+	s_gop[s_gop_len++] = frame_ref(f);
+	s_gop_bytes += f->len;
+}
+
+/**
+ * @brief Start a new session from the GOP cache
+ *
+ * Called as the session starts playing, before anything was queued for it.
+ * Caller holds s_queue_lock and wakes the sender.
+ *
+ * @return Number of cached frames the session catches up on before it takes
+ *         live frames, 0 if it waits for the next IDR
+ */
+static uint16_t gop_cache_join_locked(client_t *c)
+{
+	if (s_gop_len == 0)
+		return 0;
+	c->drop_to_idr = false;
+	c->catching_up = true;
+	c->gop_next = 0;
+	return s_gop_len;
+}
+
+/**
+ * @brief Take the next cached frame of a session catching up
+ *
+ * Timestamps are squeezed to one tick apart, ending at the newest cached
+ * frame's own: the client decodes the GOP at once and is at the live
+ * position when it runs out. The session takes live frames from its queue
+ * once it got the newest one.
+ *
+ * @param c Session
+ * @param ts Output, rewritten RTP timestamp
+ * @return Frame with a reference for the caller, NULL if the session is
+ *         not catching up
+ */
+static stream_frame_t *gop_cache_next(client_t *c, uint32_t *ts)
+{
+	stream_frame_t *f = NULL;
+	xSemaphoreTake(s_queue_lock, portMAX_DELAY);
+	if (c->catching_up && c->gop_next < s_gop_len)
+	{
+		f = frame_ref(s_gop[c->gop_next]);
+		*ts = s_gop[s_gop_len - 1]->ts - (s_gop_len - 1 - c->gop_next);
+		c->gop_next++;
+	}
+	if (c->gop_next >= s_gop_len)
+		c->catching_up = false;
+	xSemaphoreGive(s_queue_lock);
+	return f;
+}
+
+/**
+ * @brief Send the next cached frame to every session catching up
+ *
+ * @return true if a session was given a frame
+ */
+static bool send_catchup(void)
+{
+	bool sent = false;
+	for (int i = 0; i < s_num_clients; i++)
+	{
+		client_t *c = &s_clients[i];
+		uint32_t ts;
+		stream_frame_t *f = c->catching_up ? gop_cache_next(c, &ts) : NULL;
+		if (!f)
+			continue;
+		send_au(f, ts, true, &c, 1);
+		frame_unref(f);
+		sent = true;
+	}
+	return sent;
+}
+#endif
+
+/**
+ * @brief Take the oldest frame any session waits for, from every session
+ * waiting for it
+ *
+ * Sessions that keep up share one packetization of each frame; one that
+ * lags gets its older frames first.
+ *
+ * @param frame Output; the caller owns one reference per session returned
+ * @param sessions Output, MAX_TARGETS entries
+ * @return Number of sessions, 0 when every queue is empty
+ */
+static int next_frame(stream_frame_t **frame, client_t **sessions)
+{
+	client_t *senders[MAX_TARGETS];
+	int n_senders = stream_senders(senders);
+	stream_frame_t *oldest = NULL;
+	int n = 0;
+
+	xSemaphoreTake(s_queue_lock, portMAX_DELAY);
+	for (int i = 0; i < n_senders; i++)
+	{
+		client_t *c = senders[i];
+		if (c->queue_len == 0)
+			continue;
+		stream_frame_t *f = c->queue[c->queue_head];
+		if (!oldest || (int32_t)(f->ts - oldest->ts) < 0)
+			oldest = f;
+	}
+	for (int i = 0; i < n_senders && oldest; i++)
+	{
+		client_t *c = senders[i];
+		if (c->queue_len == 0 || c->queue[c->queue_head] != oldest)
+			continue;
+		c->queue_head = (c->queue_head + 1) % SESSION_QUEUE_LEN;
+		c->queue_len--;
+		sessions[n++] = c;
+	}
+	xSemaphoreGive(s_queue_lock);
+
+	*frame = oldest;
+	return n;
+}
+
+/**
+ * @brief Deepest session queue, for the transmit statistics
+ */
+static uint32_t queued_frames(void)
+{
+	client_t *senders[MAX_TARGETS];
+	int n_senders = stream_senders(senders);
+	uint32_t depth = 0;
+	for (int i = 0; i < n_senders; i++)
+		depth = senders[i]->queue_len > depth ? senders[i]->queue_len : depth;
+	return depth;
+}
+
+#if CONFIG_RTP_PACING
+static void pacer_timer_cb(void *arg)
+{
+	xTaskNotifyGive(s_sender_task);
+}
+
+/**
+ * @brief Sleep with microsecond resolution; the tick is too coarse for pacing
+ */
+static void pacer_sleep_us(int64_t us)
+{
+	if (esp_timer_start_once(s_pacer_timer, us) == ESP_OK)
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
+/**
+ * @brief Spread an access unit over the frame interval
+ *
+ * Every client has its own token bucket. The rate is raised for frames too
+ * large to leave within PACER_SPREAD_PERCENT of the frame interval, so the
+ * pacer never falls a frame behind; the burst bounds back-to-back packets.
+ * Cached frames for a session catching up leave CATCHUP_SPEEDUP times as
+ * fast.
+ */
+static void transmit_paced(const rtp_packet_list_t *au, stream_frame_t *frame, client_t **targets, int n_targets,
+						   bool catchup)
+{
+	uint16_t next[MAX_TARGETS] = {0};
+	uint16_t batch = CONFIG_RTP_PACING_BURST_BYTES / (RTP_HEADER_LEN + RTP_PREFIX_MAX + RTP_MTU);
+	batch = batch < 1 ? 1 : (batch > RTP_BATCH_MAX ? RTP_BATCH_MAX : batch);
+
+	uint64_t bits = 0;
+	for (uint16_t p = 0; p < au->count; p++)
+		bits += (RTP_HEADER_LEN + au->pkts[p].prefix_len + au->pkts[p].len) * 8;
+	uint32_t fps = s_framerate ? s_framerate : 30;
+	uint64_t min_rate = bits * fps * 100 / PACER_SPREAD_PERCENT;
+	if (catchup)
+		min_rate *= CATCHUP_SPEEDUP;
+	uint32_t rate = CONFIG_RTP_PACING_RATE_KBPS * 1000;
+	if (min_rate > rate)
+		rate = min_rate;
+
+	int64_t now = esp_timer_get_time();
+	int remaining = 0;
+	for (int t = 0; t < n_targets; t++)
+	{
+		rtp_bucket_set_rate(&targets[t]->bucket, rate, now);
+		remaining++;
+	}
+
+	while (remaining > 0)
+	{
+		int64_t wait = INT64_MAX;
+		uint32_t backlog = 0;
+		now = esp_timer_get_time();
+
+		for (int t = 0; t < n_targets; t++)
 		{
-			const uint8_t *nal = find_nal(data, len);
+			client_t *c = targets[t];
+			if (!c || next[t] >= au->count)
+				continue;
+
+			uint16_t n = au->count - next[t] < batch ? au->count - next[t] : batch;
+			size_t bytes = 0;
+			for (uint16_t p = next[t]; p < next[t] + n; p++)
+				bytes += RTP_HEADER_LEN + au->pkts[p].prefix_len + au->pkts[p].len;
 
-			while (nal)
+			int64_t w = rtp_bucket_wait_us(&c->bucket, bytes, now);
+			if (w > 0)
 			{
-				const uint8_t *next = find_nal(nal + 3, len - (nal - data) - 3);
-				size_t nal_len = next ? (next - nal) : (len - (nal - data));
+				wait = w < wait ? w : wait;
+				backlog += au->count - next[t];
+				continue;
+			}
 
-				// Skip start code - check 3-byte first, then 4-byte
-				const uint8_t *p = nal;
-				size_t skip;
-				if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-				{
-					skip = 3; // 3-byte start code
-				}
-				else if (p[0] == 0 && p[1] == 0 && p[2] == 0 && p[3] == 1)
-				{
-					skip = 4; // 4-byte start code
-				}
-				else
-				{
-					skip = 0; // No start code (shouldn't happen)
-				}
+			// A failing client is skipped for the rest of the access unit
+			if (send_batch(c, au, next[t], n, frame) != ESP_OK)
+				next[t] = au->count;
+			else
+				next[t] += n;
+			rtp_bucket_consume(&c->bucket, bytes);
+
+			if (next[t] >= au->count)
+				remaining--;
+			else
+				wait = 0;
+			backlog += au->count - next[t];
+		}
+
+		rtp_tx_record_queue(queued_frames(), backlog);
+		if (remaining > 0 && wait > 0)
+			pacer_sleep_us(wait);
+	}
+	rtp_tx_record_queue(queued_frames(), 0);
+}
+
+#else
+/**
+ * @brief Send an access unit as fast as the sockets take it (pacing bypass)
+ *
+ * Each batch reaches every client before the next one, so no client waits
+ * for whole frames sent to the others.
+ */
+static void transmit_burst(const rtp_packet_list_t *au, stream_frame_t *frame, client_t **targets, int n_targets)
+{
+	for (uint16_t p = 0; p < au->count; p += RTP_BATCH_MAX)
+	{
+		for (int t = 0; t < n_targets; t++)
+		{
+			// A failing client is skipped for the rest of the access unit
+			if (targets[t] && send_batch(targets[t], au, p, RTP_BATCH_MAX, frame) != ESP_OK)
+				targets[t] = NULL;
+		}
+	}
+}
+#endif
 
-				send_nal(&s_clients[i], p + skip, nal_len - skip, ts);
-				nal = next;
+#if CONFIG_RTP_FEC
+/**
+ * @brief Send the FEC packets of an access unit after its media packets
+ *
+ * Parity is shared; only the SN base is the client's own. Interleaved
+ * clients get none, TCP does not lose packets.
+ */
+static void send_fec(client_t *c, const rtp_fec_list_t *fec, uint32_t ts)
+{
+	if (c->txq || !c->active || c->state != RTSP_STATE_PLAYING)
+		return;
+
+	struct sockaddr_in dest = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = c->addr.sin_addr.s_addr,
+		.sin_port = htons(c->rtp_port)};
+	size_t bytes = 0;
+	uint16_t i;
+
+	for (i = 0; i < fec->count; i++)
+	{
+		const rtp_fec_packet_t *fp = &fec->pkts[i];
+		uint8_t hdr[RTP_FEC_HEADERS_MAX];
+		size_t hdr_len = rtp_fec_write_header(hdr, fp, ts, c->fec_seq++, c->fec_ssrc, c->au_seq + fp->first);
+
+		struct iovec iov[2] = {
+			{.iov_base = hdr, .iov_len = hdr_len},
+			{.iov_base = fp->payload, .iov_len = fp->len}};
+		struct msghdr msg = {
+			.msg_name = &dest,
+			.msg_namelen = sizeof(dest),
+			.msg_iov = iov,
+			.msg_iovlen = 2};
+		if (sendmsg(s_rtp_sock, &msg, 0) < 0)
+			break;
+		bytes += hdr_len + fp->len;
+	}
+	rtp_tx_record_fec(i);
+#if CONFIG_RTP_PACING
+	// Charged to the bucket so the next access unit makes room for it
+	rtp_bucket_consume(&c->bucket, bytes);
+#endif
+}
+#endif
+
+/**
+ * @brief List the RTP streams: unicast clients, then the multicast group
+ * standing in for its sessions
+ *
+ * @return Number of entries written to senders (MAX_TARGETS at most)
+ */
+static int stream_senders(client_t **senders)
+{
+	int n = 0;
+	for (int i = 0; i < s_num_clients; i++)
+	{
+		if (!s_clients[i].multicast)
+			senders[n++] = &s_clients[i];
+	}
+#if CONFIG_RTSP_MULTICAST
+	senders[n++] = &s_mcast;
+#endif
+	return n;
+}
+
+/**
+ * @brief Send one access unit to the sessions that queued it
+ *
+ * Runs in the sender task.
+ *
+ * @param frame Access unit
+ * @param ts RTP timestamp to send it with
+ * @param catchup Cached frame for a session catching up, which leaves the
+ *        sender report clock alone
+ * @param sessions Sessions
+ * @param n_sessions Number of sessions
+ */
+static void send_au(stream_frame_t *frame, uint32_t ts, bool catchup, client_t **sessions, int n_sessions)
+{
+	const uint8_t *data = frame->data;
+	const h264_nal_index_t *idx = &frame->idx;
+
+	// Parameter sets carried in-band reach every client with this access unit
+	bool in_band = (idx->sps >= 0 && idx->pps >= 0);
+	const h264_nal_t *band_sps = (idx->sps >= 0) ? &idx->nals[idx->sps] : NULL;
+	bool replace_sps = false;
+	uint8_t sps[H264_PARAM_SET_MAX], pps[H264_PARAM_SET_MAX];
+	size_t sps_len = 0, pps_len = 0;
+	uint32_t version;
+
+	xSemaphoreTake(s_param_lock, portMAX_DELAY);
+	version = s_param_version;
+	if (!catchup)
+	{
+		s_last_ts = ts;
+		s_last_ts_us = esp_timer_get_time();
+	}
+	if (idx->idr || band_sps)
+	{
+		sps_len = s_sps_len;
+		pps_len = s_pps_len;
+		memcpy(sps, s_sps, sps_len);
+		memcpy(pps, s_pps, pps_len);
+		// An in-band SPS matching the store goes out in its rewritten form
+		replace_sps = band_sps && band_sps->len == s_sps_raw_len &&
+					  memcmp(data + band_sps->offset, s_sps_raw, s_sps_raw_len) == 0;
+	}
+	xSemaphoreGive(s_param_lock);
+
+	// Packetize once; clients differ only in sequence number and SSRC
+	rtp_packet_list_t au;
+	rtp_packet_list_init(&au, s_au_pkts, RTP_PACKET_LIST_MAX, ts);
+#if CONFIG_RTP_STAP_A
+	rtp_packet_list_set_arena(&au, s_au_arena, sizeof(s_au_arena));
+#endif
+	for (int n = 0; n < idx->count; n++)
+	{
+		const uint8_t *nal = data + idx->nals[n].offset;
+		size_t nal_len = idx->nals[n].len;
+		if (replace_sps && n == idx->sps)
+		{
+			nal = sps;
+			nal_len = sps_len;
+		}
+		if (rtp_packetize_h264(&au, nal, nal_len) != ESP_OK)
+		{
+			ESP_LOGW(TAG, "Access unit exceeds %d packets, truncated", RTP_PACKET_LIST_MAX);
+			break;
+		}
+	}
+	rtp_packet_list_end_au(&au);
+
+	rtp_packet_t param_pkts[2];
+	rtp_packet_list_t params;
+	rtp_packet_list_init(&params, param_pkts, 2, ts);
+#if CONFIG_RTP_STAP_A
+	uint8_t param_arena[2 * (2 + H264_PARAM_SET_MAX) + 1];
+	rtp_packet_list_set_arena(&params, param_arena, sizeof(param_arena));
+#endif
+	if (idx->idr && !in_band && sps_len > 0 && pps_len > 0)
+	{
+		rtp_packetize_h264(&params, sps, sps_len);
+		rtp_packetize_h264(&params, pps, pps_len);
+	}
+
+	client_t *targets[MAX_TARGETS];
+	int n_targets = 0;
+	for (int i = 0; i < n_sessions; i++)
+	{
+		client_t *c = sessions[i];
+		if (!c->active || c->state != RTSP_STATE_PLAYING)
+			continue;
+
+		// A client that lost interleaved data cannot decode until the next IDR
+		if (c->skip_to_idr)
+		{
+			if (!idx->idr)
+				continue;
+			c->skip_to_idr = false;
+		}
+
+		// Re-send stored SPS/PPS ahead of an IDR only when they changed
+		if (c->param_version != version)
+		{
+			if (in_band)
+			{
+				c->param_version = version;
+			}
+			else if (params.count > 0)
+			{
+				send_packets(c, &params);
+				c->param_version = version;
+			}
+		}
+		c->au_seq = c->rtp_seq;
+		targets[n_targets++] = c;
+	}
+
+	int64_t start_us = esp_timer_get_time();
+#if CONFIG_RTP_PACING
+	transmit_paced(&au, frame, targets, n_targets, catchup);
+#else
+	transmit_burst(&au, frame, targets, n_targets);
+#endif
+
+	// Time to first frame, counted once the whole access unit left
+	int64_t sent_us = esp_timer_get_time();
+	for (int t = 0; t < n_targets; t++)
+	{
+		client_t *c = targets[t];
+		if (c && c->first_frame_us == 0)
+			c->first_frame_us = sent_us > c->play_us ? sent_us - c->play_us : 1;
+	}
+
+#if CONFIG_RTP_FEC
+	if (n_targets > 0 && s_au_fec.arena)
+	{
+		rtp_fec_generate(&s_au_fec, &au, idx->idr ? CONFIG_RTP_FEC_IDR_PERCENT : CONFIG_RTP_FEC_PERCENT);
+		for (int t = 0; t < n_targets; t++)
+		{
+			if (targets[t])
+				send_fec(targets[t], &s_au_fec, ts);
+		}
+	}
+#endif
+
+	if (n_targets > 0)
+	{
+		rtp_tx_record_frame(esp_timer_get_time() - start_us);
+
+		rtp_tx_stats_t tx;
+		rtp_get_tx_stats(&tx);
+		if (tx.frames % 300 == 0)
+		{
+			ESP_LOGI(TAG, "TX: %" PRIu32 " packets in %" PRIu32 " calls, %" PRIu32 " us/frame avg, %" PRIu32 " errors, "
+						  "peak backlog %" PRIu32 " packets, %" PRIu32 " frames dropped",
+					 tx.packets, tx.syscalls, tx.avg_frame_us, tx.errors, tx.peak_queued_packets, tx.dropped_frames);
+		}
+	}
+}
+
+/**
+ * @brief Drain the session queues
+ *
+ * The only task that sends media, so the encoder never waits on a socket.
+ */
+static void sender_task(void *arg)
+{
+	while (true)
+	{
+		xSemaphoreTake(s_send_sem, portMAX_DELAY);
+
+		bool more = true;
+		while (more)
+		{
+			// Sessions are not reset or torn down while in use here; held
+			// per frame, so that waits at most one frame
+			xSemaphoreTake(s_send_lock, portMAX_DELAY);
+			stream_frame_t *f;
+			client_t *sessions[MAX_TARGETS];
+			int n = next_frame(&f, sessions);
+			if (n > 0)
+			{
+				send_au(f, f->ts, false, sessions, n);
+				for (int i = 0; i < n; i++)
+					frame_unref(f);
 			}
+			more = n > 0;
+#if CONFIG_RTSP_GOP_CACHE
+			// Sessions catching up get a cached frame between live ones
+			if (send_catchup())
+				more = true;
+#endif
+			xSemaphoreGive(s_send_lock);
 		}
 	}
+}
 
+#if !CONFIG_RTSP_GOP_CACHE
+static bool any_client_playing(void)
+{
+	for (int i = 0; i < s_num_clients; i++)
+	{
+		if (s_clients[i].active && s_clients[i].state == RTSP_STATE_PLAYING)
+			return true;
+	}
+	return false;
+}
+#endif
+
+esp_err_t rtsp_send_h264_nals(const uint8_t *data, const h264_nal_index_t *idx, uint32_t ts)
+{
+	if (!data || !idx)
+		return ESP_ERR_INVALID_ARG;
+	if (!s_sender_task)
+		return ESP_OK;
+#if !CONFIG_RTSP_GOP_CACHE
+	if (!any_client_playing())
+		return ESP_OK;
+#endif
+
+	// The sender outlives the encoder buffer, so it works on a stored copy
+	stream_frame_t *f = frame_store_put(data, idx, ts, 0);
+
+	client_t *senders[MAX_TARGETS];
+	int n_senders = stream_senders(senders);
+	xSemaphoreTake(s_queue_lock, portMAX_DELAY);
+#if CONFIG_RTSP_GOP_CACHE
+	gop_cache_add_locked(f);
+#endif
+	for (int i = 0; i < n_senders; i++)
+	{
+		client_t *c = senders[i];
+		if (c->active && c->state == RTSP_STATE_PLAYING && !c->catching_up)
+			enqueue_locked(c, f, idx->len);
+	}
+	xSemaphoreGive(s_queue_lock);
+
+	if (!f)
+	{
+		rtp_tx_record_drop();
+		return ESP_ERR_NO_MEM;
+	}
+	frame_unref(f);
+	xSemaphoreGive(s_send_sem);
 	return ESP_OK;
 }
 
+esp_err_t rtsp_send_h264_frame(const uint8_t *data, size_t len, uint32_t ts)
+{
+	if (!data || len == 0)
+		return ESP_ERR_INVALID_ARG;
+
+	h264_nal_index_t idx;
+	h264_nal_index_build(data, len, &idx);
+	return rtsp_send_h264_nals(data, &idx, ts);
+}
+
 esp_err_t rtsp_set_sps_pps(const uint8_t *sps, size_t sps_len, const uint8_t *pps, size_t pps_len)
 {
-	if (sps && sps_len <= sizeof(s_sps))
+	// Store NAL units without start codes so PLAY can send them directly
+	if (sps)
+	{
+		size_t skip = h264_start_code_len(sps, sps_len);
+		sps += skip;
+		sps_len -= skip;
+	}
+	if (pps)
+	{
+		size_t skip = h264_start_code_len(pps, pps_len);
+		pps += skip;
+		pps_len -= skip;
+	}
+
+	if (!sps || !pps || sps_len == 0 || pps_len == 0 || sps_len > sizeof(s_sps) || pps_len > sizeof(s_pps))
+		return ESP_ERR_INVALID_ARG;
+
+	xSemaphoreTake(s_param_lock, portMAX_DELAY);
+	bool changed = false;
+	if (sps_len != s_sps_raw_len || memcmp(sps, s_sps_raw, sps_len) != 0)
 	{
-		memcpy(s_sps, sps, sps_len);
-		s_sps_len = sps_len;
+		memcpy(s_sps_raw, sps, sps_len);
+		s_sps_raw_len = sps_len;
+		changed = rewrite_sps();
 	}
-	if (pps && pps_len <= sizeof(s_pps))
+	if (pps_len != s_pps_len || memcmp(pps, s_pps, pps_len) != 0)
 	{
 		memcpy(s_pps, pps, pps_len);
 		s_pps_len = pps_len;
+		changed = true;
+	}
+	if (changed)
+	{
+		s_param_version++;
+		build_sdp_media();
 	}
-	s_sps_pps_ready = (sps && pps);
-	ESP_LOGI(TAG, "SPS/PPS stored: SPS=%d bytes, PPS=%d bytes", s_sps_len, s_pps_len);
+	s_sps_pps_ready = true;
+	xSemaphoreGive(s_param_lock);
+
+	if (changed)
+		ESP_LOGI(TAG, "SPS/PPS stored (version %" PRIu32 "): SPS=%d bytes (%d from encoder), PPS=%d bytes",
+				 s_param_version, s_sps_len, s_sps_raw_len, s_pps_len);
 	return ESP_OK;
 }
+
+esp_err_t rtsp_set_framerate(uint32_t fps)
+{
+	if (!s_param_lock)
+		return ESP_ERR_INVALID_STATE;
+
+	xSemaphoreTake(s_param_lock, portMAX_DELAY);
+	if (fps != s_framerate)
+	{
+		s_framerate = fps;
+		if (s_sps_raw_len > 0 && rewrite_sps())
+			s_param_version++;
+		build_sdp_media();
+	}
+	xSemaphoreGive(s_param_lock);
+	return ESP_OK;
+}
+
+int rtsp_server_get_session_stats(rtsp_session_stats_t *stats, int max)
+{
+	int n = 0;
+	for (int i = 0; i < s_num_clients && n < max; i++)
+	{
+		const client_t *c = &s_clients[i];
+		if (!c->active)
+			continue;
+
+		rtsp_session_stats_t *st = &stats[n++];
+		st->session = c->session;
+		inet_ntop(AF_INET, &c->addr.sin_addr, st->addr, sizeof(st->addr));
+		st->interleaved = c->txq != NULL;
+		st->multicast = c->multicast;
+		int32_t idle = (int32_t)(now_ms() - c->last_seen_ms);
+		st->idle_ms = idle > 0 ? idle : 0;
+		st->queued_frames = c->queue_len;
+		st->dropped_frames = c->dropped_frames;
+		st->dropped_bytes = c->dropped_bytes;
+		st->first_frame_us = c->first_frame_us;
+		st->rtcp = c->rtcp;
+#if CONFIG_RTSP_MULTICAST
+		// Multicast sessions share the group's sender counters
+		if (c->multicast)
+		{
+			st->rtcp.packets_sent = s_mcast.rtcp.packets_sent;
+			st->rtcp.octets_sent = s_mcast.rtcp.octets_sent;
+			st->rtcp.sr_sent = s_mcast.rtcp.sr_sent;
+		}
+#endif
+	}
+	return n;
+}
@@ -4,6 +4,11 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "esp_err.h"
+#include "h264_nal.h"
+#include "rtcp.h"
+
+// Largest session table rtsp_server_set_max_clients() accepts
+#define RTSP_SERVER_MAX_CLIENTS 16
 
 typedef enum {
     RTSP_STATE_INIT,
@@ -12,10 +17,27 @@ typedef enum {
     RTSP_STATE_TEARDOWN
 } rtsp_state_t;
 
+typedef struct {
+    uint32_t session;
+    char addr[16];          // Client address, dotted quad
+    bool interleaved;       // RTP over the RTSP connection
+    bool multicast;
+    uint32_t idle_ms;       // Since the last request or RTCP report
+    uint32_t queued_frames; // Waiting for the sender
+    uint32_t dropped_frames; // Never sent: queue overflow up to the next IDR
+    uint64_t dropped_bytes;
+    uint32_t first_frame_us; // PLAY to the first video frame sent, 0 until then (unicast)
+    rtcp_stats_t rtcp;
+} rtsp_session_stats_t;
+
+esp_err_t rtsp_server_set_max_clients(int max);
 esp_err_t rtsp_server_init(void);
 esp_err_t rtsp_server_start(void);
 void rtsp_server_stop(void);
 esp_err_t rtsp_send_h264_frame(const uint8_t *data, size_t len, uint32_t timestamp);
+esp_err_t rtsp_send_h264_nals(const uint8_t *data, const h264_nal_index_t *idx, uint32_t timestamp);
 esp_err_t rtsp_set_sps_pps(const uint8_t *sps, size_t sps_len, const uint8_t *pps, size_t pps_len);
+esp_err_t rtsp_set_framerate(uint32_t fps);
+int rtsp_server_get_session_stats(rtsp_session_stats_t *stats, int max);
 
 #endif
@@ -0,0 +1,147 @@
+#include "tcp_queue.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+static const char *TAG = "tcp_queue";
+
+esp_err_t tcp_queue_create(tcp_queue_t *q)
+{
+	memset(q, 0, sizeof(*q));
+	q->sock = -1;
+	q->lock = xSemaphoreCreateMutex();
+	return q->lock ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t tcp_queue_open(tcp_queue_t *q, int sock, size_t size)
+{
+	uint8_t *buf = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+	if (!buf)
+		return ESP_ERR_NO_MEM;
+
+	xSemaphoreTake(q->lock, portMAX_DELAY);
+	heap_caps_free(q->buf);
+	q->sock = sock;
+	q->buf = buf;
+	q->size = size;
+	q->head = 0;
+	q->len = 0;
+	q->peak = 0;
+	q->drops = 0;
+	xSemaphoreGive(q->lock);
+	return ESP_OK;
+}
+
+void tcp_queue_close(tcp_queue_t *q)
+{
+	xSemaphoreTake(q->lock, portMAX_DELAY);
+	if (q->drops > 0)
+		ESP_LOGW(TAG, "Socket %d: %" PRIu32 " records dropped, peak %u bytes queued", q->sock, q->drops, (unsigned)q->peak);
+	heap_caps_free(q->buf);
+	q->buf = NULL;
+	q->sock = -1;
+	q->len = 0;
+	xSemaphoreGive(q->lock);
+}
+
+// Caller holds the lock
+static esp_err_t flush_locked(tcp_queue_t *q)
+{
+	while (q->len > 0)
+	{
+		// Contiguous run up to the end of the ring
+		size_t run = q->size - q->head < q->len ? q->size - q->head : q->len;
+		int n = send(q->sock, q->buf + q->head, run, MSG_DONTWAIT);
+		if (n < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? ESP_OK : ESP_FAIL;
+		q->head = (q->head + n) % q->size;
+		q->len -= n;
+		if ((size_t)n < run)
+			break;
+	}
+	if (q->len == 0)
+		q->head = 0;
+	return ESP_OK;
+}
+
+// Caller holds the lock and checked the space
+static void push_locked(tcp_queue_t *q, const uint8_t *data, size_t len)
+{
+	size_t tail = (q->head + q->len) % q->size;
+	size_t first = q->size - tail < len ? q->size - tail : len;
+	memcpy(q->buf + tail, data, first);
+	memcpy(q->buf, data + first, len - first);
+	q->len += len;
+	if (q->len > q->peak)
+		q->peak = q->len;
+}
+
+esp_err_t tcp_queue_write(tcp_queue_t *q, const struct iovec *iov, int iovcnt)
+{
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	xSemaphoreTake(q->lock, portMAX_DELAY);
+	if (!q->buf || flush_locked(q) != ESP_OK)
+	{
+		xSemaphoreGive(q->lock);
+		return ESP_FAIL;
+	}
+
+	// All or nothing: a record that might not fit is not started
+	if (total > q->size - q->len)
+	{
+		q->drops++;
+		xSemaphoreGive(q->lock);
+		return ESP_ERR_NO_MEM;
+	}
+
+	// Straight to the socket while nothing is waiting ahead of the record
+	size_t sent = 0;
+	if (q->len == 0)
+	{
+		struct msghdr msg = {.msg_iov = (struct iovec *)iov, .msg_iovlen = iovcnt};
+		int n = sendmsg(q->sock, &msg, MSG_DONTWAIT);
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			xSemaphoreGive(q->lock);
+			return ESP_FAIL;
+		}
+		sent = n > 0 ? n : 0;
+	}
+
+	// Queue the part the socket did not take
+	size_t skip = sent;
+	for (int i = 0; i < iovcnt; i++)
+	{
+		size_t len = iov[i].iov_len;
+		if (skip >= len)
+		{
+			skip -= len;
+			continue;
+		}
+		push_locked(q, (const uint8_t *)iov[i].iov_base + skip, len - skip);
+		skip = 0;
+	}
+	xSemaphoreGive(q->lock);
+	return ESP_OK;
+}
+
+esp_err_t tcp_queue_flush(tcp_queue_t *q)
+{
+	xSemaphoreTake(q->lock, portMAX_DELAY);
+	esp_err_t ret = q->buf ? flush_locked(q) : ESP_FAIL;
+	xSemaphoreGive(q->lock);
+	return ret;
+}
+
+size_t tcp_queue_pending(tcp_queue_t *q)
+{
+	xSemaphoreTake(q->lock, portMAX_DELAY);
+	size_t len = q->len;
+	xSemaphoreGive(q->lock);
+	return len;
+}
@@ -0,0 +1,93 @@
+#ifndef TCP_QUEUE_H
+#define TCP_QUEUE_H
+
+#include "esp_err.h"
+#include "lwip/sockets.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+	/**
+	 * @brief Bounded, non-blocking writer for a TCP socket
+	 *
+	 * Writes are all-or-nothing: what the socket does not take at once is
+	 * kept in a ring buffer and goes out ahead of later writes, so records
+	 * are never interleaved or cut. Writers never block on the peer.
+	 */
+	typedef struct
+	{
+		int sock;
+		uint8_t *buf; // Ring storage, NULL while closed
+		size_t size;
+		size_t head; // Offset of the oldest queued byte
+		size_t len;	 // Queued bytes
+		size_t peak;
+		uint32_t drops; // Writes refused for lack of space
+		SemaphoreHandle_t lock;
+	} tcp_queue_t;
+
+	/**
+	 * @brief Create the lock of a queue; done once per queue lifetime
+	 *
+	 * @param q Queue
+	 * @return ESP_OK, ESP_ERR_NO_MEM
+	 */
+	esp_err_t tcp_queue_create(tcp_queue_t *q);
+
+	/**
+	 * @brief Attach a queue to a connected socket
+	 *
+	 * @param q Queue created with tcp_queue_create()
+	 * @param sock TCP socket
+	 * @param size Ring size in bytes (allocated in PSRAM)
+	 * @return ESP_OK, ESP_ERR_NO_MEM
+	 */
+	esp_err_t tcp_queue_open(tcp_queue_t *q, int sock, size_t size);
+
+	/**
+	 * @brief Detach from the socket and free the ring; later writes fail
+	 *
+	 * @param q Queue
+	 */
+	void tcp_queue_close(tcp_queue_t *q);
+
+	/**
+	 * @brief Write one record
+	 *
+	 * @param q Queue
+	 * @param iov Record parts
+	 * @param iovcnt Number of parts
+	 * @return ESP_OK if the record was sent or queued, ESP_ERR_NO_MEM if it
+	 *         was dropped for lack of space, ESP_FAIL on a socket error or a
+	 *         closed queue
+	 */
+	esp_err_t tcp_queue_write(tcp_queue_t *q, const struct iovec *iov, int iovcnt);
+
+	/**
+	 * @brief Send as much queued data as the socket takes without blocking
+	 *
+	 * @param q Queue
+	 * @return ESP_OK, ESP_FAIL on a socket error or a closed queue
+	 */
+	esp_err_t tcp_queue_flush(tcp_queue_t *q);
+
+	/**
+	 * @brief Get the number of bytes waiting for the socket
+	 *
+	 * @param q Queue
+	 * @return Queued bytes, 0 while closed
+	 */
+	size_t tcp_queue_pending(tcp_queue_t *q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TCP_QUEUE_H